@@ -9,12 +9,16 @@ import json
 import base64
 import requests
 import socket
-from pathlib import Path
 import time 
+import threading
+import hashlib
+import math
+from collections import OrderedDict
 
 # Load environment variables
 load_dotenv()
-os.environ['GOOGLE_APPLICATION_CREDENTIALS'] = os.path.abspath(os.getenv('GOOGLE_APPLICATION_CREDENTIALS'))
+if os.getenv('GOOGLE_APPLICATION_CREDENTIALS'):
+    os.environ['GOOGLE_APPLICATION_CREDENTIALS'] = os.path.abspath(os.getenv('GOOGLE_APPLICATION_CREDENTIALS'))
 ngrok_auth_token = os.getenv('NGROK_AUTH_TOKEN')
 
 
@@ -25,129 +29,368 @@ ngrok.set_auth_token(ngrok_auth_token)  # Replace with your actual auth token
 public_url = ngrok.connect(3000, hostname="hornet-upright-ewe.ngrok-free.app", bind_tls=False)
 print(f"Public URL: {public_url}")
 
-# Paths
-record_file = Path('tmp/recording.wav')
-voiced_file = Path('tmp/voicedby.wav')
-
 # API Key
 groq_api_key = os.getenv('GROQ_API_KEY')
-should_download_file = False
+
+# Longest a /checkVariable long-poll is held
+LONG_POLL_MAX_S = 30
+
+# PIPELINE=echo answers every turn with its own upload after ECHO_DELAY_MS
+# instead of calling STT/LLM/TTS. For load tests (loadtest.js) and bring-up
+# without cloud credentials.
+ECHO_PIPELINE = os.getenv('PIPELINE') == 'echo'
+ECHO_DELAY_MS = int(os.getenv('ECHO_DELAY_MS') or 1500)
+
+# Fixed prompts. Synthesized once and memoized, so every device gets the
+# same bytes (and the same X-Audio-Hash) and can replay them from flash.
+# timeout and offline are the device's fallback clips, see /fallbackAudio.
+PROMPTS = {
+    "timeout": "Sorry, that is taking longer than it should. Please try again in a moment.",
+    "offline": "I can't reach my server right now. Please check the connection and try again.",
+    "notHeard": "Sorry, I didn't catch that. Could you say it again?",
+    "llmError": "I'm sorry, I couldn't process your request at this time.",
+}
+FALLBACK_CLIPS = ("timeout", "offline")
+TTS_MEMO_ENTRIES = 64
+tts_memo = OrderedDict()  # text -> WAV, oldest first
+tts_memo_lock = threading.Lock()
+
+# Per-device turn state, same protocol as Backend/sessions.js: devices send
+# X-Device-Id and X-Request-Id (or ?device= / ?request=), a session holds
+# the device's current turn in memory, and results of a replaced turn are
+# dropped. Requests without a device ID share the 'default' session.
+# Responses carry a content hash (X-Audio-Hash) for the device's cache.
+SESSION_IDLE_S = 600
+sessions = {}
+sessions_lock = threading.Lock()
+generated_ids = 0
+
+class Session:
+    def __init__(self, device_id):
+        self.device_id = device_id
+        self.request_id = None
+        self.recording = None  # WAV of the current turn's upload
+        self.response = None   # WAV to play back, set once ready
+        self.response_hash = None
+        self.ready = False
+        self.updated_at = time.time()
+        self.changed = threading.Condition(sessions_lock)
+
+def device_id_of(req):
+    return req.headers.get('X-Device-Id') or req.args.get('device') or 'default'
+
+def request_id_of(req):
+    return req.headers.get('X-Request-Id') or req.args.get('request')
+
+def get_session(device_id):
+    with sessions_lock:
+        # Forget devices that have gone quiet, along with their audio
+        now = time.time()
+        for key in [k for k, s in sessions.items() if now - s.updated_at > SESSION_IDLE_S]:
+            del sessions[key]
+        session = sessions.get(device_id)
+        if session is None:
+            session = sessions[device_id] = Session(device_id)
+        session.updated_at = now
+        return session
+
+# Starts a new turn, waking long-polls still waiting on the old one
+def begin_turn(session, request_id):
+    global generated_ids
+    with sessions_lock:
+        if not request_id:
+            generated_ids += 1
+            request_id = f"srv-{generated_ids}"
+        session.request_id = request_id
+        session.recording = None
+        session.response = None
+        session.response_hash = None
+        session.ready = False
+        session.changed.notify_all()
+        return request_id
+
+# First 64 bits of the SHA-256 of a response, as 16 hex digits
+def audio_hash(audio):
+    return hashlib.sha256(audio).hexdigest()[:16]
+
+def is_current(session, request_id):
+    return session.request_id == request_id
+
+# Stores the response of a turn. Returns False if the turn was replaced.
+def complete_turn(session, request_id, response):
+    with sessions_lock:
+        if not is_current(session, request_id):
+            return False
+        session.response = response
+        session.response_hash = audio_hash(response)
+        session.ready = True
+        session.updated_at = time.time()
+        session.changed.notify_all()
+        return True
+
+# Readiness as seen by a poll for request_id (None means the current turn)
+def ready_for(session, request_id):
+    return session.ready and (not request_id or is_current(session, request_id))
 
 # Google Cloud clients
 speech_client = speech.SpeechClient()
 tts_client = texttospeech.TextToSpeechClient()
 
 # Upload Audio Endpoint
+# Starts a new turn for the device; the audio stays in its session.
 @app.route('/uploadAudio', methods=['POST'])
 def upload_audio():
-    global should_download_file
-    should_download_file = False
+    session = get_session(device_id_of(request))
+    request_id = begin_turn(session, request_id_of(request))
+    tag = f"[{session.device_id} {request_id}]"
 
     total_start = time.time()  # Start total time
+    encoding = request.headers.get('X-Audio-Encoding', 'pcm')
+    sample_rate = int(request.headers.get('X-Audio-Sample-Rate', 16000))
+    headers = {"X-Request-Id": request_id}
 
     try:
-        with open(record_file, 'wb') as f:
-            data_size = 0
-            while True:
-                chunk = request.stream.read(4096)
-                if not chunk:
-                    break
-                data_size += len(chunk)
-                f.write(chunk)
+        chunks = []
+        while True:
+            chunk = request.stream.read(4096)
+            if not chunk:
+                break
+            chunks.append(chunk)
+        upload = b''.join(chunks)
+
+        print(f"{tag} Audio upload complete. Total size: {len(upload)} bytes ({encoding})")
+        if not is_current(session, request_id):
+            return "Superseded by a newer turn", 409, headers
+
+        recording = upload_to_wav(upload, encoding, sample_rate)
+        session.recording = recording
 
-        print(f"Audio upload complete. Total size: {data_size} bytes")
+        if ECHO_PIPELINE:
+            threading.Timer(ECHO_DELAY_MS / 1000, complete_turn, (session, request_id, recording)).start()
+            return "echo", 200, headers
 
         stt_start = time.time()
-        transcription = speech_to_text_api()
+        transcription = speech_to_text_api(recording, sample_rate, tag)
         stt_end = time.time()
-        print(f"STT Time: {stt_end - stt_start:.2f} seconds")
+        print(f"{tag} STT Time: {stt_end - stt_start:.2f} seconds")
 
         if transcription:
-            print("Transcription successful, calling Groq...")
+            print(f"{tag} Transcription successful, calling Groq...")
             ai_start = time.time()
-            call_groq(transcription)
-            # call_custom_llm(transcription)
+            call_groq(transcription, session, request_id)
+            # call_custom_llm(transcription, session, request_id)
             ai_end = time.time()
-            print(f"LLM Response Time: {ai_end - ai_start:.2f} seconds")
+            print(f"{tag} LLM Response Time: {ai_end - ai_start:.2f} seconds")
 
             total_end = time.time()
-            print(f"Total Time (STT + LLM + TTS): {total_end - total_start:.2f} seconds")
+            print(f"{tag} Total Time (STT + LLM + TTS): {total_end - total_start:.2f} seconds")
 
-            return transcription, 200
+            return transcription, 200, headers
         else:
-            return "Error transcribing audio", 200
+            gpt_response_to_speech(PROMPTS["notHeard"], session, request_id)
+            return "Error transcribing audio", 200, headers
 
     except Exception as e:
-        print("Unexpected error:", e)
-        return "Unexpected server error", 500
+        print(f"{tag} Unexpected error:", e)
+        return "Unexpected server error", 500, headers
 
 
-# Check readiness
+# Check readiness of the device's response
+# With ?wait=<ms> the request blocks until it is ready or the wait expires;
+# ?request= limits it to that turn
 @app.route('/checkVariable', methods=['GET'])
 def check_variable():
-    return jsonify({ "ready": should_download_file })
-
-# Broadcast audio
+    session = get_session(device_id_of(request))
+    request_id = request_id_of(request)
+    wait_s = min(request.args.get('wait', default=0, type=int) / 1000, LONG_POLL_MAX_S)
+    deadline = time.time() + wait_s
+    with sessions_lock:
+        # Also woken when a new turn replaces the one being waited on
+        while not ready_for(session, request_id) and time.time() < deadline:
+            session.changed.wait(deadline - time.time())
+        ready = ready_for(session, request_id)
+        reply = jsonify({"ready": ready, "request": session.request_id,
+                         "hash": session.response_hash if ready else None})
+        if ready:
+            reply.headers["X-Audio-Hash"] = session.response_hash
+        return reply
+
+# Broadcast the device's response; 404 until it is ready or for a replaced turn
 @app.route('/broadcastAudio', methods=['GET'])
 def broadcast_audio():
-    if not voiced_file.exists():
+    session = get_session(device_id_of(request))
+    with sessions_lock:
+        if not ready_for(session, request_id_of(request)):
+            return '', 404
+        response, response_hash, request_id = session.response, session.response_hash, session.request_id
+    return audio_response(response, response_hash, {"X-Request-Id": request_id})
+
+# Clips the device keeps on flash for when this server can't answer
+@app.route('/fallbackAudio', methods=['GET'])
+def fallback_audio():
+    name = request.args.get('name')
+    if name not in FALLBACK_CLIPS:
         return '', 404
-    return Response(
-        open(voiced_file, 'rb'),
-        mimetype='audio/wav',
-        headers={"Content-Length": str(voiced_file.stat().st_size)}
-    )
-
-# Test audio file
+    try:
+        audio = tone_wav(660 if name == "timeout" else 440, 400) if ECHO_PIPELINE else synthesize(PROMPTS[name])
+    except Exception as e:
+        print(f"Error synthesizing fallback clip {name}:", e)
+        return '', 503
+    return audio_response(audio, audio_hash(audio))
+
+def audio_response(audio, hash, headers=None):
+    headers = dict(headers or {})
+    headers.update({"Content-Length": str(len(audio)), "X-Audio-Hash": hash})
+    return Response(audio, mimetype='audio/wav', headers=headers)
+
+# 16 kHz mono beep, stands in for the fallback prompts in echo mode
+def tone_wav(freq, ms):
+    samples = 16 * ms
+    pcm = b''.join(int(6000 * math.sin(2 * math.pi * freq * i / 16000)).to_bytes(2, 'little', signed=True)
+                   for i in range(samples))
+    header = (b'RIFF' + (36 + len(pcm)).to_bytes(4, 'little') + b'WAVEfmt ' +
+              (16).to_bytes(4, 'little') + (1).to_bytes(2, 'little') + (1).to_bytes(2, 'little') +
+              (16000).to_bytes(4, 'little') + (32000).to_bytes(4, 'little') +
+              (2).to_bytes(2, 'little') + (16).to_bytes(2, 'little') +
+              b'data' + len(pcm).to_bytes(4, 'little'))
+    return header + pcm
+
+# Test audio file (?device= selects the session)
 @app.route('/test-audio', methods=['GET'])
 def test_audio():
-    return send_file(record_file)
+    session = get_session(device_id_of(request))
+    if session.recording is None:
+        return '', 404
+    return Response(session.recording, mimetype='audio/wav')
 
 # Test TTS output
 @app.route('/test-response', methods=['GET'])
 def test_response():
-    return send_file(voiced_file)
+    session = get_session(device_id_of(request))
+    if session.response is None:
+        return '', 404
+    return Response(session.response, mimetype='audio/wav')
 
 # Status check
 @app.route('/status', methods=['GET'])
 def status():
+    now = time.time()
+    with sessions_lock:
+        summary = [{
+            "deviceId": s.device_id,
+            "requestId": s.request_id,
+            "ready": s.ready,
+            "recordingBytes": len(s.recording or b''),
+            "responseBytes": len(s.response or b''),
+            "responseHash": s.response_hash,
+            "idleMs": int((now - s.updated_at) * 1000)
+        } for s in sessions.values()]
     return jsonify({
-        "recordingExists": record_file.exists(),
-        "responseExists": voiced_file.exists(),
-        "responseReady": should_download_file,
+        "pipeline": "echo" if ECHO_PIPELINE else "google+groq",
+        "sessions": summary,
         "googleCredentials": bool(os.getenv('GOOGLE_APPLICATION_CREDENTIALS')),
         "groqKeyConfigured": bool(groq_api_key)
     })
 
+# Upload body to a WAV: compressed uploads are decoded, and streamed uploads
+# carry a placeholder length that is rewritten from the bytes received
+def upload_to_wav(upload, encoding, sample_rate):
+    if encoding != 'pcm':
+        upload = decode_upload(upload, encoding, sample_rate)
+    return fix_wav_header(upload)
+
 # Speech to Text
-def speech_to_text_api():
+def speech_to_text_api(content, sample_rate=16000, tag=''):
     try:
-        if not record_file.exists():
-            raise FileNotFoundError("Audio file not found")
-        with open(record_file, "rb") as audio_file:
-            content = audio_file.read()
         if not content:
             raise ValueError("Audio file is empty")
 
         audio = {"content": base64.b64encode(content).decode("utf-8")}
         config = {
             "encoding": "LINEAR16",
-            "sample_rate_hertz": 16000,
+            "sample_rate_hertz": sample_rate,
             "language_code": "en-US"
         }
 
         response = speech_client.recognize(config=config, audio=audio)
         transcription = "\n".join(result.alternatives[0].transcript for result in response.results)
-        print("Transcription:", transcription)
+        print(f"{tag} Transcription:", transcription)
         return transcription
 
     except Exception as e:
-        print("Error in speech_to_text_api:", e)
+        print(f"{tag} Error in speech_to_text_api:", e)
         return None
 
+# Patch RIFF and data chunk sizes of a canonical 44-byte WAV header
+def fix_wav_header(content):
+    if len(content) < 44 or content[0:4] != b'RIFF' or content[36:40] != b'data':
+        return content
+    patched = bytearray(content)
+    patched[4:8] = (len(content) - 8).to_bytes(4, 'little')
+    patched[40:44] = (len(content) - 44).to_bytes(4, 'little')
+    return bytes(patched)
+
+# Decoders for compressed uploads (X-Audio-Encoding), bit-exact with the ESP32 encoder
+ADPCM_STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+]
+ADPCM_INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+def decode_ima_adpcm(data):
+    samples = []
+    predictor = 0
+    index = 0
+    for byte in data:
+        for code in (byte & 0x0f, byte >> 4):
+            step = ADPCM_STEP_TABLE[index]
+            diff = step >> 3
+            if code & 4:
+                diff += step
+            if code & 2:
+                diff += step >> 1
+            if code & 1:
+                diff += step >> 2
+            predictor += -diff if code & 8 else diff
+            predictor = max(-32768, min(32767, predictor))
+            index = max(0, min(88, index + ADPCM_INDEX_TABLE[code]))
+            samples.append(predictor)
+    return samples
+
+def decode_mulaw(data):
+    samples = []
+    for byte in data:
+        value = ~byte & 0xff
+        exponent = (value >> 4) & 0x07
+        mantissa = value & 0x0f
+        sample = (((mantissa << 3) + 0x84) << exponent) - 0x84
+        samples.append(-sample if value & 0x80 else sample)
+    return samples
+
+def decode_upload(content, encoding, sample_rate):
+    if encoding == 'ima-adpcm':
+        samples = decode_ima_adpcm(content)
+    elif encoding == 'mulaw':
+        samples = decode_mulaw(content)
+    else:
+        return content
+    pcm = b''.join(s.to_bytes(2, 'little', signed=True) for s in samples)
+    header = (b'RIFF' + (len(pcm) + 36).to_bytes(4, 'little') + b'WAVEfmt ' +
+              (16).to_bytes(4, 'little') + (1).to_bytes(2, 'little') + (1).to_bytes(2, 'little') +
+              sample_rate.to_bytes(4, 'little') + (sample_rate * 2).to_bytes(4, 'little') +
+              (2).to_bytes(2, 'little') + (16).to_bytes(2, 'little') +
+              b'data' + len(pcm).to_bytes(4, 'little'))
+    return header + pcm
+
 # Groq LLM Call
-def call_groq(text):
-    global should_download_file
+def call_groq(text, session, request_id):
     try:
         print("Sending to Groq:", text)
         api_url = "https://api.groq.com/openai/v1/chat/completions"
@@ -169,15 +412,14 @@ def call_groq(text):
         response = requests.post(api_url, headers=headers, json=payload)
         groq_response = response.json()['choices'][0]['message']['content']
         print("Groq Response:", groq_response)
-        gpt_response_to_speech(groq_response)
+        gpt_response_to_speech(groq_response, session, request_id)
 
     except Exception as e:
         print("Error calling Groq API:", e)
-        fallback = "I'm sorry, I couldn't process your request at this time."
-        gpt_response_to_speech(fallback)
+        gpt_response_to_speech(PROMPTS["llmError"], session, request_id)
 
 # Custom LLM Call (e.g., Google Colab)
-def call_custom_llm(text):
+def call_custom_llm(text, session, request_id):
     try:
         print("Sending to custom LLM:", text)
         response = requests.post(
@@ -192,50 +434,60 @@ def call_custom_llm(text):
         response_text = custom_response.get('response', "I'm sorry, I couldn't process your request.")
         
         # Now pass the string, not the dictionary
-        gpt_response_to_speech(response_text)
+        gpt_response_to_speech(response_text, session, request_id)
     except Exception as e:
         print("Error calling custom LLM API:", e)
-        fallback = "I'm sorry, I couldn't process your request at this time."
-        gpt_response_to_speech(fallback)
+        gpt_response_to_speech(PROMPTS["llmError"], session, request_id)
 
 # GPT Response to TTS
-def gpt_response_to_speech(gpt_response):
-    global should_download_file
+def gpt_response_to_speech(gpt_response, session, request_id):
+    tag = f"[{session.device_id} {request_id}]"
     try:
         tts_start = time.time()  # Start timer
 
         if not gpt_response.strip():
             gpt_response = "I'm sorry, I don't have a response at this time."
         
-        input_text = texttospeech.SynthesisInput(text=gpt_response)
-        voice = texttospeech.VoiceSelectionParams(
-            language_code="en-US", ssml_gender=texttospeech.SsmlVoiceGender.NEUTRAL
-        )
-        audio_config = texttospeech.AudioConfig(
-            audio_encoding=texttospeech.AudioEncoding.LINEAR16,
-            sample_rate_hertz=16000,
-            effects_profile_id=["headphone-class-device"],
-            pitch=0.0,
-            speaking_rate=1.0,
-        )
+        if complete_turn(session, request_id, synthesize(gpt_response)):
+            print(f"{tag} TTS conversion complete, response ready for playback")
+        else:
+            print(f"{tag} TTS done for a replaced turn, dropped")
 
-        response = tts_client.synthesize_speech(
-            input=input_text, voice=voice, audio_config=audio_config
-        )
+        tts_end = time.time()
+        print(f"{tag} TTS Time: {tts_end - tts_start:.2f} seconds")
+
+    except Exception as e:
+        print(f"{tag} Error in TTS conversion:", e)
 
-        with open(voiced_file, "wb") as out:
-            out.write(response.audio_content)
 
-        print("Audio content written to file:", voiced_file)
-        should_download_file = True
-        print("TTS conversion complete, response ready for playback")
+# TTS with a small memo: repeated text (prompts, common answers) is
+# synthesized once and comes back byte for byte identical
+def synthesize(text):
+    with tts_memo_lock:
+        if text in tts_memo:
+            tts_memo.move_to_end(text)
+            return tts_memo[text]
 
-        tts_end = time.time()
-        print(f"TTS Time: {tts_end - tts_start:.2f} seconds")
+    input_text = texttospeech.SynthesisInput(text=text)
+    voice = texttospeech.VoiceSelectionParams(
+        language_code="en-US", ssml_gender=texttospeech.SsmlVoiceGender.NEUTRAL
+    )
+    audio_config = texttospeech.AudioConfig(
+        audio_encoding=texttospeech.AudioEncoding.LINEAR16,
+        sample_rate_hertz=16000,
+        effects_profile_id=["headphone-class-device"],
+        pitch=0.0,
+        speaking_rate=1.0,
+    )
+    response = tts_client.synthesize_speech(
+        input=input_text, voice=voice, audio_config=audio_config
+    )
 
-    except Exception as e:
-        print("Error in TTS conversion:", e)
-        should_download_file = False
+    with tts_memo_lock:
+        tts_memo[text] = response.audio_content
+        if len(tts_memo) > TTS_MEMO_ENTRIES:
+            tts_memo.popitem(last=False)
+    return response.audio_content
 
 
 # Server Start
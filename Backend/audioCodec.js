@@ -0,0 +1,90 @@
+// Decoders for the compressed uploads sent by the ESP32 (X-Audio-Encoding).
+// Must stay bit-exact with ESP32_Code/src/audio_codec.cpp.
+
+const ADPCM_STEP_TABLE = [
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+  19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+  876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+  2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+  5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+  15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+];
+
+const ADPCM_INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8];
+
+// Continuous IMA-ADPCM stream, two samples per byte, low nibble first
+function decodeImaAdpcm(input) {
+  const output = Buffer.alloc(input.length * 4);
+  let predictor = 0;
+  let index = 0;
+  let offset = 0;
+
+  const step = (code) => {
+    const stepSize = ADPCM_STEP_TABLE[index];
+    let diff = stepSize >> 3;
+    if (code & 4) diff += stepSize;
+    if (code & 2) diff += stepSize >> 1;
+    if (code & 1) diff += stepSize >> 2;
+    predictor += (code & 8) ? -diff : diff;
+    predictor = Math.max(-32768, Math.min(32767, predictor));
+    index = Math.max(0, Math.min(88, index + ADPCM_INDEX_TABLE[code]));
+    output.writeInt16LE(predictor, offset);
+    offset += 2;
+  };
+
+  for (const byte of input) {
+    step(byte & 0x0f);
+    step(byte >> 4);
+  }
+  return output;
+}
+
+// G.711 mu-law
+function decodeMulaw(input) {
+  const output = Buffer.alloc(input.length * 2);
+  for (let i = 0; i < input.length; i++) {
+    const value = ~input[i] & 0xff;
+    const exponent = (value >> 4) & 0x07;
+    const mantissa = value & 0x0f;
+    let sample = (((mantissa << 3) + 0x84) << exponent) - 0x84;
+    if (value & 0x80) sample = -sample;
+    output.writeInt16LE(sample, i * 2);
+  }
+  return output;
+}
+
+// Wraps 16-bit mono PCM in a 44-byte WAV header
+function pcmToWav(pcm, sampleRate) {
+  const header = Buffer.alloc(44);
+  header.write('RIFF', 0, 'ascii');
+  header.writeUInt32LE(pcm.length + 36, 4);
+  header.write('WAVE', 8, 'ascii');
+  header.write('fmt ', 12, 'ascii');
+  header.writeUInt32LE(16, 16);
+  header.writeUInt16LE(1, 20);
+  header.writeUInt16LE(1, 22);
+  header.writeUInt32LE(sampleRate, 24);
+  header.writeUInt32LE(sampleRate * 2, 28);
+  header.writeUInt16LE(2, 32);
+  header.writeUInt16LE(16, 34);
+  header.write('data', 36, 'ascii');
+  header.writeUInt32LE(pcm.length, 40);
+  return Buffer.concat([header, pcm]);
+}
+
+// Returns a WAV buffer for an upload body, or the body itself for plain WAV
+function decodeUpload(body, encoding, sampleRate) {
+  switch (encoding) {
+    case 'ima-adpcm':
+      return pcmToWav(decodeImaAdpcm(body), sampleRate);
+    case 'mulaw':
+      return pcmToWav(decodeMulaw(body), sampleRate);
+    default:
+      return body;
+  }
+}
+
+module.exports = { decodeImaAdpcm, decodeMulaw, pcmToWav, decodeUpload };
@@ -0,0 +1,216 @@
+// Load test for the multi-device protocol: N simulated devices run voice
+// turns against one backend at the same time and check that each gets its
+// own response back.
+//
+//   PIPELINE=echo node server.js          (or PIPELINE=echo python app.py)
+//   node loadtest.js --devices 20 --turns 5
+//
+// With PIPELINE=echo the backend answers a turn with the turn's own upload,
+// so every response can be compared byte for byte with what the device
+// sent. Each device uploads audio unique to its turn the way the ESP32
+// does (chunked POST with X-Device-Id / X-Request-Id), long-polls
+// /checkVariable and downloads /broadcastAudio over one keep-alive socket.
+// After each turn it also checks that the previous turn's request ID no
+// longer reports ready, and that the X-Audio-Hash the poll announced is the
+// hash of the audio served.
+//
+// Options:
+//   --url URL        Backend base URL (default http://localhost:3000)
+//   --devices N      Simulated devices (default 10)
+//   --turns N        Turns per device (default 3)
+//   --seconds S      Upload length in seconds of 16 kHz PCM (default 3)
+//
+// Exits non-zero on any cross-talk, protocol error or failed turn.
+
+const crypto = require('crypto');
+const http = require('http');
+const { URL } = require('url');
+
+const SAMPLE_RATE = 16000;
+const CHUNK_BYTES = 4096;
+const LONG_POLL_MS = 20000;
+const TURN_TIMEOUT_MS = 60000;
+
+function parseArgs(argv) {
+  const options = { url: 'http://localhost:3000', devices: 10, turns: 3, seconds: 3 };
+  for (let i = 2; i + 1 < argv.length; i += 2) {
+    const name = argv[i].replace(/^--/, '');
+    if (!(name in options)) {
+      throw new Error(`Unknown option ${argv[i]}`);
+    }
+    options[name] = name === 'url' ? argv[i + 1] : Number(argv[i + 1]);
+  }
+  return options;
+}
+
+// 16-bit mono WAV whose samples encode the device and turn, so any mix-up
+// between sessions changes the bytes
+function makeUtterance(device, turn, seconds) {
+  const samples = Math.floor(SAMPLE_RATE * seconds);
+  const wav = Buffer.alloc(44 + samples * 2);
+  wav.write('RIFF', 0, 'ascii');
+  wav.writeUInt32LE(36 + samples * 2, 4);
+  wav.write('WAVEfmt ', 8, 'ascii');
+  wav.writeUInt32LE(16, 16);
+  wav.writeUInt16LE(1, 20);
+  wav.writeUInt16LE(1, 22);
+  wav.writeUInt32LE(SAMPLE_RATE, 24);
+  wav.writeUInt32LE(SAMPLE_RATE * 2, 28);
+  wav.writeUInt16LE(2, 32);
+  wav.writeUInt16LE(16, 34);
+  wav.write('data', 36, 'ascii');
+  wav.writeUInt32LE(samples * 2, 40);
+  const freq = 200 + device * 37 + turn * 11;
+  for (let i = 0; i < samples; i++) {
+    const tone = Math.round(8000 * Math.sin((2 * Math.PI * freq * i) / SAMPLE_RATE));
+    wav.writeInt16LE(tone ^ ((device * 131 + turn) & 0xff), 44 + i * 2);
+  }
+  return wav;
+}
+
+function request(agent, base, method, path, headers, body) {
+  return new Promise((resolve, reject) => {
+    const url = new URL(path, base);
+    const req = http.request(url, { method, agent, headers, timeout: TURN_TIMEOUT_MS }, (res) => {
+      const chunks = [];
+      res.on('data', (chunk) => chunks.push(chunk));
+      res.on('end', () => resolve({ status: res.statusCode, headers: res.headers, body: Buffer.concat(chunks) }));
+      res.on('error', reject);
+    });
+    req.on('timeout', () => req.destroy(new Error(`${method} ${path} timed out`)));
+    req.on('error', reject);
+    if (body) {
+      // No Content-Length: Node sends it chunked, like the device
+      for (let pos = 0; pos < body.length; pos += CHUNK_BYTES) {
+        req.write(body.subarray(pos, pos + CHUNK_BYTES));
+      }
+    }
+    req.end();
+  });
+}
+
+async function runTurn(agent, options, deviceId, requestId, audio, stats) {
+  const query = `device=${encodeURIComponent(deviceId)}&request=${encodeURIComponent(requestId)}`;
+  const start = Date.now();
+
+  const upload = await request(agent, options.url, 'POST', '/uploadAudio', {
+    'Content-Type': 'audio/wav',
+    'X-Audio-Encoding': 'pcm',
+    'X-Audio-Sample-Rate': String(SAMPLE_RATE),
+    'X-Device-Id': deviceId,
+    'X-Request-Id': requestId
+  }, audio);
+  if (upload.status !== 200) {
+    throw new Error(`upload returned ${upload.status}`);
+  }
+  const uploaded = Date.now();
+
+  let ready = false;
+  let hash = null;
+  while (!ready && Date.now() - start < TURN_TIMEOUT_MS) {
+    const poll = await request(agent, options.url, 'GET', `/checkVariable?wait=${LONG_POLL_MS}&${query}`);
+    const state = JSON.parse(poll.body.toString());
+    if (state.request !== requestId) {
+      throw new Error(`poll reports request ${state.request}`);
+    }
+    ready = state.ready;
+    hash = poll.headers['x-audio-hash'];
+  }
+  if (!ready) {
+    throw new Error('response never became ready');
+  }
+  const readyAt = Date.now();
+
+  const response = await request(agent, options.url, 'GET', `/broadcastAudio?${query}`);
+  const done = Date.now();
+  if (response.status !== 200) {
+    throw new Error(`broadcast returned ${response.status}`);
+  }
+  if (!response.body.equals(audio)) {
+    stats.crossTalk++;
+    throw new Error('response does not match this turn\'s upload');
+  }
+  const bodyHash = crypto.createHash('sha256').update(response.body).digest('hex').slice(0, 16);
+  if (hash !== bodyHash || response.headers['x-audio-hash'] !== bodyHash) {
+    throw new Error(`X-Audio-Hash ${hash} does not match the audio (${bodyHash})`);
+  }
+
+  stats.latency.upload.push(uploaded - start);
+  stats.latency.wait.push(readyAt - uploaded);
+  stats.latency.download.push(done - readyAt);
+  stats.latency.turn.push(done - start);
+  stats.bytes += audio.length * 2;
+}
+
+async function runDevice(index, options, stats) {
+  const deviceId = `loadtest-${index}`;
+  const agent = new http.Agent({ keepAlive: true, maxSockets: 1 });
+  let previous = null;
+
+  for (let turn = 0; turn < options.turns; turn++) {
+    const requestId = `${deviceId}-${turn}`;
+    try {
+      await runTurn(agent, options, deviceId, requestId, makeUtterance(index, turn, options.seconds), stats);
+      stats.turns++;
+    } catch (err) {
+      stats.failures++;
+      console.error(`${requestId}: ${err.message}`);
+    }
+
+    // The replaced turn must not report ready any more
+    if (previous) {
+      try {
+        const poll = await request(agent, options.url, 'GET',
+          `/checkVariable?device=${encodeURIComponent(deviceId)}&request=${encodeURIComponent(previous)}`);
+        if (JSON.parse(poll.body.toString()).ready) {
+          stats.crossTalk++;
+          console.error(`${previous}: still ready after ${requestId}`);
+        }
+      } catch (err) {
+        stats.failures++;
+        console.error(`${previous}: ${err.message}`);
+      }
+    }
+    previous = requestId;
+  }
+  agent.destroy();
+}
+
+function percentile(values, p) {
+  if (values.length === 0) {
+    return 0;
+  }
+  const sorted = [...values].sort((a, b) => a - b);
+  return sorted[Math.min(sorted.length - 1, Math.floor((p / 100) * sorted.length))];
+}
+
+async function main() {
+  const options = parseArgs(process.argv);
+  const stats = {
+    turns: 0,
+    failures: 0,
+    crossTalk: 0,
+    bytes: 0,
+    latency: { upload: [], wait: [], download: [], turn: [] }
+  };
+
+  const start = Date.now();
+  await Promise.all(Array.from({ length: options.devices }, (_, i) => runDevice(i, options, stats)));
+  const seconds = (Date.now() - start) / 1000;
+
+  const total = options.devices * options.turns;
+  console.log(`${options.devices} devices x ${options.turns} turns against ${options.url}`);
+  console.log(`${stats.turns}/${total} turns ok, ${stats.failures} failed, ${stats.crossTalk} cross-talk`);
+  console.log(`${(stats.turns / seconds).toFixed(2)} turns/s, ${(stats.bytes / seconds / 1024).toFixed(0)} KiB/s audio in ${seconds.toFixed(1)} s`);
+  console.log(`${'stage (ms)'.padEnd(12)}${'p50'.padStart(8)}${'p95'.padStart(8)}${'max'.padStart(8)}`);
+  for (const [stage, values] of Object.entries(stats.latency)) {
+    console.log(`${stage.padEnd(12)}${String(percentile(values, 50)).padStart(8)}` +
+      `${String(percentile(values, 95)).padStart(8)}${String(percentile(values, 100)).padStart(8)}`);
+  }
+  process.exit(stats.turns === total && stats.failures === 0 && stats.crossTalk === 0 ? 0 : 1);
+}
+
+main().catch((err) => {
+  console.error(err);
+  process.exit(2);
+});
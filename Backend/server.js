@@ -1,15 +1,18 @@
 const express = require('express');
 const cors = require('cors');
-const fs = require('fs');
 const path = require('path');
 const speech = require('@google-cloud/speech');
 const textToSpeech = require('@google-cloud/text-to-speech');
 const axios = require('axios');
+const { decodeUpload } = require('./audioCodec');
+const sessions = require('./sessions');
 require('dotenv').config();
 require('express-async-errors');
 
 const port = process.env.PORT || 3000;
-process.env.GOOGLE_APPLICATION_CREDENTIALS = path.resolve(process.env.GOOGLE_APPLICATION_CREDENTIALS);
+if (process.env.GOOGLE_APPLICATION_CREDENTIALS) {
+  process.env.GOOGLE_APPLICATION_CREDENTIALS = path.resolve(process.env.GOOGLE_APPLICATION_CREDENTIALS);
+}
 
 
 
@@ -17,13 +20,30 @@ process.env.GOOGLE_APPLICATION_CREDENTIALS = path.resolve(process.env.GOOGLE_APP
 const app = express();
 
 
-// Path to files for production
-const recordFile = path.join(__dirname, 'tmp', 'recording.wav');
-const voicedFile = path.join(__dirname, 'tmp', 'voicedby.wav');
-
 // API Key
 const groqApiKey = process.env.GROQ_API_KEY;
-let shouldDownloadFile = false;
+
+// Longest a /checkVariable long-poll is held
+const LONG_POLL_MAX_MS = 30000;
+
+// PIPELINE=echo answers every turn with its own upload after ECHO_DELAY_MS
+// instead of calling STT/LLM/TTS. For load tests (loadtest.js) and bring-up
+// without cloud credentials.
+const ECHO_PIPELINE = process.env.PIPELINE === 'echo';
+const ECHO_DELAY_MS = parseInt(process.env.ECHO_DELAY_MS, 10) || 1500;
+
+// Fixed prompts. Synthesized once and memoized, so every device gets the
+// same bytes (and the same X-Audio-Hash) and can replay them from flash.
+// timeout and offline are the device's fallback clips, see /fallbackAudio.
+const PROMPTS = {
+  timeout: "Sorry, that is taking longer than it should. Please try again in a moment.",
+  offline: "I can't reach my server right now. Please check the connection and try again.",
+  notHeard: "Sorry, I didn't catch that. Could you say it again?",
+  llmError: "I'm sorry, I couldn't process your request at this time."
+};
+const FALLBACK_CLIPS = ['timeout', 'offline'];
+const TTS_MEMO_ENTRIES = 64;
+const ttsMemo = new Map(); // text -> WAV, oldest first
 
 // Init Google Cloud clients
 const speechClient = new speech.SpeechClient();
@@ -34,43 +54,60 @@ app.use(express.urlencoded({ extended: true }));
 app.use(express.json());
 
 // Upload Audio
+// Starts a new turn for the device; the audio stays in its session.
 app.post('/uploadAudio', async (req, res) => {
   try {
-    shouldDownloadFile = false;
-    const recordingFile = fs.createWriteStream(recordFile);
-    let dataSize = 0;
+    const session = sessions.getSession(sessions.deviceIdOf(req));
+    const requestId = sessions.beginTurn(session, sessions.requestIdOf(req));
+    const tag = `[${session.deviceId} ${requestId}]`;
+    const encoding = req.get('X-Audio-Encoding') || 'pcm';
+    const sampleRate = parseInt(req.get('X-Audio-Sample-Rate'), 10) || 16000;
+    const chunks = [];
 
     req.on('data', (chunk) => {
-      dataSize += chunk.length;
+      chunks.push(chunk);
     });
 
-    req.pipe(recordingFile);
-
+    // Not emitted for an aborted upload, which leaves the turn without audio
     req.on('end', async () => {
-      recordingFile.end();
-      console.log(`Audio upload complete. Total size: ${dataSize} bytes`);
+      const upload = Buffer.concat(chunks);
+      console.log(`${tag} Audio upload complete. Total size: ${upload.length} bytes (${encoding})`);
+      res.set('X-Request-Id', requestId);
+      if (!sessions.isCurrent(session, requestId)) {
+        return res.status(409).send('Superseded by a newer turn');
+      }
 
       try {
-        const transcription = await speechToTextAPI();
+        const recording = uploadToWav(upload, encoding, sampleRate);
+        session.recording = recording;
+
+        if (ECHO_PIPELINE) {
+          res.status(200).send('echo');
+          setTimeout(() => sessions.completeTurn(session, requestId, recording), ECHO_DELAY_MS);
+          return;
+        }
+
+        const transcription = await speechToTextAPI(recording, sampleRate, tag);
         if (transcription) {
-          console.log("Transcription successful, calling Groq...");
+          console.log(`${tag} Transcription successful, calling Groq...`);
           res.status(200).send(transcription);
           //calling the groq api 
-          callGroq(transcription);
+          callGroq(transcription, session, requestId);
           // Uncomment the line below to call the custom LLM API instead of Groq
-          // callCustomLLM(transcription);
+          // callCustomLLM(transcription, session, requestId);
         } else {
-          console.error("Transcription failed, sending error response");
+          console.error(`${tag} Transcription failed, sending error response`);
           res.status(200).send('Error transcribing audio');
+          GptResponsetoSpeech(PROMPTS.notHeard, session, requestId);
         }
       } catch (err) {
-        console.error('Error in audio processing:', err);
+        console.error(`${tag} Error in audio processing:`, err);
         res.status(200).send('Error processing audio');
       }
     });
 
     req.on('error', (err) => {
-      console.error('Error writing file:', err);
+      console.error(`${tag} Error receiving audio:`, err);
       res.status(500).send('Error uploading audio');
     });
   } catch (error) {
@@ -80,35 +117,68 @@ app.post('/uploadAudio', async (req, res) => {
 });
 
 // Check Variable
+// Reports whether the device's response is ready. With ?wait=<ms> the
+// request is held open until it is or the wait expires, so the device
+// learns about it without polling. ?request= limits it to that turn.
 app.get('/checkVariable', (req, res) => {
-  res.json({ ready: shouldDownloadFile });
+  const session = sessions.getSession(sessions.deviceIdOf(req));
+  const wait = Math.min(parseInt(req.query.wait, 10) || 0, LONG_POLL_MAX_MS);
+  const cancel = sessions.waitReady(session, sessions.requestIdOf(req), wait, (ready) => {
+    if (ready) {
+      res.set('X-Audio-Hash', session.responseHash);
+    }
+    res.json({ ready, request: session.requestId, hash: ready ? session.responseHash : null });
+  });
+  if (cancel) {
+    res.on('close', cancel);
+  }
 });
 
 // Broadcast Audio
+// Serves the device's response; 404 until it is ready or for a replaced turn
 app.get('/broadcastAudio', (req, res) => {
-  fs.stat(voicedFile, (err, stats) => {
-    if (err) return res.sendStatus(404);
+  const session = sessions.getSession(sessions.deviceIdOf(req));
+  if (!sessions.readyFor(session, sessions.requestIdOf(req))) {
+    return res.sendStatus(404);
+  }
 
-    res.writeHead(200, { 'Content-Type': 'audio/wav', 'Content-Length': stats.size });
-    const readStream = fs.createReadStream(voicedFile);
-    readStream.pipe(res);
-  });
+  res.set('X-Request-Id', session.requestId);
+  sendAudio(res, session.response, session.responseHash);
 });
 
-// Test endpoints
+// Fallback Audio
+// Clips the device keeps on flash for when this server can't answer
+app.get('/fallbackAudio', async (req, res) => {
+  const name = req.query.name;
+  if (!FALLBACK_CLIPS.includes(name)) {
+    return res.sendStatus(404);
+  }
+  try {
+    const audio = ECHO_PIPELINE ? toneWav(name === 'timeout' ? 660 : 440, 400) : await synthesize(PROMPTS[name]);
+    sendAudio(res, audio, sessions.audioHash(audio));
+  } catch (error) {
+    console.error(`Error synthesizing fallback clip ${name}:`, error.message);
+    res.sendStatus(503);
+  }
+});
+
+// Test endpoints (?device= selects the session)
 app.get('/test-audio', (req, res) => {
-  res.sendFile(recordFile);
+  const session = sessions.getSession(sessions.deviceIdOf(req));
+  if (!session.recording) return res.sendStatus(404);
+  res.type('audio/wav').send(session.recording);
 });
 
 app.get('/test-response', (req, res) => {
-  res.sendFile(voicedFile);
+  const session = sessions.getSession(sessions.deviceIdOf(req));
+  if (!session.response) return res.sendStatus(404);
+  res.type('audio/wav').send(session.response);
 });
 
 app.get('/status', (req, res) => {
   res.json({
-    recordingExists: fs.existsSync(recordFile),
-    responseExists: fs.existsSync(voicedFile),
-    responseReady: shouldDownloadFile,
+    pipeline: ECHO_PIPELINE ? 'echo' : 'google+groq',
+    sessions: sessions.sessionSummary(),
     googleCredentials: !!process.env.GOOGLE_APPLICATION_CREDENTIALS,
     groqKeyConfigured: !!groqApiKey
   });
@@ -129,29 +199,61 @@ app.listen(port, () => {
   }
 });
 
-// Speech to Text using Google
-async function speechToTextAPI() {
-  try {
-    // Check if file exists
-    if (!fs.existsSync(recordFile)) {
-      throw new Error('Audio file not found');
-    }
+function sendAudio(res, audio, hash) {
+  res.writeHead(200, {
+    'Content-Type': 'audio/wav',
+    'Content-Length': audio.length,
+    'X-Audio-Hash': hash
+  });
+  res.end(audio);
+}
+
+// 16 kHz mono beep, stands in for the fallback prompts in echo mode
+function toneWav(freq, ms) {
+  const samples = Math.floor(16 * ms);
+  const wav = Buffer.alloc(44 + samples * 2);
+  wav.write('RIFF', 0, 'ascii');
+  wav.writeUInt32LE(36 + samples * 2, 4);
+  wav.write('WAVEfmt ', 8, 'ascii');
+  wav.writeUInt32LE(16, 16);
+  wav.writeUInt16LE(1, 20);
+  wav.writeUInt16LE(1, 22);
+  wav.writeUInt32LE(16000, 24);
+  wav.writeUInt32LE(32000, 28);
+  wav.writeUInt16LE(2, 32);
+  wav.writeUInt16LE(16, 34);
+  wav.write('data', 36, 'ascii');
+  wav.writeUInt32LE(samples * 2, 40);
+  for (let i = 0; i < samples; i++) {
+    wav.writeInt16LE(Math.round(6000 * Math.sin((2 * Math.PI * freq * i) / 16000)), 44 + i * 2);
+  }
+  return wav;
+}
 
-    // Read audio file and convert to base64
-    const fileContent = fs.readFileSync(recordFile);
-    console.log('Audio File Size:', fileContent.length);
+// Upload body to a WAV: compressed uploads are decoded, and streamed
+// uploads (endpointed on the device, so the WAV header carries a
+// placeholder length) get their sizes rewritten from the bytes received
+function uploadToWav(upload, encoding, sampleRate) {
+  const wav = encoding !== 'pcm' ? decodeUpload(upload, encoding, sampleRate) : upload;
+  fixWavHeader(wav);
+  return wav;
+}
 
-    if (!fileContent || fileContent.length === 0) {
+// Speech to Text using Google
+async function speechToTextAPI(recording, sampleRate = 16000, tag = '') {
+  try {
+    console.log(`${tag} Audio File Size:`, recording.length);
+    if (!recording || recording.length === 0) {
       throw new Error('Audio file is empty');
     }
 
     const audio = {
-      content: fileContent.toString('base64'),
+      content: recording.toString('base64'),
     };
 
     const config = {
       encoding: 'LINEAR16',
-      sampleRateHertz: 16000,  // Match ESP32 recording rate
+      sampleRateHertz: sampleRate,  // Match ESP32 recording rate
       languageCode: 'en-US',
     };
 
@@ -164,16 +266,25 @@ async function speechToTextAPI() {
     const [response] = await speechClient.recognize(request);
 
     const transcription = response.results.map(result => result.alternatives[0].transcript).join('\n');
-    console.log('Transcription:', transcription);
+    console.log(`${tag} Transcription:`, transcription);
     return transcription;
   } catch (error) {
-    console.error('Error in speechToTextAPI:', error);
+    console.error(`${tag} Error in speechToTextAPI:`, error);
     return null;
   }
 }
 
+// Patch RIFF and data chunk sizes of a canonical 44-byte WAV header in place
+function fixWavHeader(buffer) {
+  if (buffer.length < 44 || buffer.toString('ascii', 0, 4) !== 'RIFF' || buffer.toString('ascii', 36, 40) !== 'data') {
+    return;
+  }
+  buffer.writeUInt32LE(buffer.length - 8, 4);
+  buffer.writeUInt32LE(buffer.length - 44, 40);
+}
+
 // Call Groq API
-async function callGroq(text) {
+async function callGroq(text, session, requestId) {
   try {
     console.log('Sending to Groq:', text);
 
@@ -208,7 +319,7 @@ async function callGroq(text) {
     console.log('Groq Response:', groqResponse);
 
     // Convert response to speech
-    await GptResponsetoSpeech(groqResponse);
+    await GptResponsetoSpeech(groqResponse, session, requestId);
 
   } catch (error) {
     console.error('Error calling Groq API:');
@@ -220,14 +331,13 @@ async function callGroq(text) {
     }
 
     // Send a fallback response in case of error
-    const fallbackResponse = "I'm sorry, I couldn't process your request at this time.";
-    await GptResponsetoSpeech(fallbackResponse);
+    await GptResponsetoSpeech(PROMPTS.llmError, session, requestId);
   }
 }
 
 //calling custom llm api which is in google colab 
 // Call custom local LLM API instead of Groq
-async function callCustomLLM(text) {
+async function callCustomLLM(text, session, requestId) {
   try {
     console.log('Sending to custom LLM:', text);
 
@@ -248,43 +358,62 @@ async function callCustomLLM(text) {
     console.log('Custom LLM Response:', response.data);
 
     // Convert response to speech
-    await GptResponsetoSpeech(customResponse);
+    await GptResponsetoSpeech(customResponse, session, requestId);
   } catch (error) {
     console.error('Error calling custom LLM API:', error.message);
-    const fallbackResponse = "I'm sorry, I couldn't process your request at this time.";
-    await GptResponsetoSpeech(fallbackResponse);
+    await GptResponsetoSpeech(PROMPTS.llmError, session, requestId);
   }
 }
 
 
 // Text to Speech using Google
 // In the server.js file:
-async function GptResponsetoSpeech(gptResponse) {
+async function GptResponsetoSpeech(gptResponse, session, requestId) {
   try {
     // Ensure we have a valid response
     if (!gptResponse || gptResponse.trim() === '') {
       gptResponse = "I'm sorry, I don't have a response at this time.";
     }
 
-    const request = {
-      input: { text: gptResponse },
-      voice: { languageCode: 'en-US', ssmlGender: 'NEUTRAL' },
-      audioConfig: {
-        audioEncoding: 'LINEAR16',
-        sampleRateHertz: 16000,  // Make sure this matches ESP32
-        effectsProfileId: ['headphone-class-device'],
-        pitch: 0.0,
-        speakingRate: 1.0,
-        audioChannelCount: 1
-      },
-    };
-
-    const [response] = await ttsClient.synthesizeSpeech(request);
-    fs.writeFileSync(voicedFile, response.audioContent, 'binary');
-    shouldDownloadFile = true;
-    console.log("TTS conversion complete, response ready for playback");
+    const audio = await synthesize(gptResponse);
+    if (sessions.completeTurn(session, requestId, audio)) {
+      console.log(`[${session.deviceId} ${requestId}] TTS conversion complete, response ready for playback`);
+    } else {
+      console.log(`[${session.deviceId} ${requestId}] TTS done for a replaced turn, dropped`);
+    }
   } catch (error) {
-    console.error('Error in Text-to-Speech conversion:', error);
-    shouldDownloadFile = false;
+    console.error(`[${session.deviceId} ${requestId}] Error in Text-to-Speech conversion:`, error);
   }
-}
\ No newline at end of file
+}
+
+// TTS with a small memo: repeated text (prompts, common answers) is
+// synthesized once and comes back byte for byte identical
+async function synthesize(text) {
+  const memo = ttsMemo.get(text);
+  if (memo) {
+    ttsMemo.delete(text);
+    ttsMemo.set(text, memo);
+    return memo;
+  }
+
+  const request = {
+    input: { text },
+    voice: { languageCode: 'en-US', ssmlGender: 'NEUTRAL' },
+    audioConfig: {
+      audioEncoding: 'LINEAR16',
+      sampleRateHertz: 16000,  // Make sure this matches ESP32
+      effectsProfileId: ['headphone-class-device'],
+      pitch: 0.0,
+      speakingRate: 1.0,
+      audioChannelCount: 1
+    },
+  };
+
+  const [response] = await ttsClient.synthesizeSpeech(request);
+  const audio = Buffer.from(response.audioContent);
+  ttsMemo.set(text, audio);
+  if (ttsMemo.size > TTS_MEMO_ENTRIES) {
+    ttsMemo.delete(ttsMemo.keys().next().value);
+  }
+  return audio;
+}
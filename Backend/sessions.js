@@ -0,0 +1,155 @@
+// Per-device turn state, kept in memory so several devices can talk to one
+// backend at once.
+//
+// Devices identify themselves with X-Device-Id and tag each turn with
+// X-Request-Id (or ?device= / ?request= on the GET endpoints). A session
+// holds the device's current turn only: a new upload replaces the previous
+// turn, and results of a turn that has been replaced are dropped.
+// Requests without a device ID share the 'default' session, which keeps
+// single-device setups working unchanged.
+//
+// Each response gets a content hash (audioHash), sent as X-Audio-Hash so
+// devices can play responses they already have from their flash cache.
+
+const crypto = require('crypto');
+
+const SESSION_IDLE_MS = 10 * 60 * 1000;
+const SWEEP_INTERVAL_MS = 60 * 1000;
+
+const sessions = new Map();
+let generatedIds = 0;
+
+function deviceIdOf(req) {
+  return req.get('X-Device-Id') || req.query.device || 'default';
+}
+
+function requestIdOf(req) {
+  return req.get('X-Request-Id') || req.query.request || null;
+}
+
+function getSession(deviceId) {
+  let session = sessions.get(deviceId);
+  if (!session) {
+    session = {
+      deviceId,
+      requestId: null,
+      recording: null,  // WAV of the current turn's upload
+      response: null,   // WAV to play back, set once ready
+      responseHash: null,
+      ready: false,
+      waiters: [],      // Pending long-polls for this device
+      updatedAt: Date.now()
+    };
+    sessions.set(deviceId, session);
+  }
+  session.updatedAt = Date.now();
+  return session;
+}
+
+// Starts a new turn, completing long-polls still waiting on the old one
+function beginTurn(session, requestId) {
+  session.requestId = requestId || `srv-${++generatedIds}`;
+  session.recording = null;
+  session.response = null;
+  session.responseHash = null;
+  session.ready = false;
+  notify(session);
+  return session.requestId;
+}
+
+// First 64 bits of the SHA-256 of a response, as 16 hex digits
+function audioHash(audio) {
+  return crypto.createHash('sha256').update(audio).digest('hex').slice(0, 16);
+}
+
+function isCurrent(session, requestId) {
+  return session.requestId === requestId;
+}
+
+// Stores the response of a turn. Returns false if the turn was replaced.
+function completeTurn(session, requestId, response) {
+  if (!isCurrent(session, requestId)) {
+    return false;
+  }
+  session.response = response;
+  session.responseHash = audioHash(response);
+  session.ready = true;
+  session.updatedAt = Date.now();
+  notify(session);
+  return true;
+}
+
+// Readiness as seen by a poll for requestId (null means the current turn)
+function readyFor(session, requestId) {
+  return session.ready && (!requestId || isCurrent(session, requestId));
+}
+
+// Calls done(ready) once the turn is ready or after waitMs. Returns a
+// function that cancels the wait, or null if done was called right away.
+function waitReady(session, requestId, waitMs, done) {
+  if (readyFor(session, requestId) || waitMs <= 0) {
+    done(readyFor(session, requestId));
+    return null;
+  }
+  const waiter = {
+    requestId,
+    done,
+    timer: setTimeout(() => {
+      removeWaiter(session, waiter);
+      done(readyFor(session, requestId));
+    }, waitMs)
+  };
+  session.waiters.push(waiter);
+  return () => {
+    clearTimeout(waiter.timer);
+    removeWaiter(session, waiter);
+  };
+}
+
+function removeWaiter(session, waiter) {
+  session.waiters = session.waiters.filter((w) => w !== waiter);
+}
+
+function notify(session) {
+  const waiters = session.waiters;
+  session.waiters = [];
+  for (const waiter of waiters) {
+    clearTimeout(waiter.timer);
+    waiter.done(readyFor(session, waiter.requestId));
+  }
+}
+
+function sessionSummary() {
+  return Array.from(sessions.values()).map((s) => ({
+    deviceId: s.deviceId,
+    requestId: s.requestId,
+    ready: s.ready,
+    recordingBytes: s.recording ? s.recording.length : 0,
+    responseBytes: s.response ? s.response.length : 0,
+    responseHash: s.responseHash,
+    idleMs: Date.now() - s.updatedAt
+  }));
+}
+
+// Forget devices that have gone quiet, along with their audio
+setInterval(() => {
+  const now = Date.now();
+  for (const [deviceId, session] of sessions) {
+    if (now - session.updatedAt > SESSION_IDLE_MS && session.waiters.length === 0) {
+      sessions.delete(deviceId);
+    }
+  }
+}, SWEEP_INTERVAL_MS).unref();
+
+module.exports = {
+  audioHash,
+  deviceIdOf,
+  requestIdOf,
+  getSession,
+  beginTurn,
+  isCurrent,
+  completeTurn,
+  readyFor,
+  waitReady,
+  sessionSummary
+};
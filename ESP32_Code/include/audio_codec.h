@@ -0,0 +1,44 @@
+// Upload codecs: 4:1 IMA-ADPCM and G.711 mu-law (2:1).
+//
+// ADPCM runs as one continuous stream (no WAV blocks): predictor and step
+// index start at zero and carry across calls, two samples per byte, low
+// nibble first. Decoders are included for host-side round-trip checks;
+// the backend has a matching JavaScript decoder.
+//
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum AudioEncoding
+{
+  AUDIO_ENCODING_PCM = 0,
+  AUDIO_ENCODING_IMA_ADPCM = 1,
+  AUDIO_ENCODING_MULAW = 2
+};
+
+struct AdpcmState
+{
+  int32_t predictor;
+  int32_t index;
+  bool hasNibble; // Odd sample waiting for its partner
+  uint8_t nibble;
+};
+
+// Name sent in the X-Audio-Encoding upload header
+const char *audioEncodingName(AudioEncoding encoding);
+// Content-Type of an upload in this encoding
+const char *audioEncodingContentType(AudioEncoding encoding);
+
+void adpcmInit(AdpcmState &state);
+// Encodes count samples, returns bytes written to dst (at most (count + 1) / 2)
+size_t adpcmEncode(AdpcmState &state, uint8_t *dst, const int16_t *src, size_t count);
+// Writes a pending odd nibble, returns 0 or 1
+size_t adpcmFlush(AdpcmState &state, uint8_t *dst);
+// Decodes bytes into 2 * bytes samples, returns samples written
+size_t adpcmDecode(AdpcmState &state, int16_t *dst, const uint8_t *src, size_t bytes);
+
+uint8_t mulawEncode(int16_t sample);
+int16_t mulawDecode(uint8_t value);
+size_t mulawEncodeBlock(uint8_t *dst, const int16_t *src, size_t count);
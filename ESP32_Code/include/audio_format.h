@@ -0,0 +1,90 @@
+// Compile-time PCM format descriptors.
+//
+// AudioFormat<Rate, Bits, Channels> derives everything that used to be
+// computed by hand from separate rate/bits/channel macros: frame size,
+// byte rate, buffer sizes for a duration and the canonical 44-byte WAV
+// header. All of it is constexpr, so a format the code can't handle fails
+// the build with a static_assert, and the header fields are constants
+// instead of magic bytes that go stale when the rate changes.
+//
+// wavHeaderMake is the same header for formats only known at run time
+// (the queue replays whatever rate the config says).
+//
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WAV_HEADER_SIZE (44) // RIFF, fmt (16-byte PCM) and data chunk headers
+
+struct WavHeader
+{
+  uint8_t bytes[WAV_HEADER_SIZE];
+};
+
+constexpr uint8_t wavByte(uint32_t value, int index)
+{
+  return (uint8_t)((value >> (8 * index)) & 0xFF);
+}
+
+// Canonical PCM header for dataBytes of audio
+constexpr WavHeader wavHeaderMake(uint32_t sampleRate, uint16_t bitsPerSample, uint16_t channels, uint32_t dataBytes)
+{
+  return WavHeader{{'R', 'I', 'F', 'F',
+                    wavByte(WAV_HEADER_SIZE - 8 + dataBytes, 0), wavByte(WAV_HEADER_SIZE - 8 + dataBytes, 1),
+                    wavByte(WAV_HEADER_SIZE - 8 + dataBytes, 2), wavByte(WAV_HEADER_SIZE - 8 + dataBytes, 3),
+                    'W', 'A', 'V', 'E',
+                    'f', 'm', 't', ' ', 16, 0, 0, 0,
+                    1, 0, // PCM
+                    wavByte(channels, 0), wavByte(channels, 1),
+                    wavByte(sampleRate, 0), wavByte(sampleRate, 1), wavByte(sampleRate, 2), wavByte(sampleRate, 3),
+                    wavByte(sampleRate * channels * (bitsPerSample / 8), 0),
+                    wavByte(sampleRate * channels * (bitsPerSample / 8), 1),
+                    wavByte(sampleRate * channels * (bitsPerSample / 8), 2),
+                    wavByte(sampleRate * channels * (bitsPerSample / 8), 3),
+                    wavByte(channels * (bitsPerSample / 8), 0), wavByte(channels * (bitsPerSample / 8), 1),
+                    wavByte(bitsPerSample, 0), wavByte(bitsPerSample, 1),
+                    'd', 'a', 't', 'a',
+                    wavByte(dataBytes, 0), wavByte(dataBytes, 1), wavByte(dataBytes, 2), wavByte(dataBytes, 3)}};
+}
+
+template <uint32_t Rate, uint16_t Bits, uint16_t Channels = 1>
+struct AudioFormat
+{
+  static_assert(Rate >= 8000 && Rate <= 48000, "Sample rate outside what the I2S clocks are set up for");
+  static_assert(Rate % 1000 == 0, "Sizes per millisecond need a whole number of samples");
+  static_assert(Bits == 8 || Bits == 16 || Bits == 24 || Bits == 32, "Bits per sample must be whole bytes");
+  static_assert(Channels == 1 || Channels == 2, "Mono or stereo only");
+
+  static constexpr uint32_t sampleRate = Rate;
+  static constexpr uint16_t bitsPerSample = Bits;
+  static constexpr uint16_t channels = Channels;
+  static constexpr uint16_t sampleBytes = Bits / 8;
+  static constexpr uint16_t blockAlign = Channels * sampleBytes; // Bytes per frame
+  static constexpr uint32_t byteRate = Rate * blockAlign;
+
+  static constexpr uint32_t bytesForMs(uint32_t ms)
+  {
+    return Rate / 1000 * ms * blockAlign;
+  }
+  static constexpr uint32_t bytesForSeconds(uint32_t seconds)
+  {
+    return byteRate * seconds;
+  }
+  static constexpr uint32_t msForBytes(uint32_t bytes)
+  {
+    return bytes / blockAlign / (Rate / 1000);
+  }
+  static constexpr WavHeader wavHeader(uint32_t dataBytes)
+  {
+    return wavHeaderMake(Rate, Bits, Channels, dataBytes);
+  }
+};
+
+// Header of the common case, checked against the bytes it replaced
+static_assert(AudioFormat<16000, 16>::wavHeader(0).bytes[24] == 0x80 &&
+                  AudioFormat<16000, 16>::wavHeader(0).bytes[25] == 0x3E &&
+                  AudioFormat<16000, 16>::wavHeader(0).bytes[29] == 0x7D &&
+                  AudioFormat<16000, 16>::wavHeader(0).bytes[32] == 2,
+              "WAV header layout");
@@ -0,0 +1,22 @@
+// Audio device layer under the capture and playback engines.
+//
+// The ESP32 build maps these calls onto the I2S driver (audio_hal_i2s.cpp).
+// The native build (env:native) backs the mic and speaker with WAV files
+// paced to the sample clock, so the pipeline can run on a host.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <driver/i2s.h>
+
+// Reads up to len bytes of mic slots, blocking until they arrive.
+// Returns the byte count.
+size_t audioRead(i2s_port_t port, void *buf, size_t len);
+// Queues len bytes for the speaker, blocking while the DMA ring is full.
+// Returns the bytes queued.
+size_t audioWrite(i2s_port_t port, const void *buf, size_t len);
+// Drops anything queued for the speaker and restarts it on silence
+void audioClear(i2s_port_t port);
+// Switches the speaker clock to sampleRate (16-bit mono). Returns false
+// if the port can't run at that rate; the old rate is kept then.
+bool audioSetRate(i2s_port_t port, uint32_t sampleRate);
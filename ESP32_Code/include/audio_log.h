@@ -0,0 +1,119 @@
+// Circular append-only audio log on a raw flash partition.
+//
+// Recordings go to the "audiolog" data partition (partitions.csv) instead
+// of SPIFFS files. The partition is a ring of records, each starting on a
+// sector boundary with a 20-byte header (magic, sequence number, check,
+// length and state words) followed by the audio, wrapping at the end of
+// the partition. New records overwrite the oldest ones. There is no file
+// system, so there is no garbage collection and no metadata rewrite. An
+// append only programs flash that audioLogPrepare erased ahead of the
+// write head, so its latency is fixed by the page program time. Appends
+// that run past the erased area erase inline and count as late erases.
+//
+// A record's length is programmed into its header when it is finished
+// (NOR flash can clear bits without an erase). At init the newest
+// finished record is found by sequence number; an unfinished one (power
+// lost while recording) is skipped.
+//
+// A finished record stays pending until audioLogMarkDone programs its
+// state word (an utterance waiting for upload, see utterance_queue.h).
+// Pending records are never erased: audioLogPrepare stops in front of the
+// oldest one and an append that would reach it fails. audioLogRoom tells
+// how much can be recorded before that.
+//
+// The flash sits behind FlashDevice, so the log also runs on the host
+// against a file (src/native/audio_log_sim). No Arduino dependencies.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AUDIO_LOG_MAGIC (0x474F4C41) // "ALOG"
+#define AUDIO_LOG_HEADER_SIZE (20)
+#define AUDIO_LOG_OPEN_LENGTH (0xFFFFFFFF) // Length field of an unfinished record
+#define AUDIO_LOG_STATE_PENDING (0xFFFFFFFF)
+#define AUDIO_LOG_STATE_DONE (0)
+
+// Flash operations at partition offsets. write only clears bits, on
+// erased flash; erase works on whole sectors.
+struct FlashDevice
+{
+  bool (*read)(uint32_t offset, void *buf, size_t len, void *ctx);
+  bool (*write)(uint32_t offset, const void *buf, size_t len, void *ctx);
+  bool (*erase)(uint32_t offset, size_t len, void *ctx);
+  uint32_t (*micros)(void *ctx); // Clock for the latency stats
+  uint32_t size;                 // Multiple of sectorSize
+  uint32_t sectorSize;
+  uint32_t eraseBlock;           // Preferred erase size, a multiple of sectorSize
+  void *ctx;
+};
+
+struct AudioLogStats
+{
+  uint32_t records;
+  uint32_t appends;
+  uint32_t bytes;
+  uint32_t appendUsMax;   // Slowest append, late erases included
+  uint32_t appendUsTotal;
+  uint32_t sectorsErased;
+  uint32_t eraseUsTotal;
+  uint32_t lateErases;    // Sectors erased inside an append
+};
+
+struct AudioLog
+{
+  FlashDevice dev;
+  uint64_t head;          // Next write position; offset is head % size
+  uint64_t erased;        // Flash from head up to here is erased
+  uint64_t newest;        // Start of the newest finished record, kept for reading
+  uint64_t oldestPending; // Start of the oldest record not marked done
+  uint32_t seq;           // Sequence number of the last record begun
+  bool writing;
+  uint64_t recordStart;
+  uint32_t recordLength;
+  AudioLogStats stats;
+};
+
+struct AudioLogRecord
+{
+  uint32_t seq;
+  uint32_t offset;        // Header offset in the partition
+  uint32_t length;        // Audio bytes after the header
+};
+
+struct AudioLogReader
+{
+  const AudioLog *log;
+  AudioLogRecord record;
+  uint32_t pos;           // Audio bytes read so far
+};
+
+// Finds the newest record and places the write head after it
+bool audioLogInit(AudioLog &log, const FlashDevice &dev);
+// Erases ahead of the head until bytes more can be appended without an
+// erase, never reaching the newest finished record. Returns the bytes
+// covered, which can be less when the record in front is protected.
+uint32_t audioLogPrepare(AudioLog &log, uint32_t bytes);
+// audioLogPrepare one erase block at a time, to fit it into idle time.
+// True while there is more to erase.
+bool audioLogPrepareStep(AudioLog &log, uint32_t bytes);
+// Starts a record at the next sector boundary
+bool audioLogBegin(AudioLog &log);
+// Appends to the open record. False on a flash error or a full ring (the
+// record would overwrite its own start or a pending record).
+bool audioLogAppend(AudioLog &log, const void *data, size_t len);
+// Programs the record's length; it becomes the newest record, pending
+bool audioLogFinish(AudioLog &log, AudioLogRecord &record);
+// Newest finished record. False if there is none.
+bool audioLogLatest(const AudioLog &log, AudioLogRecord &record);
+// Audio bytes a record begun now could take before reaching a pending one
+uint32_t audioLogRoom(const AudioLog &log);
+// Up to max pending records, oldest first. Returns the count.
+size_t audioLogPending(const AudioLog &log, AudioLogRecord *records, size_t max);
+// Marks a finished record done, so its space can be reused
+bool audioLogMarkDone(AudioLog &log, const AudioLogRecord &record);
+
+// False if the record has been overwritten since
+bool audioLogOpen(const AudioLog &log, const AudioLogRecord &record, AudioLogReader &reader);
+// Reads the next bytes of the record. Returns the count, 0 at the end.
+size_t audioLogRead(AudioLogReader &reader, void *buf, size_t len);
@@ -0,0 +1,13 @@
+// ESP32 side of the audio log: the raw "audiolog" partition as a
+// FlashDevice.
+#pragma once
+
+#include <Arduino.h>
+#include "audio_log.h"
+
+#define AUDIO_LOG_PARTITION "audiolog"
+#define AUDIO_LOG_PARTITION_SUBTYPE (0x40) // First custom data subtype, see partitions.csv
+#define AUDIO_LOG_ERASE_BLOCK (64 * 1024)  // Block erase, ~4x faster per byte than sector erase
+
+// Finds the partition by label. False if the partition table has none.
+bool flashPartitionOpen(FlashDevice &dev, const char *label);
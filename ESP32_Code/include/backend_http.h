@@ -0,0 +1,26 @@
+// BackendTransport over HTTP, on top of the keep-alive backend session.
+//
+// Uploads go out as a chunked POST written straight to the session socket,
+// readiness uses the /checkVariable long-poll (whose X-Audio-Hash header
+// becomes the responseKey) and the response is streamed from
+// /broadcastAudio. Every request carries the device ID and the turn's
+// request ID (X-Device-Id / X-Request-Id on the upload, ?device= and
+// ?request= on the GETs) so one backend can serve several devices.
+// Request heads and URLs are formatted into one buffer from the buffer
+// pool rather than concatenated from Strings, which left the heap riddled
+// with short-lived blocks of every size. Reply lines are parsed in a stack
+// buffer and reply bodies kept in a second pooled one, so a turn only
+// allocates inside HTTPClient.
+#pragma once
+
+#include <Arduino.h>
+#include "backend_transport.h"
+
+#define HTTP_RESPONSE_TIMEOUT (10000) // ms to wait for a reply to a request
+#define HTTP_HEAD_LEN (512)           // Upload request head or GET URL, from the buffer pool
+#define HTTP_REPLY_LEN (256)          // Reply body kept (upload, readiness), from the buffer pool
+#define HTTP_LINE_LEN (128)           // Status or header line; longer ones are cut
+
+// Fills transport with the HTTP implementation for the given endpoint URLs
+void httpTransportInit(BackendTransport &transport, const String &uploadUrl, const String &readyUrl,
+                       const String &responseUrl, const String &deviceId);
@@ -0,0 +1,47 @@
+// Keep-alive connection to the backend, shared by every request in a turn.
+//
+// One WiFiClient stays connected to the backend host between calls, and
+// the host's address is resolved once and cached. HTTPClient requests are
+// issued over it with reuse enabled; a socket the server has closed is
+// reconnected transparently on the next call.
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <HTTPClient.h>
+
+#define SESSION_CONNECT_TIMEOUT (5000) // ms
+
+struct SessionStats
+{
+  uint32_t requests;        // Requests started through the session
+  uint32_t reused;          // ...that found the socket already connected
+  uint32_t connects;        // New TCP connections
+  uint32_t connectFailures;
+  uint32_t dnsLookups;
+  uint32_t connectMsTotal;  // Time spent in DNS + TCP connect
+  uint32_t connectMsMax;
+};
+
+// Splits an http:// URL. Returns false for anything else.
+bool parseUrl(const String &url, String &host, uint16_t &port, String &path);
+
+// Points the session at a new base URL, dropping the socket and cached address
+bool sessionSetBase(const String &baseUrl);
+// Returns the shared socket, connected (reusing it when possible), or NULL
+WiFiClient *sessionConnect();
+// Closes the socket, e.g. after a response that can't be reused
+void sessionClose();
+// Starts a request for url on the shared socket. The returned HTTPClient is
+// owned by the session (a destroyed HTTPClient closes its socket).
+// X-Audio-Hash is collected from the response headers.
+HTTPClient *sessionBegin(const char *url);
+// Begins and sends a GET. If a reused socket turns out to have been closed
+// by the server, reconnects and retries once. Returns NULL if the request
+// could not be started; code holds the HTTP status or HTTPClient error.
+HTTPClient *sessionGet(const char *url, uint32_t timeoutMs, int &code);
+// Ends the request; the socket stays open if the server allows keep-alive
+void sessionEnd();
+
+const SessionStats &sessionGetStats();
+void sessionPrintStats();
@@ -0,0 +1,34 @@
+// Network side of a voice turn, as seen by the turn logic.
+//
+// The device implementation (backend_http.cpp) talks HTTP to the backend
+// over the keep-alive session. The native build swaps in an in-process
+// stand-in for the same endpoints, so a whole turn runs without a network.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "audio_codec.h"
+
+struct BackendTransport
+{
+  // Opens a streamed upload (/uploadAudio). False if the backend can't be reached.
+  bool (*uploadBegin)(AudioEncoding encoding, uint32_t sampleRate, void *ctx);
+  bool (*uploadWrite)(const uint8_t *data, size_t len, void *ctx);
+  // Drops an open upload so the backend discards it
+  void (*uploadAbort)(void *ctx);
+  // Completes the upload and copies the transcription into reply.
+  // Returns the HTTP status, or a negative value on a transport error.
+  int (*uploadFinish)(char *reply, size_t replyLen, void *ctx);
+  // Asks whether the response is ready (/checkVariable), letting the backend
+  // hold the request up to waitMs. Returns 1 ready, 0 not yet, -1 on error.
+  int (*pollReady)(uint32_t waitMs, void *ctx);
+  // Copies the content hash the backend reported for the ready response
+  // (X-Audio-Hash). False if it sent none.
+  bool (*responseKey)(char *key, size_t len, void *ctx);
+  // Starts fetching the response WAV (/broadcastAudio). Returns the HTTP status.
+  int (*responseOpen)(void *ctx);
+  // Reads the response body with PlaybackSource semantics
+  int (*responseRead)(uint8_t *buf, size_t len, void *ctx);
+  void (*responseClose)(void *ctx);
+  void *ctx;
+};
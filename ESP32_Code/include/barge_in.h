@@ -0,0 +1,87 @@
+// Barge-in detection: the user talking over the device's own playback.
+//
+// While a response plays the mic hears the speaker, so plain energy
+// detection would trigger on the answer itself. This is the simplest kind
+// of echo suppressor. Everything the playback writer sends to the speaker
+// is fed in as the reference; it reaches the mic one DMA queue later
+// (the writer blocks while the queue is full). Each mic frame's energy is
+// compared with the loudest reference frame within echoSpreadMs of that
+// delay, scaled by the learned speaker-to-mic coupling. A frame well above
+// that expected echo and above an absolute floor is near-end speech; a
+// short run of them is a barge-in.
+//
+// Frames under the margin while the speaker is active train the coupling:
+// quickly up, slowly down, so it follows the echo's loud peaks. Frames
+// more than twice the expected echo never train it, so a user starting to
+// talk can't teach themselves away. The coupling is kept across playbacks;
+// until it has come down from couplingStartQ16 (0 dB) the first answer
+// after boot needs louder speech.
+//
+// The speaker may run at another rate than the mic for a response
+// (audioSetRate). Reference frames then keep their duration rather than
+// their sample count, and the echo delay scales with the rate since the
+// DMA queue holds the same number of samples.
+//
+// The reference and the mic side run on different tasks (playback writer,
+// capture reader); the reference history has one writer and one reader.
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BARGE_REF_FRAMES (32) // Reference history, 512 ms of 16 ms frames
+
+struct BargeConfig
+{
+  uint32_t sampleRate;       // Mic rate, and the speaker's unless told otherwise
+  uint16_t frameMs;          // Analysis frame, both sides
+  uint16_t echoDelayMs;      // Reference to mic: the speaker's DMA queue at sampleRate
+  uint16_t echoSpreadMs;     // Slack either side of the delay (block sizes, acoustics)
+  uint16_t onsetFrames;      // Consecutive near-end frames for a detection
+  uint16_t marginQ8;         // Near-end energy over the expected echo (x, Q8)
+  uint32_t minEnergy;        // Absolute energy floor, like the VAD's
+  uint32_t couplingStartQ16; // Speaker-to-mic energy ratio before training
+};
+
+struct BargeStats
+{
+  uint32_t frames;      // Mic frames analysed
+  uint32_t echoFrames;  // Frames with the speaker active that stayed under the margin
+  uint32_t detections;
+  uint32_t couplingQ16; // Current speaker-to-mic energy ratio
+};
+
+struct BargeDetector
+{
+  BargeConfig config;
+  uint32_t frameLen;       // Mic samples per frame
+  uint32_t windowFirst;    // Reference frames searched for the echo,
+  uint32_t windowLast;     // counted back from the newest
+  // Reference side
+  uint32_t refFrameLen;    // Speaker samples per frame
+  volatile uint32_t refEnergy[BARGE_REF_FRAMES];
+  volatile uint32_t refFrames; // Reference frames completed
+  uint64_t refSumSq;
+  uint32_t refFill;
+  // Mic side
+  int64_t sum;
+  uint64_t sumSq;
+  uint32_t fill;
+  uint32_t run;            // Consecutive near-end frames
+  uint32_t couplingQ16;
+  BargeStats stats;
+};
+
+void bargeDefaultConfig(BargeConfig &config, uint32_t sampleRate);
+void bargeInit(BargeDetector &det, const BargeConfig &config);
+// Drops the reference and any partial run, keeping the coupling learned so
+// far. Call before each playback, while neither side is feeding.
+void bargeReset(BargeDetector &det);
+// Sets the speaker's rate for this playback; bargeReset goes back to
+// config.sampleRate. Call after bargeReset, before the first reference sample.
+void bargeSetReferenceRate(BargeDetector &det, uint32_t sampleRate);
+// Feeds 16-bit mono samples on their way to the speaker
+void bargeReference(BargeDetector &det, const int16_t *samples, size_t count);
+// Feeds mic samples. Returns true when near-end speech starts in this block.
+bool bargeProcess(BargeDetector &det, const int16_t *samples, size_t count);
@@ -0,0 +1,48 @@
+// Boot-time arena for the audio and network buffers.
+//
+// poolInit reserves one region at boot, from PSRAM when the board has it
+// and internal RAM otherwise (as much as fits in the largest free block,
+// short of a margin for Wi-Fi). The engines carve their long-lived buffers
+// out of it once (capture ring, pre-roll and blocks, playback jitter
+// buffer and chunks, HTTP request heads and replies) and reuse them every
+// turn, so a turn allocates nothing and the heap can't fragment around
+// audio. Carving is a bump allocator; nothing is given back. A request that
+// doesn't fit falls back to the heap and is counted.
+//
+// poolSampleHeap records the free heap and its largest free block. A
+// largest block that shrinks turn after turn while the total holds is
+// fragmentation; the low-water marks are exported with the metrics.
+//
+// The region and heap figures come from pool_heap_esp32.cpp on the device
+// and from the C heap in the native build (native/pool_heap_host.cpp).
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_ALIGN (8)
+
+struct PoolStats
+{
+  uint32_t size;          // Arena bytes reserved at boot
+  uint32_t used;          // Carved so far
+  uint32_t fallbacks;     // Requests served from the heap, arena full
+  bool external;          // Arena is in PSRAM
+  uint32_t heapFree;      // Last sample
+  uint32_t heapLargest;   // Largest free block at the last sample
+  uint32_t heapFreeMin;   // Lowest samples since boot
+  uint32_t heapLargestMin;
+};
+
+// Reserves the arena. Call once, before the engines start.
+bool poolInit(size_t size);
+// Carves len bytes for the life of the program. name shows up in the log.
+void *poolAlloc(size_t len, const char *name);
+void poolSampleHeap();
+PoolStats poolGetStats();
+void poolPrintStats();
+
+// Platform layer. poolReserve may reserve less than asked and lowers size.
+void *poolReserve(size_t &size, bool &external);
+uint32_t poolHeapFree();
+uint32_t poolHeapLargestBlock();
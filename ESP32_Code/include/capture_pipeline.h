@@ -0,0 +1,72 @@
+// Producer/consumer capture pipeline for the INMP441.
+//
+// An always-on reader task drains I2S DMA. Between captures it keeps the
+// last CAPTURE_PREROLL_MS of slots in a circular pre-roll buffer; during a
+// capture it feeds a FreeRTOS StreamBuffer, starting with the pre-roll
+// back to the requested start time. A consumer task pulls blocks out of
+// the ring, runs the process stage (scaling/encoding) and hands the result
+// to a sink (SPIFFS file, network stream, ...). A stalled sink only fills
+// the ring; it never stops I2S from being drained.
+#pragma once
+
+#include <Arduino.h>
+#include <driver/i2s.h>
+#include "task_layout.h"
+
+#define CAPTURE_READ_LEN (2048)         // Bytes per audioRead in the reader task (32 ms of 32-bit slots)
+#define CAPTURE_BLOCK_LEN (4096)        // Raw bytes handed to process per call
+#define CAPTURE_RING_SIZE (48 * 1024)   // StreamBuffer size (~0.75 s of 32-bit slots)
+#define CAPTURE_READER_PRIORITY TASK_PRIORITY_AUDIO_IO // Cores and priorities: task_layout.h
+#define CAPTURE_READER_CORE TASK_CORE_AUDIO
+#define CAPTURE_CONSUMER_PRIORITY TASK_PRIORITY_NET
+#define CAPTURE_CONSUMER_CORE TASK_CORE_NET
+#define CAPTURE_READER_STACK (3072)
+#define CAPTURE_CONSUMER_STACK (8192)
+#define CAPTURE_SLOT_BYTES (4)          // One 32-bit I2S slot per sample
+#define CAPTURE_PREROLL_MS (500)        // History kept while idle (32 KB at 16 kHz)
+
+// Transforms len bytes of raw I2S data from src into dst (may alias) and
+// returns the number of bytes written to dst.
+typedef uint32_t (*CaptureProcess)(uint8_t *dst, uint8_t *src, uint32_t len);
+// Consumes a processed block. Return false to end the capture early.
+typedef bool (*CaptureSink)(const uint8_t *data, size_t len, void *ctx);
+// Sees every raw block read while no capture is running. Called on the
+// reader task, so it must not block.
+typedef void (*CaptureTap)(const uint8_t *data, size_t len, void *ctx);
+
+struct CaptureStats
+{
+  uint32_t bytesCaptured;  // Bytes read from I2S, pre-roll included
+  uint32_t prerollBytes;   // Bytes taken from the pre-roll buffer
+  uint32_t bytesDelivered; // Processed bytes handed to the sink
+  uint32_t overruns;       // Reader blocks dropped because the ring was full
+  uint32_t underruns;      // Consumer waits that found the ring empty
+  uint32_t ringPeak;       // Highest ring fill level seen, in bytes
+  bool stoppedEarly;       // Sink returned false before maxBytes (endpoint or error)
+};
+
+struct CaptureConfig
+{
+  unsigned long startMs;   // millis() the capture should start at; older
+                           // audio comes from the pre-roll (0 = live only)
+  uint32_t maxBytes;       // Stop after this many processed bytes reach the sink
+  CaptureProcess process;  // Optional, NULL passes raw data through
+  CaptureSink sink;
+  void *sinkCtx;
+};
+
+// Starts the always-on reader and the consumer task, with the pre-roll,
+// ring and block buffers carved from the buffer pool. Call once after the
+// I2S driver is installed and poolInit.
+bool captureBegin(i2s_port_t port, uint32_t sampleRate);
+// Installs the idle tap (NULL removes it), e.g. for wake word detection
+void captureSetIdleTap(CaptureTap tap, void *ctx);
+// Runs a capture to completion on the reader/consumer tasks and blocks the
+// caller until both have finished with it. Returns false if captureBegin
+// hasn't run.
+bool captureRun(const CaptureConfig &config, CaptureStats &stats);
+// Longest gap between two I2S reads returning, in us, since the last
+// reset. A read period is CAPTURE_READ_LEN of slots (32 ms); a gap past
+// the DMA depth loses audio.
+uint32_t captureReaderGapMax(bool reset);
+void capturePrintStats(const CaptureStats &stats);
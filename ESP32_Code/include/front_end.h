@@ -0,0 +1,114 @@
+// Fixed-point mic front end, run on the capture blocks before upload.
+//
+// A chain of in-place stages on 16-bit mono PCM, built at init from the
+// config. The order is fixed; a stage that is turned off is left out:
+//   dc        one-pole DC blocker (the INMP441 idles well off zero)
+//   highpass  biquad high-pass, takes out rumble and mains hum
+//   preemph   first-order pre-emphasis (same biquad code, off by default)
+//   denoise   spectral subtraction: 256-point FFT with 50% overlap and
+//             sqrt-Hann windows, a noise spectrum that follows the
+//             quietest frames, and per-bin gains with a floor so the
+//             residual stays noise rather than musical tones
+// denoise delays the stream by FRONT_END_FFT_LEN samples (16 ms at 16 kHz).
+// After init it starts with that much silence; after a reset, with the end
+// of the previous capture.
+//
+// Every stage is timed with the config's clock (CPU cycles on the device),
+// so the cost per capture block can be held to FRONT_END_BUDGET_PCT.
+//
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRONT_END_MAX_STAGES (4)
+#define FRONT_END_FFT_BITS (8)
+#define FRONT_END_FFT_LEN (1 << FRONT_END_FFT_BITS) // 16 ms at 16 kHz
+#define FRONT_END_HOP (FRONT_END_FFT_LEN / 2)
+#define FRONT_END_BINS (FRONT_END_FFT_LEN / 2 + 1)
+#define FRONT_END_BUDGET_PCT (10) // Of one core, at the capture rate
+
+// Free-running counter the stages are timed with (NULL: not timed)
+typedef uint32_t (*FrontEndClock)();
+typedef void (*FrontEndStageRun)(void *state, int16_t *samples, size_t count);
+
+struct FrontEndConfig
+{
+  uint32_t sampleRate;
+  bool dcBlock;
+  uint16_t highPassHz;      // 0 = off
+  uint16_t preEmphasisQ15;  // y = x - a * x[-1]; 0 = off
+  bool denoise;
+  uint16_t overSubtractQ8;  // Noise estimate scaled by this before subtracting
+  uint16_t gainFloorQ15;    // Least gain per bin (attenuation limit)
+  uint16_t noiseInitFrames; // Frames averaged for the first noise estimate
+  uint8_t noiseRiseShift;   // Noise estimate climbs at most 1/2^n per frame
+  FrontEndClock clock;
+};
+
+// Direct form I, Q14 coefficients, a0 normalised to 1
+struct Biquad
+{
+  int32_t b0, b1, b2, a1, a2;
+  int32_t x1, x2, y1, y2;
+  int32_t err;      // Rounding remainder fed back, keeps the low end quiet
+  uint32_t clipped; // Outputs saturated since init
+};
+
+struct DcBlocker
+{
+  int32_t poleQ15;
+  int32_t x1;
+  int64_t y1; // Q15, keeps the fraction the pole needs
+};
+
+struct Denoiser
+{
+  const FrontEndConfig *config;
+  int16_t window[FRONT_END_FFT_LEN];      // sqrt-Hann, Q15
+  int16_t cosTable[FRONT_END_FFT_LEN / 2]; // Twiddles, Q15
+  int16_t sinTable[FRONT_END_FFT_LEN / 2];
+  int16_t in[FRONT_END_FFT_LEN];          // Analysis frame, oldest first
+  int16_t out[FRONT_END_HOP];             // Finished samples, handed out one per input
+  int32_t tail[FRONT_END_HOP];            // Second half of the last frame, for overlap-add
+  uint32_t fill;                          // New samples in the current hop
+  int32_t re[FRONT_END_FFT_LEN];
+  int32_t im[FRONT_END_FFT_LEN];
+  uint64_t noise[FRONT_END_BINS];         // Noise power per bin
+  uint16_t gain[FRONT_END_BINS];          // Last gain per bin, Q15
+  uint32_t frames;                        // Frames analysed since init
+};
+
+struct FrontEndStage
+{
+  const char *name;
+  FrontEndStageRun run;
+  void *state;
+  uint64_t ticks;   // Clock ticks spent in run() since the last stats reset
+  uint32_t ticksMax; // Most spent on one block
+};
+
+struct FrontEnd
+{
+  FrontEndConfig config;
+  DcBlocker dc;
+  Biquad highPass;
+  Biquad preEmphasis;
+  Denoiser denoiser;
+  FrontEndStage stages[FRONT_END_MAX_STAGES];
+  int stageCount;
+  uint32_t blocks;   // Blocks run since the last stats reset
+  uint32_t samples;
+};
+
+void frontEndDefaultConfig(FrontEndConfig &config, uint32_t sampleRate);
+void frontEndInit(FrontEnd &fe, const FrontEndConfig &config);
+// Clears the filter state between captures. The denoiser's frames and
+// noise estimate are kept, the room doesn't change between turns.
+void frontEndReset(FrontEnd &fe);
+// Processes count samples in place
+void frontEndRun(FrontEnd &fe, int16_t *samples, size_t count);
+// Samples the output lags the input by
+uint32_t frontEndLatency(const FrontEnd &fe);
+void frontEndResetStats(FrontEnd &fe);
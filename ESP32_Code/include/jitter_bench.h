@@ -0,0 +1,25 @@
+// On-device check that network load doesn't reach the audio core.
+//
+// A probe task wakes every JITTER_BENCH_PERIOD_US with vTaskDelayUntil at
+// the capture reader's priority, pinned where the reader runs, and records
+// how late each wake-up is. A second probe does the same on the network
+// core for comparison. Three phases run back to back: idle, a large
+// streamed upload and repeated downloads, the load pinned to the network
+// core like the real transfer tasks. Each phase prints worst-case and
+// average lateness per core, plus the longest gap between the capture
+// reader's I2S reads. Enabled with JITTER_BENCH in main.cpp; the upload is
+// aborted, so the backend discards it.
+#pragma once
+
+#include <Arduino.h>
+#include "backend_transport.h"
+
+#define JITTER_BENCH_PERIOD_US (1000) // One tick
+#define JITTER_BENCH_IDLE_MS (3000)
+#define JITTER_BENCH_BLOCK (4096)
+#define JITTER_BENCH_STACK (4096)
+
+// Runs the three phases; uploadBytes per upload, downloadUrl fetched until
+// downloadBytes have arrived. Needs Wi-Fi and the capture reader running.
+void jitterBenchRun(const BackendTransport &transport, uint32_t uploadBytes, const String &downloadUrl,
+                    uint32_t downloadBytes);
@@ -0,0 +1,62 @@
+// Turn latency and resource metrics.
+//
+// Each stage of a voice turn records its duration into a fixed-bucket
+// histogram, and the capture/playback engines add their error counters.
+// Response cache counters are read from response_cache, heap and buffer
+// pool figures from buffer_pool (the heap is sampled at the end of a turn),
+// offline queue figures from utterance_queue, Wi-Fi connect times from
+// wifi_link, log counters from serial_log.
+// The totals are exported in Prometheus text format (served by the device
+// on /metrics) and as a compact serial dump with approximate p50/p99.
+#pragma once
+
+#include <Arduino.h>
+#include "capture_pipeline.h"
+#include "playback_engine.h"
+
+#define METRICS_PORT (9100)
+#define METRICS_BUCKETS (12) // Histogram buckets, excluding +Inf
+#define METRICS_TEXT_CHUNK (1024) // Exposition text formatted per write
+
+enum MetricStage
+{
+  METRIC_BUTTON_TO_CAPTURE, // Button press to first sample recorded
+  METRIC_CAPTURE,
+  METRIC_UPLOAD,
+  METRIC_SERVER_WAIT,
+  METRIC_FIRST_AUDIO,       // Response ready to first audio at the speaker
+  METRIC_PLAYBACK,
+  METRIC_TURN,              // Button press to end of playback
+  METRIC_DRAIN,             // One queued utterance, upload to end of playback
+  METRIC_BARGE_IN,          // Interrupt (button or speech) to the speaker going silent
+  METRIC_STAGE_COUNT
+};
+
+enum MetricOutcome
+{
+  TURN_OK,
+  TURN_NO_SPEECH,
+  TURN_FAILED,
+  TURN_QUEUED,    // Recorded to the offline queue, answered later
+  TURN_INTERRUPTED // Playback cut short by a barge-in, the next turn started
+};
+
+// Receives a piece of the exposition text
+typedef void (*MetricsWrite)(const char *text, size_t len, void *ctx);
+
+// Sets up the lock and the text buffer; call once, after poolInit, before
+// any other metrics function
+void metricsInit();
+void metricsObserve(MetricStage stage, uint32_t ms);
+void metricsAddCapture(const CaptureStats &stats);
+void metricsAddPlayback(const PlaybackStats &stats);
+void metricsTurnDone(MetricOutcome outcome);
+// Boot to the end of setup(), ready for a button press
+void metricsBootReady(uint32_t ms);
+
+// Prometheus text exposition format, version 0.0.4, handed to write in
+// pieces of up to METRICS_TEXT_CHUNK bytes. Formatted in a buffer carved
+// from the pool at init, so a scrape doesn't touch the heap. Not reentrant;
+// the metrics server calls it from loop().
+void metricsPrometheus(MetricsWrite write, void *ctx);
+void metricsPrintSerial();
@@ -0,0 +1,66 @@
+// Jitter-buffered playback for the MAX98357A.
+//
+// A network reader task pulls bytes from a source (the HTTP response
+// stream) into a FreeRTOS StreamBuffer, and an I2S writer task drains it.
+// The writer waits for a pre-buffer threshold before starting, and on an
+// underrun writes silence until the buffer has refilled instead of
+// stalling the DMA, so a Wi-Fi hiccup is a short gap rather than a click.
+// A run can be cancelled mid-stream (barge-in): both tasks poll the cancel
+// flag, and the writer silences the DMA as soon as it sees it.
+#pragma once
+
+#include <Arduino.h>
+#include <driver/i2s.h>
+#include "task_layout.h"
+
+#define PLAYBACK_BUFFER_SIZE (32 * 1024)  // Jitter buffer (~1 s at 16 kHz/16-bit)
+#define PLAYBACK_CHUNK_LEN (1024)         // Bytes per source read / audioWrite
+#define PLAYBACK_SOURCE_TIMEOUT (5000)    // ms without data before the source is abandoned
+#define PLAYBACK_READER_PRIORITY TASK_PRIORITY_NET // Cores and priorities: task_layout.h
+#define PLAYBACK_READER_CORE TASK_CORE_NET
+#define PLAYBACK_WRITER_PRIORITY (TASK_PRIORITY_AUDIO_IO - 1)
+#define PLAYBACK_WRITER_CORE TASK_CORE_AUDIO
+#define PLAYBACK_READER_STACK (4096)
+#define PLAYBACK_WRITER_STACK (3072)
+
+// Reads up to len bytes. Returns the byte count, 0 if nothing is available
+// yet, or -1 at end of stream.
+typedef int (*PlaybackSource)(uint8_t *buf, size_t len, void *ctx);
+// Sees every block written to the speaker, silence included. Called on the
+// writer task, so it must not block.
+typedef void (*PlaybackTap)(const uint8_t *data, size_t len, void *ctx);
+
+struct PlaybackStats
+{
+  uint32_t bytesReceived;  // Bytes taken from the source
+  uint32_t bytesPlayed;    // Audio bytes written to I2S
+  uint32_t silenceBytes;   // Silence written while buffering after an underrun
+  uint32_t underruns;      // Times the buffer ran dry mid-stream
+  uint32_t depthMin;       // Lowest buffer depth seen while playing, in bytes
+  uint32_t depthMax;       // Highest buffer depth seen, in bytes
+  uint32_t startDelayMs;   // Time from start to first audio written
+  bool sourceTimedOut;
+  bool cancelled;
+  unsigned long cancelledAtMs; // millis() the writer silenced the speaker, 0 if not cancelled
+};
+
+struct PlaybackConfig
+{
+  i2s_port_t port;
+  uint32_t prebufferBytes; // Buffer this much before starting and after an underrun (TurnConfig)
+  PlaybackSource source;
+  void *sourceCtx;
+  const volatile bool *cancel; // Set by anyone to stop the run early, NULL for none
+};
+
+// Starts the reader/writer tasks, with the jitter buffer and chunks carved
+// from the buffer pool. Call once at boot, after poolInit.
+bool playbackBegin();
+// Plays the source to the end on the reader/writer tasks and blocks the
+// caller until the audio has been pushed out of the DMA buffers. Returns
+// false if playbackBegin hasn't run.
+bool playbackRun(const PlaybackConfig &config, PlaybackStats &stats);
+// Installs the tap on speaker output (NULL removes it); set it while no
+// run is in progress
+void playbackSetTap(PlaybackTap tap, void *ctx);
+void playbackPrintStats(const PlaybackStats &stats);
@@ -0,0 +1,49 @@
+// Response format conversion for the speaker: any PCM WAV format to mono
+// 16-bit at the speaker rate.
+//
+// Frames are downmixed (channel average) and brought to 16 bits first,
+// then a fixed-point polyphase FIR resamples them. The filter bank has
+// RESAMPLE_PHASES windowed-sinc phases of RESAMPLE_TAPS taps each, built
+// at init for the rate pair with its cutoff below the lower Nyquist
+// frequency, so any ratio works (22.05 -> 16 kHz included) without a
+// per-ratio table. The position advances in Q16 input samples per output
+// sample, with the truncated remainder carried so long streams don't drift
+// (22.05 kHz would lose 9 ppm otherwise). Same-rate streams skip the filter.
+//
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "wav_stream.h"
+
+#define RESAMPLE_TAPS (16)
+#define RESAMPLE_PHASES (64)
+#define RESAMPLE_COEF_BITS (14) // Q14 taps keep the 16-tap sum inside int32
+#define RESAMPLE_HIST (256)     // Input samples converted per refill
+#define RESAMPLE_MAX_FRAME (32) // Largest input frame handled (8 ch x 32-bit)
+
+struct Resampler
+{
+  WavFormat in;
+  uint32_t outRate;
+  bool bypass;       // Same rate: downmix and bit depth only
+  uint32_t step;     // Input samples per output sample, Q16
+  uint32_t stepRem;  // Remainder of step in 1/outRate Q16 units
+  uint32_t err;      // Accumulated remainder
+  uint32_t pos;      // First tap of the next output in hist, Q16
+  int16_t hist[RESAMPLE_TAPS + RESAMPLE_HIST];
+  uint32_t histFill;
+  uint8_t partial[RESAMPLE_MAX_FRAME]; // Incomplete frame from the last call
+  uint32_t partialFill;
+  int16_t coef[RESAMPLE_PHASES][RESAMPLE_TAPS];
+};
+
+// False if the format can't be converted (frame too large, bad rates)
+bool resamplerInit(Resampler &rs, const WavFormat &in, uint32_t outRate);
+// Converts input bytes (any split, partial frames are kept) into at most
+// maxOut samples. used is set to the input bytes consumed; the rest has to
+// be passed again once out has been drained. Returns the samples written.
+size_t resamplerRun(Resampler &rs, const uint8_t *in, size_t len, size_t &used, int16_t *out, size_t maxOut);
+// Pushes out the samples still inside the filter at the end of the stream
+size_t resamplerFlush(Resampler &rs, int16_t *out, size_t maxOut);
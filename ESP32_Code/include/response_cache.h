@@ -0,0 +1,60 @@
+// Flash cache of response audio, keyed by content hash.
+//
+// The backend reports a hash of each response in the X-Audio-Hash header of
+// the readiness reply. cacheTransportInit wraps a transport so that a
+// response whose hash is on flash plays from there without requesting
+// /broadcastAudio. Other responses are written through to flash while they
+// play and kept if they fit RESPONSE_CACHE_MAX_ITEM; greetings and error
+// prompts repeat, long answers rarely do. The least recently used entries
+// are evicted to stay under the budget given to cacheInit.
+//
+// Keys that aren't hashes name pinned clips ("timeout", "offline"), played
+// locally when the backend can't answer. They come with the SPIFFS image
+// (data/rc/<name>.wav) or are stored with cacheStore*, and are never
+// evicted.
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include "backend_transport.h"
+
+#define RESPONSE_CACHE_DIR "/rc"
+#define RESPONSE_CACHE_INDEX "/rc/index.bin"
+#define RESPONSE_CACHE_TEMP "/rc/store.tmp"
+#define RESPONSE_CACHE_MAX_ENTRIES (32)
+#define RESPONSE_CACHE_KEY_LEN (22)          // "/rc/<key>.wav" within SPIFFS' 31 characters
+#define RESPONSE_CACHE_HASH_LEN (16)         // Hex digits of a content hash key
+#define RESPONSE_CACHE_MAX_ITEM (128 * 1024) // Largest response kept (4 s at 16 kHz)
+
+struct CacheStats
+{
+  uint32_t lookups;    // Responses that came with a hash
+  uint32_t hits;       // ...played from flash
+  uint32_t bytesSaved; // Response bytes not downloaded thanks to hits
+  uint32_t stores;     // Downloads kept
+  uint32_t evictions;
+  uint32_t clipPlays;  // Pinned clips played
+  uint32_t bytesUsed;  // Current size of the cached files
+  uint32_t entries;
+};
+
+// Loads the index (or rebuilds it from RESPONSE_CACHE_DIR) and trims the
+// cache to budgetBytes
+bool cacheInit(fs::FS &fs, uint32_t budgetBytes);
+bool cacheHas(const char *key);
+
+// Fills transport with inner plus the cache in front of its responses
+void cacheTransportInit(BackendTransport &transport, const BackendTransport &inner);
+// Response-only transport that plays the pinned clip key. False if the clip
+// isn't on flash.
+bool cacheClipTransport(BackendTransport &transport, const char *key);
+
+// Writes an entry in pieces. Pinned unless key is a content hash. Commit
+// returns false if it didn't fit; abort drops what was written.
+bool cacheStoreBegin(const char *key);
+bool cacheStoreWrite(const uint8_t *data, size_t len);
+bool cacheStoreCommit();
+void cacheStoreAbort();
+
+CacheStats cacheGetStats();
+void cachePrintStats();
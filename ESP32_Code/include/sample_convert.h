@@ -0,0 +1,88 @@
+// INMP441 sample conversion: I2S slots to 16-bit PCM.
+//
+// The mic delivers 24-bit two's complement samples left-justified in a
+// 32-bit slot. The kernel applies a Q8 fixed-point gain, saturates to
+// int16 and can optionally run a block-rate AGC. Gain is constant within
+// a block so the inner loop is a shift, multiply and clamp per word.
+//
+// The kernel is a template on the slot width (ConvertSlot), so a 16-bit
+// slot configuration gets its own loop with the shift folded in instead of
+// a per-sample branch; a width without a ConvertSlot doesn't compile.
+//
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CONVERT_GAIN_UNITY (256) // Q8: 256 == 0dB
+#define CONVERT_GAIN_MAX (4095)  // Keeps (sample >> 12) * gain inside int32
+
+struct SampleConverter
+{
+  int32_t gainQ8;        // Current gain applied to the block
+  bool agc;              // Adjust gainQ8 after every block
+  int32_t agcTarget;     // Desired block peak after gain
+  int32_t agcMaxGainQ8;  // AGC never goes above this
+  int32_t agcMinGainQ8;  // ...or below this
+  int32_t agcGate;       // Blocks quieter than this (16-bit, unity gain) hold the gain
+  uint32_t clipped;      // Samples saturated since init
+};
+
+// Slot layouts: the slot type and how to bring a slot to a 20-bit sample
+// (16 integer bits and the 4 fractional bits the gain keeps)
+template <uint16_t SlotBits>
+struct ConvertSlot;
+
+template <>
+struct ConvertSlot<32>
+{
+  typedef int32_t Type;
+  static int32_t sample(int32_t slot) { return slot >> 12; }
+};
+
+template <>
+struct ConvertSlot<16>
+{
+  typedef int16_t Type;
+  static int32_t sample(int16_t slot) { return (int32_t)slot * 16; }
+};
+
+void converterInit(SampleConverter &conv, int32_t gainQ8, bool agc);
+// Block-rate AGC step after a block whose peak (20-bit units) was peak
+void converterAgc(SampleConverter &conv, int32_t peak);
+
+// Converts count slots into count int16 samples. dst may alias src.
+// Returns the number of samples written.
+template <uint16_t SlotBits>
+size_t converterRunSlots(SampleConverter &conv, int16_t *dst, const typename ConvertSlot<SlotBits>::Type *src,
+                         size_t count)
+{
+  const int32_t gain = conv.gainQ8;
+  int32_t peak = 0;
+  uint32_t clipped = 0;
+
+  // dst[i] never overtakes src[i] (2 vs 2 or 4 bytes), so in-place is safe
+  for (size_t i = 0; i < count; i++)
+  {
+    int32_t x = ConvertSlot<SlotBits>::sample(src[i]);
+    int32_t ax = x < 0 ? -x : x;
+    peak = ax > peak ? ax : peak;
+
+    // (x * gainQ8) / 2^12 == sample16 * gain / 256
+    int32_t y = (x * gain) >> 12;
+    int32_t sat = y > 32767 ? 32767 : y < -32768 ? -32768 : y;
+    clipped += sat != y;
+    dst[i] = (int16_t)sat;
+  }
+  conv.clipped += clipped;
+
+  if (conv.agc && count)
+  {
+    converterAgc(conv, peak);
+  }
+  return count;
+}
+
+// The INMP441's 32-bit slots
+size_t converterRun(SampleConverter &conv, int16_t *dst, const int32_t *src, size_t count);
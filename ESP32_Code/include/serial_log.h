@@ -0,0 +1,151 @@
+// Leveled log that never blocks the caller.
+//
+// LOG_E/W/I/D/V format the message into a ring in RAM and return; the
+// logDrain task, below every audio and network task on core 0, copies the
+// ring to Serial. At 115200 baud a 100-character line is 9 ms on the wire,
+// which used to be spent in whichever task printed it, capture and playback
+// included. Producers claim space with a compare-and-swap on the ring head
+// and never wait: when the ring is full the message is dropped and counted,
+// and the drain prints how many went missing.
+//
+// Levels are the ESP32 core's (1 error .. 5 verbose). A call above
+// LOG_LEVEL, CORE_DEBUG_LEVEL by default, compiles to nothing, arguments
+// included.
+//
+// LOGB_E/W/I/D/V write a binary record instead: the address of the format
+// and up to LOG_BINARY_ARGS integer arguments, 8 + 4n bytes on the
+// device, with no formatting in the caller. The format must be a literal,
+// since only its address is kept, and takes %d/%u/%x/%c conversions; the
+// arguments are checked against it at compile time.
+//
+// Text records longer than LOG_LINE_MAX are cut. Not for interrupt handlers.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <type_traits>
+
+#define LOG_LEVEL_NONE (0)
+#define LOG_LEVEL_ERROR (1)
+#define LOG_LEVEL_WARN (2)
+#define LOG_LEVEL_INFO (3)
+#define LOG_LEVEL_DEBUG (4)
+#define LOG_LEVEL_VERBOSE (5)
+
+#ifndef LOG_LEVEL
+#ifdef CORE_DEBUG_LEVEL
+#define LOG_LEVEL CORE_DEBUG_LEVEL
+#else
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE (4096) // Power of two
+#endif
+#define LOG_LINE_MAX (512)   // Longest text record, NUL included
+#define LOG_BINARY_ARGS (6)
+#define LOG_DRAIN_MS (20)    // Drain task poll period
+
+struct LogStats
+{
+  uint32_t written;  // Records put in the ring
+  uint32_t errors;   // Of which LOG_LEVEL_ERROR
+  uint32_t warnings; // Of which LOG_LEVEL_WARN
+  uint32_t dropped;  // Records lost to a full ring
+  uint32_t cut;      // Text records cut to LOG_LINE_MAX
+  uint32_t fillPeak; // Most bytes waiting in the ring at a drain
+};
+
+// Starts the drain task. Messages logged before it runs wait in the ring.
+bool logBegin();
+// Writes out everything in the ring from the calling task, e.g. before a
+// restart or at the end of a host run. Blocks until done.
+void logFlush();
+LogStats logGetStats();
+
+void logWrite(uint8_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void logWriteWords(uint8_t level, const char *format, const uint32_t *args, uint8_t count);
+
+// Never called; lets the compiler check a binary record's arguments
+// against its format
+static inline void logFormatCheck(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static inline void logFormatCheck(const char *, ...)
+{
+}
+
+template <typename... Args>
+struct LogIntegral
+{
+  static const bool value = true;
+};
+
+template <typename T, typename... Rest>
+struct LogIntegral<T, Rest...>
+{
+  static const bool value = (std::is_integral<T>::value || std::is_enum<T>::value) && LogIntegral<Rest...>::value;
+};
+
+template <typename... Args>
+inline void logBinary(uint8_t level, const char *format, Args... args)
+{
+  static_assert(sizeof...(Args) <= LOG_BINARY_ARGS, "Too many arguments for a binary log record");
+  static_assert(LogIntegral<Args...>::value, "Binary log records take integer arguments only");
+  const uint32_t words[sizeof...(Args) + 1] = {(uint32_t)args..., 0};
+  logWriteWords(level, format, words, sizeof...(Args));
+}
+
+#define LOG_AT(level, ...) logWrite(level, __VA_ARGS__)
+#define LOGB_AT(level, ...)        \
+  do                               \
+  {                                \
+    if (0)                         \
+    {                              \
+      logFormatCheck(__VA_ARGS__); \
+    }                              \
+    logBinary(level, __VA_ARGS__); \
+  } while (0)
+#define LOG_NOTHING(...) \
+  do                     \
+  {                      \
+  } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOGB_E(...) LOGB_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_E(...) LOG_NOTHING()
+#define LOGB_E(...) LOG_NOTHING()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGB_W(...) LOGB_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_W(...) LOG_NOTHING()
+#define LOGB_W(...) LOG_NOTHING()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGB_I(...) LOGB_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_I(...) LOG_NOTHING()
+#define LOGB_I(...) LOG_NOTHING()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOGB_D(...) LOGB_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_D(...) LOG_NOTHING()
+#define LOGB_D(...) LOG_NOTHING()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_VERBOSE
+#define LOG_V(...) LOG_AT(LOG_LEVEL_VERBOSE, __VA_ARGS__)
+#define LOGB_V(...) LOGB_AT(LOG_LEVEL_VERBOSE, __VA_ARGS__)
+#else
+#define LOG_V(...) LOG_NOTHING()
+#define LOGB_V(...) LOG_NOTHING()
+#endif
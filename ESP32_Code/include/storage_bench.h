@@ -0,0 +1,19 @@
+// On-device comparison of the two places a recording can go: a SPIFFS
+// file (the old path) and the raw-partition audio log.
+//
+// Both get the same stream of fixed-size appends, paced like the capture
+// consumer hands out 16-bit PCM. For each, the run reports sustained write
+// throughput, average and worst-case latency per append, and how many
+// appends missed the real-time deadline of one block. Enabled with
+// STORAGE_BENCH in main.cpp. It clobbers the newest audio log record and
+// needs the free SPIFFS space for its file.
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include "audio_log.h"
+
+#define STORAGE_BENCH_FILE "/bench.raw"
+#define STORAGE_BENCH_BLOCK (2048) // One capture block of 16-bit PCM (64 ms at 16 kHz)
+
+void storageBenchRun(fs::FS &fs, AudioLog &log, uint32_t totalBytes, uint32_t sampleRate);
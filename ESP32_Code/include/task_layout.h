@@ -0,0 +1,32 @@
+// Cores and priorities of every task, in one place.
+//
+// Core 0 (PRO_CPU) runs the Wi-Fi driver (priority 23) and lwIP (18). The
+// tasks that talk to sockets join them there, so TCP work and our network
+// I/O stay on one core. Core 1 (APP_CPU) runs the I2S tasks at the top of
+// its priority range, so a large transfer on core 0 can't preempt them;
+// only interrupts and the reader's own locks stand between them and DMA.
+//
+//   core 1  capReader   TASK_PRIORITY_AUDIO_IO      I2S in, pre-roll
+//           playWriter  TASK_PRIORITY_AUDIO_IO - 1  I2S out
+//           wakeWord    TASK_PRIORITY_AUDIO_DSP     Keyword matching
+//           loopTask    1 (Arduino)                 Control: button, LEDs,
+//                                                   Wi-Fi upkeep, /metrics
+//   core 0  capConsumer TASK_PRIORITY_NET           Encode, upload, log writes
+//           playReader  TASK_PRIORITY_NET           Response download
+//           workflow    TASK_PRIORITY_CONTROL       HTTP requests of a turn
+//           logDrain    TASK_PRIORITY_LOG           Log ring to Serial
+//
+// Tasks hand work over through stream buffers (audio), queues (workflow
+// commands and events) and task notifications (worker start signals).
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+#define TASK_CORE_NET (0)
+#define TASK_CORE_AUDIO (1)
+
+#define TASK_PRIORITY_AUDIO_IO (configMAX_PRIORITIES - 2)
+#define TASK_PRIORITY_AUDIO_DSP (2)
+#define TASK_PRIORITY_NET (3)
+#define TASK_PRIORITY_CONTROL (1)
+#define TASK_PRIORITY_LOG (1) // Below the audio and network tasks
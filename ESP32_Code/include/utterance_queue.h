@@ -0,0 +1,61 @@
+// Offline queue of recorded utterances on the audio log.
+//
+// When the backend can't be reached (Wi-Fi down, server off) the utterance
+// is recorded to the audio log instead of being lost. Queued utterances
+// are the log's pending records, so they survive a reboot. Once the
+// backend answers again they are uploaded oldest first and back to back
+// (one batch), each response played before the next upload, because the
+// backend keeps one turn per device. A failed attempt backs off
+// exponentially with jitter before the next one.
+//
+// The queue holds at most UTTERANCE_QUEUE_DEPTH utterances and as many
+// as fit the log; recording a new one drops the oldest to make room.
+//
+// Runs on the workflow task. queueGetStats may be read from elsewhere.
+#pragma once
+
+#include <Arduino.h>
+#include "audio_log.h"
+#include "voice_turn.h"
+
+#define UTTERANCE_QUEUE_DEPTH (8)
+#define UTTERANCE_QUEUE_BACKOFF_MIN_MS (2000)
+#define UTTERANCE_QUEUE_BACKOFF_MAX_MS (120000)
+
+struct QueueStats
+{
+  uint32_t depth;       // Utterances waiting for upload
+  uint32_t enqueued;    // Records kept, fallback recordings uploaded at once included
+  uint32_t drained;     // Uploaded and answered
+  uint32_t dropped;     // Overwritten by newer ones, or unreadable
+  uint32_t failures;    // Drain attempts that failed
+  uint32_t drainMsLast; // First attempt of a batch to the queue running empty
+  uint32_t drainMsMax;
+  uint32_t backoffMs;   // Current wait after a failure, 0 when none
+};
+
+// Picks up utterances still pending in the log; seed varies the jitter
+void queueInit(AudioLog &log, uint32_t seed);
+
+// Starts a log record for a new utterance, dropping the oldest queued ones
+// until a capture of config's limit fits
+bool queueBegin(const TurnConfig &config);
+// Finishes the record and queues it, or marks it done right away when keep
+// is false (no speech). False if nothing was queued.
+bool queueCommit(AudioLogRecord &record, bool keep);
+// Takes a record out of the queue after it was uploaded some other way
+void queueRemove(const AudioLogRecord &record);
+
+uint32_t queueDepth();
+// True when utterances are waiting and no backoff is running
+bool queueDrainDue();
+// ms until the backoff ends
+uint32_t queueRetryInMs();
+// Ends the backoff, e.g. when Wi-Fi comes back
+void queueKick();
+// Uploads the oldest utterance, waits for the response and plays it.
+// Failures leave it queued and start the backoff.
+bool queueDrainOne(const TurnConfig &config, const BackendTransport &transport, TurnResult &result);
+
+QueueStats queueGetStats();
+void queuePrintStats();
@@ -0,0 +1,57 @@
+// Lightweight voice-activity detector used to endpoint recordings.
+//
+// Works on 16-bit mono PCM in fixed-length frames. A frame counts as
+// speech when its energy (variance, so DC offset is ignored) rises well
+// above an adaptive noise floor, or moderately above it with a high
+// zero-crossing rate (unvoiced consonants). Speech starts after a few
+// consecutive speech frames and ends after a run of trailing silence.
+//
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum VadState
+{
+  VAD_WAITING,   // No speech yet
+  VAD_SPEECH,    // Speech onset seen, utterance in progress
+  VAD_ENDED,     // Trailing silence after speech, utterance complete
+  VAD_NO_SPEECH  // Nobody spoke before noSpeechTimeoutMs
+};
+
+struct VadConfig
+{
+  uint32_t sampleRate;
+  uint16_t frameMs;           // Analysis frame length
+  uint16_t onsetFrames;       // Consecutive speech frames needed for onset
+  uint16_t trailingSilenceMs; // Silence after speech that ends the utterance
+  uint16_t noSpeechTimeoutMs; // Give up if no onset within this time (0 = never)
+  uint16_t energyRatio;       // Speech threshold over noise floor (x)
+  uint16_t zcrPercent;        // ZCR (% of frame) that marks unvoiced speech
+  uint32_t minEnergy;         // Absolute energy floor, keeps silence from self-triggering
+};
+
+struct Vad
+{
+  VadConfig config;
+  VadState state;
+  uint32_t frameLen;      // Samples per frame
+  uint32_t frameFill;     // Samples accumulated in the current frame
+  int64_t sum;
+  uint64_t sumSq;
+  uint32_t crossings;
+  int32_t dc;             // Previous frame mean, used as the ZCR reference
+  int32_t lastSign;
+  uint32_t noiseFloor;    // Adaptive estimate of background energy
+  uint32_t frames;        // Frames analysed so far
+  uint32_t speechRun;     // Consecutive speech frames
+  uint32_t silenceRun;    // Consecutive non-speech frames since onset
+  uint32_t speechStartFrame;
+  uint32_t speechEndFrame;
+};
+
+void vadDefaultConfig(VadConfig &config, uint32_t sampleRate);
+void vadInit(Vad &vad, const VadConfig &config);
+// Feeds samples and returns the state after the last complete frame.
+VadState vadProcess(Vad &vad, const int16_t *samples, size_t count);
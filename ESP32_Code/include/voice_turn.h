@@ -0,0 +1,67 @@
+// The audio path of one voice turn, shared by the device workflow and the
+// native simulation.
+//
+// turnCapture runs the capture pipeline with endpointing and upload
+// encoding into any sink, starting from the pre-roll at the button press; turnUploadSink feeds it into a streamed upload.
+// turnWaitResponse and turnPlayResponse do the readiness wait and play the
+// response through the jitter buffer, parsing its WAV header and converting
+// other rates, channel counts and bit depths for the speaker. Orchestration (LEDs, fallbacks,
+// metrics) stays with the caller.
+#pragma once
+
+#include "audio_codec.h"
+#include "audio_format.h"
+#include "backend_transport.h"
+#include "capture_pipeline.h"
+#include "playback_engine.h"
+
+#define TURN_WAV_HEADER_SIZE WAV_HEADER_SIZE // Canonical header in front of uploads
+
+// Told the rate the speaker plays the response at, once its header is in
+// and before any of its audio reaches the speaker (playback reader task)
+typedef void (*TurnPlayRate)(uint32_t sampleRate);
+
+struct TurnConfig
+{
+  i2s_port_t micPort;
+  i2s_port_t speakerPort;
+  uint32_t speakerRate;       // Speaker rate between turns, 16-bit mono
+  uint32_t sampleRate;
+  uint32_t captureLimit;      // Max PCM bytes per utterance
+  CaptureProcess process;     // Mic slots to 16-bit PCM
+  bool useVad;                // Endpoint on speech instead of running to captureLimit
+  uint32_t trailingSilenceMs;
+  uint32_t noSpeechTimeoutMs;
+  AudioEncoding encoding;
+  uint32_t responseWaitMs;    // Total time to wait for the response
+  uint32_t longPollMs;        // Time the backend may hold one readiness request
+  uint32_t pollRetryMs;       // Gap between readiness requests answered at once
+  uint32_t prebufferBytes;    // Playback pre-buffer
+  const volatile bool *cancel; // Set to cut the response short (barge-in), NULL for none
+  TurnPlayRate playRate;       // NULL for none
+};
+
+struct TurnResult
+{
+  bool hadSpeech;
+  uint32_t pcmBytes;        // PCM bytes delivered by the capture
+  uint32_t encodedBytes;    // Bytes handed to the sink after encoding
+  unsigned long captureStartMs;
+  CaptureStats capture;
+  PlaybackStats playback;
+  uint32_t firstAudioMs;    // Response request to first audio at the speaker, 0 if none
+};
+
+// Runs one capture into sink, starting at startMs (millis() of the button
+// press) as far as the pre-roll reaches. Returns false if the capture or
+// the sink failed.
+bool turnCapture(const TurnConfig &config, unsigned long startMs, CaptureSink sink, void *sinkCtx,
+                 TurnResult &result);
+// CaptureSink writing to an open upload; ctx is the BackendTransport
+bool turnUploadSink(const uint8_t *data, size_t len, void *ctx);
+// Waits for the backend to report the response ready
+bool turnWaitResponse(const TurnConfig &config, const BackendTransport &transport);
+// Fetches the response and plays it. Returns false if it couldn't be fetched.
+// A cancel before or during playback stops it early and closes the
+// download; that still counts as played (result.playback.cancelled).
+bool turnPlayResponse(const TurnConfig &config, const BackendTransport &transport, TurnResult &result);
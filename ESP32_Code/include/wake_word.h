@@ -0,0 +1,78 @@
+// Keyword spotter for hands-free triggering.
+//
+// Front end: 25 ms Hamming frames every 10 ms, 512-point FFT, 24 log-mel
+// bands and a DCT to 12 cepstra (c0 is dropped so the match does not
+// depend on level). Matcher: subsequence DTW of the live feature stream
+// against a few enrolled templates, stored as int8 with a per-template
+// scale. A detection fires when a template's length-normalized path cost
+// drops below the threshold over a span of plausible duration.
+//
+// Templates are built from WAV recordings of the keyword (wake_eval
+// --enroll) and loaded from a blob in the format written by
+// wakeWriteTemplates. No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WAKE_SAMPLE_RATE (16000)
+#define WAKE_FRAME_LEN (400)            // 25 ms
+#define WAKE_HOP_LEN (160)              // 10 ms, one feature vector per hop
+#define WAKE_FFT_LEN (512)
+#define WAKE_MEL_BANDS (24)
+#define WAKE_CEPSTRA (12)
+#define WAKE_MAX_TEMPLATES (4)
+#define WAKE_MAX_TEMPLATE_FRAMES (120)  // 1.2 s keyword
+
+struct WakeTemplate
+{
+  uint16_t frames;
+  float scale; // Cepstrum = data * scale
+  int8_t data[WAKE_MAX_TEMPLATE_FRAMES][WAKE_CEPSTRA];
+};
+
+struct WakeConfig
+{
+  float threshold;          // Max normalized DTW cost for a detection
+  uint16_t refractoryHops;  // Ignore detections for this long after one
+  uint16_t warmupHops;      // Hops after init before detections are allowed
+};
+
+struct WakeDetector
+{
+  WakeConfig config;
+  WakeTemplate templates[WAKE_MAX_TEMPLATES];
+  int count;
+  // Front end
+  int16_t window[WAKE_FRAME_LEN]; // Last frame of samples
+  uint32_t fill;                  // Samples in window (saturates at WAKE_FRAME_LEN)
+  uint32_t hopFill;               // Samples since the last feature
+  float re[WAKE_FFT_LEN];
+  float im[WAKE_FFT_LEN];
+  // DTW columns per template: cost, path length and start hop of the best path
+  float cost[WAKE_MAX_TEMPLATES][WAKE_MAX_TEMPLATE_FRAMES];
+  uint16_t steps[WAKE_MAX_TEMPLATES][WAKE_MAX_TEMPLATE_FRAMES];
+  uint32_t start[WAKE_MAX_TEMPLATES][WAKE_MAX_TEMPLATE_FRAMES];
+  uint32_t hops;       // Features computed so far
+  uint32_t quietUntil; // No detections before this hop
+  float lastScore;     // Best template score at the most recent hop
+  float triggerScore;  // Score of the last detection
+};
+
+void wakeDefaultConfig(WakeConfig &config);
+void wakeInit(WakeDetector &det, const WakeConfig &config);
+// Parses a template blob. Returns the number of templates loaded.
+int wakeLoadTemplates(WakeDetector &det, const uint8_t *blob, size_t len);
+// Serializes the loaded templates, returns bytes written (0 if out is too small)
+size_t wakeWriteTemplates(const WakeDetector &det, uint8_t *out, size_t len);
+// Quantizes frames of cepstra into a new template. Returns false if full.
+bool wakeAddTemplate(WakeDetector &det, const float (*cepstra)[WAKE_CEPSTRA], uint16_t frames);
+// Feeds 16 kHz mono samples. Returns true if the keyword ended in this block.
+bool wakeProcess(WakeDetector &det, const int16_t *samples, size_t count);
+// Drops buffered audio and partial matches, e.g. after a gap in the
+// stream; detections resume after the warm-up
+void wakeReset(WakeDetector &det);
+// Features of a whole recording, trimmed to the frames within 30 dB of the
+// loudest one and 10 dB above the background noise. Returns the frame
+// count written to out.
+size_t wakeExtractFeatures(const int16_t *samples, size_t count, float (*out)[WAKE_CEPSTRA], size_t maxFrames);
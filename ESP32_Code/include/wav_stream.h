@@ -0,0 +1,58 @@
+// Incremental RIFF/WAVE parser for streamed responses.
+//
+// Bytes go in as they arrive from the socket, in pieces of any size. The
+// parser walks the chunk list (fmt, LIST, fact, ... in any order, with
+// pad bytes), records the format and passes only the data chunk's payload
+// through. A data chunk size of 0 or 0xFFFFFFFF (streaming TTS engines
+// that don't know the length up front) means "to the end of the stream".
+// A stream that doesn't start with RIFF is treated as raw PCM in the
+// fallback format given to wavParserInit.
+//
+// No Arduino dependencies, so it also builds on the host.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WAV_FORMAT_PCM (1)
+#define WAV_FORMAT_EXTENSIBLE (0xFFFE)
+#define WAV_FMT_MAX (40) // fmt chunk bytes kept (WAVE_FORMAT_EXTENSIBLE size)
+
+enum WavParseState
+{
+  WAV_PARSE_RIFF,   // Reading the 12-byte RIFF header
+  WAV_PARSE_CHUNK,  // Reading a chunk header
+  WAV_PARSE_FMT,    // Reading the fmt chunk body
+  WAV_PARSE_SKIP,   // Skipping a chunk we don't use
+  WAV_PARSE_DATA,   // Passing data chunk payload through
+  WAV_PARSE_ERROR   // Unsupported format; everything else is dropped
+};
+
+struct WavFormat
+{
+  uint16_t channels;
+  uint32_t sampleRate;
+  uint16_t bitsPerSample; // 8 (unsigned), 16, 24 or 32 (signed)
+  uint16_t frameBytes;    // channels * bitsPerSample / 8
+};
+
+struct WavParser
+{
+  WavParseState state;
+  WavFormat format;
+  bool haveFormat;   // fmt seen (or raw fallback in use)
+  uint8_t header[WAV_FMT_MAX];
+  uint32_t headerFill;
+  uint32_t fmtWant;     // fmt bytes to collect
+  uint32_t chunkLeft;   // Bytes left in the current chunk, pad byte included
+  bool unbounded;       // Data chunk runs to the end of the stream
+  bool dataPad;         // Odd-sized data chunk, a pad byte follows it
+  uint32_t headerBytes; // Bytes consumed outside the data payload
+};
+
+void wavParserInit(WavParser &parser, const WavFormat &fallback);
+// Consumes len bytes from buf and moves the data payload among them to the
+// front of buf. Returns the payload byte count (0 while in headers).
+size_t wavParserRun(WavParser &parser, uint8_t *buf, size_t len);
+// Format once known: true after the fmt chunk (or for raw PCM)
+bool wavParserFormat(const WavParser &parser, WavFormat &format);
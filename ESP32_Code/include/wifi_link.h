@@ -0,0 +1,58 @@
+// Station connection with the credentials and the last good AP in NVS.
+//
+// A plain WiFi.begin scans every channel for the SSID before associating
+// (1-3 s, longer with several APs). Once connected, the AP's channel and
+// BSSID are stored next to the credentials, and the next connect passes
+// them to WiFi.begin, which then associates without scanning. If that
+// fails within WIFI_LINK_FAST_TIMEOUT (AP moved channel, different AP) the
+// link falls back to a scanning connect and stores the AP it finds.
+//
+// With WIFI_LINK_STATIC_IP the last DHCP lease is stored too and set as a
+// static address on the next connect, skipping DHCP. Only use it when the
+// router reserves the address for the device.
+//
+// Credentials from the config portal are stored with wifiLinkSetCredentials
+// and survive a reboot. Connects run in the background: wifiLinkBegin
+// starts one and wifiLinkPoll (from loop()) follows it, reconnects after a
+// drop and keeps the stats.
+#pragma once
+
+#include <Arduino.h>
+
+#define WIFI_LINK_NAMESPACE "wifilink"
+#define WIFI_LINK_FAST_TIMEOUT (1500)  // ms for a connect with the stored AP
+#define WIFI_LINK_SCAN_TIMEOUT (10000) // ms for a scanning connect
+#ifndef WIFI_LINK_STATIC_IP
+#define WIFI_LINK_STATIC_IP (0)
+#endif
+
+struct WifiLinkStats
+{
+  uint32_t bootConnectMs; // Boot to the first connection, 0 until then
+  uint32_t connectMsLast; // Begin or drop to connected, fallbacks included
+  uint32_t connectMsMax;
+  uint32_t fastConnects;  // Connected with the stored channel and BSSID
+  uint32_t scanConnects;
+  uint32_t fastFailures;  // Fast attempts that fell back to a scan
+  uint32_t drops;         // Connections lost
+};
+
+// Loads the stored credentials and AP, or takes the defaults when none are
+// stored. Puts the radio in station mode without the SDK's own flash
+// config and auto-reconnect, which the link replaces.
+void wifiLinkInit(const char *defaultSsid, const char *defaultPassword);
+// True if the current credentials have connected before
+bool wifiLinkVerified();
+const char *wifiLinkSsid();
+// Stores new credentials and forgets the AP
+void wifiLinkSetCredentials(const char *ssid, const char *password);
+
+// Starts a connect, fast if an AP is stored
+void wifiLinkBegin();
+// Follows the connect, reconnects after a drop. True while connected.
+bool wifiLinkPoll();
+// Polls until connected or timeoutMs runs out
+bool wifiLinkWait(uint32_t timeoutMs);
+
+WifiLinkStats wifiLinkGetStats();
+void wifiLinkPrintStats();
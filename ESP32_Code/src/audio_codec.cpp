@@ -0,0 +1,194 @@
+#include "audio_codec.h"
+
+static const int16_t adpcmStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+static const int8_t adpcmIndexTable[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8};
+
+const char *audioEncodingName(AudioEncoding encoding)
+{
+  switch (encoding)
+  {
+  case AUDIO_ENCODING_IMA_ADPCM:
+    return "ima-adpcm";
+  case AUDIO_ENCODING_MULAW:
+    return "mulaw";
+  default:
+    return "pcm";
+  }
+}
+
+const char *audioEncodingContentType(AudioEncoding encoding)
+{
+  // PCM uploads carry a WAV header, the codecs are raw streams
+  return encoding == AUDIO_ENCODING_PCM ? "audio/wav" : "application/octet-stream";
+}
+
+void adpcmInit(AdpcmState &state)
+{
+  state.predictor = 0;
+  state.index = 0;
+  state.hasNibble = false;
+  state.nibble = 0;
+}
+
+// Applies one 4-bit code to the predictor, shared by encoder and decoder
+// so both sides stay bit-exact.
+static inline void adpcmStep(AdpcmState &state, uint8_t code)
+{
+  int32_t step = adpcmStepTable[state.index];
+  int32_t diff = step >> 3;
+  if (code & 4)
+    diff += step;
+  if (code & 2)
+    diff += step >> 1;
+  if (code & 1)
+    diff += step >> 2;
+
+  int32_t predictor = state.predictor + ((code & 8) ? -diff : diff);
+  if (predictor > 32767)
+    predictor = 32767;
+  else if (predictor < -32768)
+    predictor = -32768;
+  state.predictor = predictor;
+
+  int32_t index = state.index + adpcmIndexTable[code];
+  if (index < 0)
+    index = 0;
+  else if (index > 88)
+    index = 88;
+  state.index = index;
+}
+
+static inline uint8_t adpcmEncodeSample(AdpcmState &state, int16_t sample)
+{
+  int32_t step = adpcmStepTable[state.index];
+  int32_t diff = sample - state.predictor;
+  uint8_t code = 0;
+  if (diff < 0)
+  {
+    code = 8;
+    diff = -diff;
+  }
+  if (diff >= step)
+  {
+    code |= 4;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step)
+  {
+    code |= 2;
+    diff -= step;
+  }
+  step >>= 1;
+  if (diff >= step)
+  {
+    code |= 1;
+  }
+  adpcmStep(state, code);
+  return code;
+}
+
+size_t adpcmEncode(AdpcmState &state, uint8_t *dst, const int16_t *src, size_t count)
+{
+  size_t out = 0;
+  size_t i = 0;
+
+  if (state.hasNibble && count)
+  {
+    dst[out++] = state.nibble | (adpcmEncodeSample(state, src[i++]) << 4);
+    state.hasNibble = false;
+  }
+  for (; i + 1 < count; i += 2)
+  {
+    uint8_t lo = adpcmEncodeSample(state, src[i]);
+    uint8_t hi = adpcmEncodeSample(state, src[i + 1]);
+    dst[out++] = lo | (hi << 4);
+  }
+  if (i < count)
+  {
+    state.nibble = adpcmEncodeSample(state, src[i]);
+    state.hasNibble = true;
+  }
+  return out;
+}
+
+size_t adpcmFlush(AdpcmState &state, uint8_t *dst)
+{
+  if (!state.hasNibble)
+  {
+    return 0;
+  }
+  dst[0] = state.nibble;
+  state.hasNibble = false;
+  return 1;
+}
+
+size_t adpcmDecode(AdpcmState &state, int16_t *dst, const uint8_t *src, size_t bytes)
+{
+  size_t out = 0;
+  for (size_t i = 0; i < bytes; i++)
+  {
+    adpcmStep(state, src[i] & 0x0f);
+    dst[out++] = (int16_t)state.predictor;
+    adpcmStep(state, src[i] >> 4);
+    dst[out++] = (int16_t)state.predictor;
+  }
+  return out;
+}
+
+#define MULAW_BIAS (0x84)
+#define MULAW_CLIP (32635)
+
+uint8_t mulawEncode(int16_t sample)
+{
+  int32_t x = sample;
+  uint8_t sign = 0;
+  if (x < 0)
+  {
+    x = -x;
+    sign = 0x80;
+  }
+  if (x > MULAW_CLIP)
+    x = MULAW_CLIP;
+  x += MULAW_BIAS;
+
+  // Segment = position of the highest set bit above bit 7
+  uint8_t exponent = 7;
+  for (int32_t mask = 0x4000; (x & mask) == 0 && exponent > 0; mask >>= 1)
+  {
+    exponent--;
+  }
+  uint8_t mantissa = (x >> (exponent + 3)) & 0x0f;
+  return ~(sign | (exponent << 4) | mantissa);
+}
+
+int16_t mulawDecode(uint8_t value)
+{
+  value = ~value;
+  int32_t exponent = (value >> 4) & 0x07;
+  int32_t mantissa = value & 0x0f;
+  int32_t x = ((mantissa << 3) + MULAW_BIAS) << exponent;
+  x -= MULAW_BIAS;
+  return (int16_t)((value & 0x80) ? -x : x);
+}
+
+size_t mulawEncodeBlock(uint8_t *dst, const int16_t *src, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    dst[i] = mulawEncode(src[i]);
+  }
+  return count;
+}
@@ -0,0 +1,39 @@
+#include "audio_hal.h"
+
+#include <freertos/FreeRTOS.h>
+
+// Rates the MAX98357A takes and the I2S clock divider hits closely
+static const uint32_t audioSpeakerRates[] = {8000, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000};
+
+size_t audioRead(i2s_port_t port, void *buf, size_t len)
+{
+  size_t bytesRead = 0;
+  i2s_read(port, buf, len, &bytesRead, portMAX_DELAY);
+  return bytesRead;
+}
+
+size_t audioWrite(i2s_port_t port, const void *buf, size_t len)
+{
+  size_t written = 0;
+  i2s_write(port, buf, len, &written, portMAX_DELAY);
+  return written;
+}
+
+void audioClear(i2s_port_t port)
+{
+  i2s_stop(port);
+  i2s_zero_dma_buffer(port);
+  i2s_start(port);
+}
+
+bool audioSetRate(i2s_port_t port, uint32_t sampleRate)
+{
+  for (uint32_t rate : audioSpeakerRates)
+  {
+    if (rate == sampleRate)
+    {
+      return i2s_set_sample_rates(port, sampleRate) == ESP_OK;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,423 @@
+#include "audio_log.h"
+
+#include <string.h>
+
+struct AudioLogHeader
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t check;  // ~(magic ^ seq), so audio that happens to hold the magic isn't taken for a header
+  uint32_t length; // Programmed by audioLogFinish
+  uint32_t state;  // Programmed by audioLogMarkDone
+};
+
+static uint32_t logOffset(const AudioLog &log, uint64_t pos)
+{
+  return (uint32_t)(pos % log.dev.size);
+}
+
+static uint64_t alignUp(uint64_t pos, uint32_t align)
+{
+  return (pos + align - 1) / align * align;
+}
+
+// Flash access that may wrap at the end of the partition
+static bool logRead(const AudioLog &log, uint64_t pos, void *buf, size_t len)
+{
+  uint32_t offset = logOffset(log, pos);
+  size_t first = len < log.dev.size - offset ? len : log.dev.size - offset;
+  return log.dev.read(offset, buf, first, log.dev.ctx) &&
+         (first == len || log.dev.read(0, (uint8_t *)buf + first, len - first, log.dev.ctx));
+}
+
+static bool logWrite(const AudioLog &log, uint64_t pos, const void *buf, size_t len)
+{
+  uint32_t offset = logOffset(log, pos);
+  size_t first = len < log.dev.size - offset ? len : log.dev.size - offset;
+  return log.dev.write(offset, buf, first, log.dev.ctx) &&
+         (first == len || log.dev.write(0, (const uint8_t *)buf + first, len - first, log.dev.ctx));
+}
+
+// Erases from log.erased up to end (sector aligned), in eraseBlock pieces
+// where alignment allows
+static bool logEraseTo(AudioLog &log, uint64_t end)
+{
+  while (log.erased < end)
+  {
+    uint32_t offset = logOffset(log, log.erased);
+    uint32_t len = log.dev.sectorSize;
+    if (offset % log.dev.eraseBlock == 0 && log.erased + log.dev.eraseBlock <= end &&
+        offset + log.dev.eraseBlock <= log.dev.size)
+    {
+      len = log.dev.eraseBlock;
+    }
+    uint32_t start = log.dev.micros(log.dev.ctx);
+    if (!log.dev.erase(offset, len, log.dev.ctx))
+    {
+      return false;
+    }
+    log.stats.eraseUsTotal += log.dev.micros(log.dev.ctx) - start;
+    log.stats.sectorsErased += len / log.dev.sectorSize;
+    // A record longer than the free space runs over the newest finished one
+    if (log.newest != UINT64_MAX && log.erased + len > log.newest + log.dev.size)
+    {
+      log.newest = UINT64_MAX;
+    }
+    log.erased += len;
+  }
+  return true;
+}
+
+static bool validHeader(const AudioLogHeader &h)
+{
+  return h.magic == AUDIO_LOG_MAGIC && h.check == ~(h.magic ^ h.seq);
+}
+
+static bool finishedHeader(const AudioLog &log, const AudioLogHeader &h)
+{
+  return validHeader(h) && h.length != AUDIO_LOG_OPEN_LENGTH && h.length <= log.dev.size - AUDIO_LOG_HEADER_SIZE;
+}
+
+// Absolute position of the record starting at offset, which lies behind
+// the head
+static uint64_t logBehindHead(const AudioLog &log, uint32_t offset)
+{
+  uint32_t back = (logOffset(log, log.head) + log.dev.size - offset) % log.dev.size;
+  return log.head - (back ? back : log.dev.size);
+}
+
+// Oldest finished record not marked done, from the headers on flash. An
+// erase always reaches a record's header before the rest of it, so a
+// header that is still there means the whole record is intact.
+static bool logFindOldestPending(AudioLog &log)
+{
+  log.oldestPending = UINT64_MAX;
+  for (uint32_t offset = 0; offset < log.dev.size; offset += log.dev.sectorSize)
+  {
+    AudioLogHeader h;
+    if (!log.dev.read(offset, &h, sizeof(h), log.dev.ctx))
+    {
+      return false;
+    }
+    if (finishedHeader(log, h) && h.state == AUDIO_LOG_STATE_PENDING)
+    {
+      uint64_t pos = logBehindHead(log, offset);
+      if (pos < log.oldestPending)
+      {
+        log.oldestPending = pos;
+      }
+    }
+  }
+  return true;
+}
+
+bool audioLogInit(AudioLog &log, const FlashDevice &dev)
+{
+  memset(&log, 0, sizeof(log));
+  log.dev = dev;
+  if (dev.size == 0 || dev.sectorSize == 0 || dev.size % dev.sectorSize || dev.eraseBlock % dev.sectorSize)
+  {
+    return false;
+  }
+
+  // Newest header on a sector boundary, and the newest finished one
+  AudioLogHeader newest = {};
+  AudioLogHeader finished = {};
+  uint32_t newestOffset = 0;
+  uint32_t finishedOffset = 0;
+  bool found = false;
+  bool foundFinished = false;
+  for (uint32_t offset = 0; offset < dev.size; offset += dev.sectorSize)
+  {
+    AudioLogHeader h;
+    if (!dev.read(offset, &h, sizeof(h), dev.ctx))
+    {
+      return false;
+    }
+    if (!validHeader(h))
+    {
+      continue;
+    }
+    if (!found || (int32_t)(h.seq - newest.seq) > 0)
+    {
+      newest = h;
+      newestOffset = offset;
+      found = true;
+    }
+    if (finishedHeader(log, h) && (!foundFinished || (int32_t)(h.seq - finished.seq) > 0))
+    {
+      finished = h;
+      finishedOffset = offset;
+      foundFinished = true;
+    }
+  }
+
+  // Positions are absolute and start one lap in, so everything behind the
+  // head has a position too
+  log.head = dev.size;
+  log.newest = UINT64_MAX;
+  if (found)
+  {
+    // An unfinished newest record (power lost while recording) is reused
+    log.seq = newest.seq;
+    log.head = dev.size + newestOffset;
+    if (newest.length != AUDIO_LOG_OPEN_LENGTH)
+    {
+      log.head = alignUp(log.head + AUDIO_LOG_HEADER_SIZE + newest.length, dev.sectorSize);
+    }
+  }
+  if (foundFinished)
+  {
+    log.newest = logBehindHead(log, finishedOffset);
+  }
+  // Nothing is known to be erased; audioLogPrepare starts from the head
+  log.erased = log.head;
+  return logFindOldestPending(log);
+}
+
+// How far to erase for bytes more after the head
+static uint64_t prepareTarget(const AudioLog &log, uint32_t bytes)
+{
+  uint64_t base = log.writing ? log.recordStart : log.head;
+  uint64_t target = alignUp(log.head + bytes, log.dev.sectorSize);
+  // The newest finished record stays readable until the next one is done,
+  // pending ones until they are marked done
+  uint64_t limit = base + log.dev.size;
+  uint64_t kept = log.oldestPending < log.newest ? log.oldestPending : log.newest;
+  if (kept != UINT64_MAX && kept + log.dev.size < limit)
+  {
+    limit = kept + log.dev.size;
+  }
+  return target < limit ? target : limit;
+}
+
+uint32_t audioLogPrepare(AudioLog &log, uint32_t bytes)
+{
+  uint64_t target = prepareTarget(log, bytes);
+  if (target > log.erased)
+  {
+    logEraseTo(log, target);
+  }
+  return log.erased > log.head ? (uint32_t)(log.erased - log.head) : 0;
+}
+
+bool audioLogPrepareStep(AudioLog &log, uint32_t bytes)
+{
+  uint64_t target = prepareTarget(log, bytes);
+  if (target <= log.erased)
+  {
+    return false;
+  }
+  // One block erase where a whole block is due, one sector otherwise
+  uint64_t end = log.erased + log.dev.eraseBlock;
+  if (logOffset(log, log.erased) % log.dev.eraseBlock != 0 || end > target)
+  {
+    end = log.erased + log.dev.sectorSize;
+  }
+  return logEraseTo(log, end) && log.erased < target;
+}
+
+bool audioLogBegin(AudioLog &log)
+{
+  if (log.writing)
+  {
+    return false;
+  }
+  log.head = alignUp(log.head, log.dev.sectorSize);
+  if (log.oldestPending != UINT64_MAX && log.head + log.dev.sectorSize > log.oldestPending + log.dev.size)
+  {
+    return false;
+  }
+  if (log.erased < log.head + AUDIO_LOG_HEADER_SIZE && !logEraseTo(log, log.head + log.dev.sectorSize))
+  {
+    return false;
+  }
+
+  AudioLogHeader h;
+  h.magic = AUDIO_LOG_MAGIC;
+  h.seq = log.seq + 1;
+  h.check = ~(h.magic ^ h.seq);
+  h.length = AUDIO_LOG_OPEN_LENGTH;
+  h.state = AUDIO_LOG_STATE_PENDING;
+  if (!logWrite(log, log.head, &h, sizeof(h)))
+  {
+    return false;
+  }
+  log.seq = h.seq;
+  log.recordStart = log.head;
+  log.recordLength = 0;
+  log.head += AUDIO_LOG_HEADER_SIZE;
+  log.writing = true;
+  return true;
+}
+
+bool audioLogAppend(AudioLog &log, const void *data, size_t len)
+{
+  uint64_t limit = log.recordStart + log.dev.size;
+  if (log.oldestPending != UINT64_MAX && log.oldestPending + log.dev.size < limit)
+  {
+    limit = log.oldestPending + log.dev.size;
+  }
+  if (!log.writing || log.head + len > limit)
+  {
+    return false;
+  }
+  uint32_t start = log.dev.micros(log.dev.ctx);
+  if (log.head + len > log.erased)
+  {
+    uint64_t before = log.stats.sectorsErased;
+    if (!logEraseTo(log, alignUp(log.head + len, log.dev.sectorSize)))
+    {
+      return false;
+    }
+    log.stats.lateErases += log.stats.sectorsErased - before;
+  }
+  if (!logWrite(log, log.head, data, len))
+  {
+    return false;
+  }
+  uint32_t us = log.dev.micros(log.dev.ctx) - start;
+
+  log.head += len;
+  log.recordLength += len;
+  log.stats.appends++;
+  log.stats.bytes += len;
+  log.stats.appendUsTotal += us;
+  if (us > log.stats.appendUsMax)
+  {
+    log.stats.appendUsMax = us;
+  }
+  return true;
+}
+
+bool audioLogFinish(AudioLog &log, AudioLogRecord &record)
+{
+  if (!log.writing)
+  {
+    return false;
+  }
+  log.writing = false;
+  if (!logWrite(log, log.recordStart + offsetof(AudioLogHeader, length), &log.recordLength, sizeof(uint32_t)))
+  {
+    return false;
+  }
+  log.newest = log.recordStart;
+  if (log.oldestPending == UINT64_MAX)
+  {
+    log.oldestPending = log.recordStart;
+  }
+  log.head = alignUp(log.head, log.dev.sectorSize);
+  if (log.erased < log.head)
+  {
+    log.erased = log.head;
+  }
+  log.stats.records++;
+
+  record.seq = log.seq;
+  record.offset = logOffset(log, log.recordStart);
+  record.length = log.recordLength;
+  return true;
+}
+
+bool audioLogLatest(const AudioLog &log, AudioLogRecord &record)
+{
+  if (log.newest == UINT64_MAX)
+  {
+    return false;
+  }
+  AudioLogHeader h;
+  if (!logRead(log, log.newest, &h, sizeof(h)) || !finishedHeader(log, h))
+  {
+    return false;
+  }
+  record.seq = h.seq;
+  record.offset = logOffset(log, log.newest);
+  record.length = h.length;
+  return true;
+}
+
+uint32_t audioLogRoom(const AudioLog &log)
+{
+  uint64_t start = alignUp(log.head, log.dev.sectorSize);
+  uint64_t limit = start + log.dev.size;
+  if (log.oldestPending != UINT64_MAX && log.oldestPending + log.dev.size < limit)
+  {
+    limit = log.oldestPending + log.dev.size;
+  }
+  return limit > start + AUDIO_LOG_HEADER_SIZE ? (uint32_t)(limit - start - AUDIO_LOG_HEADER_SIZE) : 0;
+}
+
+size_t audioLogPending(const AudioLog &log, AudioLogRecord *records, size_t max)
+{
+  // Walk the ring from the oldest pending record up to the head
+  size_t count = 0;
+  if (log.oldestPending == UINT64_MAX)
+  {
+    return 0;
+  }
+  for (uint64_t pos = log.oldestPending; pos < log.head && count < max; pos += log.dev.sectorSize)
+  {
+    AudioLogHeader h;
+    if (!logRead(log, pos, &h, sizeof(h)))
+    {
+      break;
+    }
+    if (!finishedHeader(log, h))
+    {
+      continue;
+    }
+    if (h.state == AUDIO_LOG_STATE_PENDING)
+    {
+      records[count].seq = h.seq;
+      records[count].offset = logOffset(log, pos);
+      records[count].length = h.length;
+      count++;
+    }
+    // Skip the audio; the loop steps to the sector after it
+    pos = alignUp(pos + AUDIO_LOG_HEADER_SIZE + h.length, log.dev.sectorSize) - log.dev.sectorSize;
+  }
+  return count;
+}
+
+bool audioLogMarkDone(AudioLog &log, const AudioLogRecord &record)
+{
+  uint64_t pos = logBehindHead(log, record.offset);
+  AudioLogHeader h;
+  if (!logRead(log, pos, &h, sizeof(h)) || !validHeader(h) || h.seq != record.seq)
+  {
+    return false;
+  }
+  uint32_t state = AUDIO_LOG_STATE_DONE;
+  if (h.state != AUDIO_LOG_STATE_DONE &&
+      !logWrite(log, pos + offsetof(AudioLogHeader, state), &state, sizeof(state)))
+  {
+    return false;
+  }
+  return pos != log.oldestPending || logFindOldestPending(log);
+}
+
+bool audioLogOpen(const AudioLog &log, const AudioLogRecord &record, AudioLogReader &reader)
+{
+  AudioLogHeader h;
+  if (!logRead(log, record.offset, &h, sizeof(h)) || !finishedHeader(log, h) || h.seq != record.seq ||
+      h.length != record.length)
+  {
+    return false;
+  }
+  reader.log = &log;
+  reader.record = record;
+  reader.pos = 0;
+  return true;
+}
+
+size_t audioLogRead(AudioLogReader &reader, void *buf, size_t len)
+{
+  uint32_t left = reader.record.length - reader.pos;
+  size_t n = len < left ? len : left;
+  if (n == 0 || !logRead(*reader.log, (uint64_t)reader.record.offset + AUDIO_LOG_HEADER_SIZE + reader.pos, buf, n))
+  {
+    return 0;
+  }
+  reader.pos += n;
+  return n;
+}
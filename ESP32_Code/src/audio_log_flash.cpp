@@ -0,0 +1,42 @@
+#include "audio_log_flash.h"
+
+#include <esp_partition.h>
+
+static bool partitionRead(uint32_t offset, void *buf, size_t len, void *ctx)
+{
+  return esp_partition_read((const esp_partition_t *)ctx, offset, buf, len) == ESP_OK;
+}
+
+static bool partitionWrite(uint32_t offset, const void *buf, size_t len, void *ctx)
+{
+  return esp_partition_write((const esp_partition_t *)ctx, offset, buf, len) == ESP_OK;
+}
+
+static bool partitionErase(uint32_t offset, size_t len, void *ctx)
+{
+  return esp_partition_erase_range((const esp_partition_t *)ctx, offset, len) == ESP_OK;
+}
+
+static uint32_t partitionMicros(void *ctx)
+{
+  return micros();
+}
+
+bool flashPartitionOpen(FlashDevice &dev, const char *label)
+{
+  const esp_partition_t *part = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)AUDIO_LOG_PARTITION_SUBTYPE, label);
+  if (!part)
+  {
+    return false;
+  }
+  dev.read = partitionRead;
+  dev.write = partitionWrite;
+  dev.erase = partitionErase;
+  dev.micros = partitionMicros;
+  dev.size = part->size;
+  dev.sectorSize = SPI_FLASH_SEC_SIZE;
+  dev.eraseBlock = AUDIO_LOG_ERASE_BLOCK;
+  dev.ctx = (void *)part;
+  return true;
+}
@@ -0,0 +1,400 @@
+#include "backend_http.h"
+#include "backend_session.h"
+#include "buffer_pool.h"
+#include "serial_log.h"
+
+#include <HTTPClient.h>
+
+struct HttpTransport
+{
+  String uploadHost;   // uploadUrl split up once, at init
+  String uploadPath;
+  bool uploadUrlValid;
+  String uploadUrl;
+  String readyUrl;
+  String responseUrl;
+  String deviceId;
+  char requestId[20];  // Current turn, new for every upload
+  char audioHash[24];  // X-Audio-Hash of the turn's response, once ready
+  char *head;          // HTTP_HEAD_LEN bytes for request heads and URLs
+  char *reply;         // HTTP_REPLY_LEN bytes for reply bodies
+  uint32_t bootId;     // Keeps request IDs unique across reboots
+  uint32_t turns;
+  WiFiClient *upload;  // Socket the open chunked upload is going out on
+  HTTPClient *response;
+  WiFiClient *body;
+  int32_t remaining;   // Response bytes left, -1 if the length is unknown
+};
+
+static HttpTransport http;
+
+static bool writeChunk(WiFiClient &client, const uint8_t *data, size_t len)
+{
+  if (len == 0)
+  {
+    return true;
+  }
+  char sizeLine[12];
+  int n = snprintf(sizeLine, sizeof(sizeLine), "%X\r\n", (unsigned int)len);
+  if (client.write((const uint8_t *)sizeLine, n) != (size_t)n)
+  {
+    return false;
+  }
+  if (client.write(data, len) != len)
+  {
+    return false;
+  }
+  return client.write((const uint8_t *)"\r\n", 2) == 2;
+}
+
+// Reads one line into line without its CR LF, cut at len - 1 characters.
+// False if the socket timed out first.
+static bool readLine(WiFiClient &client, char *line, size_t len)
+{
+  size_t n = 0;
+  char c;
+  while (client.readBytes(&c, 1) == 1)
+  {
+    if (c == '\n')
+    {
+      while (n > 0 && (line[n - 1] == '\r' || line[n - 1] == ' '))
+      {
+        n--;
+      }
+      line[n] = '\0';
+      return true;
+    }
+    if (n + 1 < len)
+    {
+      line[n++] = c;
+    }
+  }
+  line[n] = '\0';
+  return false;
+}
+
+// Reads a response off the raw socket, the body into body (cut at len - 1,
+// the rest read and dropped). reusable is set when the body was
+// length-delimited and fully read, so the socket can carry the next request.
+static int readHttpResponse(WiFiClient &client, char *body, size_t len, bool &reusable)
+{
+  client.setTimeout(HTTP_RESPONSE_TIMEOUT / 1000);
+  reusable = false;
+  body[0] = '\0';
+
+  // Status line: "HTTP/1.1 200 OK"
+  char line[HTTP_LINE_LEN];
+  if (!readLine(client, line, sizeof(line)) || strncmp(line, "HTTP/", 5) != 0)
+  {
+    return -1;
+  }
+  const char *space = strchr(line, ' ');
+  int code = space ? atoi(space + 1) : -1;
+  bool keepAlive = strncmp(line, "HTTP/1.1", 8) == 0;
+
+  // Headers
+  int contentLength = -1;
+  while (readLine(client, line, sizeof(line)) && line[0] != '\0')
+  {
+    for (char *c = line; *c; c++)
+    {
+      *c = tolower((unsigned char)*c);
+    }
+    if (strncmp(line, "content-length:", 15) == 0)
+    {
+      contentLength = atoi(line + 15);
+    }
+    else if (strncmp(line, "connection:", 11) == 0)
+    {
+      keepAlive = strstr(line, "close") == NULL;
+    }
+  }
+
+  // Body
+  int received = 0;
+  size_t kept = 0;
+  unsigned long start = millis();
+  while ((contentLength < 0 || received < contentLength) && (client.connected() || client.available()) &&
+         millis() - start < HTTP_RESPONSE_TIMEOUT)
+  {
+    while (client.available() && (contentLength < 0 || received < contentLength))
+    {
+      int c = client.read();
+      if (c < 0)
+      {
+        break;
+      }
+      if (kept + 1 < len)
+      {
+        body[kept++] = (char)c;
+      }
+      received++;
+    }
+    delay(1);
+  }
+  body[kept] = '\0';
+
+  // Only a fully read, length-delimited body leaves the socket reusable
+  reusable = keepAlive && contentLength >= 0 && received == contentLength;
+  return code;
+}
+
+// Body of a GET reply into buf, cut at len - 1. What doesn't fit is left
+// for sessionEnd to discard.
+static void readBody(HTTPClient *client, char *buf, size_t len)
+{
+  int size = client->getSize();
+  WiFiClient *stream = client->getStreamPtr();
+  // Without a length, only what has arrived; waiting would take the timeout
+  int want = size >= 0 ? size : stream->available();
+  if (want < 0)
+  {
+    want = 0;
+  }
+  if ((size_t)want > len - 1)
+  {
+    want = len - 1;
+  }
+  size_t n = stream->readBytes(buf, want);
+  buf[n] = '\0';
+}
+
+// GET URL for the device and turn, with extra parameters in front. NULL
+// if it doesn't fit.
+static const char *sessionUrl(HttpTransport *t, const String &base, const char *extra)
+{
+  int n = snprintf(t->head, HTTP_HEAD_LEN, "%s?%sdevice=%s&request=%s", base.c_str(), extra, t->deviceId.c_str(),
+                   t->requestId);
+  return n > 0 && n < HTTP_HEAD_LEN ? t->head : NULL;
+}
+
+static bool httpUploadBegin(AudioEncoding encoding, uint32_t sampleRate, void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  snprintf(t->requestId, sizeof(t->requestId), "%08x-%u", t->bootId, ++t->turns);
+  t->audioHash[0] = '\0';
+
+  if (!t->uploadUrlValid)
+  {
+    LOG_E("Invalid upload URL: %s\n", t->uploadUrl.c_str());
+    return false;
+  }
+
+  int len = snprintf(t->head, HTTP_HEAD_LEN,
+                     "POST %s HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "X-Audio-Encoding: %s\r\n"
+                     "X-Audio-Sample-Rate: %u\r\n"
+                     "X-Device-Id: %s\r\n"
+                     "X-Request-Id: %s\r\n"
+                     "Transfer-Encoding: chunked\r\n"
+                     "Connection: keep-alive\r\n\r\n",
+                     t->uploadPath.c_str(), t->uploadHost.c_str(), audioEncodingContentType(encoding),
+                     audioEncodingName(encoding), (unsigned)sampleRate, t->deviceId.c_str(), t->requestId);
+  if (len <= 0 || len >= HTTP_HEAD_LEN)
+  {
+    LOG_E("Upload request head too long\n");
+    return false;
+  }
+
+  // A kept-alive socket the server already closed fails here; retry fresh
+  t->upload = NULL;
+  for (int attempt = 0; attempt < 2 && !t->upload; attempt++)
+  {
+    WiFiClient *conn = sessionConnect();
+    if (!conn)
+    {
+      return false;
+    }
+    if (conn->write((const uint8_t *)t->head, len) == (size_t)len)
+    {
+      t->upload = conn;
+    }
+    else
+    {
+      sessionClose();
+    }
+  }
+  return t->upload != NULL;
+}
+
+static bool httpUploadWrite(const uint8_t *data, size_t len, void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  return t->upload && writeChunk(*t->upload, data, len);
+}
+
+static void httpUploadAbort(void *ctx)
+{
+  // Closing without the terminating chunk makes the server discard the body
+  HttpTransport *t = (HttpTransport *)ctx;
+  t->upload = NULL;
+  sessionClose();
+}
+
+static int httpUploadFinish(char *reply, size_t replyLen, void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  // Same socket the body went out on, a reconnect would lose the request
+  WiFiClient *client = t->upload;
+  t->upload = NULL;
+  if (!client || client->print("0\r\n\r\n") != 5)
+  {
+    sessionClose();
+    return -1;
+  }
+
+  bool reusable;
+  int code = readHttpResponse(*client, t->reply, HTTP_REPLY_LEN, reusable);
+  if (!reusable)
+  {
+    sessionClose();
+  }
+  if (reply && replyLen)
+  {
+    strlcpy(reply, t->reply, replyLen);
+  }
+  return code;
+}
+
+static int httpPollReady(uint32_t waitMs, void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  char wait[24];
+  snprintf(wait, sizeof(wait), "wait=%u&", (unsigned)waitMs);
+  const char *url = sessionUrl(t, t->readyUrl, wait);
+  int code;
+  HTTPClient *client = url ? sessionGet(url, waitMs + 5000, code) : NULL;
+  if (!client)
+  {
+    return -1;
+  }
+  int ready = -1;
+  if (code > 0)
+  {
+    readBody(client, t->reply, HTTP_REPLY_LEN);
+    ready = strstr(t->reply, "\"ready\":true") ? 1 : 0;
+    if (ready == 1)
+    {
+      strlcpy(t->audioHash, client->header("X-Audio-Hash").c_str(), sizeof(t->audioHash));
+    }
+  }
+  sessionEnd();
+  return ready;
+}
+
+static bool httpResponseKey(char *key, size_t len, void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  if (t->audioHash[0] == '\0' || strlen(t->audioHash) >= len)
+  {
+    return false;
+  }
+  strlcpy(key, t->audioHash, len);
+  return true;
+}
+
+static int httpResponseOpen(void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  const char *url = sessionUrl(t, t->responseUrl, "");
+  int code;
+  t->response = url ? sessionGet(url, HTTP_RESPONSE_TIMEOUT, code) : NULL;
+  if (!t->response)
+  {
+    return -1;
+  }
+  t->body = t->response->getStreamPtr();
+  t->remaining = t->response->getSize();
+  if (code != HTTP_CODE_OK)
+  {
+    LOG_E("HTTP GET failed, error: %s\n", HTTPClient::errorToString(code).c_str());
+  }
+  return code;
+}
+
+static int httpResponseRead(uint8_t *buf, size_t len, void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  if (t->remaining == 0)
+  {
+    return -1;
+  }
+  int available = t->body->available();
+  if (available <= 0)
+  {
+    return t->body->connected() ? 0 : -1;
+  }
+
+  size_t want = (size_t)available < len ? (size_t)available : len;
+  if (t->remaining > 0 && (size_t)t->remaining < want)
+  {
+    want = t->remaining;
+  }
+  int n = t->body->read(buf, want);
+  if (n <= 0)
+  {
+    return 0;
+  }
+  if (t->remaining > 0)
+  {
+    t->remaining -= n;
+  }
+  return n;
+}
+
+static void httpResponseClose(void *ctx)
+{
+  HttpTransport *t = (HttpTransport *)ctx;
+  if (!t->response)
+  {
+    return;
+  }
+  // A partly read body leaves the socket mid-response; it can't be reused
+  if (t->remaining != 0)
+  {
+    sessionClose();
+  }
+  sessionEnd();
+  t->response = NULL;
+  t->body = NULL;
+}
+
+void httpTransportInit(BackendTransport &transport, const String &uploadUrl, const String &readyUrl,
+                       const String &responseUrl, const String &deviceId)
+{
+  uint16_t port;
+  http.uploadUrl = uploadUrl;
+  http.uploadUrlValid = parseUrl(uploadUrl, http.uploadHost, port, http.uploadPath);
+  http.readyUrl = readyUrl;
+  http.responseUrl = responseUrl;
+  http.deviceId = deviceId;
+  if (!http.head)
+  {
+    http.head = (char *)poolAlloc(HTTP_HEAD_LEN, "HTTP head");
+  }
+  if (!http.reply)
+  {
+    http.reply = (char *)poolAlloc(HTTP_REPLY_LEN, "HTTP reply");
+  }
+  if (!http.bootId)
+  {
+    http.bootId = esp_random();
+  }
+  http.upload = NULL;
+  http.response = NULL;
+  http.body = NULL;
+  http.remaining = 0;
+
+  transport.uploadBegin = httpUploadBegin;
+  transport.uploadWrite = httpUploadWrite;
+  transport.uploadAbort = httpUploadAbort;
+  transport.uploadFinish = httpUploadFinish;
+  transport.pollReady = httpPollReady;
+  transport.responseKey = httpResponseKey;
+  transport.responseOpen = httpResponseOpen;
+  transport.responseRead = httpResponseRead;
+  transport.responseClose = httpResponseClose;
+  transport.ctx = &http;
+}
@@ -0,0 +1,163 @@
+#include "backend_session.h"
+#include "serial_log.h"
+
+static WiFiClient sessionClient;
+static HTTPClient sessionHttp;
+static String sessionHost;
+static uint16_t sessionPort = 80;
+static IPAddress sessionAddress;
+static bool sessionResolved = false;
+static SessionStats sessionStats;
+// Response headers kept for the caller after a request
+static const char *sessionHeaders[] = {"X-Audio-Hash"};
+
+bool parseUrl(const String &url, String &host, uint16_t &port, String &path)
+{
+  // Only plain http:// is supported, same as HTTPClient without a CA cert
+  if (!url.startsWith("http://"))
+  {
+    return false;
+  }
+  int hostStart = 7;
+  int pathStart = url.indexOf('/', hostStart);
+  if (pathStart < 0)
+  {
+    pathStart = url.length();
+  }
+  String hostPort = url.substring(hostStart, pathStart);
+  path = pathStart < (int)url.length() ? url.substring(pathStart) : String("/");
+
+  int colon = hostPort.indexOf(':');
+  if (colon >= 0)
+  {
+    host = hostPort.substring(0, colon);
+    port = hostPort.substring(colon + 1).toInt();
+  }
+  else
+  {
+    host = hostPort;
+    port = 80;
+  }
+  return host.length() > 0 && port != 0;
+}
+
+bool sessionSetBase(const String &baseUrl)
+{
+  String path;
+  sessionClose();
+  sessionResolved = false;
+  return parseUrl(baseUrl, sessionHost, sessionPort, path);
+}
+
+WiFiClient *sessionConnect()
+{
+  sessionStats.requests++;
+  if (sessionClient.connected())
+  {
+    sessionStats.reused++;
+    return &sessionClient;
+  }
+  sessionClient.stop();
+
+  unsigned long start = millis();
+  bool connected = false;
+
+  // Try the cached address first, re-resolve once if it has gone stale
+  for (int attempt = 0; attempt < 2 && !connected; attempt++)
+  {
+    if (!sessionResolved)
+    {
+      sessionStats.dnsLookups++;
+      if (!WiFi.hostByName(sessionHost.c_str(), sessionAddress))
+      {
+        break;
+      }
+      sessionResolved = true;
+    }
+    connected = sessionClient.connect(sessionAddress, sessionPort, SESSION_CONNECT_TIMEOUT);
+    if (!connected)
+    {
+      sessionResolved = false;
+    }
+  }
+
+  uint32_t elapsed = millis() - start;
+  sessionStats.connectMsTotal += elapsed;
+  if (elapsed > sessionStats.connectMsMax)
+  {
+    sessionStats.connectMsMax = elapsed;
+  }
+  if (!connected)
+  {
+    sessionStats.connectFailures++;
+    LOG_E("Backend connect failed: %s\n", sessionHost.c_str());
+    return NULL;
+  }
+  sessionStats.connects++;
+  sessionClient.setNoDelay(true);
+  return &sessionClient;
+}
+
+void sessionClose()
+{
+  sessionClient.stop();
+}
+
+HTTPClient *sessionBegin(const char *url)
+{
+  // Connecting here means HTTPClient finds the socket open and reuses it
+  if (!sessionConnect())
+  {
+    return NULL;
+  }
+  sessionHttp.setReuse(true);
+  if (!sessionHttp.begin(sessionClient, url))
+  {
+    return NULL;
+  }
+  sessionHttp.collectHeaders(sessionHeaders, sizeof(sessionHeaders) / sizeof(sessionHeaders[0]));
+  return &sessionHttp;
+}
+
+HTTPClient *sessionGet(const char *url, uint32_t timeoutMs, int &code)
+{
+  code = -1;
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    bool reusing = sessionClient.connected();
+    HTTPClient *http = sessionBegin(url);
+    if (!http)
+    {
+      return NULL;
+    }
+    http->setTimeout(timeoutMs);
+    code = http->GET();
+    if (code > 0 || !reusing)
+    {
+      return http;
+    }
+    // Stale keep-alive socket: drop it and go again on a fresh one
+    http->end();
+    sessionClose();
+  }
+  return &sessionHttp;
+}
+
+void sessionEnd()
+{
+  sessionHttp.end();
+}
+
+const SessionStats &sessionGetStats()
+{
+  return sessionStats;
+}
+
+void sessionPrintStats()
+{
+  uint32_t attempts = sessionStats.connects + sessionStats.connectFailures;
+  LOG_I("Session: %u requests, %u reused, %u connects (%u failed), %u DNS lookups, connect avg %u ms max %u ms\n",
+        sessionStats.requests, sessionStats.reused, sessionStats.connects, sessionStats.connectFailures,
+        sessionStats.dnsLookups, attempts ? sessionStats.connectMsTotal / attempts : 0,
+        sessionStats.connectMsMax);
+}
@@ -0,0 +1,177 @@
+#include "barge_in.h"
+
+#include <string.h>
+
+// Coupling training per frame: up by 1/4 of the gap, down by 1/16
+#define BARGE_RISE_SHIFT (2)
+#define BARGE_FALL_SHIFT (4)
+#define BARGE_COUPLING_MIN (16) // Q16, -36 dB
+
+void bargeDefaultConfig(BargeConfig &config, uint32_t sampleRate)
+{
+  config.sampleRate = sampleRate;
+  config.frameMs = 16;
+  config.echoDelayMs = 256;
+  config.echoSpreadMs = 80;
+  config.onsetFrames = 3;
+  config.marginQ8 = 4 * 256;
+  config.minEnergy = 20000;
+  config.couplingStartQ16 = 65536;
+}
+
+// Samples in one frame at rate, and the reference frames the echo of the
+// current mic frame can come from when the speaker runs at rate
+static void bargeSetRate(BargeDetector &det, uint32_t rate, uint32_t &frameLen)
+{
+  const BargeConfig &config = det.config;
+  frameLen = rate * config.frameMs / 1000;
+  if (frameLen == 0)
+  {
+    frameLen = 1;
+  }
+  uint32_t frameMs = config.frameMs ? config.frameMs : 1;
+  uint32_t delayMs = rate ? (uint32_t)((uint64_t)config.echoDelayMs * config.sampleRate / rate) : config.echoDelayMs;
+  uint32_t delay = (delayMs + frameMs / 2) / frameMs;
+  uint32_t spread = (config.echoSpreadMs + frameMs - 1) / frameMs;
+  det.windowFirst = delay > spread ? delay - spread : 0;
+  det.windowLast = delay + spread < BARGE_REF_FRAMES ? delay + spread : BARGE_REF_FRAMES - 1;
+  if (det.windowFirst > det.windowLast)
+  {
+    det.windowFirst = det.windowLast;
+  }
+}
+
+void bargeInit(BargeDetector &det, const BargeConfig &config)
+{
+  memset((void *)&det, 0, sizeof(det));
+  det.config = config;
+  bargeSetRate(det, config.sampleRate, det.frameLen);
+  det.refFrameLen = det.frameLen;
+  det.couplingQ16 = config.couplingStartQ16;
+  det.stats.couplingQ16 = det.couplingQ16;
+}
+
+void bargeReset(BargeDetector &det)
+{
+  for (int i = 0; i < BARGE_REF_FRAMES; i++)
+  {
+    det.refEnergy[i] = 0;
+  }
+  det.refFrames = 0;
+  det.refSumSq = 0;
+  det.refFill = 0;
+  bargeSetRate(det, det.config.sampleRate, det.refFrameLen);
+  det.sum = 0;
+  det.sumSq = 0;
+  det.fill = 0;
+  det.run = 0;
+}
+
+// The mic side may be reading the window meanwhile, but with no reference
+// frame written yet it finds only silence whichever bounds it sees
+void bargeSetReferenceRate(BargeDetector &det, uint32_t sampleRate)
+{
+  bargeSetRate(det, sampleRate, det.refFrameLen);
+}
+
+void bargeReference(BargeDetector &det, const int16_t *samples, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    det.refSumSq += (int32_t)samples[i] * samples[i];
+    if (++det.refFill == det.refFrameLen)
+    {
+      uint32_t frame = det.refFrames;
+      det.refEnergy[frame % BARGE_REF_FRAMES] = (uint32_t)(det.refSumSq / det.refFrameLen);
+      // Published after the energy, so the mic side never sees a stale slot
+      det.refFrames = frame + 1;
+      det.refSumSq = 0;
+      det.refFill = 0;
+    }
+  }
+}
+
+// Loudest reference frame the current mic frame can be hearing. Frames
+// before the first one written are silence.
+static uint32_t bargeEchoReference(const BargeDetector &det)
+{
+  uint32_t frames = det.refFrames;
+  uint32_t loudest = 0;
+  for (uint32_t back = det.windowFirst; back <= det.windowLast && back < frames; back++)
+  {
+    uint32_t energy = det.refEnergy[(frames - 1 - back) % BARGE_REF_FRAMES];
+    if (energy > loudest)
+    {
+      loudest = energy;
+    }
+  }
+  return loudest;
+}
+
+static bool bargeEndFrame(BargeDetector &det)
+{
+  int32_t mean = (int32_t)(det.sum / (int64_t)det.frameLen);
+  uint64_t meanSq = (uint64_t)((int64_t)mean * mean);
+  uint64_t avgSq = det.sumSq / det.frameLen;
+  uint32_t energy = avgSq > meanSq ? (uint32_t)(avgSq - meanSq) : 0;
+  det.stats.frames++;
+
+  uint32_t reference = bargeEchoReference(det);
+  uint64_t expected = ((uint64_t)reference * det.couplingQ16) >> 16;
+  bool nearEnd = energy >= det.config.minEnergy && (uint64_t)energy * 256 > expected * det.config.marginQ8;
+  if (nearEnd)
+  {
+    det.run++;
+    if (det.run == det.config.onsetFrames)
+    {
+      det.stats.detections++;
+      return true;
+    }
+    return false;
+  }
+  det.run = 0;
+
+  if (reference >= det.config.minEnergy)
+  {
+    det.stats.echoFrames++;
+    uint64_t wide = ((uint64_t)energy << 16) / reference;
+    uint32_t ratio = wide > UINT32_MAX / 2 ? UINT32_MAX / 2 : (uint32_t)wide;
+    if (ratio > det.couplingQ16 * 2)
+    {
+      // Possibly the user starting to talk: don't let it train the coupling
+    }
+    else if (ratio > det.couplingQ16)
+    {
+      det.couplingQ16 += (ratio - det.couplingQ16) >> BARGE_RISE_SHIFT;
+    }
+    else
+    {
+      det.couplingQ16 -= (det.couplingQ16 - ratio) >> BARGE_FALL_SHIFT;
+    }
+    if (det.couplingQ16 < BARGE_COUPLING_MIN)
+    {
+      det.couplingQ16 = BARGE_COUPLING_MIN;
+    }
+    det.stats.couplingQ16 = det.couplingQ16;
+  }
+  return false;
+}
+
+bool bargeProcess(BargeDetector &det, const int16_t *samples, size_t count)
+{
+  bool detected = false;
+  for (size_t i = 0; i < count; i++)
+  {
+    int32_t s = samples[i];
+    det.sum += s;
+    det.sumSq += (int64_t)s * s;
+    if (++det.fill == det.frameLen)
+    {
+      detected |= bargeEndFrame(det);
+      det.sum = 0;
+      det.sumSq = 0;
+      det.fill = 0;
+    }
+  }
+  return detected;
+}
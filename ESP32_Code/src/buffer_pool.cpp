@@ -0,0 +1,76 @@
+#include "buffer_pool.h"
+#include "serial_log.h"
+
+#include <Arduino.h>
+
+struct BufferPool
+{
+  uint8_t *base;
+  PoolStats stats;
+};
+
+static BufferPool pool;
+
+bool poolInit(size_t size)
+{
+  if (pool.base)
+  {
+    return true;
+  }
+  size_t wanted = size;
+  pool.base = (uint8_t *)poolReserve(size, pool.stats.external);
+  if (!pool.base)
+  {
+    LOG_E("Buffer pool: %u bytes not available\n", (unsigned)wanted);
+    return false;
+  }
+  pool.stats.size = size;
+  pool.stats.used = 0;
+  poolSampleHeap();
+  LOG_I("Buffer pool: %u/%u bytes in %s RAM\n", (unsigned)size, (unsigned)wanted,
+        pool.stats.external ? "external" : "internal");
+  return true;
+}
+
+void *poolAlloc(size_t len, const char *name)
+{
+  size_t start = (pool.stats.used + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+  if (pool.base && start + len <= pool.stats.size)
+  {
+    pool.stats.used = start + len;
+    return pool.base + start;
+  }
+
+  // Still works, but this buffer now lives in the general heap
+  pool.stats.fallbacks++;
+  LOG_I("Buffer pool: %s (%u bytes) from the heap, %u/%u used\n", name, (unsigned)len, pool.stats.used,
+        pool.stats.size);
+  return malloc(len);
+}
+
+void poolSampleHeap()
+{
+  pool.stats.heapFree = poolHeapFree();
+  pool.stats.heapLargest = poolHeapLargestBlock();
+  if (pool.stats.heapFreeMin == 0 || pool.stats.heapFree < pool.stats.heapFreeMin)
+  {
+    pool.stats.heapFreeMin = pool.stats.heapFree;
+  }
+  if (pool.stats.heapLargestMin == 0 || pool.stats.heapLargest < pool.stats.heapLargestMin)
+  {
+    pool.stats.heapLargestMin = pool.stats.heapLargest;
+  }
+}
+
+PoolStats poolGetStats()
+{
+  return pool.stats;
+}
+
+void poolPrintStats()
+{
+  const PoolStats &s = pool.stats;
+  LOG_I("Pool: %u/%u bytes%s, %u heap fallbacks; heap free %u (min %u), largest block %u (min %u)\n", s.used,
+        s.size, s.external ? " PSRAM" : "", s.fallbacks, s.heapFree, s.heapFreeMin, s.heapLargest,
+        s.heapLargestMin);
+}
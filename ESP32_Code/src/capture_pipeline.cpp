@@ -0,0 +1,301 @@
+#include "capture_pipeline.h"
+#include "audio_hal.h"
+#include "buffer_pool.h"
+#include "serial_log.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+
+// Shared state for one capture run. Only one capture runs at a time.
+struct CaptureSession
+{
+  CaptureConfig config;
+  CaptureStats *stats;
+  StreamBufferHandle_t ring;
+  SemaphoreHandle_t done; // Given by the consumer when finished and the reader on detach
+  size_t prerollWanted;   // Pre-roll bytes to push into the ring on attach
+  volatile bool stop;
+};
+
+// The consumer task and the buffers of a run, made once by captureBegin
+// and reused by every capture
+struct CaptureConsumer
+{
+  uint8_t *block;
+  StreamBufferHandle_t ring;
+  StaticStreamBuffer_t ringState;
+  TaskHandle_t task;      // Notified to start a run
+  SemaphoreHandle_t done;
+  CaptureSession *session;
+};
+
+// The always-on reader and the history it keeps between captures
+struct CaptureReader
+{
+  i2s_port_t port;
+  uint32_t sampleRate;
+  uint8_t *preroll;
+  size_t prerollSize;
+  size_t prerollHead; // Next write position
+  size_t prerollFill;
+  CaptureSession *session; // Capture being fed, NULL while idle
+  CaptureTap idleTap;
+  void *idleTapCtx;
+  SemaphoreHandle_t lock;  // Guards session, the idle tap and the pre-roll buffer
+  uint32_t lastReadUs;
+  volatile uint32_t gapUsMax; // Longest time between two reads returning
+  bool running;
+};
+
+static CaptureReader reader;
+static CaptureConsumer consumer;
+
+static void capturePrerollAppend(const uint8_t *data, size_t len)
+{
+  if (len >= reader.prerollSize)
+  {
+    data += len - reader.prerollSize;
+    len = reader.prerollSize;
+  }
+  size_t first = reader.prerollSize - reader.prerollHead;
+  if (first > len)
+  {
+    first = len;
+  }
+  memcpy(reader.preroll + reader.prerollHead, data, first);
+  memcpy(reader.preroll, data + first, len - first);
+  reader.prerollHead = (reader.prerollHead + len) % reader.prerollSize;
+  reader.prerollFill = reader.prerollFill + len > reader.prerollSize ? reader.prerollSize : reader.prerollFill + len;
+}
+
+// Hands the newest len bytes of history to the session ring, oldest first
+static void capturePrerollDrain(CaptureSession *session, size_t len)
+{
+  size_t start = (reader.prerollHead + reader.prerollSize - len) % reader.prerollSize;
+  size_t first = reader.prerollSize - start;
+  if (first > len)
+  {
+    first = len;
+  }
+  xStreamBufferSend(session->ring, reader.preroll + start, first, 0);
+  xStreamBufferSend(session->ring, reader.preroll, len - first, 0);
+  session->stats->bytesCaptured += len;
+  session->stats->prerollBytes = len;
+}
+
+static void captureReaderTask(void *arg)
+{
+  uint8_t *readBuff = (uint8_t *)arg;
+
+  while (true)
+  {
+    size_t bytes_read = audioRead(reader.port, readBuff, CAPTURE_READ_LEN);
+    if (bytes_read == 0)
+    {
+      continue;
+    }
+    uint32_t now = micros();
+    if (reader.lastReadUs && now - reader.lastReadUs > reader.gapUsMax)
+    {
+      reader.gapUsMax = now - reader.lastReadUs;
+    }
+    reader.lastReadUs = now;
+
+    xSemaphoreTake(reader.lock, portMAX_DELAY);
+    CaptureSession *session = reader.session;
+    if (session && session->stop)
+    {
+      // Consumer is done; history restarts here so it never spans a capture
+      reader.session = NULL;
+      reader.prerollFill = 0;
+      xSemaphoreGive(session->done);
+      session = NULL;
+    }
+    if (!session)
+    {
+      capturePrerollAppend(readBuff, bytes_read);
+      if (reader.idleTap)
+      {
+        reader.idleTap(readBuff, bytes_read, reader.idleTapCtx);
+      }
+      xSemaphoreGive(reader.lock);
+      continue;
+    }
+
+    if (session->prerollWanted)
+    {
+      capturePrerollDrain(session, session->prerollWanted);
+      session->prerollWanted = 0;
+    }
+    session->stats->bytesCaptured += bytes_read;
+
+    // Never block on a full ring: drop the block and count it, so I2S DMA
+    // keeps being drained no matter how slow the sink is.
+    if (xStreamBufferSpacesAvailable(session->ring) < bytes_read)
+    {
+      session->stats->overruns++;
+    }
+    else
+    {
+      xStreamBufferSend(session->ring, readBuff, bytes_read, 0);
+    }
+
+    uint32_t fill = xStreamBufferBytesAvailable(session->ring);
+    if (fill > session->stats->ringPeak)
+    {
+      session->stats->ringPeak = fill;
+    }
+    xSemaphoreGive(reader.lock);
+  }
+}
+
+static void captureConsume(CaptureSession *session)
+{
+  CaptureStats *stats = session->stats;
+  uint8_t *block = consumer.block;
+  // One reader period plus slack; an empty ring after this is an underrun
+  const TickType_t waitTicks = pdMS_TO_TICKS(100);
+
+  while (stats->bytesDelivered < session->config.maxBytes)
+  {
+    size_t len = xStreamBufferReceive(session->ring, block, CAPTURE_BLOCK_LEN, waitTicks);
+    if (len == 0)
+    {
+      stats->underruns++;
+      continue;
+    }
+    len &= ~(size_t)3; // Reader only sends whole 32-bit words
+
+    if (session->config.process)
+    {
+      len = session->config.process(block, block, len);
+    }
+    if (len > session->config.maxBytes - stats->bytesDelivered)
+    {
+      len = session->config.maxBytes - stats->bytesDelivered;
+    }
+    if (!session->config.sink(block, len, session->config.sinkCtx))
+    {
+      stats->stoppedEarly = true;
+      break;
+    }
+    stats->bytesDelivered += len;
+  }
+
+  session->stop = true;
+  xSemaphoreGive(session->done);
+}
+
+// Sleeps between captures; created once so a turn doesn't allocate a stack
+static void captureConsumerTask(void *arg)
+{
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    captureConsume(consumer.session);
+  }
+}
+
+bool captureBegin(i2s_port_t port, uint32_t sampleRate)
+{
+  if (reader.running)
+  {
+    return true;
+  }
+  reader.port = port;
+  reader.sampleRate = sampleRate;
+  reader.prerollSize = (size_t)CAPTURE_PREROLL_MS * sampleRate / 1000 * CAPTURE_SLOT_BYTES;
+  reader.preroll = (uint8_t *)poolAlloc(reader.prerollSize, "capture pre-roll");
+  reader.prerollHead = 0;
+  reader.prerollFill = 0;
+  reader.session = NULL;
+  reader.idleTap = NULL;
+  reader.lock = xSemaphoreCreateMutex();
+  uint8_t *readBuff = (uint8_t *)poolAlloc(CAPTURE_READ_LEN, "capture read");
+
+  // StreamBuffer storage needs one byte more than its capacity
+  uint8_t *ringStorage = (uint8_t *)poolAlloc(CAPTURE_RING_SIZE + 1, "capture ring");
+  consumer.block = (uint8_t *)poolAlloc(CAPTURE_BLOCK_LEN, "capture block");
+  consumer.ring = ringStorage ? xStreamBufferCreateStatic(CAPTURE_RING_SIZE, 1, ringStorage, &consumer.ringState) : NULL;
+  consumer.done = xSemaphoreCreateCounting(2, 0);
+  if (!reader.preroll || !reader.lock || !readBuff || !consumer.block || !consumer.ring || !consumer.done)
+  {
+    return false;
+  }
+  if (xTaskCreatePinnedToCore(captureConsumerTask, "capConsumer", CAPTURE_CONSUMER_STACK, NULL,
+                              CAPTURE_CONSUMER_PRIORITY, &consumer.task, CAPTURE_CONSUMER_CORE) != pdPASS)
+  {
+    return false;
+  }
+  reader.running = xTaskCreatePinnedToCore(captureReaderTask, "capReader", CAPTURE_READER_STACK, readBuff,
+                                           CAPTURE_READER_PRIORITY, NULL, CAPTURE_READER_CORE) == pdPASS;
+  return reader.running;
+}
+
+void captureSetIdleTap(CaptureTap tap, void *ctx)
+{
+  if (!reader.running)
+  {
+    return;
+  }
+  xSemaphoreTake(reader.lock, portMAX_DELAY);
+  reader.idleTap = tap;
+  reader.idleTapCtx = ctx;
+  xSemaphoreGive(reader.lock);
+}
+
+bool captureRun(const CaptureConfig &config, CaptureStats &stats)
+{
+  memset(&stats, 0, sizeof(stats));
+  if (!reader.running)
+  {
+    return false;
+  }
+
+  CaptureSession session;
+  session.config = config;
+  session.stats = &stats;
+  session.stop = false;
+  session.prerollWanted = 0;
+  session.ring = consumer.ring;
+  session.done = consumer.done;
+  xStreamBufferReset(session.ring);
+
+  consumer.session = &session;
+  xTaskNotifyGive(consumer.task);
+
+  // Attach to the reader, asking for the history back to startMs
+  xSemaphoreTake(reader.lock, portMAX_DELAY);
+  if (config.startMs)
+  {
+    uint32_t backMs = millis() - config.startMs;
+    size_t wanted = (size_t)backMs * reader.sampleRate / 1000 * CAPTURE_SLOT_BYTES;
+    session.prerollWanted = wanted < reader.prerollFill ? wanted : reader.prerollFill;
+  }
+  reader.session = &session;
+  xSemaphoreGive(reader.lock);
+
+  // Consumer done, then the reader letting go of the session
+  xSemaphoreTake(session.done, portMAX_DELAY);
+  xSemaphoreTake(session.done, portMAX_DELAY);
+  return true;
+}
+
+uint32_t captureReaderGapMax(bool reset)
+{
+  uint32_t gap = reader.gapUsMax;
+  if (reset)
+  {
+    reader.gapUsMax = 0;
+  }
+  return gap;
+}
+
+void capturePrintStats(const CaptureStats &stats)
+{
+  LOG_I("Capture: %u bytes read (%u pre-roll), %u delivered, %u overruns, %u underruns, ring peak %u/%u\n",
+        stats.bytesCaptured, stats.prerollBytes, stats.bytesDelivered, stats.overruns, stats.underruns,
+        stats.ringPeak, CAPTURE_RING_SIZE);
+}
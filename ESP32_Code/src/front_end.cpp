@@ -0,0 +1,396 @@
+#include "front_end.h"
+
+#include <math.h>
+#include <string.h>
+
+#define FRONT_END_DC_HZ (20)       // DC blocker corner
+#define FRONT_END_BIQUAD_BITS (14) // Q14 coefficients
+#define FRONT_END_GAIN_RELEASE (2) // Per-bin gain falls 1/4 of the way per frame
+#define FRONT_END_NOISE_LIKE (3)   // Bin power under this x the estimate counts as noise
+#define FRONT_END_NOISE_SMOOTH (3) // ...and moves the estimate 1/8 of the way
+
+static inline int32_t saturate16(int32_t y, uint32_t *clipped)
+{
+  if (y > 32767)
+  {
+    if (clipped)
+      (*clipped)++;
+    return 32767;
+  }
+  if (y < -32768)
+  {
+    if (clipped)
+      (*clipped)++;
+    return -32768;
+  }
+  return y;
+}
+
+static int32_t toQ14(double c)
+{
+  return (int32_t)lround(c * (1 << FRONT_END_BIQUAD_BITS));
+}
+
+// ---- DC blocker: y = x - x[-1] + p * y[-1] ----
+
+static void dcRun(void *state, int16_t *samples, size_t count)
+{
+  DcBlocker *dc = (DcBlocker *)state;
+  int32_t x1 = dc->x1;
+  int64_t y1 = dc->y1;
+  for (size_t i = 0; i < count; i++)
+  {
+    int32_t x = samples[i];
+    y1 = (int64_t)(x - x1) * 32768 + ((dc->poleQ15 * y1) >> 15);
+    x1 = x;
+    samples[i] = (int16_t)saturate16((int32_t)((y1 + (1 << 14)) >> 15), NULL);
+  }
+  dc->x1 = x1;
+  dc->y1 = y1;
+}
+
+// ---- Biquad, direct form I with first-order error feedback ----
+
+static void biquadHighPass(Biquad &bq, uint32_t sampleRate, uint32_t hz)
+{
+  // RBJ cookbook, Q = 1/sqrt(2)
+  double w0 = 2 * M_PI * hz / sampleRate;
+  double alpha = sin(w0) / (2 * M_SQRT1_2);
+  double a0 = 1 + alpha;
+  memset(&bq, 0, sizeof(bq));
+  bq.b0 = toQ14((1 + cos(w0)) / 2 / a0);
+  bq.b1 = toQ14(-(1 + cos(w0)) / a0);
+  bq.b2 = bq.b0;
+  bq.a1 = toQ14(-2 * cos(w0) / a0);
+  bq.a2 = toQ14((1 - alpha) / a0);
+}
+
+static void biquadPreEmphasis(Biquad &bq, uint16_t coeffQ15)
+{
+  memset(&bq, 0, sizeof(bq));
+  bq.b0 = 1 << FRONT_END_BIQUAD_BITS;
+  bq.b1 = -(int32_t)(coeffQ15 >> (15 - FRONT_END_BIQUAD_BITS));
+}
+
+static void biquadRun(void *state, int16_t *samples, size_t count)
+{
+  Biquad *bq = (Biquad *)state;
+  int32_t x1 = bq->x1, x2 = bq->x2, y1 = bq->y1, y2 = bq->y2;
+  int32_t err = bq->err;
+  uint32_t clipped = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    int32_t x = samples[i];
+    int64_t acc = (int64_t)bq->b0 * x + (int64_t)bq->b1 * x1 + (int64_t)bq->b2 * x2 - (int64_t)bq->a1 * y1 -
+                  (int64_t)bq->a2 * y2 + err;
+    int32_t y = (int32_t)(acc >> FRONT_END_BIQUAD_BITS);
+    err = (int32_t)(acc - (int64_t)y * (1 << FRONT_END_BIQUAD_BITS));
+    y = saturate16(y, &clipped);
+    x2 = x1;
+    x1 = x;
+    y2 = y1;
+    y1 = y;
+    samples[i] = (int16_t)y;
+  }
+  bq->x1 = x1;
+  bq->x2 = x2;
+  bq->y1 = y1;
+  bq->y2 = y2;
+  bq->err = err;
+  bq->clipped += clipped;
+}
+
+// ---- Spectral subtraction ----
+
+static uint32_t isqrt32(uint32_t v)
+{
+  uint32_t root = 0;
+  uint32_t bit = 1u << 30;
+  while (bit > v)
+  {
+    bit >>= 2;
+  }
+  while (bit)
+  {
+    if (v >= root + bit)
+    {
+      v -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+    {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+// In-place radix-2 FFT. The forward transform is unscaled (|X| stays under
+// 2^23 for 16-bit input); the inverse halves every stage, which is the 1/N.
+static void denoiseFft(Denoiser &d, bool inverse)
+{
+  int32_t *re = d.re;
+  int32_t *im = d.im;
+  for (uint32_t i = 1, j = 0; i < FRONT_END_FFT_LEN; i++)
+  {
+    uint32_t bit = FRONT_END_FFT_LEN >> 1;
+    for (; j & bit; bit >>= 1)
+    {
+      j ^= bit;
+    }
+    j |= bit;
+    if (i < j)
+    {
+      int32_t t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+
+  int shift = inverse ? 1 : 0;
+  for (uint32_t half = 1, stride = FRONT_END_FFT_LEN / 2; half < FRONT_END_FFT_LEN; half <<= 1, stride >>= 1)
+  {
+    for (uint32_t k = 0; k < half; k++)
+    {
+      int32_t wr = d.cosTable[k * stride];
+      int32_t wi = inverse ? d.sinTable[k * stride] : -d.sinTable[k * stride];
+      for (uint32_t i = k; i < FRONT_END_FFT_LEN; i += half << 1)
+      {
+        uint32_t j = i + half;
+        int32_t tr = (int32_t)(((int64_t)wr * re[j] - (int64_t)wi * im[j]) >> 15);
+        int32_t ti = (int32_t)(((int64_t)wr * im[j] + (int64_t)wi * re[j]) >> 15);
+        re[j] = (re[i] - tr + shift) >> shift;
+        im[j] = (im[i] - ti + shift) >> shift;
+        re[i] = (re[i] + tr + shift) >> shift;
+        im[i] = (im[i] + ti + shift) >> shift;
+      }
+    }
+  }
+}
+
+// Suppression gain for one bin, Q15: power subtraction, then the floor and
+// a slow release so isolated bins don't flicker
+static uint32_t denoiseGain(Denoiser &d, uint32_t bin, uint64_t power)
+{
+  const FrontEndConfig &config = *d.config;
+  uint64_t &noise = d.noise[bin];
+  if (d.frames < config.noiseInitFrames)
+  {
+    noise = (noise * d.frames + power) / (d.frames + 1);
+  }
+  else if (power < noise * FRONT_END_NOISE_LIKE)
+  {
+    // Could be noise: average it in
+    if (power < noise)
+    {
+      noise -= (noise - power) >> FRONT_END_NOISE_SMOOTH;
+    }
+    else
+    {
+      noise += (power - noise) >> FRONT_END_NOISE_SMOOTH;
+    }
+  }
+  else
+  {
+    // Speech or a real rise in the noise; only the latter lasts
+    uint64_t step = (noise >> config.noiseRiseShift) + 1;
+    noise += power - noise < step ? power - noise : step;
+  }
+
+  uint64_t subtract = (noise * config.overSubtractQ8) >> 8;
+  uint32_t gain = 0;
+  if (power > subtract)
+  {
+    // Power gain in Q15, its square root is the amplitude gain
+    uint32_t powerGain = (uint32_t)(((power - subtract) << 15) / power);
+    gain = isqrt32(powerGain << 15);
+  }
+  if (gain < config.gainFloorQ15)
+  {
+    gain = config.gainFloorQ15;
+  }
+  uint32_t last = d.gain[bin];
+  if (gain < last)
+  {
+    gain = last - ((last - gain) >> FRONT_END_GAIN_RELEASE);
+  }
+  d.gain[bin] = (uint16_t)gain;
+  return gain;
+}
+
+static void denoiseFrame(Denoiser &d)
+{
+  for (uint32_t n = 0; n < FRONT_END_FFT_LEN; n++)
+  {
+    d.re[n] = ((int32_t)d.in[n] * d.window[n] + (1 << 14)) >> 15;
+    d.im[n] = 0;
+  }
+  denoiseFft(d, false);
+
+  for (uint32_t k = 0; k < FRONT_END_BINS; k++)
+  {
+    uint64_t power = (uint64_t)((int64_t)d.re[k] * d.re[k]) + (uint64_t)((int64_t)d.im[k] * d.im[k]);
+    int64_t gain = denoiseGain(d, k, power);
+    d.re[k] = (int32_t)((d.re[k] * gain) >> 15);
+    d.im[k] = (int32_t)((d.im[k] * gain) >> 15);
+    if (k > 0 && k < FRONT_END_FFT_LEN / 2)
+    {
+      uint32_t mirror = FRONT_END_FFT_LEN - k;
+      d.re[mirror] = (int32_t)((d.re[mirror] * gain) >> 15);
+      d.im[mirror] = (int32_t)((d.im[mirror] * gain) >> 15);
+    }
+  }
+  d.frames++;
+
+  denoiseFft(d, true);
+  for (uint32_t n = 0; n < FRONT_END_HOP; n++)
+  {
+    int32_t head = (int32_t)(((int64_t)d.re[n] * d.window[n] + (1 << 14)) >> 15);
+    d.out[n] = (int16_t)saturate16(d.tail[n] + head, NULL);
+    d.tail[n] = (int32_t)(((int64_t)d.re[n + FRONT_END_HOP] * d.window[n + FRONT_END_HOP] + (1 << 14)) >> 15);
+  }
+  memmove(d.in, d.in + FRONT_END_HOP, FRONT_END_HOP * sizeof(d.in[0]));
+}
+
+static void denoiseRun(void *state, int16_t *samples, size_t count)
+{
+  Denoiser *d = (Denoiser *)state;
+  for (size_t i = 0; i < count; i++)
+  {
+    d->in[FRONT_END_HOP + d->fill] = samples[i];
+    samples[i] = d->out[d->fill];
+    if (++d->fill == FRONT_END_HOP)
+    {
+      denoiseFrame(*d);
+      d->fill = 0;
+    }
+  }
+}
+
+static void denoiseInit(Denoiser &d, const FrontEndConfig *config)
+{
+  memset(&d, 0, sizeof(d));
+  d.config = config;
+  for (uint32_t n = 0; n < FRONT_END_FFT_LEN; n++)
+  {
+    // sin is the square root of a periodic Hann; analysis times synthesis
+    // at 50% overlap sums to one
+    d.window[n] = (int16_t)lround(32767 * sin(M_PI * n / FRONT_END_FFT_LEN));
+  }
+  for (uint32_t k = 0; k < FRONT_END_FFT_LEN / 2; k++)
+  {
+    d.cosTable[k] = (int16_t)lround(32767 * cos(2 * M_PI * k / FRONT_END_FFT_LEN));
+    d.sinTable[k] = (int16_t)lround(32767 * sin(2 * M_PI * k / FRONT_END_FFT_LEN));
+  }
+  for (uint32_t k = 0; k < FRONT_END_BINS; k++)
+  {
+    d.gain[k] = 32767;
+  }
+}
+
+// ---- Chain ----
+
+void frontEndDefaultConfig(FrontEndConfig &config, uint32_t sampleRate)
+{
+  config.sampleRate = sampleRate;
+  config.dcBlock = true;
+  config.highPassHz = 80;
+  config.preEmphasisQ15 = 0;
+  config.denoise = true;
+  config.overSubtractQ8 = 2 * 256;
+  config.gainFloorQ15 = 5827; // -15 dB
+  config.noiseInitFrames = 12; // ~100 ms, inside the pre-roll
+  config.noiseRiseShift = 7;   // ~4 dB/s at 125 frames/s
+  config.clock = NULL;
+}
+
+static void frontEndAddStage(FrontEnd &fe, const char *name, FrontEndStageRun run, void *state)
+{
+  FrontEndStage &stage = fe.stages[fe.stageCount++];
+  stage.name = name;
+  stage.run = run;
+  stage.state = state;
+}
+
+void frontEndInit(FrontEnd &fe, const FrontEndConfig &config)
+{
+  memset(&fe, 0, sizeof(fe));
+  fe.config = config;
+  if (config.dcBlock)
+  {
+    fe.dc.poleQ15 = 32768 - (int32_t)lround(2 * M_PI * FRONT_END_DC_HZ / config.sampleRate * 32768);
+    frontEndAddStage(fe, "dc", dcRun, &fe.dc);
+  }
+  if (config.highPassHz)
+  {
+    biquadHighPass(fe.highPass, config.sampleRate, config.highPassHz);
+    frontEndAddStage(fe, "highpass", biquadRun, &fe.highPass);
+  }
+  if (config.preEmphasisQ15)
+  {
+    biquadPreEmphasis(fe.preEmphasis, config.preEmphasisQ15);
+    frontEndAddStage(fe, "preemph", biquadRun, &fe.preEmphasis);
+  }
+  if (config.denoise)
+  {
+    denoiseInit(fe.denoiser, &fe.config);
+    frontEndAddStage(fe, "denoise", denoiseRun, &fe.denoiser);
+  }
+}
+
+void frontEndReset(FrontEnd &fe)
+{
+  fe.dc.x1 = 0;
+  fe.dc.y1 = 0;
+  Biquad *filters[] = {&fe.highPass, &fe.preEmphasis};
+  for (Biquad *bq : filters)
+  {
+    bq->x1 = bq->x2 = bq->y1 = bq->y2 = 0;
+    bq->err = 0;
+  }
+  // The denoiser's frames are left alone: zeroed, the first 16 ms of the
+  // capture would come out silent and the VAD would calibrate its noise
+  // floor on them. Its output starts with the end of the last capture
+  // instead, which is room noise too.
+}
+
+void frontEndRun(FrontEnd &fe, int16_t *samples, size_t count)
+{
+  for (int i = 0; i < fe.stageCount; i++)
+  {
+    FrontEndStage &stage = fe.stages[i];
+    uint32_t start = fe.config.clock ? fe.config.clock() : 0;
+    stage.run(stage.state, samples, count);
+    if (fe.config.clock)
+    {
+      uint32_t ticks = fe.config.clock() - start;
+      stage.ticks += ticks;
+      if (ticks > stage.ticksMax)
+      {
+        stage.ticksMax = ticks;
+      }
+    }
+  }
+  fe.blocks++;
+  fe.samples += count;
+}
+
+uint32_t frontEndLatency(const FrontEnd &fe)
+{
+  return fe.config.denoise ? FRONT_END_FFT_LEN : 0;
+}
+
+void frontEndResetStats(FrontEnd &fe)
+{
+  for (int i = 0; i < fe.stageCount; i++)
+  {
+    fe.stages[i].ticks = 0;
+    fe.stages[i].ticksMax = 0;
+  }
+  fe.blocks = 0;
+  fe.samples = 0;
+}
@@ -0,0 +1,215 @@
+#include "jitter_bench.h"
+
+#include <HTTPClient.h>
+#include <freertos/task.h>
+#include "backend_session.h"
+#include "capture_pipeline.h"
+#include "task_layout.h"
+#include "serial_log.h"
+
+struct JitterProbe
+{
+  volatile bool stop;
+  TaskHandle_t owner; // Notified when the probe has finished
+  uint32_t lateUsMax;
+  uint64_t lateUsTotal;
+  uint32_t wakes;
+};
+
+struct JitterLoad
+{
+  const BackendTransport *transport;
+  uint32_t uploadBytes;
+  const String *downloadUrl;
+  uint32_t downloadBytes;
+  bool upload; // Else download
+  uint32_t bytes;
+  uint32_t elapsedMs;
+  bool ok;
+  TaskHandle_t owner;
+};
+
+static uint8_t benchBlock[JITTER_BENCH_BLOCK];
+
+static void probeTask(void *arg)
+{
+  JitterProbe *probe = (JitterProbe *)arg;
+  TickType_t wake = xTaskGetTickCount();
+  // Aligned to a tick so the first sample isn't counted late
+  vTaskDelayUntil(&wake, 1);
+  uint32_t expected = micros();
+  while (!probe->stop)
+  {
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(JITTER_BENCH_PERIOD_US / 1000));
+    expected += JITTER_BENCH_PERIOD_US;
+    int32_t late = (int32_t)(micros() - expected);
+    if (late < 0)
+    {
+      late = 0;
+    }
+    if ((uint32_t)late > probe->lateUsMax)
+    {
+      probe->lateUsMax = late;
+    }
+    probe->lateUsTotal += late;
+    probe->wakes++;
+    if (late > 10 * JITTER_BENCH_PERIOD_US)
+    {
+      // Missed several ticks; the next deadlines are relative to now
+      wake = xTaskGetTickCount();
+      expected = micros();
+    }
+  }
+  xTaskNotifyGive(probe->owner);
+  vTaskDelete(NULL);
+}
+
+static bool loadUpload(JitterLoad &load)
+{
+  const BackendTransport &t = *load.transport;
+  if (!t.uploadBegin(AUDIO_ENCODING_PCM, 16000, t.ctx))
+  {
+    return false;
+  }
+  while (load.bytes < load.uploadBytes)
+  {
+    if (!t.uploadWrite(benchBlock, sizeof(benchBlock), t.ctx))
+    {
+      t.uploadAbort(t.ctx);
+      return false;
+    }
+    load.bytes += sizeof(benchBlock);
+  }
+  t.uploadAbort(t.ctx);
+  return true;
+}
+
+static bool loadDownload(JitterLoad &load)
+{
+  while (load.bytes < load.downloadBytes)
+  {
+    int code;
+    HTTPClient *client = sessionGet(load.downloadUrl->c_str(), 5000, code);
+    if (!client || code != HTTP_CODE_OK)
+    {
+      sessionEnd();
+      return false;
+    }
+    WiFiClient *body = client->getStreamPtr();
+    int remaining = client->getSize();
+    uint32_t got = 0;
+    unsigned long lastData = millis();
+    while (remaining != 0 && millis() - lastData < 5000)
+    {
+      int n = body->read(benchBlock, sizeof(benchBlock));
+      if (n > 0)
+      {
+        got += n;
+        remaining -= remaining > 0 ? n : 0;
+        lastData = millis();
+      }
+      else if (!body->connected())
+      {
+        break;
+      }
+      else
+      {
+        delay(1);
+      }
+    }
+    sessionEnd();
+    if (got == 0)
+    {
+      return false;
+    }
+    load.bytes += got;
+  }
+  return true;
+}
+
+static void loadTask(void *arg)
+{
+  JitterLoad *load = (JitterLoad *)arg;
+  uint32_t start = millis();
+  load->ok = load->upload ? loadUpload(*load) : loadDownload(*load);
+  load->elapsedMs = millis() - start;
+  xTaskNotifyGive(load->owner);
+  vTaskDelete(NULL);
+}
+
+static void probeStart(JitterProbe &probe, const char *name, BaseType_t core)
+{
+  memset(&probe, 0, sizeof(probe));
+  probe.owner = xTaskGetCurrentTaskHandle();
+  xTaskCreatePinnedToCore(probeTask, name, JITTER_BENCH_STACK, &probe, TASK_PRIORITY_AUDIO_IO, NULL, core);
+}
+
+static void probePrint(const char *core, const JitterProbe &probe)
+{
+  LOG_I("    %-6s late max %6u us  avg %4u us  (%u wake-ups)\n", core, probe.lateUsMax,
+        probe.wakes ? (uint32_t)(probe.lateUsTotal / probe.wakes) : 0, probe.wakes);
+}
+
+// One phase: both probes run while load (NULL for idle) does its transfer
+static void benchPhase(const char *name, JitterLoad *load)
+{
+  JitterProbe audio, net;
+  captureReaderGapMax(true);
+  probeStart(audio, "jitAudio", TASK_CORE_AUDIO);
+  probeStart(net, "jitNet", TASK_CORE_NET);
+
+  if (load)
+  {
+    load->owner = xTaskGetCurrentTaskHandle();
+    xTaskCreatePinnedToCore(loadTask, "jitLoad", JITTER_BENCH_STACK, load, TASK_PRIORITY_NET, NULL,
+                            TASK_CORE_NET);
+    ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+  }
+  else
+  {
+    vTaskDelay(pdMS_TO_TICKS(JITTER_BENCH_IDLE_MS));
+  }
+
+  audio.stop = true;
+  net.stop = true;
+  ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+  ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+
+  if (load)
+  {
+    LOG_I("  %s: %u KB in %u ms (%u KB/s)%s\n", name, load->bytes / 1024, load->elapsedMs,
+          load->elapsedMs ? load->bytes / load->elapsedMs * 1000 / 1024 : 0, load->ok ? "" : ", failed");
+  }
+  else
+  {
+    LOG_I("  %s: %u ms\n", name, JITTER_BENCH_IDLE_MS);
+  }
+  probePrint("audio", audio);
+  probePrint("net", net);
+  LOG_I("    I2S read gap max %u us\n", captureReaderGapMax(false));
+}
+
+void jitterBenchRun(const BackendTransport &transport, uint32_t uploadBytes, const String &downloadUrl,
+                    uint32_t downloadBytes)
+{
+  for (size_t i = 0; i < sizeof(benchBlock); i++)
+  {
+    benchBlock[i] = (uint8_t)(i * 13);
+  }
+  LOG_I("Jitter benchmark: %u us period, probes at priority %d on cores %d (audio) and %d (net)\n",
+        JITTER_BENCH_PERIOD_US, TASK_PRIORITY_AUDIO_IO, TASK_CORE_AUDIO, TASK_CORE_NET);
+
+  benchPhase("idle", NULL);
+
+  JitterLoad load = {};
+  load.transport = &transport;
+  load.uploadBytes = uploadBytes;
+  load.downloadUrl = &downloadUrl;
+  load.downloadBytes = downloadBytes;
+  load.upload = true;
+  benchPhase("upload", &load);
+
+  load.bytes = 0;
+  load.upload = false;
+  benchPhase("download", &load);
+}
@@ -5,7 +5,29 @@
 #include <HTTPClient.h>
 #include <WebServer.h>
 #include <DNSServer.h>
+#include <freertos/queue.h>
+#include <freertos/stream_buffer.h>
 #include "config.h"
+#include "sample_convert.h"
+#include "audio_codec.h"
+#include "voice_turn.h"
+#include "backend_session.h"
+#include "backend_http.h"
+#include "metrics.h"
+#include "response_cache.h"
+#include "wake_word.h"
+#include "audio_log.h"
+#include "audio_log_flash.h"
+#include "storage_bench.h"
+#include "buffer_pool.h"
+#include "utterance_queue.h"
+#include "wifi_link.h"
+#include "task_layout.h"
+#include "jitter_bench.h"
+#include "barge_in.h"
+#include "front_end.h"
+#include "audio_format.h"
+#include "serial_log.h"
 
 // INMP441 Ports
 #define I2S_WS 5   // LRC
@@ -35,11 +57,9 @@ const byte DNS_PORT = 53;
 IPAddress apIP(192, 168, 4, 1);
 DNSServer dnsServer;
 WebServer webServer(80);
+WebServer metricsServer(METRICS_PORT);
 
-// Configuration variables
-String configSSID = "";
-String configPassword = "";
-String configServerIP = "";
+// Set when the config portal has stored new credentials
 bool configComplete = false;
 
 unsigned long lastButtonPressTime = 0;
@@ -48,57 +68,285 @@ volatile bool workflowInProgress = false;
 
 // MAX98357A I2S Setup
 #define MAX_I2S_NUM I2S_NUM_1
-#define MAX_I2S_SAMPLE_BITS (16)
 #define MAX_I2S_READ_LEN (256)
-#define MAX_I2S_SAMPLE_RATE (16000) // Changed from 12000 to match recording rate
 // INMP441 I2S Setup
 #define I2S_PORT I2S_NUM_0
-#define I2S_SAMPLE_RATE (16000)
-#define I2S_SAMPLE_BITS (16)
-#define I2S_READ_LEN (16 * 1024)
+
+// Audio formats (audio_format.h), the one place rates and widths are set.
+// The INMP441 sends 24-bit samples in 32-bit slots; the converter turns
+// them into the 16-bit PCM that is endpointed, encoded and uploaded. The
+// speaker runs at SpeakerFormat between responses.
+typedef AudioFormat<16000, 32> MicSlotFormat;
+typedef AudioFormat<MicSlotFormat::sampleRate, 16> CaptureFormat;
+typedef AudioFormat<16000, 16> SpeakerFormat;
+static_assert(MicSlotFormat::blockAlign == CAPTURE_SLOT_BYTES, "The capture pipeline reads one 32-bit slot per sample");
+static_assert(CaptureFormat::bitsPerSample == 16 && CaptureFormat::channels == 1,
+              "The VAD, front end and encoders take 16-bit mono");
+static_assert(SpeakerFormat::bitsPerSample == 16 && SpeakerFormat::channels == 1, "Playback writes 16-bit mono");
+#define MIC_GAIN_Q8 (4 * CONVERT_GAIN_UNITY) // +12 dB, speech sits low on the INMP441
+#define MIC_AGC (1)
+// Front end on the converted capture blocks, ahead of the VAD and the
+// encoder (front_end.h): DC blocker, high-pass and spectral-subtraction
+// noise suppression. Its cost per block is printed after each capture.
+#define USE_FRONT_END (1)
+#define FRONT_END_HIGHPASS_HZ (80) // 0 = off; male voices start around 85 Hz
+#define FRONT_END_PREEMPHASIS (0)  // Q15 coefficient, 0 = off
+#define FRONT_END_DENOISE (1)
 #define RECORD_TIME (5) // Seconds
-#define I2S_CHANNEL_NUM (1)
-#define FLASH_RECORD_SIZE (I2S_CHANNEL_NUM * I2S_SAMPLE_RATE * I2S_SAMPLE_BITS / 8 * RECORD_TIME)
+#define FLASH_RECORD_SIZE (CaptureFormat::bytesForSeconds(RECORD_TIME))
+
+// Streaming upload: send I2S frames to /uploadAudio as they are captured
+// (HTTP chunked transfer) instead of staging the recording on flash.
+// The audio log path is kept as a fallback when the server can't be reached.
+#define STREAM_UPLOAD (1)
+
+// Voice-activity endpointing: recording starts at speech onset and stops
+// after trailing silence instead of running the fixed RECORD_TIME window.
+// MAX_RECORD_TIME is the hard cap for long questions.
+#define USE_VAD (1)
+#define VAD_TRAILING_SILENCE_MS (800)
+#define VAD_NO_SPEECH_TIMEOUT_MS (4000)
+#define MAX_RECORD_TIME (15) // Seconds
+#define MAX_RECORD_SIZE (CaptureFormat::bytesForSeconds(MAX_RECORD_TIME))
+#if USE_VAD
+#define CAPTURE_LIMIT MAX_RECORD_SIZE
+#else
+#define CAPTURE_LIMIT FLASH_RECORD_SIZE
+#endif
 
-File file;
-const char audioRecordfile[] = "/recording.wav";
-const char audioResponsefile[] = "/voicedby.wav";
-const int headerSize = 44;
+// Upload encoding: AUDIO_ENCODING_PCM (WAV), AUDIO_ENCODING_IMA_ADPCM (4:1)
+// or AUDIO_ENCODING_MULAW (2:1). Encoded uploads are sent without a WAV
+// header and announced in X-Audio-Encoding; the backend decodes them.
+#define UPLOAD_ENCODING AUDIO_ENCODING_IMA_ADPCM
+const bool uploadWavHeader = UPLOAD_ENCODING == AUDIO_ENCODING_PCM;
+#define UPLOAD_READ_CHUNK (1024) // Audio log bytes per write of a fallback upload
+
+// Readiness long-poll: /checkVariable?wait=<ms> is held open by the backend
+// until the TTS file is ready, so playback starts as soon as it exists.
+#define RESPONSE_WAIT_TIMEOUT (30000) // ms, total time to wait for the response
+#define LONG_POLL_WAIT (20000)        // ms the server may hold one request
+#define POLL_RETRY_DELAY (500)        // ms between retries when the server answers at once
+
+// Playback pre-buffer before the speaker starts (and after an underrun)
+#define PLAYBACK_PREBUFFER_MS (250)
+
+// Buffer pool for the capture and playback engines and the HTTP request
+// heads and replies, reserved at boot so turns don't allocate (see
+// buffer_pool.h)
+#define AUDIO_POOL_SIZE (128 * 1024)
+
+// Workflow task running the blocking stages of a turn, next to the network
+// stack; the audio tasks have the other core (task_layout.h)
+#define WORKFLOW_TASK_STACK (8192)
+#define WORKFLOW_TASK_PRIORITY TASK_PRIORITY_CONTROL
+#define WORKFLOW_TASK_CORE TASK_CORE_NET
+// Between the stages of a turn the audio log erase waits; checked this often
+#define WORKFLOW_PREPARE_POLL_MS (50)
+
+// JITTER_BENCH measures audio task jitter at boot while a large upload and
+// downloads of the offline clip run on the network core (serial output)
+#define JITTER_BENCH (0)
+#define JITTER_BENCH_BYTES (512 * 1024)
+
+// Wi-Fi connects in the background from the top of setup() (wifi_link.h:
+// credentials and last AP in NVS, no scan when the AP is known). Setup
+// waits up to WIFI_BOOT_WAIT for it when the credentials have worked
+// before, then carries on offline; new credentials get a full scan before
+// the config portal opens. Holding the button at power-on opens the portal.
+#define WIFI_BOOT_WAIT (4000)
+
+// Wake word as a second trigger next to the button. Runs on the idle mic
+// stream; templates come from WAKE_TEMPLATE_FILE on SPIFFS (built with the
+// wake_eval tool from recordings of the keyword). Without the file only the
+// button starts a turn. Tune WAKE_THRESHOLD with wake_eval --corpus.
+#define USE_WAKE_WORD (1)
+#define WAKE_TEMPLATE_FILE "/wake.bin"
+#define WAKE_THRESHOLD (0.7f)
+#define WAKE_BUFFER_SIZE (4096) // int16 samples from the capture reader (128 ms)
+#define WAKE_TASK_STACK (4096)
+#define WAKE_TASK_PRIORITY TASK_PRIORITY_AUDIO_DSP
+#define WAKE_TASK_CORE TASK_CORE_AUDIO
+
+// Barge-in: the mic keeps running while a response plays, and a button
+// press or the user talking over the answer cuts it short (download
+// closed, DMA silenced) and starts the next turn. The speaker's own voice
+// is kept from triggering it by barge_in.h, with the playback as the
+// reference. A spoken barge-in starts the capture BARGE_ONSET_LEAD_MS
+// before the detection, back in the pre-roll where the words began.
+#define USE_BARGE_IN (1)
+#define BARGE_ONSET_LEAD_MS (250)
+
+// Response cache on SPIFFS: responses the backend tags with X-Audio-Hash
+// are kept (LRU within the budget) and replayed without a download. The
+// fallback clips are played when the backend times out or can't be
+// reached; missing ones are fetched from /fallbackAudio once at boot.
+#define RESPONSE_CACHE_BUDGET (384 * 1024)
+#define FALLBACK_CLIP_TIMEOUT "timeout"
+#define FALLBACK_CLIP_OFFLINE "offline"
+const char *const fallbackClips[] = {FALLBACK_CLIP_TIMEOUT, FALLBACK_CLIP_OFFLINE};
+
+// Fallback recordings go to the raw "audiolog" partition (partitions.csv)
+// rather than SPIFFS. Flash for the next recording is erased while the
+// device is idle, so appends from the capture consumer never wait on an
+// erase. STORAGE_BENCH compares both at boot (serial output).
+#define STORAGE_BENCH (0)
+#define STORAGE_BENCH_BYTES (256 * 1024)
+
+// Offline queue: without Wi-Fi (or while older utterances still wait) a
+// button press records to the audio log instead of being dropped. Queued
+// utterances are uploaded oldest first once the backend answers, with
+// exponential backoff between failed attempts (see utterance_queue.h).
+#define USE_OFFLINE_QUEUE (1)
+
+AudioLog audioLog;
+bool audioLogReady = false;
+bool audioLogPrepareDue = false; // Flash ahead of the log head to erase, workflow task only
+AudioLogRecord pendingRecord;
 unsigned long startMicros;
+bool lastCaptureHadSpeech = true;
+SampleConverter micConverter;
+FrontEnd micFrontEnd;
+BackendTransport httpBackend; // HTTP to the backend, set up in updateServerUrls()
+BackendTransport backend;     // httpBackend behind the response cache
+TurnResult turnResult;
 
 bool isWIFIConnected = false;
 volatile bool buttonPressed = false;
+WakeDetector wakeDetector;
+StreamBufferHandle_t wakeBuffer;
+volatile bool wakeStale = false; // Set when a turn starts, the stream had a gap
+BargeDetector bargeDetector;
+volatile bool bargeArmed = false;     // A response is playing and may be interrupted
+volatile bool bargeRequested = false; // Cancels the playing response (TurnConfig.cancel)
+volatile unsigned long bargeRequestMs;
+
+// A turn is an explicit state machine. loop() hands each stage to the
+// workflow task and reacts to its completion event, so button and Wi-Fi
+// handling keep running while a stage is in flight.
+enum WorkflowState
+{
+  WF_IDLE,
+  WF_CAPTURING,
+  WF_UPLOADING,
+  WF_AWAITING_RESPONSE,
+  WF_PLAYING,
+  WF_QUEUEING, // Recording to the offline queue
+  WF_DRAINING  // Uploading a queued utterance and playing its response
+};
+const char *const workflowStateNames[] = {"Idle", "Capturing", "Uploading", "AwaitingResponse", "Playing",
+                                          "Queueing", "Draining"};
+// Latency budget per state in ms, logged when exceeded (Idle has none)
+const uint32_t workflowBudgetMs[] = {0, MAX_RECORD_TIME * 1000 + 1000, 3000, RESPONSE_WAIT_TIMEOUT, 60000,
+                                     MAX_RECORD_TIME * 1000 + 10000, 3000 + RESPONSE_WAIT_TIMEOUT + 60000};
+// Histogram each state's duration feeds (Idle is unused, METRIC_STAGE_COUNT
+// for none)
+const MetricStage workflowMetric[] = {METRIC_TURN,     METRIC_CAPTURE,     METRIC_UPLOAD, METRIC_SERVER_WAIT,
+                                      METRIC_PLAYBACK, METRIC_STAGE_COUNT, METRIC_DRAIN};
+
+struct WorkflowEvent
+{
+  WorkflowState stage;
+  bool ok;
+};
+
+WorkflowState workflowState = WF_IDLE;
+QueueHandle_t workflowCommands;
+QueueHandle_t workflowEvents;
+unsigned long turnStart;
+unsigned long stageStart;
+bool stageOverBudget;
+
+// How the captured utterance still has to be uploaded
+enum PendingUpload
+{
+  UPLOAD_NONE,
+  UPLOAD_STREAM, // Chunked request open on the session socket
+  UPLOAD_LOG     // Recording staged in pendingRecord
+};
+PendingUpload pendingUpload = UPLOAD_NONE;
 
 // Dynamic server URLs that will be updated based on configuration
 String serverUploadUrl;
 String serverBroadcastUrl;
 String broadcastPermitionUrl;
+String fallbackAudioUrl;
 
 // Function prototypes
 void SPIFFSInit();
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 void listSPIFFS(void);
+void printSpaceInfo();
+#endif
 void i2sInitINMP441();
 void i2sInitMax98357A();
-void wavHeader(byte *header, int wavSize);
-void I2SAudioRecord_dataScale(uint8_t *d_buff, uint8_t *s_buff, uint32_t len);
-void printSpaceInfo();
-bool connectToWifi();
+uint32_t I2SAudioRecord_dataScale(uint8_t *d_buff, uint8_t *s_buff, uint32_t len);
 void buttonInterrupt();
-void handleVoiceAssistantWorkflow();
-void recordAudio();
-void uploadFile();
-void waitForResponseAndPlay();
+void workflowTask(void *arg);
+void workflowPoll();
+void workflowEnter(WorkflowState next);
+bool runStage(WorkflowState stage);
+bool stageCapture();
+bool stageUpload();
+bool stagePlay();
+bool stageQueue();
+bool stageDrain();
+void maintainWifi();
+bool wakeWordInit();
+void micTap(const uint8_t *data, size_t len, void *ctx);
+void speakerTap(const uint8_t *data, size_t len, void *ctx);
+void speakerRateSet(uint32_t sampleRate);
+void bargeInterrupt(unsigned long pressMs);
+void wakeTask(void *arg);
+uint32_t recordAudio();
+uint32_t frontEndCycles();
+void printFrontEndStats();
+bool uploadFile();
+bool streamCapture();
+bool streamFinishUpload();
+bool logSink(const uint8_t *data, size_t len, void *ctx);
+void audioLogSetup();
+bool runCapture(CaptureSink sink, void *sinkCtx);
+bool waitForResponse();
+bool playResponse();
+bool playFallback(const char *clip);
+void fetchFallbackClips();
 void startConfigPortal();
 void handleRoot();
 void handleSave();
 void handleNotFound();
+void handleMetrics();
 void updateServerUrls();
-bool tryHardcodedWifi();
+String deviceId();
+
+const TurnConfig turnConfig = {
+    I2S_PORT,
+    MAX_I2S_NUM,
+    SpeakerFormat::sampleRate,
+    CaptureFormat::sampleRate,
+    CAPTURE_LIMIT,
+    I2SAudioRecord_dataScale,
+    USE_VAD,
+    VAD_TRAILING_SILENCE_MS,
+    VAD_NO_SPEECH_TIMEOUT_MS,
+    UPLOAD_ENCODING,
+    RESPONSE_WAIT_TIMEOUT,
+    LONG_POLL_WAIT,
+    POLL_RETRY_DELAY,
+    SpeakerFormat::bytesForMs(PLAYBACK_PREBUFFER_MS),
+    &bargeRequested,
+    speakerRateSet};
 
 void setup()
 {
   Serial.begin(115200);
-  delay(500);
+  logBegin();
+
+  // Audio and network buffers, before Wi-Fi takes its share of the heap
+  poolInit(AUDIO_POOL_SIZE);
+
+  // Wi-Fi associates while the rest of setup runs
+  wifiLinkInit(WIFI_SSID, WIFI_PASSWORD);
+  wifiLinkBegin();
 
   // Set up LEDs
   pinMode(isWifiConnectedPin, OUTPUT);
@@ -111,42 +359,111 @@ void setup()
 
   // Set up button with interrupt
   pinMode(Button_Pin, INPUT_PULLUP);
+  bool portalRequested = digitalRead(Button_Pin) == LOW;
   attachInterrupt(digitalPinToInterrupt(Button_Pin), buttonInterrupt, FALLING);
 
   // Initialize SPIFFS
   SPIFFSInit();
+  cacheInit(SPIFFS, RESPONSE_CACHE_BUDGET);
+  audioLogSetup();
 
   // Initialize I2S interfaces
+  converterInit(micConverter, MIC_GAIN_Q8, MIC_AGC);
+  if (USE_FRONT_END)
+  {
+    FrontEndConfig frontEndConfig;
+    frontEndDefaultConfig(frontEndConfig, CaptureFormat::sampleRate);
+    frontEndConfig.highPassHz = FRONT_END_HIGHPASS_HZ;
+    frontEndConfig.preEmphasisQ15 = FRONT_END_PREEMPHASIS;
+    frontEndConfig.denoise = FRONT_END_DENOISE;
+    frontEndConfig.clock = frontEndCycles;
+    frontEndInit(micFrontEnd, frontEndConfig);
+  }
   i2sInitINMP441();
   i2sInitMax98357A();
 
-  // First try to connect using hardcoded credentials
-  isWIFIConnected = tryHardcodedWifi();
+  // Mic runs from here on, keeping a pre-roll for the next button press
+  if (!captureBegin(I2S_PORT, CaptureFormat::sampleRate))
+  {
+    LOG_E("Failed to start the capture reader\n");
+  }
+  if (!playbackBegin())
+  {
+    LOG_E("Failed to start the playback engine\n");
+  }
+  bool wakeReady = USE_WAKE_WORD && wakeWordInit();
+  if (USE_BARGE_IN)
+  {
+    BargeConfig bargeConfig;
+    bargeDefaultConfig(bargeConfig, CaptureFormat::sampleRate);
+    bargeInit(bargeDetector, bargeConfig);
+    playbackSetTap(speakerTap, NULL);
+  }
+  if (wakeReady || USE_BARGE_IN)
+  {
+    captureSetIdleTap(micTap, NULL);
+  }
+
+  metricsInit();
+
+  // Workflow task and its command/event queues
+  workflowCommands = xQueueCreate(1, sizeof(WorkflowState));
+  workflowEvents = xQueueCreate(1, sizeof(WorkflowEvent));
+  xTaskCreatePinnedToCore(workflowTask, "workflow", WORKFLOW_TASK_STACK, NULL, WORKFLOW_TASK_PRIORITY, NULL,
+                          WORKFLOW_TASK_CORE);
 
-  // If hardcoded connection fails, start configuration portal
-  if (!isWIFIConnected)
+  // Credentials that never connected get the portal; known ones keep
+  // retrying from loop() and turns go to the offline queue meanwhile
+  bool verified = wifiLinkVerified();
+  isWIFIConnected = wifiLinkWait(verified ? WIFI_BOOT_WAIT : WIFI_LINK_FAST_TIMEOUT + WIFI_LINK_SCAN_TIMEOUT);
+  if (portalRequested || (!isWIFIConnected && !verified))
   {
     startConfigPortal();
+    wifiLinkBegin();
+    isWIFIConnected = wifiLinkWait(WIFI_LINK_SCAN_TIMEOUT);
+  }
+  digitalWrite(isWifiConnectedPin, isWIFIConnected ? HIGH : LOW);
 
-    // After configuration, connect to the configured WiFi
-    if (configComplete)
+  // Update server URLs with the static URL
+  updateServerUrls();
+  if (isWIFIConnected)
+  {
+    fetchFallbackClips();
+    if (JITTER_BENCH)
     {
-      isWIFIConnected = connectToWifi();
+      jitterBenchRun(httpBackend, JITTER_BENCH_BYTES, fallbackAudioUrl + "?name=" FALLBACK_CLIP_OFFLINE,
+                     JITTER_BENCH_BYTES);
     }
   }
-  else
+
+  // Metrics for scraping, reachable once the station is up
+  metricsServer.on("/metrics", HTTP_GET, handleMetrics);
+  metricsServer.begin();
+  LOG_I("Metrics on port %d at /metrics\n", METRICS_PORT);
+
+  uint32_t readyMs = millis();
+  metricsBootReady(readyMs);
+  wifiLinkPrintStats();
+  LOG_I("Ready to talk %u ms after boot (%s)\n", readyMs, isWIFIConnected ? "online" : "offline");
+  LOG_I("Setup complete. Press button or say the wake word to start voice assistant.\n");
+}
+
+void audioLogSetup()
+{
+  FlashDevice dev;
+  if (!flashPartitionOpen(dev, AUDIO_LOG_PARTITION) || !audioLogInit(audioLog, dev))
   {
-    // If hardcoded connection succeeds, set as configured
-    configComplete = true;
-    configSSID = WIFI_SSID;
-    configPassword = WIFI_PASSWORD;
-    // No need to set configServerIP as we'll use the static URL
+    LOG_W("Audio log partition not found, fallback recording disabled\n");
+    return;
   }
+  audioLogReady = true;
+  LOG_I("Audio log: %u KB, last record #%u\n", dev.size / 1024, audioLog.seq);
 
-  // Update server URLs with the static URL
-  updateServerUrls();
-
-  Serial.println("Setup complete. Press button to start voice assistant.");
+  if (STORAGE_BENCH)
+  {
+    storageBenchRun(SPIFFS, audioLog, STORAGE_BENCH_BYTES, CaptureFormat::sampleRate);
+  }
+  queueInit(audioLog, esp_random());
 }
 
 void updateServerUrls()
@@ -156,16 +473,29 @@ void updateServerUrls()
   serverUploadUrl = baseUrl + "/uploadAudio";
   serverBroadcastUrl = baseUrl + "/broadcastAudio";
   broadcastPermitionUrl = baseUrl + "/checkVariable";
+  fallbackAudioUrl = baseUrl + "/fallbackAudio";
+  sessionSetBase(baseUrl);
+  httpTransportInit(httpBackend, serverUploadUrl, broadcastPermitionUrl, serverBroadcastUrl, deviceId());
+  cacheTransportInit(backend, httpBackend);
+
+  LOG_I("Server URLs updated:\n");
+  LOG_I("Upload URL: %s\n", serverUploadUrl.c_str());
+  LOG_I("Broadcast URL: %s\n", serverBroadcastUrl.c_str());
+  LOG_I("Permission URL: %s\n", broadcastPermitionUrl.c_str());
+}
 
-  Serial.println("Server URLs updated:");
-  Serial.println("Upload URL: " + serverUploadUrl);
-  Serial.println("Broadcast URL: " + serverBroadcastUrl);
-  Serial.println("Permission URL: " + broadcastPermitionUrl);
+// Stable per-unit ID for the backend session: the station MAC
+String deviceId()
+{
+  String mac = WiFi.macAddress();
+  mac.replace(":", "");
+  mac.toLowerCase();
+  return "mindease-" + mac;
 }
 
 void startConfigPortal()
 {
-  Serial.println("Starting configuration portal...");
+  LOG_I("Starting configuration portal...\n");
 
   // Set up AP mode
   WiFi.disconnect(true);
@@ -183,10 +513,10 @@ void startConfigPortal()
   webServer.onNotFound(handleNotFound);
   webServer.begin();
 
-  Serial.println("Configuration portal started!");
-  Serial.println("Connect to WiFi network: " + String(AP_SSID));
-  Serial.println("Password: " + String(AP_PASSWORD));
-  Serial.println("Then navigate to http://192.168.4.1 to configure");
+  LOG_I("Configuration portal started!\n");
+  LOG_I("Connect to WiFi network: %s\n", AP_SSID);
+  LOG_I("Password: %s\n", AP_PASSWORD);
+  LOG_I("Then navigate to http://192.168.4.1 to configure\n");
 
   // Blink LED to indicate config mode
   for (int i = 0; i < 5; i++)
@@ -206,20 +536,9 @@ void startConfigPortal()
     delay(10);
   }
 
-  // If timed out without configuration, use defaults if available
   if (!configComplete)
   {
-    Serial.println("Configuration portal timed out. Using default settings if available.");
-
-// Check if config.h has WiFi credentials defined
-#ifdef WIFI_SSID
-    configSSID = WIFI_SSID;
-    configPassword = WIFI_PASSWORD;
-    configServerIP = "192.168.81.41"; // Default server IP
-    configComplete = true;
-#else
-    Serial.println("No default settings available. Device may not function properly.");
-#endif
+    LOG_W("Configuration portal timed out. Keeping the credentials for %s.\n", wifiLinkSsid());
   }
 
   // Stop AP mode properly
@@ -292,10 +611,8 @@ void handleSave()
       return;
     }
 
-    // Save the configuration
-    configSSID = ssid;
-    configPassword = password;
-    // Server URL is now static, no need to collect it
+    // Stored in NVS, so the next boot connects without the portal
+    wifiLinkSetCredentials(ssid.c_str(), password.c_str());
 
     String html = "<!DOCTYPE html><html><head><title>Configuration Saved</title>"
                   "<meta name='viewport' content='width=device-width, initial-scale=1'>"
@@ -315,8 +632,8 @@ void handleSave()
                   "</div></body></html>";
     webServer.send(200, "text/html", html);
 
-    Serial.println("Configuration received:");
-    Serial.println("SSID: " + configSSID);
+    LOG_I("Configuration received:\n");
+    LOG_I("SSID: %s\n", ssid.c_str());
 
     configComplete = true;
   }
@@ -326,6 +643,20 @@ void handleSave()
   }
 }
 
+static void metricsChunk(const char *text, size_t len, void *ctx)
+{
+  ((WebServer *)ctx)->sendContent(text, len);
+}
+
+void handleMetrics()
+{
+  // Chunked, straight from the metrics buffer
+  metricsServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  metricsServer.send(200, "text/plain; version=0.0.4", "");
+  metricsPrometheus(metricsChunk, &metricsServer);
+  metricsServer.sendContent("", 0);
+}
+
 void handleNotFound()
 {
   // Check if the request is for a recognized file type
@@ -347,87 +678,174 @@ void handleNotFound()
 
 void loop()
 {
-  // If WiFi is disconnected, try to reconnect
-  if (isWIFIConnected && WiFi.status() != WL_CONNECTED)
+  maintainWifi();
+  workflowPoll();
+  metricsServer.handleClient();
+  delay(10);
+}
+
+void maintainWifi()
+{
+  // Reconnects in the background, to the stored AP first
+  bool connected = wifiLinkPoll();
+  if (connected != isWIFIConnected)
   {
-    Serial.println("WiFi connection lost. Reconnecting...");
-    isWIFIConnected = connectToWifi();
-    if (!isWIFIConnected)
+    isWIFIConnected = connected;
+    digitalWrite(isWifiConnectedPin, connected ? HIGH : LOW);
+    LOG_I("%s\n", connected ? "WiFi connected" : "WiFi connection lost. Reconnecting...");
+    if (connected)
     {
-      digitalWrite(isWifiConnectedPin, LOW);
+      // Failures so far were the outage; send queued utterances right away
+      queueKick();
     }
   }
-
-  if (buttonPressed && !workflowInProgress)
-  {
-    buttonPressed = false;
-    workflowInProgress = true;
-    handleVoiceAssistantWorkflow();
-    workflowInProgress = false;
-    // Add a delay after completing workflow to prevent immediate restart
-    delay(1000);
-  }
-  delay(100);
 }
 
 void IRAM_ATTR buttonInterrupt()
 {
   unsigned long currentTime = millis();
-  if (currentTime - lastButtonPressTime > debounceTime && !workflowInProgress)
+  if (currentTime - lastButtonPressTime > debounceTime && (!workflowInProgress || bargeArmed))
   {
+    if (bargeArmed)
+    {
+      bargeInterrupt(currentTime);
+      return;
+    }
     buttonPressed = true;
     lastButtonPressTime = currentTime;
   }
 }
 
-bool connectToWifi()
+// Cuts the playing response short and asks for the next turn, starting at
+// pressMs. Called from the button ISR and the capture reader, so it only
+// sets flags; the playback tasks poll bargeRequested.
+void IRAM_ATTR bargeInterrupt(unsigned long pressMs)
 {
-  // Ensure WiFi is in station mode
-  WiFi.mode(WIFI_STA);
-  WiFi.disconnect(true);
-  delay(100);
+  bargeArmed = false;
+  lastButtonPressTime = pressMs;
+  bargeRequestMs = millis();
+  bargeRequested = true;
+}
 
-  Serial.print("Connecting to WiFi: ");
+bool wakeWordInit()
+{
+  WakeConfig config;
+  wakeDefaultConfig(config);
+  config.threshold = WAKE_THRESHOLD;
+  wakeInit(wakeDetector, config);
 
-  // Use the configured WiFi credentials
-  if (configComplete)
+  File templates = SPIFFS.open(WAKE_TEMPLATE_FILE, FILE_READ);
+  if (!templates)
   {
-    Serial.println(configSSID);
-    WiFi.begin(configSSID.c_str(), configPassword.c_str());
+    LOG_W("Wake word disabled: no " WAKE_TEMPLATE_FILE "\n");
+    return false;
   }
-  else
+  size_t len = templates.size();
+  uint8_t *blob = (uint8_t *)malloc(len);
+  int count = 0;
+  if (blob && templates.read(blob, len) == len)
   {
-    // Fallback to config.h credentials if configuration wasn't completed
-    Serial.println(WIFI_SSID);
-    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+    count = wakeLoadTemplates(wakeDetector, blob, len);
+  }
+  free(blob);
+  templates.close();
+  if (count == 0)
+  {
+    LOG_E("Wake word disabled: bad " WAKE_TEMPLATE_FILE "\n");
+    return false;
   }
 
-  // Wait longer for connection - some networks take time
-  int attempts = 0;
-  const int maxAttempts = 30; // Increased from 20 to 30
+  wakeBuffer = xStreamBufferCreate(WAKE_BUFFER_SIZE * sizeof(int16_t), WAKE_HOP_LEN * sizeof(int16_t));
+  if (!wakeBuffer ||
+      xTaskCreatePinnedToCore(wakeTask, "wakeWord", WAKE_TASK_STACK, NULL, WAKE_TASK_PRIORITY, NULL,
+                              WAKE_TASK_CORE) != pdPASS)
+  {
+    LOG_E("Wake word disabled: out of memory\n");
+    return false;
+  }
+  LOG_I("Wake word enabled (%d templates)\n", count);
+  return true;
+}
 
-  while (WiFi.status() != WL_CONNECTED && attempts < maxAttempts)
+// Runs on the capture reader: top 16 bits of each slot go to the barge-in
+// detector while a response plays, otherwise into the wake buffer. Audio
+// is dropped rather than waited for if the wake task falls behind.
+void micTap(const uint8_t *data, size_t len, void *ctx)
+{
+  static int16_t samples[CAPTURE_READ_LEN / CAPTURE_SLOT_BYTES];
+  bool barge = bargeArmed;
+  if (workflowInProgress ? !barge : !wakeBuffer)
   {
-    delay(500);
-    Serial.print(".");
-    attempts++;
+    return;
   }
+  const int32_t *slots = (const int32_t *)data;
+  size_t count = len / CAPTURE_SLOT_BYTES;
+  for (size_t i = 0; i < count; i++)
+  {
+    samples[i] = slots[i] >> 16;
+  }
+  if (!barge)
+  {
+    xStreamBufferSend(wakeBuffer, samples, count * sizeof(int16_t), 0);
+  }
+  else if (bargeProcess(bargeDetector, samples, count))
+  {
+    bargeInterrupt(millis() - BARGE_ONSET_LEAD_MS);
+  }
+}
 
-  if (WiFi.status() == WL_CONNECTED)
+// Runs on the playback writer: what the speaker plays is the echo reference
+void speakerTap(const uint8_t *data, size_t len, void *ctx)
+{
+  if (bargeArmed)
   {
-    digitalWrite(isWifiConnectedPin, HIGH);
-    Serial.println("\nConnected to WiFi!");
-    Serial.print("IP Address: ");
-    Serial.println(WiFi.localIP());
-    return true;
+    bargeReference(bargeDetector, (const int16_t *)data, len / sizeof(int16_t));
   }
-  else
+}
+
+// Runs on the playback reader once the response's rate is known, before any
+// of it reaches speakerTap. A WAV the speaker is reclocked for (pinned clips
+// included) would otherwise be framed as if played at the mic rate.
+void speakerRateSet(uint32_t sampleRate)
+{
+  if (bargeArmed)
   {
-    digitalWrite(isWifiConnectedPin, LOW);
-    Serial.println("\nFailed to connect to WiFi!");
-    Serial.println("SSID: " + (configComplete ? configSSID : String(WIFI_SSID)));
-    Serial.println("Status code: " + String(WiFi.status()));
-    return false;
+    bargeSetReferenceRate(bargeDetector, sampleRate);
+  }
+}
+
+void wakeTask(void *arg)
+{
+  int16_t samples[WAKE_HOP_LEN * 4];
+  uint64_t busyUs = 0;
+  uint32_t hops = 0;
+
+  while (true)
+  {
+    size_t len = xStreamBufferReceive(wakeBuffer, samples, sizeof(samples), portMAX_DELAY);
+    if (wakeStale)
+    {
+      // Don't match across the turn that just ran
+      wakeStale = false;
+      wakeReset(wakeDetector);
+    }
+
+    uint32_t hopsBefore = wakeDetector.hops;
+    unsigned long t0 = micros();
+    bool detected = wakeProcess(wakeDetector, samples, len / sizeof(int16_t));
+    busyUs += micros() - t0;
+    hops += wakeDetector.hops - hopsBefore;
+
+    if (detected && !workflowInProgress)
+    {
+      // Binary record: this is the DSP task on the audio core
+      LOGB_I("Wake word detected (score %u.%02u, %u us per %d ms hop)\n",
+             (uint32_t)(wakeDetector.triggerScore * 100) / 100, (uint32_t)(wakeDetector.triggerScore * 100) % 100,
+             hops ? (uint32_t)(busyUs / hops) : 0, WAKE_HOP_LEN * 1000 / WAKE_SAMPLE_RATE);
+      // Same trigger as the button; the capture starts after the keyword
+      lastButtonPressTime = millis();
+      buttonPressed = true;
+    }
   }
 }
 
@@ -435,249 +853,578 @@ void SPIFFSInit()
 {
   if (!SPIFFS.begin(true))
   {
-    Serial.println("SPIFFS initialization failed!");
+    LOG_E("SPIFFS initialization failed!\n");
     while (1)
       yield();
   }
-  Serial.println("SPIFFS initialized");
+  LOG_I("SPIFFS initialized\n");
 
-  // List files
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
   listSPIFFS();
+#endif
 }
 
-void handleVoiceAssistantWorkflow()
+void workflowPoll()
 {
-  unsigned long totalStart = millis();
-
-  // Check WiFi and reconnect if needed
-  if (WiFi.status() != WL_CONNECTED)
+  if (workflowState == WF_IDLE)
   {
-    if (!connectToWifi())
+    if (buttonPressed)
     {
-      Serial.println("Cannot proceed without WiFi connection");
-      return;
+      buttonPressed = false;
+      // Queued utterances are answered first, so a new one joins the queue
+      bool queueIt = USE_OFFLINE_QUEUE && audioLogReady && (!isWIFIConnected || queueDepth() > 0);
+      if (!isWIFIConnected && !queueIt)
+      {
+        LOG_E("Cannot proceed without WiFi connection\n");
+        return;
+      }
+      workflowInProgress = true;
+      wakeStale = true;
+      turnStart = lastButtonPressTime;
+      workflowEnter(queueIt ? WF_QUEUEING : WF_CAPTURING);
+    }
+    else if (USE_OFFLINE_QUEUE && isWIFIConnected && queueDrainDue())
+    {
+      workflowInProgress = true;
+      wakeStale = true;
+      workflowEnter(WF_DRAINING);
     }
-    isWIFIConnected = true;
+    return;
   }
 
-  // Clean up any existing files
-  if (SPIFFS.exists(audioRecordfile))
+  unsigned long elapsed = millis() - stageStart;
+  if (!stageOverBudget && elapsed > workflowBudgetMs[workflowState])
   {
-    SPIFFS.remove(audioRecordfile);
+    stageOverBudget = true;
+    LOG_W("%s over budget (%lu ms > %u ms)\n", workflowStateNames[workflowState], elapsed,
+          workflowBudgetMs[workflowState]);
   }
-  if (SPIFFS.exists(audioResponsefile))
+
+  WorkflowEvent event;
+  if (xQueueReceive(workflowEvents, &event, 0) != pdTRUE)
   {
-    SPIFFS.remove(audioResponsefile);
+    return;
   }
+  uint32_t stageMs = millis() - stageStart;
+  LOG_I("Time taken for %s: %u ms\n", workflowStateNames[event.stage], stageMs);
 
-  // Prepare recording file
-  file = SPIFFS.open(audioRecordfile, FILE_WRITE);
-  if (!file)
+  if (event.stage == WF_PLAYING)
   {
-    Serial.println("Failed to open file for writing");
-    return;
+    bargeArmed = false;
+    if (bargeRequested)
+    {
+      // Taken like a button press at lastButtonPressTime once idle
+      bargeRequested = false;
+      buttonPressed = true;
+      if (turnResult.playback.cancelled)
+      {
+        uint32_t silentMs = turnResult.playback.cancelledAtMs - bargeRequestMs;
+        LOG_W("Response interrupted, speaker silent %u ms after the barge-in (%u spoken so far, "
+              "echo coupling %u/65536)\n",
+              silentMs, bargeDetector.stats.detections, bargeDetector.stats.couplingQ16);
+        metricsObserve(METRIC_BARGE_IN, silentMs);
+        metricsTurnDone(TURN_INTERRUPTED);
+        workflowEnter(WF_IDLE);
+        return;
+      }
+    }
   }
 
-  // Write WAV header
-  byte header[headerSize];
-  wavHeader(header, FLASH_RECORD_SIZE);
-  file.write(header, headerSize);
+  if (event.stage == WF_DRAINING)
+  {
+    // Not a turn of its own: failures only start the queue's backoff
+    if (event.ok)
+    {
+      metricsObserve(METRIC_DRAIN, stageMs);
+    }
+    queuePrintStats();
+    workflowEnter(event.ok && queueDrainDue() ? WF_DRAINING : WF_IDLE);
+    return;
+  }
+  if (!event.ok)
+  {
+    LOG_E("%s failed, ending turn\n", workflowStateNames[event.stage]);
+    metricsTurnDone(TURN_FAILED);
+    workflowEnter(WF_IDLE);
+    return;
+  }
+  if (workflowMetric[event.stage] != METRIC_STAGE_COUNT)
+  {
+    metricsObserve(workflowMetric[event.stage], stageMs);
+  }
 
-  // Record audio
-  unsigned long t1 = millis();
-  digitalWrite(LED, HIGH);
-  recordAudio();
-  Serial.printf("Time taken for recording: %lu ms\n", millis() - t1);
+  switch (event.stage)
+  {
+  case WF_CAPTURING:
+    if (!lastCaptureHadSpeech)
+    {
+      LOG_W("No speech detected, nothing to send\n");
+      metricsTurnDone(TURN_NO_SPEECH);
+      workflowEnter(WF_IDLE);
+    }
+    else
+    {
+      workflowEnter(WF_UPLOADING);
+    }
+    break;
+  case WF_UPLOADING:
+    workflowEnter(WF_AWAITING_RESPONSE);
+    break;
+  case WF_AWAITING_RESPONSE:
+    workflowEnter(WF_PLAYING);
+    break;
+  case WF_QUEUEING:
+    if (!lastCaptureHadSpeech)
+    {
+      LOG_W("No speech detected, nothing queued\n");
+    }
+    metricsTurnDone(lastCaptureHadSpeech ? TURN_QUEUED : TURN_NO_SPEECH);
+    workflowEnter(WF_IDLE);
+    break;
+  default:
+    LOG_I("Total workflow time: %lu ms\n", millis() - turnStart);
+    metricsObserve(METRIC_TURN, millis() - turnStart);
+    metricsTurnDone(TURN_OK);
+    metricsPrintSerial();
+    LOG_I("Workflow completed. Ready for next button press.\n");
+    workflowEnter(WF_IDLE);
+    break;
+  }
+}
 
-  // Upload to server
-  
-  t1 = millis();
-  uploadFile();
-  Serial.printf("Time taken for upload: %lu ms\n", millis() - t1);
+void workflowEnter(WorkflowState next)
+{
+  workflowState = next;
+  stageStart = millis();
+  stageOverBudget = false;
 
-  // Clean up recording file to save space
-  if (SPIFFS.exists(audioRecordfile))
+  if (next == WF_IDLE)
+  {
+    digitalWrite(LED, LOW);
+    workflowInProgress = false;
+    return;
+  }
+  if (next == WF_PLAYING && USE_BARGE_IN)
   {
-    SPIFFS.remove(audioRecordfile);
+    // Both taps are idle until armed, so the reset can't race them
+    bargeReset(bargeDetector);
+    bargeRequested = false;
+    bargeArmed = true;
   }
+  xQueueSend(workflowCommands, &next, 0);
+}
 
-  // Wait for response and play it
-  t1 = millis();
-  waitForResponseAndPlay();
-  Serial.printf("Time taken for wait + playback: %lu ms\n", millis() - t1);
-  Serial.printf("Total workflow time: %lu ms\n", millis() - totalStart);
+void workflowTask(void *arg)
+{
+  // The first fallback recording starts on erased flash. Erased here
+  // rather than in setup(), so it overlaps the Wi-Fi connect.
+  audioLogPrepareDue = audioLogReady;
 
-  // Clean up response file
-  if (SPIFFS.exists(audioResponsefile))
+  WorkflowState stage;
+  for (;;)
   {
-    SPIFFS.remove(audioResponsefile);
+    // The next recording's flash is erased between turns only, one block
+    // (~150 ms) per pass: a whole recording's worth is a second or more,
+    // which inside a turn would hold up the response. A press mid-erase
+    // waits for one block, which the pre-roll covers.
+    TickType_t wait = portMAX_DELAY;
+    if (audioLogPrepareDue)
+    {
+      if (workflowInProgress)
+      {
+        wait = pdMS_TO_TICKS(WORKFLOW_PREPARE_POLL_MS);
+      }
+      else
+      {
+        audioLogPrepareDue = audioLogPrepareStep(audioLog, CAPTURE_LIMIT + AUDIO_LOG_HEADER_SIZE);
+        wait = 0;
+      }
+    }
+    if (xQueueReceive(workflowCommands, &stage, wait) != pdTRUE)
+    {
+      continue;
+    }
+    WorkflowEvent event = {stage, runStage(stage)};
+    // A recording or a drained record may have moved what can be erased
+    audioLogPrepareDue = audioLogReady;
+    xQueueSend(workflowEvents, &event, portMAX_DELAY);
   }
-  digitalWrite(LED, LOW);
-  Serial.println("Workflow completed. Ready for next button press.");
 }
 
-void recordAudio()
+bool runStage(WorkflowState stage)
 {
-  digitalWrite(isAudioRecording, HIGH);
-  Serial.println(" *** Get Ready to Speak *** ");
+  switch (stage)
+  {
+  case WF_CAPTURING:
+    return stageCapture();
+  case WF_UPLOADING:
+    return stageUpload();
+  case WF_AWAITING_RESPONSE:
+    return waitForResponse();
+  case WF_PLAYING:
+    return stagePlay();
+  case WF_QUEUEING:
+    return stageQueue();
+  case WF_DRAINING:
+    return stageDrain();
+  default:
+    return false;
+  }
+}
 
-  // Initialize buffer for flushing
-  int i2s_read_len = I2S_READ_LEN;
-  size_t bytes_read;
-  char *flush_buff = (char *)calloc(i2s_read_len, sizeof(char));
+bool stageCapture()
+{
+  digitalWrite(LED, HIGH);
+  pendingUpload = UPLOAD_NONE;
 
-  // Flush the I2S buffer multiple times to clear any previous audio
-  for (int i = 0; i < 5; i++)
+#if STREAM_UPLOAD
+  // Record and upload in one pass, nothing touches SPIFFS
+  if (streamCapture())
+  {
+    return pendingUpload == UPLOAD_STREAM || !lastCaptureHadSpeech;
+  }
+  LOG_W("Streaming upload unavailable, falling back to the audio log\n");
+#endif
+
+  // The WAV header isn't stored; uploadFile prepends it with the real length.
+  // If the upload fails too, the record stays in the offline queue.
+  if (!audioLogReady || !queueBegin(turnConfig))
   {
-    i2s_read(I2S_PORT, (void *)flush_buff, i2s_read_len, &bytes_read, portMAX_DELAY);
+    LOG_E("Failed to start an audio log record\n");
+    return false;
   }
-  free(flush_buff);
 
-  // Add a short delay before starting
-  delay(500);
+  recordAudio();
+  pendingUpload = UPLOAD_LOG;
+  return true;
+}
+
+bool stageUpload()
+{
+  bool ok;
+  if (pendingUpload == UPLOAD_STREAM)
+  {
+    pendingUpload = UPLOAD_NONE;
+    ok = streamFinishUpload();
+  }
+  else
+  {
+    ok = uploadFile();
+    pendingUpload = UPLOAD_NONE;
+    if (ok)
+    {
+      queueRemove(pendingRecord);
+    }
+    else if (queueDepth() > 0)
+    {
+      LOG_I("Recording kept in the offline queue\n");
+    }
+  }
+  if (!ok)
+  {
+    playFallback(FALLBACK_CLIP_OFFLINE);
+  }
+  return ok;
+}
 
-  Serial.println(" *** Recording Start *** ");
+bool stagePlay()
+{
+  return playResponse();
+}
+
+bool stageQueue()
+{
+  digitalWrite(LED, HIGH);
+  if (!queueBegin(turnConfig))
+  {
+    LOG_E("Failed to start an audio log record\n");
+    return false;
+  }
+  recordAudio();
+  if (lastCaptureHadSpeech && (!isWIFIConnected || !queueDrainDue()))
+  {
+    // Tell the user the answer comes later
+    playFallback(FALLBACK_CLIP_OFFLINE);
+  }
+  return true;
+}
 
-  int flash_wr_size = 0;
-  char *i2s_read_buff = (char *)calloc(i2s_read_len, sizeof(char));
-  uint8_t *flash_write_buff = (uint8_t *)calloc(i2s_read_len, sizeof(char));
+bool stageDrain()
+{
+  digitalWrite(LED, HIGH);
+  bool ok = queueDrainOne(turnConfig, backend, turnResult);
+  if (ok)
+  {
+    metricsAddPlayback(turnResult.playback);
+  }
+  return ok;
+}
 
+uint32_t recordAudio()
+{
   digitalWrite(isAudioRecording, HIGH);
+  LOG_I(" *** Recording Start *** \n");
 
-  while (flash_wr_size < FLASH_RECORD_SIZE)
+  if (!runCapture(logSink, &audioLog))
   {
-    i2s_read(I2S_PORT, (void *)i2s_read_buff, i2s_read_len, &bytes_read, portMAX_DELAY);
-    I2SAudioRecord_dataScale(flash_write_buff, (uint8_t *)i2s_read_buff, i2s_read_len);
-    file.write((const byte *)flash_write_buff, i2s_read_len);
-    flash_wr_size += i2s_read_len;
-    Serial.printf("Sound recording %u%%\n", flash_wr_size * 100 / FLASH_RECORD_SIZE);
+    LOG_E("Recording to the audio log failed\n");
   }
+  uint32_t recorded = turnResult.pcmBytes;
 
-  file.close();
+  // Seals the record with its length, whatever made it to flash. Without
+  // speech there is nothing to send and the record isn't kept.
+  if (!queueCommit(pendingRecord, lastCaptureHadSpeech))
+  {
+    recorded = 0;
+  }
   digitalWrite(isAudioRecording, LOW);
 
-  free(i2s_read_buff);
-  free(flash_write_buff);
-
-  Serial.println("Recording completed");
-  listSPIFFS();
+  LOG_I("Recording completed, %u bytes (append max %u us, %u late erases)\n", recorded,
+        audioLog.stats.appendUsMax, audioLog.stats.lateErases);
   startMicros = micros(); // Start time
+  return recorded;
 }
 
-void uploadFile()
+bool uploadFile()
 {
-  file = SPIFFS.open(audioRecordfile, FILE_READ);
-  if (!file)
+  AudioLogReader reader;
+  if (!audioLogOpen(audioLog, pendingRecord, reader))
   {
-    Serial.println("FILE IS NOT AVAILABLE!");
-    return;
+    LOG_E("RECORDING IS NOT AVAILABLE!\n");
+    return false;
   }
 
-  Serial.println("===> Upload FILE to Node.js Server");
-  Serial.printf("Free heap before upload: %u bytes\n", ESP.getFreeHeap());
+  LOG_I("===> Upload FILE to Node.js Server\n");
 
+  // Through the backend transport like the streamed upload, so the request
+  // carries the device and request ids the response is polled under
+  if (!backend.uploadBegin(UPLOAD_ENCODING, CaptureFormat::sampleRate, backend.ctx))
+  {
+    return false;
+  }
+  bool ok = true;
+  if (uploadWavHeader)
+  {
+    WavHeader header = CaptureFormat::wavHeader(pendingRecord.length);
+    ok = backend.uploadWrite(header.bytes, WAV_HEADER_SIZE, backend.ctx);
+  }
+  uint8_t buf[UPLOAD_READ_CHUNK];
+  size_t n;
+  while (ok && (n = audioLogRead(reader, buf, sizeof(buf))) > 0)
+  {
+    ok = backend.uploadWrite(buf, n, backend.ctx);
+  }
+  if (!ok || reader.pos != pendingRecord.length)
+  {
+    LOG_E("Upload interrupted at %u of %u bytes\n", reader.pos, pendingRecord.length);
+    backend.uploadAbort(backend.ctx);
+    return false;
+  }
 
-  HTTPClient client;
-  client.begin(serverUploadUrl);
-  client.addHeader("Content-Type", "audio/wav");
-  client.setTimeout(10000); // <-- wait up to 60 seconds
-  // client.setReuse(true);              // optional: reuse the TCP connection
-  delay(500);  // Give ESP some breathing time
-  yield();     // Yield to WiFi task scheduler
-  int httpResponseCode = client.sendRequest("POST", &file, file.size());
-
-  Serial.print("httpResponseCode : ");
-  Serial.println(httpResponseCode);
+  char response[512];
+  int httpResponseCode = backend.uploadFinish(response, sizeof(response), backend.ctx);
 
+  LOG_I("httpResponseCode : %d\n", httpResponseCode);
   if (httpResponseCode == 200)
   {
-    String response = client.getString();
-    Serial.println("==================== Transcription ====================");
-    Serial.println(response);
-    Serial.println("====================      End      ====================");
+    LOG_I("==================== Transcription ====================\n");
+    LOG_I("%s\n", response);
+    LOG_I("====================      End      ====================\n");
   }
-  else {
-    Serial.printf("Upload failed, error code: %d\n", httpResponseCode);
-    if (httpResponseCode == -11) {
-      Serial.println("Likely memory or timeout issue. Try increasing timeout or reducing file size.");
-    }
+  else
+  {
+    LOG_E("Upload failed, error code: %d\n", httpResponseCode);
   }
-
-  file.close();
-  client.end();
+  return httpResponseCode == 200;
 }
 
-void waitForResponseAndPlay() {
-  HTTPClient http;
-  int maxAttempts = 30;
-  bool responseReady = false;
+bool streamCapture()
+{
+  // Open the upload before recording so a dead server costs nothing but
+  // the fallback
+  if (!backend.uploadBegin(UPLOAD_ENCODING, CaptureFormat::sampleRate, backend.ctx))
+  {
+    return false;
+  }
 
-  Serial.println("Waiting for server processing...");
+  digitalWrite(isAudioRecording, HIGH);
+  LOG_I(" *** Recording Start (streaming) *** \n");
 
-  for (int i = 0; i < maxAttempts; i++) {
-    http.begin(broadcastPermitionUrl);
-    int httpResponseCode = http.GET();
+  // The length isn't known yet; the backend rewrites the sizes from what
+  // it actually received.
+  bool ok = true;
+  if (uploadWavHeader)
+  {
+    static const WavHeader header = CaptureFormat::wavHeader(CAPTURE_LIMIT);
+    ok = backend.uploadWrite(header.bytes, WAV_HEADER_SIZE, backend.ctx);
+  }
 
-    if (httpResponseCode > 0) {
-      String payload = http.getString();
-      if (payload.indexOf("\"ready\":true") > -1) {
-        responseReady = true;
-        break;
-      }
-    }
-    http.end();
-    delay(500);
+  // The capture ring absorbs slow socket writes, I2S keeps being drained
+  if (ok)
+  {
+    ok = runCapture(turnUploadSink, &backend);
   }
 
-  if (!responseReady) {
-    Serial.println("Server response timeout");
-    return;
+  digitalWrite(isAudioRecording, LOW);
+  LOG_I("Recording completed, streamed %u PCM bytes\n", turnResult.pcmBytes);
+
+  if (!lastCaptureHadSpeech)
+  {
+    // Drop the request without finishing it so the server discards it
+    backend.uploadAbort(backend.ctx);
+    return true;
   }
+  if (!ok)
+  {
+    LOG_E("Stream upload failed while recording\n");
+    backend.uploadAbort(backend.ctx);
+    // Audio is already consumed, a SPIFFS retry would record a new utterance
+    return true;
+  }
+
+  pendingUpload = UPLOAD_STREAM;
+  return true;
+}
 
-  Serial.println("Playing response...");
-  http.begin(serverBroadcastUrl);
-  int httpCode = http.GET();
+bool streamFinishUpload()
+{
+  char response[512];
+  int httpResponseCode = backend.uploadFinish(response, sizeof(response), backend.ctx);
+  startMicros = micros();
 
-  if (httpCode == HTTP_CODE_OK) {
-    i2s_zero_dma_buffer(MAX_I2S_NUM);
+  LOG_I("httpResponseCode : %d\n", httpResponseCode);
+  if (httpResponseCode == 200)
+  {
+    LOG_I("==================== Transcription ====================\n");
+    LOG_I("%s\n", response);
+    LOG_I("====================      End      ====================\n");
+  }
+  else
+  {
+    LOG_E("Upload failed, error code: %d\n", httpResponseCode);
+  }
+  return httpResponseCode == 200;
+}
 
-    WiFiClient *stream = http.getStreamPtr();
-    size_t contentLength = http.getSize();  // Actual content size
+bool logSink(const uint8_t *data, size_t len, void *ctx)
+{
+  return audioLogAppend(*(AudioLog *)ctx, data, len);
+}
 
-    // Skip WAV header
-    uint8_t header_buffer[44];
-    int header_bytes_read = 0;
-    while (header_bytes_read < 44) {
-      int len = stream->read(header_buffer + header_bytes_read, 44 - header_bytes_read);
-      if (len > 0) header_bytes_read += len;
-    }
+bool runCapture(CaptureSink sink, void *sinkCtx)
+{
+  // The utterance starts at the button press, recovered from the pre-roll.
+  // The consumer task is idle between captures, so the reset can't race it.
+  frontEndReset(micFrontEnd);
+  frontEndResetStats(micFrontEnd);
+  bool ok = turnCapture(turnConfig, lastButtonPressTime, sink, sinkCtx, turnResult);
+  lastCaptureHadSpeech = turnResult.hadSpeech;
+  printFrontEndStats();
+
+  // Press to first sample kept: zero unless the pre-roll window fell short
+  uint32_t prerollMs = MicSlotFormat::msForBytes(turnResult.capture.prerollBytes);
+  uint32_t lateMs = turnResult.captureStartMs - lastButtonPressTime;
+  metricsObserve(METRIC_BUTTON_TO_CAPTURE, lateMs > prerollMs ? lateMs - prerollMs : 0);
+  metricsAddCapture(turnResult.capture);
+  return ok;
+}
 
-    uint8_t buffer[4096];
-    size_t total_bytes_written = 0;
-
-    while (total_bytes_written < contentLength - 44) {
-      int len = stream->read(buffer, sizeof(buffer));
-      if (len > 0) {
-        size_t written;
-        i2s_write(MAX_I2S_NUM, buffer, len, &written, portMAX_DELAY);
-        total_bytes_written += written;
-      } else {
-        delay(10); // small wait for more data
-      }
-    }
+bool waitForResponse() {
+  if (!turnWaitResponse(turnConfig, backend)) {
+    playFallback(FALLBACK_CLIP_TIMEOUT);
+    return false;
+  }
+  return true;
+}
 
-    delay(500); // Let audio complete
-    i2s_stop(MAX_I2S_NUM);
-    i2s_zero_dma_buffer(MAX_I2S_NUM);
-    i2s_start(MAX_I2S_NUM);
-    Serial.printf("Audio playback completed (bytes: %d)\n", total_bytes_written);
+bool playResponse() {
+  bool ok = turnPlayResponse(turnConfig, backend, turnResult);
+  if (turnResult.firstAudioMs > 0) {
+    metricsObserve(METRIC_FIRST_AUDIO, turnResult.firstAudioMs);
+  }
+  if (ok) {
+    metricsAddPlayback(turnResult.playback);
   } else {
-    Serial.printf("HTTP GET failed, error: %s\n", http.errorToString(httpCode).c_str());
+    playFallback(FALLBACK_CLIP_OFFLINE);
+  }
+  sessionPrintStats();
+  cachePrintStats();
+  return ok;
+}
+
+// Plays a pinned clip from the response cache instead of the backend's answer
+bool playFallback(const char *clip)
+{
+  BackendTransport local;
+  if (!cacheClipTransport(local, clip))
+  {
+    LOG_E("No fallback clip '%s' on flash\n", clip);
+    return false;
   }
+  LOG_I("Playing fallback clip '%s'\n", clip);
+  TurnResult result;
+  return turnPlayResponse(turnConfig, local, result);
+}
 
-  // Important: manually close the stream to prevent hanging
-  http.getStreamPtr()->stop();
-  http.end();
+// Downloads the fallback clips the cache doesn't have yet. Runs once at
+// boot, before the workflow task can use the backend session.
+void fetchFallbackClips()
+{
+  uint8_t buf[1024];
+  for (const char *clip : fallbackClips)
+  {
+    if (cacheHas(clip))
+    {
+      continue;
+    }
+    char url[160];
+    snprintf(url, sizeof(url), "%s?name=%s", fallbackAudioUrl.c_str(), clip);
+    int code;
+    HTTPClient *client = sessionGet(url, HTTP_RESPONSE_TIMEOUT, code);
+    if (!client)
+    {
+      return;
+    }
+    bool stored = false;
+    if (code == HTTP_CODE_OK && cacheStoreBegin(clip))
+    {
+      WiFiClient *body = client->getStreamPtr();
+      int remaining = client->getSize();
+      unsigned long lastData = millis();
+      bool ok = true;
+      while (ok && remaining != 0 && millis() - lastData < HTTP_RESPONSE_TIMEOUT)
+      {
+        int available = body->available();
+        if (available <= 0)
+        {
+          if (!body->connected())
+          {
+            break;
+          }
+          delay(5);
+          continue;
+        }
+        int n = body->read(buf, available < (int)sizeof(buf) ? available : sizeof(buf));
+        if (n > 0)
+        {
+          ok = cacheStoreWrite(buf, n);
+          remaining -= remaining > 0 ? n : 0;
+          lastData = millis();
+        }
+      }
+      if (ok && remaining <= 0)
+      {
+        stored = cacheStoreCommit();
+      }
+      else
+      {
+        cacheStoreAbort();
+        sessionClose();
+      }
+    }
+    sessionEnd();
+    LOG_I("Fallback clip '%s': %s (HTTP %d)\n", clip, stored ? "stored" : "not available", code);
+  }
 }
 
 
@@ -685,12 +1432,12 @@ void i2sInitINMP441()
 {
   i2s_config_t i2s_config = {
       .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX),
-      .sample_rate = I2S_SAMPLE_RATE,
-      .bits_per_sample = i2s_bits_per_sample_t(I2S_SAMPLE_BITS),
+      .sample_rate = MicSlotFormat::sampleRate,
+      .bits_per_sample = i2s_bits_per_sample_t(MicSlotFormat::bitsPerSample),
       .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
       .communication_format = i2s_comm_format_t(I2S_COMM_FORMAT_STAND_I2S),
       .intr_alloc_flags = 0,
-      .dma_buf_count = 64,
+      .dma_buf_count = 16, // 1 s of 32-bit slots, the capture reader task drains it continuously
       .dma_buf_len = 1024,
       .use_apll = 1};
 
@@ -708,8 +1455,8 @@ void i2sInitINMP441()
 void i2sInitMax98357A() {
   i2s_config_t i2s_config = {
       .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_TX),
-      .sample_rate = MAX_I2S_SAMPLE_RATE,
-      .bits_per_sample = i2s_bits_per_sample_t(MAX_I2S_SAMPLE_BITS),
+      .sample_rate = SpeakerFormat::sampleRate,
+      .bits_per_sample = i2s_bits_per_sample_t(SpeakerFormat::bitsPerSample),
       .channel_format = I2S_CHANNEL_FMT_ONLY_RIGHT,
       .communication_format = I2S_COMM_FORMAT_STAND_I2S,
       .intr_alloc_flags = 0,
@@ -732,88 +1479,68 @@ void i2sInitMax98357A() {
   i2s_zero_dma_buffer(MAX_I2S_NUM);
 }
 
-void I2SAudioRecord_dataScale(uint8_t *d_buff, uint8_t *s_buff, uint32_t len)
-{
-  uint32_t j = 0;
-  uint32_t dac_value = 0;
-  for (int i = 0; i < len; i += 2)
-  {
-    dac_value = ((((uint16_t)(s_buff[i + 1] & 0xf) << 8) | ((s_buff[i + 0]))));
-    d_buff[j++] = 0;
-    // Increase amplification factor from 256/2048 to improve volume
-    d_buff[j++] = dac_value * 512 / 2048; // Double the amplification
-  }
-}
-
-void wavHeader(byte *header, int wavSize)
-{
-  header[0] = 'R';
-  header[1] = 'I';
-  header[2] = 'F';
-  header[3] = 'F';
-  unsigned int fileSize = wavSize + headerSize - 8;
-  header[4] = (byte)(fileSize & 0xFF);
-  header[5] = (byte)((fileSize >> 8) & 0xFF);
-  header[6] = (byte)((fileSize >> 16) & 0xFF);
-  header[7] = (byte)((fileSize >> 24) & 0xFF);
-  header[8] = 'W';
-  header[9] = 'A';
-  header[10] = 'V';
-  header[11] = 'E';
-  header[12] = 'f';
-  header[13] = 'm';
-  header[14] = 't';
-  header[15] = ' ';
-  header[16] = 0x10;
-  header[17] = 0x00;
-  header[18] = 0x00;
-  header[19] = 0x00;
-  header[20] = 0x01;
-  header[21] = 0x00;
-  header[22] = 0x01;
-  header[23] = 0x00;
-  header[24] = 0x80; // 16000 & 0xFF
-  header[25] = 0x3E; // (16000 >> 8) & 0xFF
-  header[26] = 0x00;
-  header[27] = 0x00;
-  header[28] = 0x00; // 32000 & 0xFF
-  header[29] = 0x7D; // (32000 >> 8) & 0xFF
-  header[30] = 0x00; // (32000 >> 16) & 0xFF
-  header[31] = 0x00;
-  header[32] = 0x02;
-  header[33] = 0x00;
-  header[34] = 0x10;
-  header[35] = 0x00;
-  header[36] = 'd';
-  header[37] = 'a';
-  header[38] = 't';
-  header[39] = 'a';
-  header[40] = (byte)(wavSize & 0xFF);
-  header[41] = (byte)((wavSize >> 8) & 0xFF);
-  header[42] = (byte)((wavSize >> 16) & 0xFF);
-  header[43] = (byte)((wavSize >> 24) & 0xFF);
+uint32_t I2SAudioRecord_dataScale(uint8_t *d_buff, uint8_t *s_buff, uint32_t len)
+{
+  // INMP441 slots in, 16-bit PCM out; the kernel is built for the slot width
+  typedef ConvertSlot<MicSlotFormat::bitsPerSample>::Type Slot;
+  size_t samples = converterRunSlots<MicSlotFormat::bitsPerSample>(micConverter, (int16_t *)d_buff,
+                                                                    (const Slot *)s_buff, len / MicSlotFormat::blockAlign);
+  if (USE_FRONT_END)
+  {
+    frontEndRun(micFrontEnd, (int16_t *)d_buff, samples);
+  }
+  return samples * 2;
+}
+
+uint32_t frontEndCycles()
+{
+  return ESP.getCycleCount();
+}
+
+// Cycles per capture block for each front end stage, against the budget
+// share of one core
+void printFrontEndStats()
+{
+  if (!USE_FRONT_END || micFrontEnd.blocks == 0)
+  {
+    return;
+  }
+  uint32_t blockSamples = micFrontEnd.samples / micFrontEnd.blocks;
+  uint64_t blockCycles = (uint64_t)ESP.getCpuFreqMHz() * 1000000 * blockSamples / CaptureFormat::sampleRate;
+  uint64_t total = 0;
+  for (int i = 0; i < micFrontEnd.stageCount; i++)
+  {
+    const FrontEndStage &stage = micFrontEnd.stages[i];
+    uint32_t avg = stage.ticks / micFrontEnd.blocks;
+    total += avg;
+    LOG_I("Front end %s: %u cycles avg, %u max per %u-sample block\n", stage.name, avg, stage.ticksMax,
+          blockSamples);
+  }
+  uint32_t permille = blockCycles ? total * 1000 / blockCycles : 0;
+  LOG_I("Front end: %u.%u%% of a core (budget %u%%)%s\n", permille / 10, permille % 10,
+        FRONT_END_BUDGET_PCT, permille > FRONT_END_BUDGET_PCT * 10 ? ", over budget" : "");
 }
 
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
 void listSPIFFS(void)
 {
-  // DEBUG
-  printSpaceInfo();
-  Serial.println(F("\r\nListing SPIFFS files:"));
-  static const char line[] PROGMEM = "=================================================";
+  static const char line[] = "=================================================";
 
-  Serial.println(FPSTR(line));
-  Serial.println(F("  File name                              Size"));
-  Serial.println(FPSTR(line));
+  printSpaceInfo();
+  LOG_D("\r\nListing SPIFFS files:\n");
+  LOG_D("%s\n", line);
+  LOG_D("  File name                              Size\n");
+  LOG_D("%s\n", line);
 
   fs::File root = SPIFFS.open("/");
   if (!root)
   {
-    Serial.println(F("Failed to open directory"));
+    LOG_E("Failed to open directory\n");
     return;
   }
   if (!root.isDirectory())
   {
-    Serial.println(F("Not a directory"));
+    LOG_E("Not a directory\n");
     return;
   }
 
@@ -822,84 +1549,27 @@ void listSPIFFS(void)
   {
     if (file.isDirectory())
     {
-      Serial.print("DIR : ");
-      String fileName = file.name();
-      Serial.print(fileName);
+      LOG_D("DIR : %s\n", file.name());
     }
     else
     {
-      String fileName = file.name();
-      Serial.print("  " + fileName);
       // File path can be 31 characters maximum in SPIFFS
-      int spaces = 33 - fileName.length(); // Tabulate nicely
-      if (spaces < 1)
-        spaces = 1;
-      while (spaces--)
-        Serial.print(" ");
-      String fileSize = (String)file.size();
-      spaces = 10 - fileSize.length(); // Tabulate nicely
-      if (spaces < 1)
-        spaces = 1;
-      while (spaces--)
-        Serial.print(" ");
-      Serial.println(fileSize + " bytes");
+      LOG_D("  %-32s %9u bytes\n", file.name(), (unsigned)file.size());
     }
 
     file = root.openNextFile();
   }
 
-  Serial.println(FPSTR(line));
-  Serial.println();
-  delay(1000);
+  LOG_D("%s\n\n", line);
 }
 
 void printSpaceInfo()
 {
   size_t totalBytes = SPIFFS.totalBytes();
   size_t usedBytes = SPIFFS.usedBytes();
-  size_t freeBytes = totalBytes - usedBytes;
 
-  Serial.print("Total space: ");
-  Serial.println(totalBytes);
-  Serial.print("Used space: ");
-  Serial.println(usedBytes);
-  Serial.print("Free space: ");
-  Serial.println(freeBytes);
+  LOG_D("Total space: %u\n", (unsigned)totalBytes);
+  LOG_D("Used space: %u\n", (unsigned)usedBytes);
+  LOG_D("Free space: %u\n", (unsigned)(totalBytes - usedBytes));
 }
-bool tryHardcodedWifi()
-{
-  // Try to connect with hardcoded WiFi credentials from config.h
-  WiFi.mode(WIFI_STA);
-  WiFi.disconnect(true);
-  delay(100);
-
-  Serial.print("Connecting to hardcoded WiFi: ");
-  Serial.println(WIFI_SSID);
-
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-
-  // Try to connect 3 times
-  int attempts = 0;
-  const int maxAttempts = 3;
-
-  while (WiFi.status() != WL_CONNECTED && attempts < maxAttempts)
-  {
-    delay(1000);
-    Serial.print(".");
-    attempts++;
-  }
-
-  if (WiFi.status() == WL_CONNECTED)
-  {
-    digitalWrite(isWifiConnectedPin, HIGH);
-    Serial.println("\nConnected to WiFi!");
-    Serial.print("IP Address: ");
-    Serial.println(WiFi.localIP());
-    return true;
-  }
-  else
-  {
-    Serial.println("\nFailed to connect using hardcoded credentials.");
-    return false;
-  }
-}
\ No newline at end of file
+#endif
@@ -0,0 +1,336 @@
+#include "metrics.h"
+#include "response_cache.h"
+#include "buffer_pool.h"
+#include "utterance_queue.h"
+#include "wifi_link.h"
+#include "serial_log.h"
+
+#include <WiFi.h>
+#include <stdarg.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Bucket upper bounds in ms, spanning a fast button press to a long reply
+static const uint32_t bucketBounds[METRICS_BUCKETS] = {50, 100, 250, 500, 1000, 2000,
+                                                       3000, 5000, 8000, 12000, 20000, 30000};
+static const char *const stageNames[METRIC_STAGE_COUNT] = {
+    "button_to_capture", "capture", "upload", "server_wait", "first_audio", "playback", "turn", "drain", "barge_in"};
+
+struct Histogram
+{
+  uint32_t buckets[METRICS_BUCKETS + 1]; // Last one is +Inf, not cumulative
+  uint32_t count;
+  uint32_t sum;
+  uint32_t max;
+};
+
+struct Metrics
+{
+  Histogram stages[METRIC_STAGE_COUNT];
+  uint32_t turns[TURN_INTERRUPTED + 1];
+  uint32_t i2sOverruns;
+  uint32_t captureUnderruns;
+  uint32_t playbackUnderruns;
+  uint32_t playbackTimeouts;
+  uint32_t bootReadyMs;
+};
+
+// Written from the workflow task, read from loop()
+static Metrics metrics;
+static SemaphoreHandle_t metricsLock;
+static char *textBuffer; // METRICS_TEXT_CHUNK, from the buffer pool
+
+static void lock()
+{
+  xSemaphoreTake(metricsLock, portMAX_DELAY);
+}
+
+static void unlock()
+{
+  xSemaphoreGive(metricsLock);
+}
+
+void metricsInit()
+{
+  memset(&metrics, 0, sizeof(metrics));
+  metricsLock = xSemaphoreCreateMutex();
+  if (!textBuffer)
+  {
+    textBuffer = (char *)poolAlloc(METRICS_TEXT_CHUNK, "metrics text");
+  }
+}
+
+void metricsObserve(MetricStage stage, uint32_t ms)
+{
+  int bucket = 0;
+  while (bucket < METRICS_BUCKETS && ms > bucketBounds[bucket])
+  {
+    bucket++;
+  }
+
+  lock();
+  Histogram &h = metrics.stages[stage];
+  h.buckets[bucket]++;
+  h.count++;
+  h.sum += ms;
+  if (ms > h.max)
+  {
+    h.max = ms;
+  }
+  unlock();
+}
+
+void metricsAddCapture(const CaptureStats &stats)
+{
+  lock();
+  metrics.i2sOverruns += stats.overruns;
+  metrics.captureUnderruns += stats.underruns;
+  unlock();
+}
+
+void metricsAddPlayback(const PlaybackStats &stats)
+{
+  lock();
+  metrics.playbackUnderruns += stats.underruns;
+  if (stats.sourceTimedOut)
+  {
+    metrics.playbackTimeouts++;
+  }
+  unlock();
+}
+
+void metricsTurnDone(MetricOutcome outcome)
+{
+  lock();
+  metrics.turns[outcome]++;
+  // Once per turn, so a shrinking largest block shows up as a trend
+  poolSampleHeap();
+  unlock();
+}
+
+void metricsBootReady(uint32_t ms)
+{
+  lock();
+  metrics.bootReadyMs = ms;
+  unlock();
+}
+
+// Upper bound of the bucket holding quantile q (percent), 0 when empty.
+// Past the last bound the observed max is the best estimate.
+static uint32_t quantile(const Histogram &h, uint32_t q)
+{
+  if (h.count == 0)
+  {
+    return 0;
+  }
+  uint32_t rank = (h.count * q + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < METRICS_BUCKETS; i++)
+  {
+    seen += h.buckets[i];
+    if (seen >= rank)
+    {
+      return bucketBounds[i] < h.max ? bucketBounds[i] : h.max;
+    }
+  }
+  return h.max;
+}
+
+// Exposition text goes out in pieces through one pooled buffer
+struct MetricsText
+{
+  char *buf;
+  size_t pos;
+  MetricsWrite write;
+  void *ctx;
+};
+
+static void flush(MetricsText &out)
+{
+  if (out.pos > 0)
+  {
+    out.write(out.buf, out.pos, out.ctx);
+    out.pos = 0;
+  }
+}
+
+static void emit(MetricsText &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void emit(MetricsText &out, const char *format, ...)
+{
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(out.buf + out.pos, METRICS_TEXT_CHUNK - out.pos, format, args);
+    va_end(args);
+    if (n < 0)
+    {
+      return;
+    }
+    if (out.pos + n < METRICS_TEXT_CHUNK)
+    {
+      out.pos += n;
+      return;
+    }
+    // Didn't fit: send what is there and format it again at the start
+    flush(out);
+  }
+}
+
+static void emitMetric(MetricsText &out, const char *name, const char *help, const char *type, uint32_t value)
+{
+  emit(out, "# HELP %s %s\n# TYPE %s %s\n%s %u\n", name, help, name, type, name, value);
+}
+
+void metricsPrometheus(MetricsWrite write, void *ctx)
+{
+  lock();
+  Metrics snap = metrics;
+  PoolStats pool = poolGetStats();
+  unlock();
+
+  MetricsText out = {textBuffer, 0, write, ctx};
+
+  emit(out, "# HELP mindease_stage_duration_milliseconds Duration of each voice turn stage\n"
+            "# TYPE mindease_stage_duration_milliseconds histogram\n");
+  for (int s = 0; s < METRIC_STAGE_COUNT; s++)
+  {
+    const Histogram &h = snap.stages[s];
+    uint32_t cumulative = 0;
+    for (int i = 0; i <= METRICS_BUCKETS; i++)
+    {
+      cumulative += h.buckets[i];
+      if (i < METRICS_BUCKETS)
+      {
+        emit(out, "mindease_stage_duration_milliseconds_bucket{stage=\"%s\",le=\"%u\"} %u\n", stageNames[s],
+             bucketBounds[i], cumulative);
+      }
+      else
+      {
+        emit(out, "mindease_stage_duration_milliseconds_bucket{stage=\"%s\",le=\"+Inf\"} %u\n", stageNames[s],
+             cumulative);
+      }
+    }
+    emit(out, "mindease_stage_duration_milliseconds_sum{stage=\"%s\"} %u\n", stageNames[s], h.sum);
+    emit(out, "mindease_stage_duration_milliseconds_count{stage=\"%s\"} %u\n", stageNames[s], h.count);
+  }
+
+  emit(out, "# HELP mindease_turns_total Voice turns by outcome\n"
+            "# TYPE mindease_turns_total counter\n");
+  emit(out, "mindease_turns_total{outcome=\"ok\"} %u\n", snap.turns[TURN_OK]);
+  emit(out, "mindease_turns_total{outcome=\"no_speech\"} %u\n", snap.turns[TURN_NO_SPEECH]);
+  emit(out, "mindease_turns_total{outcome=\"failed\"} %u\n", snap.turns[TURN_FAILED]);
+  emit(out, "mindease_turns_total{outcome=\"queued\"} %u\n", snap.turns[TURN_QUEUED]);
+  emit(out, "mindease_turns_total{outcome=\"interrupted\"} %u\n", snap.turns[TURN_INTERRUPTED]);
+
+  emitMetric(out, "mindease_i2s_overruns_total", "Mic blocks dropped on a full capture ring", "counter",
+             snap.i2sOverruns);
+  emitMetric(out, "mindease_capture_underruns_total", "Capture consumer waits on an empty ring", "counter",
+             snap.captureUnderruns);
+  emitMetric(out, "mindease_playback_underruns_total", "Playback buffer ran dry mid-stream", "counter",
+             snap.playbackUnderruns);
+  emitMetric(out, "mindease_playback_timeouts_total", "Responses abandoned on a stalled source", "counter",
+             snap.playbackTimeouts);
+  CacheStats cache = cacheGetStats();
+  emitMetric(out, "mindease_response_cache_lookups_total", "Responses that came with a content hash", "counter",
+             cache.lookups);
+  emitMetric(out, "mindease_response_cache_hits_total", "Responses played from the flash cache", "counter",
+             cache.hits);
+  emitMetric(out, "mindease_response_cache_saved_bytes_total", "Response bytes served from flash instead of the network",
+             "counter", cache.bytesSaved);
+  emitMetric(out, "mindease_response_cache_evictions_total", "Cached responses evicted for space", "counter",
+             cache.evictions);
+  emitMetric(out, "mindease_fallback_clips_total", "Fallback clips played when the backend couldn't answer", "counter",
+             cache.clipPlays);
+  emitMetric(out, "mindease_response_cache_bytes", "Flash used by the response cache", "gauge", cache.bytesUsed);
+  emitMetric(out, "mindease_heap_free_bytes", "Free heap", "gauge", ESP.getFreeHeap());
+  emitMetric(out, "mindease_heap_min_free_bytes", "Free heap low-water mark since boot", "gauge",
+             ESP.getMinFreeHeap());
+  emitMetric(out, "mindease_heap_largest_free_block_bytes", "Largest free internal heap block at the last turn",
+             "gauge", pool.heapLargest);
+  emitMetric(out, "mindease_heap_min_largest_free_block_bytes", "Smallest largest free block seen after a turn",
+             "gauge", pool.heapLargestMin);
+  emitMetric(out, "mindease_buffer_pool_used_bytes", "Buffer pool bytes carved out", "gauge", pool.used);
+  emitMetric(out, "mindease_buffer_pool_fallbacks_total", "Buffers that didn't fit the pool and came from the heap",
+             "counter", pool.fallbacks);
+  QueueStats queue = queueGetStats();
+  emitMetric(out, "mindease_offline_queue_depth", "Utterances waiting for upload", "gauge", queue.depth);
+  emitMetric(out, "mindease_offline_queue_enqueued_total", "Utterances recorded to the offline queue", "counter",
+             queue.enqueued);
+  emitMetric(out, "mindease_offline_queue_drained_total", "Queued utterances uploaded and answered", "counter",
+             queue.drained);
+  emitMetric(out, "mindease_offline_queue_dropped_total", "Queued utterances dropped for space", "counter",
+             queue.dropped);
+  emitMetric(out, "mindease_offline_queue_failures_total", "Failed drain attempts", "counter", queue.failures);
+  emitMetric(out, "mindease_offline_queue_drain_milliseconds", "Time the last batch took to empty the queue",
+             "gauge", queue.drainMsLast);
+  WifiLinkStats wifi = wifiLinkGetStats();
+  emitMetric(out, "mindease_boot_ready_milliseconds", "Boot to ready for a button press", "gauge",
+             snap.bootReadyMs);
+  emitMetric(out, "mindease_wifi_boot_connect_milliseconds", "Boot to the first Wi-Fi connection", "gauge",
+             wifi.bootConnectMs);
+  emitMetric(out, "mindease_wifi_connect_milliseconds", "Last Wi-Fi connect or reconnect", "gauge",
+             wifi.connectMsLast);
+  emitMetric(out, "mindease_wifi_fast_connects_total", "Connects with the stored channel and BSSID", "counter",
+             wifi.fastConnects);
+  emitMetric(out, "mindease_wifi_scan_connects_total", "Connects after a full scan", "counter", wifi.scanConnects);
+  emitMetric(out, "mindease_wifi_drops_total", "Wi-Fi connections lost", "counter", wifi.drops);
+  LogStats log = logGetStats();
+  emitMetric(out, "mindease_log_messages_total", "Log records written to the ring", "counter", log.written);
+  emitMetric(out, "mindease_log_errors_total", "Error-level log records", "counter", log.errors);
+  emitMetric(out, "mindease_log_dropped_total", "Log records lost to a full ring", "counter", log.dropped);
+  emitMetric(out, "mindease_log_ring_peak_bytes", "Most log bytes waiting for the serial port", "gauge",
+             log.fillPeak);
+
+  emit(out, "# HELP mindease_wifi_rssi_dbm Signal strength of the current AP\n"
+            "# TYPE mindease_wifi_rssi_dbm gauge\n");
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    emit(out, "mindease_wifi_rssi_dbm %d\n", (int)WiFi.RSSI());
+  }
+  else
+  {
+    emit(out, "mindease_wifi_rssi_dbm NaN\n");
+  }
+  emitMetric(out, "mindease_uptime_seconds", "Time since boot", "counter", millis() / 1000);
+  flush(out);
+}
+
+void metricsPrintSerial()
+{
+  lock();
+  Metrics snap = metrics;
+  PoolStats pool = poolGetStats();
+  unlock();
+
+  LOG_I("Metrics: turns ok=%u no_speech=%u failed=%u queued=%u interrupted=%u\n", snap.turns[TURN_OK],
+        snap.turns[TURN_NO_SPEECH], snap.turns[TURN_FAILED], snap.turns[TURN_QUEUED],
+        snap.turns[TURN_INTERRUPTED]);
+  for (int s = 0; s < METRIC_STAGE_COUNT; s++)
+  {
+    const Histogram &h = snap.stages[s];
+    if (h.count == 0)
+    {
+      continue;
+    }
+    LOG_I("  %-17s n=%-4u p50<=%-5u p99<=%-5u max=%u ms\n", stageNames[s], h.count,
+          quantile(h, 50), quantile(h, 99), h.max);
+  }
+  LOG_I("  overruns=%u cap_underruns=%u play_underruns=%u heap=%u min=%u rssi=%d\n",
+        snap.i2sOverruns, snap.captureUnderruns, snap.playbackUnderruns, ESP.getFreeHeap(),
+        ESP.getMinFreeHeap(), WiFi.status() == WL_CONNECTED ? WiFi.RSSI() : 0);
+  LOG_I("  heap largest=%u min=%u pool=%u/%u fallbacks=%u\n", pool.heapLargest, pool.heapLargestMin, pool.used,
+        pool.size, pool.fallbacks);
+  CacheStats cache = cacheGetStats();
+  LOG_I("  cache hits=%u/%u saved=%u bytes clips=%u\n", cache.hits, cache.lookups, cache.bytesSaved,
+        cache.clipPlays);
+  QueueStats queue = queueGetStats();
+  LOG_I("  queue depth=%u dropped=%u drained=%u drain=%u ms\n", queue.depth, queue.dropped, queue.drained,
+        queue.drainMsLast);
+  WifiLinkStats wifi = wifiLinkGetStats();
+  LOG_I("  boot ready=%u ms wifi boot=%u ms last connect=%u ms fast=%u scan=%u drops=%u\n", snap.bootReadyMs,
+        wifi.bootConnectMs, wifi.connectMsLast, wifi.fastConnects, wifi.scanConnects, wifi.drops);
+  LogStats log = logGetStats();
+  LOG_I("  log records=%u errors=%u warnings=%u dropped=%u cut=%u ring peak=%u/%u\n", log.written, log.errors,
+        log.warnings, log.dropped, log.cut, log.fillPeak, LOG_RING_SIZE);
+}
@@ -0,0 +1,178 @@
+// WAV-backed mic and speaker behind audio_hal.h
+#include "sim.h"
+#include "audio_hal.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <vector>
+
+#define SIM_ECHO_FRAMES (1 << 15) // Speaker output ahead of the mic, ~2 s at 16 kHz
+
+struct SimMic
+{
+  const int16_t *samples;
+  size_t count;
+  uint32_t sampleRate;
+  unsigned long startUs;  // Sim time the mic clock started
+  int64_t frame;          // Next frame to read since startUs
+  int64_t fileStart;      // Frame the samples begin at
+};
+
+struct SimSpeaker
+{
+  std::vector<int16_t> samples;
+  uint32_t sampleRate;
+  unsigned long playedUntilUs; // Sim time the queued audio runs out
+};
+
+// What the mic hears of the speaker: samples placed on the mic clock at the
+// time they leave the speaker, plus the acoustic delay
+struct SimEcho
+{
+  float gain;
+  int64_t delayFrames;
+  int16_t samples[SIM_ECHO_FRAMES];
+  int64_t frames[SIM_ECHO_FRAMES]; // Mic frame each slot holds, -1 if none
+  pthread_mutex_t lock;            // Speaker writes, mic reads
+};
+
+static SimMic mic;
+static SimSpeaker speaker;
+static SimEcho echo = {0, 0, {0}, {0}, PTHREAD_MUTEX_INITIALIZER};
+
+static int64_t micFrameAt(unsigned long us)
+{
+  return (int64_t)(long)(us - mic.startUs) * mic.sampleRate / 1000000;
+}
+
+void simMicInit(const int16_t *samples, size_t count, uint32_t sampleRate)
+{
+  mic.samples = samples;
+  mic.count = count;
+  mic.sampleRate = sampleRate;
+  mic.startUs = micros();
+  mic.frame = 0;
+  mic.fileStart = INT64_MAX;
+}
+
+void simMicRewind()
+{
+  simMicSchedule(0);
+}
+
+void simMicSchedule(uint32_t delayMs)
+{
+  mic.fileStart = micFrameAt(micros()) + (int64_t)delayMs * mic.sampleRate / 1000;
+}
+
+void simEchoInit(float gainDb, uint32_t delayMs)
+{
+  pthread_mutex_lock(&echo.lock);
+  echo.gain = powf(10, gainDb / 20);
+  echo.delayFrames = (int64_t)delayMs * mic.sampleRate / 1000;
+  for (int i = 0; i < SIM_ECHO_FRAMES; i++)
+  {
+    echo.frames[i] = -1;
+  }
+  pthread_mutex_unlock(&echo.lock);
+}
+
+void simSpeakerInit(uint32_t sampleRate)
+{
+  speaker.samples.clear();
+  speaker.sampleRate = sampleRate;
+  speaker.playedUntilUs = micros();
+}
+
+const int16_t *simSpeakerSamples(size_t &count)
+{
+  count = speaker.samples.size();
+  return speaker.samples.data();
+}
+
+size_t audioRead(i2s_port_t port, void *buf, size_t len)
+{
+  // 32-bit slots with the 16-bit sample in the top half, like the INMP441
+  int32_t *slots = (int32_t *)buf;
+  size_t frames = len / 4;
+
+  // Block until the sample clock has produced the last requested frame
+  int64_t end = mic.frame + (int64_t)frames;
+  int64_t produced = (int64_t)(micros() - mic.startUs) * mic.sampleRate / 1000000;
+  if (end > produced)
+  {
+    delay((uint32_t)((end - produced) * 1000 / mic.sampleRate) + 1);
+  }
+
+  pthread_mutex_lock(&echo.lock);
+  for (size_t i = 0; i < frames; i++, mic.frame++)
+  {
+    int64_t index = mic.frame - mic.fileStart;
+    bool inFile = index >= 0 && index < (int64_t)mic.count;
+    int32_t sample = inFile ? mic.samples[index] : 0;
+    int slot = mic.frame & (SIM_ECHO_FRAMES - 1);
+    if (echo.frames[slot] == mic.frame)
+    {
+      sample += (int32_t)lrintf(echo.samples[slot] * echo.gain);
+      sample = sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample;
+    }
+    slots[i] = sample << 16;
+  }
+  pthread_mutex_unlock(&echo.lock);
+  return frames * 4;
+}
+
+size_t audioWrite(i2s_port_t port, const void *buf, size_t len)
+{
+  const int16_t *samples = (const int16_t *)buf;
+  size_t frames = len / 2;
+  speaker.samples.insert(speaker.samples.end(), samples, samples + frames);
+
+  // Queue behind what is already playing; block while the DMA ring is full
+  unsigned long now = micros();
+  if ((long)(speaker.playedUntilUs - now) < 0)
+  {
+    speaker.playedUntilUs = now;
+  }
+
+  // The echo of these samples reaches the mic once they leave the speaker
+  pthread_mutex_lock(&echo.lock);
+  int64_t echoFrame = micFrameAt(speaker.playedUntilUs) + echo.delayFrames;
+  for (size_t i = 0; i < frames && echo.gain > 0; i++, echoFrame++)
+  {
+    int slot = echoFrame & (SIM_ECHO_FRAMES - 1);
+    echo.samples[slot] = samples[i];
+    echo.frames[slot] = echoFrame;
+  }
+  pthread_mutex_unlock(&echo.lock);
+
+  speaker.playedUntilUs += (unsigned long)((uint64_t)frames * 1000000 / speaker.sampleRate);
+  unsigned long dmaUs = (unsigned long)((uint64_t)SIM_SPEAKER_DMA_FRAMES * 1000000 / speaker.sampleRate);
+  unsigned long queuedUs = speaker.playedUntilUs - now;
+  if (queuedUs > dmaUs)
+  {
+    delay((queuedUs - dmaUs) / 1000);
+  }
+  return len;
+}
+
+void audioClear(i2s_port_t port)
+{
+  // Queued samples never play, so they make no echo either
+  unsigned long now = micros();
+  pthread_mutex_lock(&echo.lock);
+  int64_t from = micFrameAt(now) + echo.delayFrames;
+  int64_t to = micFrameAt(speaker.playedUntilUs) + echo.delayFrames;
+  for (int64_t f = from; f < to && f - from < SIM_ECHO_FRAMES; f++)
+  {
+    echo.frames[f & (SIM_ECHO_FRAMES - 1)] = -1;
+  }
+  pthread_mutex_unlock(&echo.lock);
+  speaker.playedUntilUs = now;
+}
+
+bool audioSetRate(i2s_port_t port, uint32_t sampleRate)
+{
+  // The output WAV has one rate, so everything else goes through the resampler
+  return sampleRate == speaker.sampleRate;
+}
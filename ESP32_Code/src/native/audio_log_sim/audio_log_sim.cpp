@@ -0,0 +1,388 @@
+// Host simulation of the raw-partition audio log (audio_log.cpp).
+//
+//   pio run -e audio_log_sim && .pio/build/audio_log_sim/program [options]
+//
+// The partition is a file driven through a NOR flash model: erase sets
+// whole sectors to 0xFF, programming can only clear bits (an attempt to
+// set one is counted and fails the run), and a simulated clock advances by
+// typical SPI NOR timings (4 KB sector erase 45 ms, 64 KB block erase
+// 150 ms, 0.7 ms per 256-byte page program).
+//
+// Recordings of random length are written in capture-sized appends over
+// several wraps of the ring, once with the space erased between recordings
+// (audioLogPrepareStep until done, as the device's workflow task does while
+// idle; the longest step is how long it keeps a new turn waiting) and once
+// with erases left to the appends. Every finished record is read back
+// and checked, the log is reopened at random points to check that the
+// newest record is found again, and some recordings are cut off without
+// audioLogFinish to model power loss. Reports append latency (average,
+// worst case, appends slower than the audio they carry) and throughput.
+//
+// Options:
+//   --flash FILE   Backing file (default audio_log_sim.bin, created)
+//   --size KB      Partition size (default 704, a multiple of 64)
+//   --turns N      Recordings per scenario (default 60)
+//   --seed N       Random seed (default 1)
+#include "audio_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define SIM_SECTOR_SIZE (4096)
+#define SIM_ERASE_BLOCK (64 * 1024)
+#define SIM_PAGE_SIZE (256)
+#define SIM_SECTOR_ERASE_US (45000)
+#define SIM_BLOCK_ERASE_US (150000)
+#define SIM_PAGE_PROGRAM_US (700)
+#define SIM_READ_US_PER_KB (25)            // 40 MHz quad read
+#define SIM_SAMPLE_RATE (16000)
+#define SIM_MAX_RECORD (15 * 16000 * 2)    // CAPTURE_LIMIT with VAD, 16-bit PCM
+#define SIM_MIN_APPEND (256)
+#define SIM_MAX_APPEND (2048)
+
+struct NorFlash
+{
+  FILE *file;
+  uint32_t size;
+  uint64_t nowUs;
+  uint32_t bitViolations; // Programs that tried to turn a 0 into a 1
+  uint32_t eraseOps;
+};
+
+static bool norRead(uint32_t offset, void *buf, size_t len, void *ctx)
+{
+  NorFlash *nor = (NorFlash *)ctx;
+  if (offset + len > nor->size || fseek(nor->file, offset, SEEK_SET) != 0)
+  {
+    return false;
+  }
+  nor->nowUs += (len * SIM_READ_US_PER_KB) / 1024;
+  return fread(buf, 1, len, nor->file) == len;
+}
+
+static bool norWrite(uint32_t offset, const void *buf, size_t len, void *ctx)
+{
+  NorFlash *nor = (NorFlash *)ctx;
+  if (offset + len > nor->size)
+  {
+    return false;
+  }
+  std::vector<uint8_t> cells(len);
+  if (fseek(nor->file, offset, SEEK_SET) != 0 || fread(cells.data(), 1, len, nor->file) != len)
+  {
+    return false;
+  }
+  const uint8_t *data = (const uint8_t *)buf;
+  for (size_t i = 0; i < len; i++)
+  {
+    if (data[i] & ~cells[i])
+    {
+      nor->bitViolations++;
+    }
+    cells[i] &= data[i];
+  }
+  uint32_t pages = (offset + len - 1) / SIM_PAGE_SIZE - offset / SIM_PAGE_SIZE + 1;
+  nor->nowUs += (uint64_t)pages * SIM_PAGE_PROGRAM_US;
+  return fseek(nor->file, offset, SEEK_SET) == 0 && fwrite(cells.data(), 1, len, nor->file) == len;
+}
+
+static bool norErase(uint32_t offset, size_t len, void *ctx)
+{
+  NorFlash *nor = (NorFlash *)ctx;
+  if (offset % SIM_SECTOR_SIZE || len % SIM_SECTOR_SIZE || offset + len > nor->size)
+  {
+    return false;
+  }
+  std::vector<uint8_t> ones(len, 0xFF);
+  nor->nowUs += len == SIM_ERASE_BLOCK ? SIM_BLOCK_ERASE_US : (uint64_t)len / SIM_SECTOR_SIZE * SIM_SECTOR_ERASE_US;
+  nor->eraseOps++;
+  return fseek(nor->file, offset, SEEK_SET) == 0 && fwrite(ones.data(), 1, len, nor->file) == len;
+}
+
+static uint32_t norMicros(void *ctx)
+{
+  return (uint32_t)((NorFlash *)ctx)->nowUs;
+}
+
+static FlashDevice norDevice(NorFlash &nor)
+{
+  FlashDevice dev;
+  dev.read = norRead;
+  dev.write = norWrite;
+  dev.erase = norErase;
+  dev.micros = norMicros;
+  dev.size = nor.size;
+  dev.sectorSize = SIM_SECTOR_SIZE;
+  dev.eraseBlock = SIM_ERASE_BLOCK;
+  dev.ctx = &nor;
+  return dev;
+}
+
+static uint32_t rng(uint32_t &state)
+{
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// Audio content is a function of the record's sequence number and offset,
+// so any record can be checked without keeping a copy
+static uint8_t contentByte(uint32_t seq, uint32_t pos)
+{
+  uint32_t x = seq * 2654435761u + pos * 40503u;
+  return (uint8_t)(x ^ (x >> 13));
+}
+
+static bool verifyRecord(const AudioLog &log, const AudioLogRecord &record)
+{
+  AudioLogReader reader;
+  if (!audioLogOpen(log, record, reader))
+  {
+    return false;
+  }
+  uint8_t buf[1024];
+  uint32_t pos = 0;
+  size_t n;
+  while ((n = audioLogRead(reader, buf, sizeof(buf))) > 0)
+  {
+    for (size_t i = 0; i < n; i++, pos++)
+    {
+      if (buf[i] != contentByte(record.seq, pos))
+      {
+        return false;
+      }
+    }
+  }
+  return pos == record.length;
+}
+
+struct ScenarioResult
+{
+  uint32_t records;
+  uint32_t appends;
+  uint64_t bytes;
+  uint64_t appendUs;
+  uint32_t appendUsMax;
+  uint32_t lateAppends; // Slower than the audio they carry
+  uint32_t lateErases;
+  uint64_t prepareUs;
+  uint32_t prepareStepUsMax;
+  uint32_t reopens;
+  uint32_t powerLosses;
+  uint32_t failures;
+};
+
+static void fail(ScenarioResult &r, const char *what, uint32_t seq)
+{
+  r.failures++;
+  fprintf(stderr, "  record #%u: %s\n", seq, what);
+}
+
+static ScenarioResult runScenario(NorFlash &nor, bool prepare, uint32_t turns, uint32_t seed)
+{
+  ScenarioResult r = {};
+  uint32_t state = seed * 0x9E3779B9u + 1;
+
+  // Start from blank flash each time so both scenarios see the same wear
+  std::vector<uint8_t> ones(nor.size, 0xFF);
+  fseek(nor.file, 0, SEEK_SET);
+  fwrite(ones.data(), 1, ones.size(), nor.file);
+
+  AudioLog log;
+  if (!audioLogInit(log, norDevice(nor)))
+  {
+    fail(r, "init failed", 0);
+    return r;
+  }
+  AudioLogRecord last = {};
+  bool haveLast = false;
+
+  for (uint32_t turn = 0; turn < turns; turn++)
+  {
+    if (prepare)
+    {
+      bool more = true;
+      while (more)
+      {
+        uint64_t start = nor.nowUs;
+        more = audioLogPrepareStep(log, SIM_MAX_RECORD + AUDIO_LOG_HEADER_SIZE);
+        uint32_t us = (uint32_t)(nor.nowUs - start);
+        r.prepareUs += us;
+        r.prepareStepUsMax = us > r.prepareStepUsMax ? us : r.prepareStepUsMax;
+      }
+    }
+    if (!audioLogBegin(log))
+    {
+      fail(r, "begin failed", log.seq + 1);
+      continue;
+    }
+    uint32_t seq = log.seq;
+    uint32_t length = SIM_SAMPLE_RATE + rng(state) % (SIM_MAX_RECORD - SIM_SAMPLE_RATE);
+    bool powerLoss = rng(state) % 8 == 0;
+    if (powerLoss)
+    {
+      length /= 2;
+    }
+
+    uint8_t chunk[SIM_MAX_APPEND];
+    uint32_t pos = 0;
+    uint32_t lateBefore = log.stats.lateErases;
+    while (pos < length)
+    {
+      uint32_t n = SIM_MIN_APPEND + rng(state) % (SIM_MAX_APPEND - SIM_MIN_APPEND + 1);
+      n = n < length - pos ? n : length - pos;
+      for (uint32_t i = 0; i < n; i++)
+      {
+        chunk[i] = contentByte(seq, pos + i);
+      }
+      uint64_t start = nor.nowUs;
+      if (!audioLogAppend(log, chunk, n))
+      {
+        fail(r, "append failed", seq);
+        break;
+      }
+      uint32_t us = (uint32_t)(nor.nowUs - start);
+      r.appends++;
+      r.bytes += n;
+      r.appendUs += us;
+      r.appendUsMax = us > r.appendUsMax ? us : r.appendUsMax;
+      // The last append of a record can be a few bytes; hold it to a full
+      // minimum-size append's worth of audio
+      uint32_t audioBytes = n > SIM_MIN_APPEND ? n : SIM_MIN_APPEND;
+      if ((uint64_t)us * SIM_SAMPLE_RATE * 2 > (uint64_t)audioBytes * 1000000)
+      {
+        r.lateAppends++;
+      }
+      pos += n;
+    }
+    r.lateErases += log.stats.lateErases - lateBefore;
+
+    if (powerLoss)
+    {
+      // Reboot mid-record: the open record must be ignored, and the
+      // previous one found unless the open one already ran over it
+      r.powerLosses++;
+      haveLast = haveLast && log.newest != UINT64_MAX;
+      if (!audioLogInit(log, norDevice(nor)))
+      {
+        fail(r, "reinit after power loss failed", seq);
+        return r;
+      }
+      AudioLogRecord latest;
+      bool found = audioLogLatest(log, latest);
+      if (found != haveLast || (found && (latest.seq != last.seq || !verifyRecord(log, latest))))
+      {
+        fail(r, "wrong newest record after power loss", seq);
+      }
+      continue;
+    }
+
+    AudioLogRecord record;
+    if (!audioLogFinish(log, record) || record.seq != seq || record.length != length)
+    {
+      fail(r, "finish failed", seq);
+      continue;
+    }
+    if (!verifyRecord(log, record))
+    {
+      fail(r, "read-back mismatch", seq);
+    }
+    // Nothing uploads here; a pending record would hold its space forever
+    if (!audioLogMarkDone(log, record))
+    {
+      fail(r, "mark done failed", seq);
+    }
+    last = record;
+    haveLast = true;
+    r.records++;
+
+    if (rng(state) % 5 == 0)
+    {
+      r.reopens++;
+      if (!audioLogInit(log, norDevice(nor)))
+      {
+        fail(r, "reinit failed", seq);
+        return r;
+      }
+      AudioLogRecord latest;
+      if (!audioLogLatest(log, latest) || latest.seq != last.seq || !verifyRecord(log, latest))
+      {
+        fail(r, "newest record not found after reopen", seq);
+      }
+    }
+  }
+  return r;
+}
+
+static void printResult(const char *name, const ScenarioResult &r)
+{
+  uint64_t writeUs = r.appendUs ? r.appendUs : 1;
+  printf("%-10s %4u rec %8llu KB %7.0f KB/s  append avg %6.0f us  max %7u us  late %4u/%-6u late erases %5u"
+         "  pre-erase %6.1f s (step max %u ms)  reopen %u  power loss %u\n",
+         name, r.records, (unsigned long long)(r.bytes / 1024), r.bytes / 1024.0 * 1e6 / writeUs,
+         r.appends ? (double)r.appendUs / r.appends : 0.0, r.appendUsMax, r.lateAppends, r.appends, r.lateErases,
+         r.prepareUs / 1e6, r.prepareStepUsMax / 1000, r.reopens, r.powerLosses);
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = "audio_log_sim.bin";
+  uint32_t sizeKb = 704;
+  uint32_t turns = 60;
+  uint32_t seed = 1;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--flash") == 0)
+    {
+      path = argv[i + 1];
+    }
+    else if (strcmp(argv[i], "--size") == 0)
+    {
+      sizeKb = atoi(argv[i + 1]);
+    }
+    else if (strcmp(argv[i], "--turns") == 0)
+    {
+      turns = atoi(argv[i + 1]);
+    }
+    else if (strcmp(argv[i], "--seed") == 0)
+    {
+      seed = atoi(argv[i + 1]);
+    }
+    else
+    {
+      fprintf(stderr, "Bad option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (sizeKb == 0 || sizeKb % (SIM_ERASE_BLOCK / 1024))
+  {
+    fprintf(stderr, "--size must be a multiple of %u KB\n", SIM_ERASE_BLOCK / 1024);
+    return 2;
+  }
+
+  NorFlash nor = {};
+  nor.size = sizeKb * 1024;
+  nor.file = fopen(path, "w+b");
+  if (!nor.file)
+  {
+    perror(path);
+    return 2;
+  }
+
+  printf("audio log on %u KB NOR (%u KB sectors, %u KB blocks), %u recordings up to %u KB, seed %u\n", sizeKb,
+         SIM_SECTOR_SIZE / 1024, SIM_ERASE_BLOCK / 1024, turns, SIM_MAX_RECORD / 1024, seed);
+  ScenarioResult prepared = runScenario(nor, true, turns, seed);
+  printResult("prepared", prepared);
+  ScenarioResult onDemand = runScenario(nor, false, turns, seed);
+  printResult("on demand", onDemand);
+  fclose(nor.file);
+
+  if (nor.bitViolations)
+  {
+    fprintf(stderr, "%u programs tried to set bits without an erase\n", nor.bitViolations);
+  }
+  return prepared.failures || onDemand.failures || nor.bitViolations ? 1 : 0;
+}
@@ -0,0 +1,262 @@
+// Host round trip and benchmark for the upload codecs (audio_codec.cpp).
+//
+//   pio run -e codec_bench && .pio/build/codec_bench/program [--mic speech.wav]
+//
+// Encodes speech with IMA-ADPCM and mu-law the way the capture consumer
+// does (blocks of odd length, so the ADPCM nibble carries across calls),
+// decodes it again and reports host ns per sample for the encoder and
+// decoder and the SNR of the round trip. Without --mic the speech is
+// synthetic (voiced syllables through two formants, with pauses).
+//
+// The decoders are also checked against vectors from the backend's
+// decoders (Backend/audioCodec.js), which turn the uploads back into WAV:
+// the device and backend codecs have to agree to the bit.
+//
+// Exits non-zero if a vector doesn't match or a codec's SNR is under its
+// pass mark.
+#include "audio_codec.h"
+#include "../wav_file.h"
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define BENCH_RATE (16000)
+#define BENCH_BLOCK (1023) // Odd on purpose, see above
+#define BENCH_SECONDS (20)
+#define BENCH_MIN_SNR_ADPCM (20.0)
+#define BENCH_MIN_SNR_MULAW (30.0)
+
+// Backend/audioCodec.js output, FNV-1a over the little-endian samples:
+//   decodeImaAdpcm(adpcmVectorStream())  704 samples
+//   decodeMulaw(bytes 0..255)            256 samples
+#define BENCH_JS_ADPCM_FNV (0x190dfaaeu)
+#define BENCH_JS_MULAW_FNV (0x715d95a8u)
+
+struct SpotCheck
+{
+  int index;
+  int16_t value;
+};
+
+static const SpotCheck jsAdpcmSpots[] = {
+    {0, 0}, {2, 1}, {100, 6534}, {511, -32768}, {543, 32767}, {607, -32768}, {703, -30812},
+};
+static const SpotCheck jsMulawSpots[] = {
+    {0x00, -32124}, {0x0f, -16764}, {0x7f, 0}, {0x80, 32124}, {0xff, 0}, {0x55, -716}, {0xd5, 716},
+};
+
+// Every code pair, then runs that pin the step index at both ends and
+// clip the predictor both ways
+static std::vector<uint8_t> adpcmVectorStream()
+{
+  std::vector<uint8_t> stream;
+  for (int i = 0; i < 256; i++)
+  {
+    stream.push_back((uint8_t)i);
+  }
+  stream.insert(stream.end(), 32, 0x77);
+  stream.insert(stream.end(), 32, 0xFF);
+  stream.insert(stream.end(), 32, 0x08);
+  return stream;
+}
+
+static uint32_t fnv1a(const int16_t *samples, size_t count)
+{
+  uint32_t hash = 0x811c9dc5u;
+  for (size_t i = 0; i < count; i++)
+  {
+    uint16_t s = (uint16_t)samples[i];
+    hash = (hash ^ (s & 0xFF)) * 16777619u;
+    hash = (hash ^ (s >> 8)) * 16777619u;
+  }
+  return hash;
+}
+
+static int checkVectors(const char *name, const std::vector<int16_t> &decoded, uint32_t fnv, const SpotCheck *spots,
+                        size_t spotCount)
+{
+  int failed = 0;
+  for (size_t i = 0; i < spotCount; i++)
+  {
+    if (decoded[spots[i].index] != spots[i].value)
+    {
+      printf("  %s sample %d is %d, backend decodes %d\n", name, spots[i].index, decoded[spots[i].index],
+             spots[i].value);
+      failed++;
+    }
+  }
+  uint32_t hash = fnv1a(decoded.data(), decoded.size());
+  if (hash != fnv)
+  {
+    printf("  %s decodes to hash %08x, backend %08x\n", name, hash, fnv);
+    failed++;
+  }
+  return failed;
+}
+
+static int checkBackendVectors()
+{
+  std::vector<uint8_t> stream = adpcmVectorStream();
+  std::vector<int16_t> adpcm(stream.size() * 2);
+  AdpcmState state;
+  adpcmInit(state);
+  adpcmDecode(state, adpcm.data(), stream.data(), stream.size());
+
+  std::vector<int16_t> mulaw(256);
+  for (int i = 0; i < 256; i++)
+  {
+    mulaw[i] = mulawDecode((uint8_t)i);
+  }
+
+  return checkVectors("ima-adpcm", adpcm, BENCH_JS_ADPCM_FNV, jsAdpcmSpots,
+                      sizeof(jsAdpcmSpots) / sizeof(jsAdpcmSpots[0])) +
+         checkVectors("mulaw", mulaw, BENCH_JS_MULAW_FNV, jsMulawSpots,
+                      sizeof(jsMulawSpots) / sizeof(jsMulawSpots[0]));
+}
+
+static uint32_t benchRandom()
+{
+  static uint32_t state = 12345;
+  state = state * 1664525 + 1013904223;
+  return state;
+}
+
+// Syllables of a harmonic source through two formants, separated by pauses
+static std::vector<int16_t> syntheticSpeech(double seconds)
+{
+  std::vector<int16_t> out((size_t)(seconds * BENCH_RATE), 0);
+  size_t pos = BENCH_RATE / 4;
+  while (pos < out.size())
+  {
+    size_t len = (size_t)(BENCH_RATE * (0.15 + 0.15 * (benchRandom() % 100) / 100.0));
+    double f0 = 100 + benchRandom() % 120;
+    double f1 = 400 + benchRandom() % 500;
+    double f2 = 1000 + benchRandom() % 1400;
+    double level = 3000 + benchRandom() % 9000;
+    for (size_t i = 0; i < len && pos + i < out.size(); i++)
+    {
+      double t = (double)i / BENCH_RATE;
+      double v = 0;
+      for (int h = 1; f0 * h < 4000; h++)
+      {
+        double f = f0 * h;
+        double w = 1 / (1 + pow((f - f1) / 150, 2)) + 0.5 / (1 + pow((f - f2) / 250, 2));
+        v += w * sin(2 * M_PI * f * t) / h;
+      }
+      out[pos + i] = (int16_t)lrint(level * sin(M_PI * i / len) * v);
+    }
+    pos += len + (size_t)(BENCH_RATE * (0.05 + 0.3 * (benchRandom() % 100) / 100.0));
+  }
+  return out;
+}
+
+static double snrDb(const std::vector<int16_t> &ref, const std::vector<int16_t> &out)
+{
+  double signal = 0, noise = 0;
+  for (size_t i = 0; i < ref.size() && i < out.size(); i++)
+  {
+    double e = (double)out[i] - ref[i];
+    signal += (double)ref[i] * ref[i];
+    noise += e * e;
+  }
+  return noise > 0 ? 10 * log10(signal / noise) : 200;
+}
+
+static double nsSince(std::chrono::steady_clock::time_point t0)
+{
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char **argv)
+{
+  const char *micPath = NULL;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--mic") == 0)
+    {
+      micPath = argv[i + 1];
+    }
+    else
+    {
+      fprintf(stderr, "Bad option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  std::vector<int16_t> speech;
+  if (micPath)
+  {
+    int16_t *samples;
+    size_t count;
+    uint32_t rate;
+    if (!simLoadWav(micPath, samples, count, rate))
+    {
+      fprintf(stderr, "Cannot open %s\n", micPath);
+      return 2;
+    }
+    speech.assign(samples, samples + count);
+    free(samples);
+  }
+  else
+  {
+    speech = syntheticSpeech(BENCH_SECONDS);
+  }
+  size_t n = speech.size();
+
+  int failed = checkBackendVectors();
+  printf("Backend decoder vectors: %s\n", failed ? "FAILED" : "ok");
+
+  // IMA-ADPCM, encoded block by block like the capture consumer
+  std::vector<uint8_t> adpcm(n / 2 + 2);
+  std::vector<int16_t> adpcmOut(adpcm.size() * 2);
+  AdpcmState enc;
+  adpcmInit(enc);
+  size_t bytes = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t pos = 0; pos < n; pos += BENCH_BLOCK)
+  {
+    size_t len = n - pos < BENCH_BLOCK ? n - pos : BENCH_BLOCK;
+    bytes += adpcmEncode(enc, adpcm.data() + bytes, speech.data() + pos, len);
+  }
+  bytes += adpcmFlush(enc, adpcm.data() + bytes);
+  double adpcmEncNs = nsSince(t0);
+  AdpcmState dec;
+  adpcmInit(dec);
+  t0 = std::chrono::steady_clock::now();
+  adpcmOut.resize(adpcmDecode(dec, adpcmOut.data(), adpcm.data(), bytes));
+  double adpcmDecNs = nsSince(t0);
+
+  // mu-law
+  std::vector<uint8_t> mulaw(n);
+  std::vector<int16_t> mulawOut(n);
+  t0 = std::chrono::steady_clock::now();
+  for (size_t pos = 0; pos < n; pos += BENCH_BLOCK)
+  {
+    size_t len = n - pos < BENCH_BLOCK ? n - pos : BENCH_BLOCK;
+    mulawEncodeBlock(mulaw.data() + pos, speech.data() + pos, len);
+  }
+  double mulawEncNs = nsSince(t0);
+  t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+  {
+    mulawOut[i] = mulawDecode(mulaw[i]);
+  }
+  double mulawDecNs = nsSince(t0);
+
+  double adpcmSnr = snrDb(speech, adpcmOut);
+  double mulawSnr = snrDb(speech, mulawOut);
+  printf("%-10s %11s %11s %8s %8s %8s\n", "codec", "enc ns/smp", "dec ns/smp", "ratio", "SNR dB", "min");
+  printf("%-10s %11.2f %11.2f %7.1f:1 %8.1f %8.1f\n", audioEncodingName(AUDIO_ENCODING_IMA_ADPCM), adpcmEncNs / n,
+         adpcmDecNs / n, 2.0 * n / bytes, adpcmSnr, BENCH_MIN_SNR_ADPCM);
+  printf("%-10s %11.2f %11.2f %7.1f:1 %8.1f %8.1f\n", audioEncodingName(AUDIO_ENCODING_MULAW), mulawEncNs / n,
+         mulawDecNs / n, 2.0, mulawSnr, BENCH_MIN_SNR_MULAW);
+  printf("(%.1f s of %s speech)\n", (double)n / BENCH_RATE, micPath ? micPath : "synthetic");
+
+  failed += adpcmOut.size() < n || adpcmSnr < BENCH_MIN_SNR_ADPCM;
+  failed += mulawSnr < BENCH_MIN_SNR_MULAW;
+  return failed ? 1 : 0;
+}
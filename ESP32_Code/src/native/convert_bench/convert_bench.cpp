@@ -0,0 +1,214 @@
+// Host benchmark and accuracy check for the mic sample conversion
+// (sample_convert.h).
+//
+//   pio run -e convert_bench && .pio/build/convert_bench/program [--blocks N]
+//
+// Checks converterRunSlots against fixed golden vectors: unity and boosted
+// gain, rounding of the fractional bits, saturation and the clip count for
+// 32- and 16-bit slots, in place like the device runs it, and the gain the
+// block-rate AGC steps to after quiet, normal and loud blocks. Then times
+// both slot widths over a DMA buffer (1024 slots, like the capture reader's
+// reads) and reports host ns per sample and samples per us.
+// Exits non-zero on any mismatch.
+#include "sample_convert.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define BENCH_DMA_SLOTS (1024)
+#define BENCH_GOLDEN_MAX (8)
+
+// 16-bit sample in the top of a 32-bit slot, the way the INMP441 sends it
+#define SLOT32(s) ((int32_t)((uint32_t)(int32_t)(s) << 16))
+
+struct GoldenCase
+{
+  const char *name;
+  int32_t gainQ8;
+  int count;
+  int32_t in[BENCH_GOLDEN_MAX]; // Slots, 32- or 16-bit by the table
+  int16_t out[BENCH_GOLDEN_MAX];
+  uint32_t clipped;
+};
+
+static const GoldenCase golden32[] = {
+    {"unity", CONVERT_GAIN_UNITY, 8,
+     {0, SLOT32(1), SLOT32(-1), SLOT32(1000), SLOT32(-32768), SLOT32(32767), 0x7FFFFF00, (int32_t)0x80000000},
+     {0, 1, -1, 1000, -32768, 32767, 32767, -32768},
+     0},
+    // Fractions below the 4 bits the gain keeps are floored
+    {"fraction", CONVERT_GAIN_UNITY, 4, {0x00018000, -0x00018000, 0x00000FFF, 0x0000F000}, {1, -2, 0, 0}, 0},
+    {"+6 dB", 2 * CONVERT_GAIN_UNITY, 5,
+     {SLOT32(1000), SLOT32(16383), SLOT32(20000), SLOT32(-20000), SLOT32(-1)},
+     {2000, 32766, 32767, -32768, -2},
+     2},
+    {"max gain", CONVERT_GAIN_MAX, 4, {SLOT32(1), SLOT32(9), SLOT32(100), SLOT32(-100)}, {15, 143, 1599, -1600}, 0},
+};
+
+static const GoldenCase golden16[] = {
+    {"unity", CONVERT_GAIN_UNITY, 6, {0, 1, -1, 1000, -32768, 32767}, {0, 1, -1, 1000, -32768, 32767}, 0},
+    {"+6 dB", 2 * CONVERT_GAIN_UNITY, 5, {1000, 16383, 20000, -20000, -1}, {2000, 32766, 32767, -32768, -2}, 2},
+    {"max gain", CONVERT_GAIN_MAX, 4, {1, 9, 100, -100}, {15, 143, 1599, -1600}, 0},
+};
+
+// One AGC block: every slot at level, then the gain the AGC should pick
+struct AgcStep
+{
+  int16_t level;
+  int16_t out;    // Converted with the gain from before the block
+  int32_t gainQ8; // After the block
+};
+
+struct AgcCase
+{
+  const char *name;
+  int32_t startQ8;
+  int steps;
+  AgcStep step[4];
+};
+
+static const AgcCase agcCases[] = {
+    // Under the gate the gain holds; above it, +1/32 + 1 per block
+    {"gate, release", CONVERT_GAIN_UNITY, 3, {{2, 2, 256}, {1000, 1000, 265}, {1000, 1035, 274}}},
+    // Attack jumps to target / peak, never under unity
+    {"attack", 2048, 3, {{1000, 8000, 2113}, {8000, 32767, 524}, {20000, 32767, 256}}},
+    {"ceiling", 4000, 1, {{1000, 15625, CONVERT_GAIN_MAX}}},
+};
+
+static int checkOutput(const char *width, const GoldenCase &c, const int16_t *out, uint32_t clipped)
+{
+  int failed = 0;
+  for (int i = 0; i < c.count; i++)
+  {
+    if (out[i] != c.out[i])
+    {
+      printf("  %s %s: sample %d is %d, expected %d\n", width, c.name, i, out[i], c.out[i]);
+      failed++;
+    }
+  }
+  if (clipped != c.clipped)
+  {
+    printf("  %s %s: %u clipped, expected %u\n", width, c.name, clipped, c.clipped);
+    failed++;
+  }
+  return failed;
+}
+
+static int checkGolden()
+{
+  int failed = 0;
+  for (const GoldenCase &c : golden32)
+  {
+    SampleConverter conv;
+    converterInit(conv, c.gainQ8, false);
+    int32_t slots[BENCH_GOLDEN_MAX];
+    memcpy(slots, c.in, sizeof(slots));
+    // In place, as I2SAudioRecord_dataScale does
+    converterRunSlots<32>(conv, (int16_t *)slots, slots, c.count);
+    failed += checkOutput("32-bit", c, (const int16_t *)slots, conv.clipped);
+  }
+  for (const GoldenCase &c : golden16)
+  {
+    SampleConverter conv;
+    converterInit(conv, c.gainQ8, false);
+    int16_t slots[BENCH_GOLDEN_MAX];
+    for (int i = 0; i < c.count; i++)
+    {
+      slots[i] = (int16_t)c.in[i];
+    }
+    converterRunSlots<16>(conv, slots, slots, c.count);
+    failed += checkOutput("16-bit", c, slots, conv.clipped);
+  }
+  for (const AgcCase &c : agcCases)
+  {
+    SampleConverter conv;
+    converterInit(conv, c.startQ8, true);
+    for (int s = 0; s < c.steps; s++)
+    {
+      int32_t slots[16];
+      int16_t out[16];
+      for (int i = 0; i < 16; i++)
+      {
+        slots[i] = SLOT32(i & 1 ? -c.step[s].level : c.step[s].level);
+      }
+      converterRun(conv, out, slots, 16);
+      if (out[0] != c.step[s].out || conv.gainQ8 != c.step[s].gainQ8)
+      {
+        printf("  AGC %s block %d: out %d gain %d, expected %d gain %d\n", c.name, s + 1, out[0], conv.gainQ8,
+               c.step[s].out, c.step[s].gainQ8);
+        failed++;
+      }
+    }
+  }
+  return failed;
+}
+
+// Speech-like level: a slow sweep through the 16-bit range, some clipping
+// at the 4x gain the timing runs with
+template <typename Slot>
+static void fillSlots(std::vector<Slot> &slots, int shift)
+{
+  uint32_t seed = 1;
+  for (size_t i = 0; i < slots.size(); i++)
+  {
+    seed = seed * 1664525 + 1013904223;
+    int32_t s = (int32_t)(seed >> 16) - 32768;
+    slots[i] = (Slot)((uint32_t)s << shift);
+  }
+}
+
+template <uint16_t SlotBits>
+static double timeSlots(uint32_t blocks, uint32_t &sink)
+{
+  typedef typename ConvertSlot<SlotBits>::Type Slot;
+  std::vector<Slot> slots(BENCH_DMA_SLOTS);
+  std::vector<int16_t> out(BENCH_DMA_SLOTS);
+  fillSlots(slots, SlotBits - 16);
+  SampleConverter conv;
+  converterInit(conv, 4 * CONVERT_GAIN_UNITY, false);
+
+  auto t0 = std::chrono::steady_clock::now();
+  for (uint32_t b = 0; b < blocks; b++)
+  {
+    converterRunSlots<SlotBits>(conv, out.data(), slots.data(), BENCH_DMA_SLOTS);
+    sink += (uint16_t)out[b % BENCH_DMA_SLOTS];
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+  return ns / ((double)blocks * BENCH_DMA_SLOTS);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t blocks = 20000;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--blocks") == 0)
+    {
+      blocks = (uint32_t)atoi(argv[i + 1]);
+    }
+    else
+    {
+      fprintf(stderr, "Bad option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  int failed = checkGolden();
+  printf("Golden vectors: %s\n", failed ? "FAILED" : "ok");
+
+  uint32_t sink = 0;
+  double ns32 = timeSlots<32>(blocks, sink);
+  double ns16 = timeSlots<16>(blocks, sink);
+  printf("%-14s %10s %12s   (%u blocks of %u slots)\n", "slot width", "ns/sample", "samples/us", blocks,
+         BENCH_DMA_SLOTS);
+  printf("%-14s %10.2f %12.1f\n", "32-bit", ns32, 1000 / ns32);
+  printf("%-14s %10.2f %12.1f\n", "16-bit", ns16, 1000 / ns16);
+  if (sink == 1)
+  {
+    printf("\n"); // Keeps the timed loops from being optimised away
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,416 @@
+// Host benchmark and regression check for the mic front end (front_end.cpp).
+//
+//   pio run -e front_end_bench && .pio/build/front_end_bench/program
+//   .pio/build/front_end_bench/program --corpus clean.txt --noise room.wav --snr 5
+//
+// Clean speech is mixed with noise at --snr dB (speech power over noise
+// power) and run through the front end in 1024-sample blocks, the size of
+// a converted capture block. Without --corpus a synthetic utterance is
+// used (voiced syllables with formants and fricative bursts); without
+// --noise the noise is white plus pink-ish rumble, 50 Hz hum and a DC
+// offset, the things the INMP441 picks up in a kitchen.
+//
+// Quality is measured against the clean speech run through the linear
+// stages only (dc, highpass, preemph), aligned by the denoiser's latency:
+//   raw      noisy input against clean input
+//   linear   noisy through the linear stages
+//   full     noisy through the whole chain
+// as global SNR and segmental SNR over speech frames (the closer proxy for
+// recognition accuracy). Word error rate needs the backend's recogniser;
+// --out DIR writes the noisy and processed audio for a run through it.
+//
+// Cost is host time per block for each stage and the share of real time.
+// On the device the same stages are timed in CPU cycles after every
+// capture, against FRONT_END_BUDGET_PCT.
+//
+// Then the endpoint check: BENCH_ROOM_CAPTURES captures of steady room
+// noise (no speech), each started with frontEndReset like runCapture does,
+// through a freshly initialised full chain into the VAD the capture
+// endpoints with. Every
+// one has to end in VAD_NO_SPEECH; the first after init isn't enough,
+// later captures start from the state the previous one left.
+//
+// Exits non-zero if the full chain's average segmental SNR gain over the
+// linear stages is under --min-gain dB (default 2), or if the VAD hears
+// speech in the room noise.
+//
+// Options:
+//   --corpus LIST   Clean 16 kHz WAVs, one path per line ('#' comments)
+//   --noise WAV     Noise to mix in, looped
+//   --snr DB        Mix level (default 10)
+//   --out DIR       Write <name>.noisy.wav and <name>.front_end.wav
+//   --min-gain DB   Pass mark for the segmental SNR gain (default 2)
+#include "front_end.h"
+#include "vad.h"
+#include "../wav_file.h"
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define BENCH_RATE (16000)
+#define BENCH_BLOCK (1024)        // Samples per capture block after conversion
+#define BENCH_SKIP_MS (250)       // Settling time left out of the scores
+#define BENCH_SEG_LEN (256)       // Segmental SNR frame
+#define BENCH_SEG_ACTIVE_DB (-35) // Frames this far under the loudest are pauses
+#define BENCH_ROOM_CAPTURES (4)
+#define BENCH_ROOM_RMS (400)      // -38 dBFS, a noisy room
+#define BENCH_ROOM_DC (-600)      // The INMP441's idle offset
+
+struct BenchScores
+{
+  double snr;
+  double segSnr;
+};
+
+static uint32_t benchRandom()
+{
+  static uint32_t state = 12345;
+  state = state * 1664525 + 1013904223;
+  return state;
+}
+
+static double benchNoise()
+{
+  return ((int32_t)benchRandom() >> 1) / 1073741824.0;
+}
+
+static uint32_t hostClock()
+{
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Syllables of a harmonic source through two formants, some with a
+// fricative onset, separated by short pauses
+static std::vector<double> syntheticSpeech(double seconds)
+{
+  std::vector<double> out((size_t)(seconds * BENCH_RATE), 0.0);
+  size_t pos = BENCH_RATE / 2;
+  while (pos < out.size())
+  {
+    size_t len = (size_t)(BENCH_RATE * (0.15 + 0.15 * (benchRandom() % 100) / 100.0));
+    double f0 = 100 + benchRandom() % 120;
+    double f1 = 400 + benchRandom() % 500;
+    double f2 = 1000 + benchRandom() % 1400;
+    bool fricative = benchRandom() % 3 == 0;
+    for (size_t i = 0; i < len && pos + i < out.size(); i++)
+    {
+      double t = (double)i / BENCH_RATE;
+      double env = sin(M_PI * i / len);
+      double v = 0;
+      for (int h = 1; f0 * h < 4000; h++)
+      {
+        double f = f0 * h * (1 + 0.05 * t);
+        double w = 1 / (1 + pow((f - f1) / 150, 2)) + 0.5 / (1 + pow((f - f2) / 250, 2));
+        v += w * sin(2 * M_PI * f * t) / h;
+      }
+      if (fricative && i < len / 3)
+      {
+        v = 0.4 * benchNoise() * (1 - 3.0 * i / len) + v * 3.0 * i / len;
+      }
+      out[pos + i] = 0.25 * env * v;
+    }
+    pos += len + (size_t)(BENCH_RATE * (0.05 + 0.3 * (benchRandom() % 100) / 100.0));
+  }
+  return out;
+}
+
+static std::vector<double> syntheticNoise(size_t count)
+{
+  std::vector<double> out(count);
+  double pink = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    double t = (double)i / BENCH_RATE;
+    pink = 0.995 * pink + 0.05 * benchNoise();
+    out[i] = benchNoise() + 2 * pink + 0.5 * sin(2 * M_PI * 50 * t) + 0.3 * sin(2 * M_PI * 150 * t) + 0.8;
+  }
+  return out;
+}
+
+static double power(const std::vector<double> &v)
+{
+  double sum = 0;
+  for (double x : v)
+  {
+    sum += x * x;
+  }
+  return v.empty() ? 0 : sum / v.size();
+}
+
+static std::vector<int16_t> toPcm(const std::vector<double> &v)
+{
+  std::vector<int16_t> out(v.size());
+  for (size_t i = 0; i < v.size(); i++)
+  {
+    double s = v[i] * 32767;
+    out[i] = (int16_t)(s > 32767 ? 32767 : s < -32768 ? -32768 : lrint(s));
+  }
+  return out;
+}
+
+static std::vector<int16_t> runChain(FrontEnd &fe, const std::vector<int16_t> &in)
+{
+  std::vector<int16_t> out(in);
+  frontEndReset(fe);
+  for (size_t pos = 0; pos < out.size(); pos += BENCH_BLOCK)
+  {
+    size_t n = out.size() - pos < BENCH_BLOCK ? out.size() - pos : BENCH_BLOCK;
+    frontEndRun(fe, out.data() + pos, n);
+  }
+  return out;
+}
+
+// out[i + lag] against ref[i]
+static BenchScores score(const std::vector<int16_t> &ref, const std::vector<int16_t> &out, size_t lag)
+{
+  size_t start = BENCH_RATE * BENCH_SKIP_MS / 1000;
+  size_t end = out.size() - lag;
+  double signal = 0, noise = 0;
+  double loudest = 0;
+  std::vector<double> segSignal, segNoise;
+  for (size_t seg = start; seg + BENCH_SEG_LEN <= end; seg += BENCH_SEG_LEN)
+  {
+    double s = 0, n = 0;
+    for (size_t i = seg; i < seg + BENCH_SEG_LEN; i++)
+    {
+      double d = (double)out[i + lag] - ref[i];
+      s += (double)ref[i] * ref[i];
+      n += d * d;
+    }
+    signal += s;
+    noise += n;
+    loudest = s > loudest ? s : loudest;
+    segSignal.push_back(s);
+    segNoise.push_back(n);
+  }
+
+  double segSum = 0;
+  int segCount = 0;
+  for (size_t i = 0; i < segSignal.size(); i++)
+  {
+    if (segSignal[i] < loudest * pow(10, BENCH_SEG_ACTIVE_DB / 10.0))
+    {
+      continue;
+    }
+    double db = 10 * log10(segSignal[i] / (segNoise[i] + 1e-9));
+    segSum += db < -10 ? -10 : db > 35 ? 35 : db;
+    segCount++;
+  }
+  BenchScores scores;
+  scores.snr = 10 * log10(signal / (noise + 1e-9));
+  scores.segSnr = segCount ? segSum / segCount : 0;
+  return scores;
+}
+
+// Captures of steady noise through the chain and the endpoint VAD.
+// Returns how many heard speech.
+static int checkRoomNoise(const FrontEndConfig &config)
+{
+  static FrontEnd fe;
+  frontEndInit(fe, config);
+  VadConfig vadConfig;
+  vadDefaultConfig(vadConfig, BENCH_RATE);
+  size_t captureLen = (size_t)BENCH_RATE * (vadConfig.noSpeechTimeoutMs + 1000) / 1000;
+  int failed = 0;
+  printf("\nEndpoint on room noise (rms %d):\n", BENCH_ROOM_RMS);
+  for (int c = 0; c < BENCH_ROOM_CAPTURES; c++)
+  {
+    std::vector<int16_t> block(BENCH_BLOCK);
+    Vad vad;
+    vadInit(vad, vadConfig);
+    frontEndReset(fe);
+    VadState state = VAD_WAITING;
+    size_t pos = 0;
+    for (; pos < captureLen && state == VAD_WAITING; pos += BENCH_BLOCK)
+    {
+      for (int16_t &s : block)
+      {
+        // Uniform noise, rms = range / sqrt(3)
+        s = (int16_t)lrint(BENCH_ROOM_DC + BENCH_ROOM_RMS * sqrt(3.0) * benchNoise());
+      }
+      frontEndRun(fe, block.data(), block.size());
+      state = vadProcess(vad, block.data(), block.size());
+    }
+    bool ok = state == VAD_NO_SPEECH;
+    printf("  capture %d: %s after %u ms, noise floor %u\n", c + 1,
+           ok ? "no speech" : state == VAD_WAITING ? "still waiting" : "SPEECH", (unsigned)(pos * 1000 / BENCH_RATE),
+           vad.noiseFloor);
+    failed += !ok;
+  }
+  return failed;
+}
+
+static bool loadClean(const char *path, std::vector<double> &speech)
+{
+  int16_t *samples;
+  size_t count;
+  uint32_t rate;
+  if (!simLoadWav(path, samples, count, rate))
+  {
+    return false;
+  }
+  if (rate != BENCH_RATE)
+  {
+    fprintf(stderr, "%s: %u Hz, the front end runs at %u Hz\n", path, rate, BENCH_RATE);
+    free(samples);
+    return false;
+  }
+  speech.resize(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    speech[i] = samples[i] / 32768.0;
+  }
+  free(samples);
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const char *corpusPath = NULL;
+  const char *noisePath = NULL;
+  const char *outDir = NULL;
+  double snrDb = 10;
+  double minGain = 2;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--corpus") == 0)
+      corpusPath = argv[i + 1];
+    else if (strcmp(argv[i], "--noise") == 0)
+      noisePath = argv[i + 1];
+    else if (strcmp(argv[i], "--out") == 0)
+      outDir = argv[i + 1];
+    else if (strcmp(argv[i], "--snr") == 0)
+      snrDb = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "--min-gain") == 0)
+      minGain = atof(argv[i + 1]);
+    else
+    {
+      fprintf(stderr, "Bad option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  std::vector<std::string> paths;
+  if (corpusPath)
+  {
+    FILE *corpus = fopen(corpusPath, "r");
+    if (!corpus)
+    {
+      fprintf(stderr, "Cannot open %s\n", corpusPath);
+      return 2;
+    }
+    char line[512];
+    char path[480];
+    while (fgets(line, sizeof(line), corpus))
+    {
+      if (line[0] != '#' && sscanf(line, "%479s", path) == 1)
+      {
+        paths.push_back(path);
+      }
+    }
+    fclose(corpus);
+  }
+  else
+  {
+    paths.push_back("synthetic");
+  }
+
+  std::vector<double> noiseLoop;
+  if (noisePath && !loadClean(noisePath, noiseLoop))
+  {
+    return 2;
+  }
+
+  static FrontEnd full, linear, clean;
+  FrontEndConfig config;
+  frontEndDefaultConfig(config, BENCH_RATE);
+  FrontEndConfig fullConfig = config;
+  config.clock = hostClock;
+  frontEndInit(full, config);
+  config.denoise = false;
+  config.clock = NULL;
+  frontEndInit(linear, config);
+  frontEndInit(clean, config);
+
+  printf("%-28s %8s %8s %8s   %8s %8s %8s\n", "file", "raw", "linear", "full", "seg raw", "seg lin", "seg full");
+  double gainSum = 0;
+  int files = 0;
+  for (const std::string &path : paths)
+  {
+    std::vector<double> speech;
+    if (corpusPath ? !loadClean(path.c_str(), speech) : (speech = syntheticSpeech(8.0), false))
+    {
+      continue;
+    }
+    std::vector<double> noise(speech.size());
+    if (noiseLoop.empty())
+    {
+      noise = syntheticNoise(speech.size());
+    }
+    else
+    {
+      for (size_t i = 0; i < noise.size(); i++)
+      {
+        noise[i] = noiseLoop[i % noiseLoop.size()];
+      }
+    }
+    double scale = sqrt(power(speech) / (power(noise) * pow(10, snrDb / 10)));
+    std::vector<double> mixed(speech.size());
+    for (size_t i = 0; i < mixed.size(); i++)
+    {
+      mixed[i] = speech[i] + scale * noise[i];
+    }
+
+    std::vector<int16_t> cleanIn = toPcm(speech);
+    std::vector<int16_t> noisy = toPcm(mixed);
+    std::vector<int16_t> ref = runChain(clean, cleanIn);
+    std::vector<int16_t> lin = runChain(linear, noisy);
+    std::vector<int16_t> out = runChain(full, noisy);
+
+    BenchScores raw = score(cleanIn, noisy, 0);
+    BenchScores linScores = score(ref, lin, 0);
+    BenchScores fullScores = score(ref, out, frontEndLatency(full));
+    const char *name = strrchr(path.c_str(), '/') ? strrchr(path.c_str(), '/') + 1 : path.c_str();
+    printf("%-28.28s %8.1f %8.1f %8.1f   %8.1f %8.1f %8.1f\n", name, raw.snr, linScores.snr, fullScores.snr,
+           raw.segSnr, linScores.segSnr, fullScores.segSnr);
+    gainSum += fullScores.segSnr - linScores.segSnr;
+    files++;
+
+    if (outDir)
+    {
+      std::string base = std::string(outDir) + "/" + name;
+      simSaveWav((base + ".noisy.wav").c_str(), noisy.data(), noisy.size(), BENCH_RATE);
+      simSaveWav((base + ".front_end.wav").c_str(), out.data() + frontEndLatency(full),
+                 out.size() - frontEndLatency(full), BENCH_RATE);
+    }
+  }
+  if (!files)
+  {
+    fprintf(stderr, "No usable files\n");
+    return 2;
+  }
+
+  double blockNs = BENCH_BLOCK * 1e9 / BENCH_RATE;
+  printf("\nCost per %d-sample block (%.0f ms) on this host:\n", BENCH_BLOCK, blockNs / 1e6);
+  printf("%-10s %10s %10s %10s\n", "stage", "avg us", "max us", "% of rt");
+  for (int i = 0; i < full.stageCount; i++)
+  {
+    const FrontEndStage &stage = full.stages[i];
+    double avg = full.blocks ? (double)stage.ticks / full.blocks : 0;
+    printf("%-10s %10.1f %10.1f %10.3f\n", stage.name, avg / 1000, stage.ticksMax / 1000.0, avg / blockNs * 100);
+  }
+
+  double gain = gainSum / files;
+  printf("\nSegmental SNR gain over the linear stages: %.1f dB (pass mark %.1f dB) at %.0f dB input SNR\n", gain,
+         minGain, snrDb);
+
+  int roomFailed = checkRoomNoise(fullConfig);
+  return gain >= minGain && roomFailed == 0 ? 0 : 1;
+}
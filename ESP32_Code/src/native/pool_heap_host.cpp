@@ -0,0 +1,23 @@
+#include "buffer_pool.h"
+
+#include <stdlib.h>
+
+// The host heap doesn't fragment in any way worth reporting; the figures
+// are fixed so the pool code runs unchanged
+#define HOST_HEAP_SIZE (320 * 1024)
+
+void *poolReserve(size_t &size, bool &external)
+{
+  external = false;
+  return malloc(size);
+}
+
+uint32_t poolHeapFree()
+{
+  return HOST_HEAP_SIZE;
+}
+
+uint32_t poolHeapLargestBlock()
+{
+  return HOST_HEAP_SIZE;
+}
@@ -0,0 +1,205 @@
+// Host benchmark for the response conversion path (wav_stream.cpp and
+// resampler.cpp).
+//
+//   pio run -e resample_bench && .pio/build/resample_bench/program [--seconds S]
+//
+// For each source format a TTS service might return, builds a WAV of a
+// 1 kHz tone (with a LIST chunk in front of the data, like ffmpeg and most
+// TTS APIs write), then feeds it through the parser and resampler in
+// 1 KiB reads to 16 kHz mono, the way the device's playback reader does.
+// Reports host time per output sample and per input frame, and the SNR of
+// the output against an ideal 1 kHz tone at 16 kHz as a quality check.
+// Exits non-zero if a format fails to parse or the SNR is under 40 dB.
+#include "resampler.h"
+#include "wav_stream.h"
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define BENCH_OUT_RATE (16000)
+#define BENCH_READ_LEN (1024)
+#define BENCH_TONE_HZ (1000.0)
+#define BENCH_MIN_SNR_DB (40.0)
+
+struct BenchFormat
+{
+  uint32_t sampleRate;
+  uint16_t channels;
+  uint16_t bitsPerSample;
+};
+
+static const BenchFormat benchFormats[] = {
+    {16000, 1, 16}, {16000, 2, 16}, {8000, 1, 8},   {22050, 1, 16}, {24000, 1, 16},
+    {24000, 2, 16}, {32000, 1, 16}, {44100, 2, 16}, {48000, 1, 16}, {48000, 2, 24},
+};
+
+static void put32(std::vector<uint8_t> &v, uint32_t x)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    v.push_back((x >> (8 * i)) & 0xFF);
+  }
+}
+
+static void put16(std::vector<uint8_t> &v, uint16_t x)
+{
+  v.push_back(x & 0xFF);
+  v.push_back(x >> 8);
+}
+
+static std::vector<uint8_t> makeWav(const BenchFormat &f, double seconds)
+{
+  uint32_t frames = (uint32_t)(f.sampleRate * seconds);
+  uint32_t frameBytes = f.channels * f.bitsPerSample / 8;
+  uint32_t dataSize = frames * frameBytes;
+  static const char list[] = "INFOISFT\x0e\0\0\0Lavf60.16.100\0";
+  uint32_t listSize = sizeof(list) - 1;
+
+  std::vector<uint8_t> wav;
+  wav.insert(wav.end(), {'R', 'I', 'F', 'F'});
+  put32(wav, 4 + 24 + 8 + listSize + 8 + dataSize);
+  wav.insert(wav.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+  put32(wav, 16);
+  put16(wav, WAV_FORMAT_PCM);
+  put16(wav, f.channels);
+  put32(wav, f.sampleRate);
+  put32(wav, f.sampleRate * frameBytes);
+  put16(wav, frameBytes);
+  put16(wav, f.bitsPerSample);
+  wav.insert(wav.end(), {'L', 'I', 'S', 'T'});
+  put32(wav, listSize);
+  wav.insert(wav.end(), list, list + listSize);
+  wav.insert(wav.end(), {'d', 'a', 't', 'a'});
+  put32(wav, dataSize);
+
+  for (uint32_t i = 0; i < frames; i++)
+  {
+    double x = 0.5 * sin(2 * M_PI * BENCH_TONE_HZ * i / f.sampleRate);
+    for (int c = 0; c < f.channels; c++)
+    {
+      int32_t s = (int32_t)lrint(x * 2147483647.0);
+      switch (f.bitsPerSample)
+      {
+      case 8:
+        wav.push_back((uint8_t)((s >> 24) + 128));
+        break;
+      case 16:
+        put16(wav, (uint16_t)(s >> 16));
+        break;
+      case 24:
+        wav.push_back((s >> 8) & 0xFF);
+        put16(wav, (uint16_t)(s >> 16));
+        break;
+      }
+    }
+  }
+  return wav;
+}
+
+// Parses and converts a whole file in device-sized reads
+static bool convert(const std::vector<uint8_t> &wav, std::vector<int16_t> &out)
+{
+  static WavParser parser;
+  static Resampler rs;
+  WavFormat fallback = {1, BENCH_OUT_RATE, 16, 2};
+  wavParserInit(parser, fallback);
+  bool ready = false;
+  uint8_t buf[BENCH_READ_LEN];
+  int16_t samples[BENCH_READ_LEN / 2];
+
+  for (size_t pos = 0; pos < wav.size(); pos += BENCH_READ_LEN)
+  {
+    size_t len = wav.size() - pos < BENCH_READ_LEN ? wav.size() - pos : BENCH_READ_LEN;
+    memcpy(buf, wav.data() + pos, len);
+    len = wavParserRun(parser, buf, len);
+    WavFormat format;
+    if (!ready && wavParserFormat(parser, format))
+    {
+      if (!resamplerInit(rs, format, BENCH_OUT_RATE))
+      {
+        return false;
+      }
+      ready = true;
+    }
+    size_t done = 0;
+    while (done < len)
+    {
+      size_t used;
+      size_t n = resamplerRun(rs, buf + done, len - done, used, samples, BENCH_READ_LEN / 2);
+      out.insert(out.end(), samples, samples + n);
+      done += used;
+    }
+  }
+  if (!ready || parser.state == WAV_PARSE_ERROR)
+  {
+    return false;
+  }
+  size_t n = resamplerFlush(rs, samples, BENCH_READ_LEN / 2);
+  out.insert(out.end(), samples, samples + n);
+  return true;
+}
+
+// Output against the ideal tone, skipping the filter's edges
+static double toneSnr(const std::vector<int16_t> &out)
+{
+  double signal = 0, noise = 0;
+  for (size_t i = RESAMPLE_TAPS; i + RESAMPLE_TAPS < out.size(); i++)
+  {
+    double ideal = 0.5 * 32767 * sin(2 * M_PI * BENCH_TONE_HZ * i / BENCH_OUT_RATE);
+    signal += ideal * ideal;
+    noise += (out[i] - ideal) * (out[i] - ideal);
+  }
+  return noise > 0 ? 10 * log10(signal / noise) : 200;
+}
+
+int main(int argc, char **argv)
+{
+  double seconds = 10;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--seconds") == 0)
+    {
+      seconds = atof(argv[i + 1]);
+    }
+    else
+    {
+      fprintf(stderr, "Bad option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  printf("%-22s %10s %12s %12s %10s\n", "source -> 16 kHz mono", "ns/out", "ns/in frame", "x realtime",
+         "SNR dB");
+  int failed = 0;
+  for (const BenchFormat &f : benchFormats)
+  {
+    std::vector<uint8_t> wav = makeWav(f, seconds);
+    std::vector<int16_t> out;
+    out.reserve((size_t)(BENCH_OUT_RATE * seconds) + 64);
+
+    auto t0 = std::chrono::steady_clock::now();
+    bool ok = convert(wav, out);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+
+    char name[32];
+    snprintf(name, sizeof(name), "%u Hz %u ch %u-bit", f.sampleRate, f.channels, f.bitsPerSample);
+    if (!ok || out.empty())
+    {
+      printf("%-22s failed\n", name);
+      failed++;
+      continue;
+    }
+    double snr = toneSnr(out);
+    printf("%-22s %10.1f %12.1f %12.0f %10.1f\n", name, ns / out.size(), ns / (f.sampleRate * seconds),
+           seconds * 1e9 / ns, snr);
+    if (snr < BENCH_MIN_SNR_DB)
+    {
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+// Minimal Arduino core for the native build: time, delay and Serial,
+// which is all the shared pipeline modules use.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+
+typedef uint8_t byte;
+
+// Simulated time. simSetSpeed(n) runs the clock n times faster than the
+// host, so a turn replays quickly while still reporting device time.
+void simSetSpeed(uint32_t speed);
+uint32_t simGetSpeed();
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+
+class HardwareSerial
+{
+public:
+  int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  size_t print(const char *text);
+  size_t println(const char *text = "");
+  size_t println(int value);
+  size_t write(const uint8_t *data, size_t len);
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,9 @@
+// I2S port ids for the native build. Audio goes through audio_hal.h.
+#pragma once
+
+typedef enum
+{
+  I2S_NUM_0 = 0,
+  I2S_NUM_1 = 1,
+  I2S_NUM_MAX
+} i2s_port_t;
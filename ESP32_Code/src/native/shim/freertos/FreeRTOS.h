@@ -0,0 +1,21 @@
+// FreeRTOS subset on POSIX threads for the native build. One tick is one
+// simulated millisecond; priorities and stack sizes are accepted and ignored.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdTRUE (1)
+#define pdFALSE (0)
+#define pdPASS (1)
+#define pdFAIL (0)
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS (1)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configMAX_PRIORITIES (25)
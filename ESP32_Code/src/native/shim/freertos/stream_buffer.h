@@ -0,0 +1,20 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct SimStreamBuffer *StreamBufferHandle_t;
+// The simulation keeps its own control block; only the storage is used
+typedef struct
+{
+  void *unused;
+} StaticStreamBuffer_t;
+
+StreamBufferHandle_t xStreamBufferCreate(size_t size, size_t triggerLevel);
+StreamBufferHandle_t xStreamBufferCreateStatic(size_t size, size_t triggerLevel, uint8_t *storage,
+                                               StaticStreamBuffer_t *state);
+void vStreamBufferDelete(StreamBufferHandle_t buffer);
+size_t xStreamBufferSend(StreamBufferHandle_t buffer, const void *data, size_t len, TickType_t ticks);
+size_t xStreamBufferReceive(StreamBufferHandle_t buffer, void *data, size_t len, TickType_t ticks);
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t buffer);
+size_t xStreamBufferBytesAvailable(StreamBufferHandle_t buffer);
+BaseType_t xStreamBufferReset(StreamBufferHandle_t buffer);
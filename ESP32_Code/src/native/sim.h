@@ -0,0 +1,38 @@
+// Native simulation of the device (env:native): WAV files stand in for the
+// INMP441 and MAX98357A, and an in-process backend stands in for the
+// /uploadAudio, /checkVariable and /broadcastAudio endpoints.
+#pragma once
+
+#include <Arduino.h>
+#include "backend_transport.h"
+#include "wav_file.h"
+
+#define SIM_SPEAKER_DMA_FRAMES (4 * 1024)  // Speaker DMA ring depth
+
+// The mic runs continuously on the sample clock. simMicRewind() starts the
+// samples at the current instant (the button press), simMicSchedule()
+// delayMs from now; otherwise it hears silence.
+void simMicInit(const int16_t *samples, size_t count, uint32_t sampleRate);
+void simMicRewind();
+void simMicSchedule(uint32_t delayMs);
+// The mic also hears the speaker, gainDb below what is played and delayMs
+// after it leaves the DMA ring. Call after simMicInit.
+void simEchoInit(float gainDb, uint32_t delayMs);
+// The speaker records everything written to it, paced to the sample clock
+void simSpeakerInit(uint32_t sampleRate);
+const int16_t *simSpeakerSamples(size_t &count);
+
+struct SimBackendConfig
+{
+  uint32_t rttMs;          // Added to every request
+  uint32_t uplinkKbps;     // Upload bandwidth, 0 for unlimited
+  uint32_t downlinkKbps;   // Response bandwidth, 0 for unlimited
+  uint32_t thinkMs;        // Upload finished to response ready (STT + LLM + TTS)
+  const uint8_t *reply;    // Response WAV file served as is, NULL to echo the upload back
+  size_t replyBytes;
+  uint32_t sampleRate;
+};
+
+void simBackendInit(BackendTransport &transport, const SimBackendConfig &config);
+// Switches the stand-in server off (requests fail as if refused) and on
+void simBackendSetOnline(bool online);
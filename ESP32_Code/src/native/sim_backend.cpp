@@ -0,0 +1,236 @@
+// In-process stand-in for the backend endpoints behind BackendTransport.
+// Decodes uploads like Backend/server.js, then answers with a fixed reply
+// file (or an echo of the upload as 16-bit WAV) after a configurable think
+// time.
+#include "sim.h"
+#include "audio_codec.h"
+#include "voice_turn.h"
+#include "serial_log.h"
+
+#include <vector>
+
+struct SimBackend
+{
+  SimBackendConfig config;
+  AudioEncoding encoding;
+  std::vector<uint8_t> upload;
+  std::vector<int16_t> decoded;
+  std::vector<uint8_t> response; // WAV served by /broadcastAudio
+  char responseHash[17];
+  size_t responsePos;
+  unsigned long readyAtMs;
+  bool ready;
+  unsigned long uplinkBusyUntil;   // Sim us the uplink is free again
+  unsigned long downlinkBusyUntil;
+  bool online;
+};
+
+static SimBackend backend;
+
+// Holds the caller for the time len bytes take on a link of kbps
+static void linkSend(unsigned long &busyUntilUs, uint32_t kbps, size_t len)
+{
+  if (kbps == 0)
+  {
+    return;
+  }
+  unsigned long now = micros();
+  if ((long)(busyUntilUs - now) < 0)
+  {
+    busyUntilUs = now;
+  }
+  busyUntilUs += (unsigned long)((uint64_t)len * 8000 / kbps);
+  if ((long)(busyUntilUs - now) >= 1000)
+  {
+    delay((busyUntilUs - now) / 1000);
+  }
+}
+
+static bool simUploadBegin(AudioEncoding encoding, uint32_t sampleRate, void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  delay(b->config.rttMs);
+  if (!b->online)
+  {
+    return false;
+  }
+  b->encoding = encoding;
+  b->upload.clear();
+  b->ready = false;
+  return true;
+}
+
+static bool simUploadWrite(const uint8_t *data, size_t len, void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  linkSend(b->uplinkBusyUntil, b->config.uplinkKbps, len);
+  b->upload.insert(b->upload.end(), data, data + len);
+  return b->online;
+}
+
+static void simUploadAbort(void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  b->upload.clear();
+}
+
+// Response WAV for the turn, built when the upload completes
+static void simBuildResponse(SimBackend *b)
+{
+  if (b->config.reply)
+  {
+    b->response.assign(b->config.reply, b->config.reply + b->config.replyBytes);
+  }
+  else
+  {
+    const int16_t *pcm = b->decoded.data();
+    size_t count = b->decoded.size();
+    uint32_t dataSize = count * 2;
+    WavHeader header = wavHeaderMake(b->config.sampleRate, 16, 1, dataSize);
+    b->response.assign(header.bytes, header.bytes + TURN_WAV_HEADER_SIZE);
+    b->response.insert(b->response.end(), (const uint8_t *)pcm, (const uint8_t *)(pcm + count));
+  }
+
+  // Content hash like the backend's X-Audio-Hash (FNV-1a here)
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint8_t byte : b->response)
+  {
+    hash = (hash ^ byte) * 0x100000001b3ULL;
+  }
+  snprintf(b->responseHash, sizeof(b->responseHash), "%016llx", (unsigned long long)hash);
+}
+
+static int simUploadFinish(char *reply, size_t replyLen, void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  // Wait for the queued body to drain, then a round trip for the reply
+  linkSend(b->uplinkBusyUntil, b->config.uplinkKbps, 0);
+  delay(b->config.rttMs);
+  if (!b->online)
+  {
+    return -1;
+  }
+
+  b->decoded.clear();
+  if (b->encoding == AUDIO_ENCODING_IMA_ADPCM)
+  {
+    AdpcmState state;
+    adpcmInit(state);
+    b->decoded.resize(b->upload.size() * 2);
+    adpcmDecode(state, b->decoded.data(), b->upload.data(), b->upload.size());
+  }
+  else if (b->encoding == AUDIO_ENCODING_MULAW)
+  {
+    for (uint8_t value : b->upload)
+    {
+      b->decoded.push_back(mulawDecode(value));
+    }
+  }
+  else if (b->upload.size() > TURN_WAV_HEADER_SIZE)
+  {
+    const int16_t *pcm = (const int16_t *)(b->upload.data() + TURN_WAV_HEADER_SIZE);
+    b->decoded.assign(pcm, pcm + (b->upload.size() - TURN_WAV_HEADER_SIZE) / 2);
+  }
+
+  simBuildResponse(b);
+  b->readyAtMs = millis() + b->config.thinkMs;
+  b->ready = true;
+  if (reply && replyLen)
+  {
+    snprintf(reply, replyLen, "[sim] %u bytes %s, %.2f s of speech", (unsigned)b->upload.size(),
+             audioEncodingName(b->encoding), b->decoded.size() / (double)b->config.sampleRate);
+  }
+  return 200;
+}
+
+static int simPollReady(uint32_t waitMs, void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  delay(b->config.rttMs);
+  if (!b->online)
+  {
+    return -1;
+  }
+  if (!b->ready)
+  {
+    return 0;
+  }
+  // Long-poll: hold the request until ready or waitMs runs out
+  long left = (long)(b->readyAtMs - millis());
+  if (left > 0)
+  {
+    delay(left < (long)waitMs ? left : waitMs);
+  }
+  return (long)(b->readyAtMs - millis()) <= 0 ? 1 : 0;
+}
+
+static bool simResponseKey(char *key, size_t len, void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  if (!b->ready || len <= strlen(b->responseHash))
+  {
+    return false;
+  }
+  strcpy(key, b->responseHash);
+  return true;
+}
+
+static int simResponseOpen(void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  delay(b->config.rttMs);
+  b->responsePos = 0;
+  return b->online ? 200 : -1;
+}
+
+static int simResponseRead(uint8_t *buf, size_t len, void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  size_t left = b->response.size() - b->responsePos;
+  if (left == 0)
+  {
+    return -1;
+  }
+  size_t n = len < left ? len : left;
+  linkSend(b->downlinkBusyUntil, b->config.downlinkKbps, n);
+  memcpy(buf, b->response.data() + b->responsePos, n);
+  b->responsePos += n;
+  return n;
+}
+
+static void simResponseClose(void *ctx)
+{
+  SimBackend *b = (SimBackend *)ctx;
+  b->responsePos = 0;
+}
+
+void simBackendInit(BackendTransport &transport, const SimBackendConfig &config)
+{
+  backend.config = config;
+  backend.ready = false;
+  backend.online = true;
+  backend.uplinkBusyUntil = micros();
+  backend.downlinkBusyUntil = micros();
+
+  transport.uploadBegin = simUploadBegin;
+  transport.uploadWrite = simUploadWrite;
+  transport.uploadAbort = simUploadAbort;
+  transport.uploadFinish = simUploadFinish;
+  transport.pollReady = simPollReady;
+  transport.responseKey = simResponseKey;
+  transport.responseOpen = simResponseOpen;
+  transport.responseRead = simResponseRead;
+  transport.responseClose = simResponseClose;
+  transport.ctx = &backend;
+}
+
+void simBackendSetOnline(bool online)
+{
+  if (backend.online != online)
+  {
+    LOG_I("[sim] backend %s\n", online ? "on" : "off");
+  }
+  backend.online = online;
+  // A restarted server has lost the turn in progress
+  backend.ready = backend.ready && online;
+}
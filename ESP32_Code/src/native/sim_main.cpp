@@ -0,0 +1,575 @@
+// Runs the voice turn on the host and reports per-stage latency.
+//
+//   pio run -e native
+//   .pio/build/native/program [options]
+//
+// Options:
+//   --mic FILE        16-bit WAV heard by the mic from the button press on
+//                     (default: a synthetic utterance)
+//   --reply FILE      WAV served as the response, any PCM format (default: echo
+//                     the upload)
+//   --out FILE        Write everything sent to the speaker to a WAV
+//   --turns N         Turns to run (default 3)
+//   --speed N         Run the clock N times faster than real time (default 1)
+//   --encoding NAME   pcm, ima-adpcm or mulaw (default ima-adpcm)
+//   --think MS        Backend processing time (default 1500)
+//   --rtt MS          Round trip added to every request (default 40)
+//   --uplink KBPS     Upload bandwidth, 0 = unlimited (default 1000)
+//   --downlink KBPS   Response bandwidth, 0 = unlimited (default 2000)
+//   --outage A:B      Switch the backend off for turns A to B (1-based). Those
+//                     turns go to the offline queue on a RAM audio log, and
+//                     are uploaded with backoff once the backend is back.
+//   --echo DB         Level the mic hears the speaker at (default -12)
+//   --barge MS        Talk over each response (the --mic utterance again) MS
+//                     after it is ready, on every turn but the last. The
+//                     barge-in detector has to cut the response short; the
+//                     next turn starts from the detection.
+//
+// All times are simulated device milliseconds. Exits non-zero if a turn
+// fails, utterances are left in the queue, a barge-in is missed or the
+// speaker's echo triggers one.
+#include "sim.h"
+#include "sample_convert.h"
+#include "front_end.h"
+#include "voice_turn.h"
+#include "buffer_pool.h"
+#include "utterance_queue.h"
+#include "barge_in.h"
+#include "serial_log.h"
+
+#include <math.h>
+#include <vector>
+
+#define SIM_SAMPLE_RATE (16000)
+#define SIM_POOL_SIZE (128 * 1024) // AUDIO_POOL_SIZE in main.cpp
+#define SIM_LOG_SIZE (704 * 1024)  // "audiolog" in partitions.csv
+#define SIM_LOG_SECTOR (4096)
+#define SIM_LOG_BLOCK (64 * 1024)
+#define SIM_DRAIN_ATTEMPTS (20)    // Retries after the last turn before giving up
+#define SIM_ECHO_DELAY_MS (5)      // Speaker to mic through the enclosure
+#define SIM_BARGE_LEAD_MS (250)    // BARGE_ONSET_LEAD_MS in main.cpp
+
+enum SimStage
+{
+  SIM_BUTTON_TO_CAPTURE,
+  SIM_CAPTURE,
+  SIM_UPLOAD,
+  SIM_SERVER_WAIT,
+  SIM_FIRST_AUDIO,
+  SIM_PLAYBACK,
+  SIM_TURN,
+  SIM_DRAIN,
+  SIM_BARGE_DETECT, // Barge-in speech onset to detection
+  SIM_BARGE_STOP,   // Detection to the speaker going silent
+  SIM_STAGE_COUNT
+};
+
+static const char *const stageNames[SIM_STAGE_COUNT] = {
+    "button_to_capture", "capture", "upload", "server_wait", "first_audio", "playback", "turn", "drain",
+    "barge_detect", "barge_stop"};
+
+enum SimOutcome
+{
+  SIM_TURN_OK,
+  SIM_TURN_QUEUED,
+  SIM_TURN_FAILED,
+  SIM_TURN_INTERRUPTED
+};
+
+// Barge-in wiring of main.cpp: mic and speaker taps around the detector
+struct SimBarge
+{
+  BargeDetector detector;
+  volatile bool armed;
+  volatile bool requested; // TurnConfig.cancel
+  volatile unsigned long detectMs;
+  uint32_t onsetMs;        // Speech onset within the mic utterance
+  uint32_t scheduled;      // Barge-ins the sim talked over a response for
+  uint32_t detected;
+  uint32_t unexpected;     // Detections with nobody talking: echo got through
+};
+
+static SampleConverter converter;
+static FrontEnd frontEnd;
+static SimBarge barge;
+static AudioLog simLog;
+static std::vector<uint8_t> simFlash(SIM_LOG_SIZE, 0xFF);
+
+// Audio log partition in RAM with NOR semantics (audio_log_sim has the
+// timing model; here only the queue logic matters)
+static bool simFlashRead(uint32_t offset, void *buf, size_t len, void *ctx)
+{
+  memcpy(buf, simFlash.data() + offset, len);
+  return true;
+}
+
+static bool simFlashWrite(uint32_t offset, const void *buf, size_t len, void *ctx)
+{
+  const uint8_t *data = (const uint8_t *)buf;
+  for (size_t i = 0; i < len; i++)
+  {
+    simFlash[offset + i] &= data[i];
+  }
+  return true;
+}
+
+static bool simFlashErase(uint32_t offset, size_t len, void *ctx)
+{
+  memset(simFlash.data() + offset, 0xFF, len);
+  return true;
+}
+
+static uint32_t simFlashMicros(void *ctx)
+{
+  return micros();
+}
+
+static bool simLogSink(const uint8_t *data, size_t len, void *ctx)
+{
+  return audioLogAppend(*(AudioLog *)ctx, data, len);
+}
+
+static void simMicTap(const uint8_t *data, size_t len, void *ctx)
+{
+  static int16_t samples[CAPTURE_READ_LEN / CAPTURE_SLOT_BYTES];
+  if (!barge.armed)
+  {
+    return;
+  }
+  const int32_t *slots = (const int32_t *)data;
+  size_t count = len / CAPTURE_SLOT_BYTES;
+  for (size_t i = 0; i < count; i++)
+  {
+    samples[i] = slots[i] >> 16;
+  }
+  if (bargeProcess(barge.detector, samples, count))
+  {
+    barge.armed = false;
+    barge.detectMs = millis();
+    barge.requested = true;
+  }
+}
+
+static void simSpeakerTap(const uint8_t *data, size_t len, void *ctx)
+{
+  if (barge.armed)
+  {
+    bargeReference(barge.detector, (const int16_t *)data, len / sizeof(int16_t));
+  }
+}
+
+static void simSpeakerRate(uint32_t sampleRate)
+{
+  if (barge.armed)
+  {
+    bargeSetReferenceRate(barge.detector, sampleRate);
+  }
+}
+
+// First 16 ms frame above -30 dBFS
+static uint32_t speechOnsetMs(const std::vector<int16_t> &samples, uint32_t rate)
+{
+  size_t frame = rate * 16 / 1000;
+  for (size_t start = 0; start + frame <= samples.size(); start += frame)
+  {
+    uint64_t sumSq = 0;
+    for (size_t i = start; i < start + frame; i++)
+    {
+      sumSq += (int32_t)samples[i] * samples[i];
+    }
+    if (sumSq / frame > 1070000)
+    {
+      return start * 1000 / rate;
+    }
+  }
+  return 0;
+}
+
+static uint32_t simProcess(uint8_t *dst, uint8_t *src, uint32_t len)
+{
+  size_t samples = converterRun(converter, (int16_t *)dst, (const int32_t *)src, len / 4);
+  frontEndRun(frontEnd, (int16_t *)dst, samples);
+  return samples * 2;
+}
+
+static bool simCapture(const TurnConfig &config, unsigned long pressMs, CaptureSink sink, void *sinkCtx,
+                       TurnResult &result)
+{
+  frontEndReset(frontEnd);
+  return turnCapture(config, pressMs, sink, sinkCtx, result);
+}
+
+// The user starts talking 200 ms after the press: ~1.8 s of voiced
+// "speech", then silence
+static std::vector<int16_t> synthesizeUtterance(uint32_t rate)
+{
+  std::vector<int16_t> out(rate * 4);
+  uint32_t seed = 1;
+  for (size_t i = 0; i < out.size(); i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    double noise = ((seed >> 16) & 0x7FFF) / 32768.0 - 0.5;
+    double t = (double)i / rate;
+    double voice = 0;
+    if (t >= 0.2 && t < 2.0)
+    {
+      double envelope = 0.6 + 0.4 * sin(2 * M_PI * 4 * t);
+      for (int h = 1; h <= 5; h++)
+      {
+        voice += sin(2 * M_PI * 140 * h * t) / h;
+      }
+      voice *= 4000 * envelope;
+    }
+    out[i] = (int16_t)(voice + noise * 60);
+  }
+  return out;
+}
+
+static bool parseEncoding(const char *name, AudioEncoding &encoding)
+{
+  const AudioEncoding all[] = {AUDIO_ENCODING_PCM, AUDIO_ENCODING_IMA_ADPCM, AUDIO_ENCODING_MULAW};
+  for (AudioEncoding candidate : all)
+  {
+    if (strcmp(name, audioEncodingName(candidate)) == 0)
+    {
+      encoding = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Offline path of main.cpp: the utterance is recorded to the queue
+static SimOutcome queueTurn(const TurnConfig &config, unsigned long pressMs)
+{
+  TurnResult result;
+  memset(&result, 0, sizeof(result));
+  AudioLogRecord record;
+  if (!queueBegin(config))
+  {
+    return SIM_TURN_FAILED;
+  }
+  bool ok = simCapture(config, pressMs, simLogSink, &simLog, result);
+  bool queued = queueCommit(record, ok && result.hadSpeech);
+  audioLogPrepare(simLog, config.captureLimit + AUDIO_LOG_HEADER_SIZE);
+  return queued ? SIM_TURN_QUEUED : SIM_TURN_FAILED;
+}
+
+// One turn, same sequence as the streaming path in main.cpp. The user
+// started talking at pressMs; with bargeMs they talk over the response too.
+static SimOutcome runTurn(const TurnConfig &config, const BackendTransport &transport, uint32_t *stageMs,
+                          unsigned long pressMs, uint32_t bargeMs)
+{
+  TurnResult result;
+  memset(&result, 0, sizeof(result));
+
+  // Older utterances are answered first, and a dead backend means offline
+  if (queueDepth() > 0 || !transport.uploadBegin(config.encoding, config.sampleRate, transport.ctx))
+  {
+    return queueTurn(config, pressMs);
+  }
+  bool ok = true;
+  if (config.encoding == AUDIO_ENCODING_PCM)
+  {
+    // Sizes get rewritten by the backend, like the device's streamed header
+    uint8_t header[TURN_WAV_HEADER_SIZE] = {'R', 'I', 'F', 'F'};
+    ok = transport.uploadWrite(header, sizeof(header), transport.ctx);
+  }
+  ok = ok && simCapture(config, pressMs, turnUploadSink, (void *)&transport, result);
+  unsigned long captureEnd = millis();
+  if (!ok || !result.hadSpeech)
+  {
+    LOG_W("%s\n", result.hadSpeech ? "Capture failed" : "No speech detected");
+    transport.uploadAbort(transport.ctx);
+    return SIM_TURN_FAILED;
+  }
+
+  char reply[128];
+  int code = transport.uploadFinish(reply, sizeof(reply), transport.ctx);
+  unsigned long uploadEnd = millis();
+  LOG_I("Upload: %d %s\n", code, reply);
+  if (code != 200 || !turnWaitResponse(config, transport))
+  {
+    return SIM_TURN_FAILED;
+  }
+  unsigned long waitEnd = millis();
+  bargeReset(barge.detector);
+  barge.requested = false;
+  barge.armed = true;
+  if (bargeMs)
+  {
+    simMicSchedule(bargeMs);
+    barge.scheduled++;
+  }
+  bool played = turnPlayResponse(config, transport, result);
+  barge.armed = false;
+  if (!played)
+  {
+    return SIM_TURN_FAILED;
+  }
+  unsigned long playEnd = millis();
+
+  // Press to first sample kept, zero when the pre-roll covers the gap
+  uint32_t prerollMs = result.capture.prerollBytes / (config.sampleRate / 1000 * CAPTURE_SLOT_BYTES);
+  uint32_t lateMs = result.captureStartMs - pressMs;
+  stageMs[SIM_BUTTON_TO_CAPTURE] = lateMs > prerollMs ? lateMs - prerollMs : 0;
+  stageMs[SIM_CAPTURE] = captureEnd - result.captureStartMs;
+  stageMs[SIM_UPLOAD] = uploadEnd - captureEnd;
+  stageMs[SIM_SERVER_WAIT] = waitEnd - uploadEnd;
+  stageMs[SIM_FIRST_AUDIO] = result.firstAudioMs;
+  stageMs[SIM_PLAYBACK] = playEnd - waitEnd;
+  stageMs[SIM_TURN] = playEnd - pressMs;
+
+  if (!barge.requested)
+  {
+    return SIM_TURN_OK;
+  }
+  unsigned long onsetMs = waitEnd + bargeMs + barge.onsetMs;
+  if (!bargeMs || barge.detectMs < onsetMs)
+  {
+    LOG_W("Barge-in with nobody talking, %lu ms into the response\n", barge.detectMs - waitEnd);
+    barge.unexpected++;
+  }
+  else
+  {
+    barge.detected++;
+  }
+  stageMs[SIM_BARGE_DETECT] = barge.detectMs - onsetMs;
+  stageMs[SIM_BARGE_STOP] = result.playback.cancelledAtMs - barge.detectMs;
+  LOG_I("Barge-in detected %u ms after speech onset, speaker silent %u ms later\n", stageMs[SIM_BARGE_DETECT],
+        stageMs[SIM_BARGE_STOP]);
+  return SIM_TURN_INTERRUPTED;
+}
+
+// Uploads queued utterances while attempts are due, like the idle workflow
+static void drainQueue(const TurnConfig &config, const BackendTransport &transport,
+                       std::vector<uint32_t> &drainMs)
+{
+  while (queueDrainDue())
+  {
+    TurnResult result;
+    memset(&result, 0, sizeof(result));
+    unsigned long start = millis();
+    if (!queueDrainOne(config, transport, result))
+    {
+      return;
+    }
+    drainMs.push_back(millis() - start);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *micPath = NULL;
+  const char *replyPath = NULL;
+  const char *outPath = NULL;
+  int turns = 3;
+  uint32_t speed = 1;
+  int outageFrom = 0;
+  int outageTo = -1;
+  float echoDb = -12;
+  uint32_t bargeMs = 0;
+  AudioEncoding encoding = AUDIO_ENCODING_IMA_ADPCM;
+  SimBackendConfig backendConfig = {40, 1000, 2000, 1500, NULL, 0, SIM_SAMPLE_RATE};
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!value)
+    {
+      Serial.printf("Missing value for %s\n", arg);
+      return 2;
+    }
+    i++;
+    if (strcmp(arg, "--mic") == 0)
+      micPath = value;
+    else if (strcmp(arg, "--reply") == 0)
+      replyPath = value;
+    else if (strcmp(arg, "--out") == 0)
+      outPath = value;
+    else if (strcmp(arg, "--turns") == 0)
+      turns = atoi(value);
+    else if (strcmp(arg, "--speed") == 0)
+      speed = atoi(value);
+    else if (strcmp(arg, "--think") == 0)
+      backendConfig.thinkMs = atoi(value);
+    else if (strcmp(arg, "--rtt") == 0)
+      backendConfig.rttMs = atoi(value);
+    else if (strcmp(arg, "--uplink") == 0)
+      backendConfig.uplinkKbps = atoi(value);
+    else if (strcmp(arg, "--downlink") == 0)
+      backendConfig.downlinkKbps = atoi(value);
+    else if (strcmp(arg, "--outage") == 0 && sscanf(value, "%d:%d", &outageFrom, &outageTo) == 2)
+      continue;
+    else if (strcmp(arg, "--echo") == 0)
+      echoDb = atof(value);
+    else if (strcmp(arg, "--barge") == 0)
+      bargeMs = atoi(value);
+    else if (strcmp(arg, "--encoding") != 0 || !parseEncoding(value, encoding))
+    {
+      Serial.printf("Bad option %s %s\n", arg, value);
+      return 2;
+    }
+  }
+  simSetSpeed(speed);
+
+  std::vector<int16_t> micAudio;
+  if (micPath)
+  {
+    int16_t *samples;
+    size_t count;
+    uint32_t rate;
+    if (!simLoadWav(micPath, samples, count, rate))
+    {
+      return 2;
+    }
+    if (rate != SIM_SAMPLE_RATE)
+    {
+      Serial.printf("Warning: %s is %u Hz, played as %u Hz\n", micPath, rate, SIM_SAMPLE_RATE);
+    }
+    micAudio.assign(samples, samples + count);
+    free(samples);
+  }
+  else
+  {
+    micAudio = synthesizeUtterance(SIM_SAMPLE_RATE);
+  }
+
+  std::vector<uint8_t> reply;
+  if (replyPath)
+  {
+    FILE *file = fopen(replyPath, "rb");
+    if (!file)
+    {
+      Serial.printf("Cannot open %s\n", replyPath);
+      return 2;
+    }
+    uint8_t block[4096];
+    size_t n;
+    while ((n = fread(block, 1, sizeof(block), file)) > 0)
+    {
+      reply.insert(reply.end(), block, block + n);
+    }
+    fclose(file);
+    backendConfig.reply = reply.data();
+    backendConfig.replyBytes = reply.size();
+  }
+
+  // Same settings as the device build in main.cpp
+  logBegin();
+  converterInit(converter, CONVERT_GAIN_UNITY, false);
+  FrontEndConfig frontEndConfig;
+  frontEndDefaultConfig(frontEndConfig, SIM_SAMPLE_RATE);
+  frontEndInit(frontEnd, frontEndConfig);
+  const TurnConfig config = {I2S_NUM_0, I2S_NUM_1, SIM_SAMPLE_RATE, SIM_SAMPLE_RATE, SIM_SAMPLE_RATE * 2 * 15,
+                             simProcess, true, 800, 4000, encoding, 30000, 20000, 500, SIM_SAMPLE_RATE * 2 * 250 / 1000,
+                             &barge.requested, simSpeakerRate};
+
+  BackendTransport transport;
+  simMicInit(micAudio.data(), micAudio.size(), SIM_SAMPLE_RATE);
+  simSpeakerInit(SIM_SAMPLE_RATE);
+  simEchoInit(echoDb, SIM_ECHO_DELAY_MS);
+  simBackendInit(transport, backendConfig);
+  poolInit(SIM_POOL_SIZE);
+  captureBegin(config.micPort, config.sampleRate);
+  playbackBegin();
+  BargeConfig bargeConfig;
+  bargeDefaultConfig(bargeConfig, SIM_SAMPLE_RATE);
+  bargeInit(barge.detector, bargeConfig);
+  barge.onsetMs = speechOnsetMs(micAudio, SIM_SAMPLE_RATE);
+  captureSetIdleTap(simMicTap, NULL);
+  playbackSetTap(simSpeakerTap, NULL);
+  FlashDevice flash = {simFlashRead, simFlashWrite, simFlashErase, simFlashMicros, SIM_LOG_SIZE,
+                       SIM_LOG_SECTOR, SIM_LOG_BLOCK, NULL};
+  audioLogInit(simLog, flash);
+  queueInit(simLog, 1);
+
+  std::vector<uint32_t> results[SIM_STAGE_COUNT];
+  int failed = 0;
+  int queued = 0;
+  int interrupted = 0;
+  bool barged = false;
+  for (int turn = 0; turn < turns; turn++)
+  {
+    LOG_I("=== Turn %d ===\n", turn + 1);
+    simBackendSetOnline(turn + 1 < outageFrom || turn + 1 > outageTo);
+    // After a barge-in the user is already talking; the turn starts from
+    // the detection like main.cpp, reaching back into the pre-roll
+    unsigned long pressMs = millis();
+    if (barged)
+    {
+      pressMs = barge.detectMs - SIM_BARGE_LEAD_MS;
+    }
+    else
+    {
+      simMicRewind();
+    }
+    uint32_t stageMs[SIM_STAGE_COUNT];
+    SimOutcome outcome = runTurn(config, transport, stageMs, pressMs, turn + 1 < turns ? bargeMs : 0);
+    if (outcome == SIM_TURN_OK)
+    {
+      for (int s = 0; s < SIM_DRAIN; s++)
+      {
+        results[s].push_back(stageMs[s]);
+      }
+    }
+    if (outcome == SIM_TURN_INTERRUPTED)
+    {
+      for (int s = 0; s < SIM_PLAYBACK; s++)
+      {
+        results[s].push_back(stageMs[s]);
+      }
+      results[SIM_BARGE_DETECT].push_back(stageMs[SIM_BARGE_DETECT]);
+      results[SIM_BARGE_STOP].push_back(stageMs[SIM_BARGE_STOP]);
+    }
+    barged = outcome == SIM_TURN_INTERRUPTED;
+    failed += outcome == SIM_TURN_FAILED;
+    queued += outcome == SIM_TURN_QUEUED;
+    interrupted += barged;
+    drainQueue(config, transport, results[SIM_DRAIN]);
+  }
+
+  // Whatever is still queued goes out once the backoff allows
+  simBackendSetOnline(true);
+  for (int attempt = 0; queueDepth() > 0 && attempt < SIM_DRAIN_ATTEMPTS; attempt++)
+  {
+    delay(queueRetryInMs());
+    drainQueue(config, transport, results[SIM_DRAIN]);
+  }
+
+  LOG_I("\n%d/%d turns completed, %d queued, %d interrupted (%s, think %u ms, rtt %u ms, up %u kbps, "
+        "down %u kbps)\n",
+        turns - failed - queued - interrupted, turns, queued, interrupted, audioEncodingName(encoding),
+        backendConfig.thinkMs, backendConfig.rttMs, backendConfig.uplinkKbps, backendConfig.downlinkKbps);
+  queuePrintStats();
+  LOG_I("Barge-in: %u/%u detected, %u false (echo %.0f dB, coupling %u/65536)\n", barge.detected,
+        barge.scheduled, barge.unexpected, echoDb, barge.detector.stats.couplingQ16);
+  LOG_I("%-18s %8s %8s %8s\n", "stage (ms)", "min", "avg", "max");
+  for (int s = 0; s < SIM_STAGE_COUNT; s++)
+  {
+    if (results[s].empty())
+    {
+      continue;
+    }
+    uint32_t lo = UINT32_MAX, hi = 0;
+    uint64_t sum = 0;
+    for (uint32_t ms : results[s])
+    {
+      lo = ms < lo ? ms : lo;
+      hi = ms > hi ? ms : hi;
+      sum += ms;
+    }
+    LOG_I("%-18s %8u %8u %8u\n", stageNames[s], lo, (uint32_t)(sum / results[s].size()), hi);
+  }
+
+  if (outPath)
+  {
+    size_t count;
+    const int16_t *played = simSpeakerSamples(count);
+    simSaveWav(outPath, played, count, SIM_SAMPLE_RATE);
+  }
+  logFlush();
+  bool bargeOk = barge.detected == barge.scheduled && barge.unexpected == 0;
+  return failed || queueDepth() > 0 || !bargeOk ? 1 : 0;
+}
@@ -0,0 +1,418 @@
+// Arduino time/Serial and the FreeRTOS subset on POSIX threads, scaled by
+// the simulation speed.
+#include <Arduino.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+HardwareSerial Serial;
+
+static uint32_t simSpeed = 1;
+
+static uint64_t hostMicros()
+{
+  static uint64_t start = 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (start == 0)
+  {
+    start = now;
+  }
+  return now - start;
+}
+
+void simSetSpeed(uint32_t speed)
+{
+  simSpeed = speed ? speed : 1;
+}
+
+uint32_t simGetSpeed()
+{
+  return simSpeed;
+}
+
+unsigned long micros()
+{
+  return (unsigned long)(hostMicros() * simSpeed);
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(hostMicros() * simSpeed / 1000);
+}
+
+// Host sleep for a span of simulated time
+static void sleepTicks(TickType_t ticks)
+{
+  uint64_t us = (uint64_t)ticks * 1000 / simSpeed;
+  struct timespec ts = {(time_t)(us / 1000000), (long)(us % 1000000) * 1000};
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+  {
+  }
+}
+
+void delay(uint32_t ms)
+{
+  sleepTicks(ms);
+}
+
+int HardwareSerial::printf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  int n = vprintf(format, args);
+  va_end(args);
+  return n;
+}
+
+size_t HardwareSerial::print(const char *text)
+{
+  return fputs(text, stdout) < 0 ? 0 : strlen(text);
+}
+
+size_t HardwareSerial::println(const char *text)
+{
+  return print(text) + print("\n");
+}
+
+size_t HardwareSerial::println(int value)
+{
+  return printf("%d\n", value);
+}
+
+size_t HardwareSerial::write(const uint8_t *data, size_t len)
+{
+  return fwrite(data, 1, len, stdout);
+}
+
+// Absolute CLOCK_MONOTONIC deadline ticks of simulated time from now
+static void deadline(struct timespec &ts, TickType_t ticks)
+{
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t ns = (uint64_t)ticks * 1000000 / simSpeed + ts.tv_nsec;
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+}
+
+static void condInit(pthread_cond_t &cond)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// Waits on cond until ready() holds or ticks run out. Mutex held by caller.
+template <typename Ready>
+static bool waitFor(pthread_cond_t &cond, pthread_mutex_t &lock, TickType_t ticks, Ready ready)
+{
+  if (ticks == portMAX_DELAY)
+  {
+    while (!ready())
+    {
+      pthread_cond_wait(&cond, &lock);
+    }
+    return true;
+  }
+  struct timespec ts;
+  deadline(ts, ticks);
+  while (!ready())
+  {
+    if (pthread_cond_timedwait(&cond, &lock, &ts) == ETIMEDOUT)
+    {
+      return ready();
+    }
+  }
+  return true;
+}
+
+// A task is a detached thread plus its notification value
+struct SimTask
+{
+  TaskFunction_t task;
+  void *arg;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notifications;
+};
+
+static thread_local SimTask *currentTask;
+
+static void *taskEntry(void *arg)
+{
+  currentTask = (SimTask *)arg;
+  currentTask->task(currentTask->arg);
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stackDepth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle)
+{
+  // Never freed: tasks here live as long as the program
+  SimTask *start = (SimTask *)calloc(1, sizeof(SimTask));
+  if (!start)
+  {
+    return pdFAIL;
+  }
+  start->task = task;
+  start->arg = arg;
+  pthread_mutex_init(&start->lock, NULL);
+  condInit(start->cond);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, taskEntry, start) != 0)
+  {
+    free(start);
+    return pdFAIL;
+  }
+  pthread_detach(thread);
+  if (handle)
+  {
+    *handle = (TaskHandle_t)start;
+  }
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackDepth, void *arg,
+                                   UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+  return xTaskCreate(task, name, stackDepth, arg, priority, handle);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  SimTask *t = (SimTask *)task;
+  pthread_mutex_lock(&t->lock);
+  t->notifications++;
+  pthread_cond_broadcast(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks)
+{
+  SimTask *t = currentTask;
+  if (!t)
+  {
+    return 0;
+  }
+  pthread_mutex_lock(&t->lock);
+  waitFor(t->cond, t->lock, ticks, [t] { return t->notifications > 0; });
+  uint32_t value = t->notifications;
+  if (value)
+  {
+    t->notifications = clearOnExit ? 0 : value - 1;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return value;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+  pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  sleepTicks(ticks);
+}
+
+TickType_t xTaskGetTickCount()
+{
+  return (TickType_t)millis();
+}
+
+struct SimSemaphore
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  UBaseType_t count;
+  UBaseType_t maxCount;
+};
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount)
+{
+  SimSemaphore *sem = (SimSemaphore *)malloc(sizeof(SimSemaphore));
+  if (!sem)
+  {
+    return NULL;
+  }
+  pthread_mutex_init(&sem->lock, NULL);
+  condInit(sem->cond);
+  sem->count = initialCount;
+  sem->maxCount = maxCount;
+  return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return xSemaphoreCreateCounting(1, 1);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+  pthread_mutex_lock(&sem->lock);
+  bool taken = waitFor(sem->cond, sem->lock, ticks, [sem] { return sem->count > 0; });
+  if (taken)
+  {
+    sem->count--;
+  }
+  pthread_mutex_unlock(&sem->lock);
+  return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+  pthread_mutex_lock(&sem->lock);
+  bool given = sem->count < sem->maxCount;
+  if (given)
+  {
+    sem->count++;
+    pthread_cond_broadcast(&sem->cond);
+  }
+  pthread_mutex_unlock(&sem->lock);
+  return given ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+  pthread_cond_destroy(&sem->cond);
+  pthread_mutex_destroy(&sem->lock);
+  free(sem);
+}
+
+struct SimStreamBuffer
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t *data;
+  size_t size;
+  size_t head; // Next byte to read
+  size_t used;
+  size_t trigger;
+  bool ownsData;
+};
+
+StreamBufferHandle_t xStreamBufferCreateStatic(size_t size, size_t triggerLevel, uint8_t *storage,
+                                               StaticStreamBuffer_t *state)
+{
+  SimStreamBuffer *buffer = (SimStreamBuffer *)malloc(sizeof(SimStreamBuffer));
+  if (!buffer)
+  {
+    return NULL;
+  }
+  buffer->data = storage;
+  buffer->ownsData = false;
+  pthread_mutex_init(&buffer->lock, NULL);
+  condInit(buffer->cond);
+  buffer->size = size;
+  buffer->head = 0;
+  buffer->used = 0;
+  buffer->trigger = triggerLevel ? triggerLevel : 1;
+  return buffer;
+}
+
+StreamBufferHandle_t xStreamBufferCreate(size_t size, size_t triggerLevel)
+{
+  uint8_t *data = (uint8_t *)malloc(size);
+  StreamBufferHandle_t buffer = data ? xStreamBufferCreateStatic(size, triggerLevel, data, NULL) : NULL;
+  if (!buffer)
+  {
+    free(data);
+    return NULL;
+  }
+  buffer->ownsData = true;
+  return buffer;
+}
+
+void vStreamBufferDelete(StreamBufferHandle_t buffer)
+{
+  pthread_cond_destroy(&buffer->cond);
+  pthread_mutex_destroy(&buffer->lock);
+  if (buffer->ownsData)
+  {
+    free(buffer->data);
+  }
+  free(buffer);
+}
+
+size_t xStreamBufferSend(StreamBufferHandle_t buffer, const void *data, size_t len, TickType_t ticks)
+{
+  const uint8_t *src = (const uint8_t *)data;
+  size_t sent = 0;
+  pthread_mutex_lock(&buffer->lock);
+  // Like FreeRTOS: wait for room for the whole write, then copy what fits
+  waitFor(buffer->cond, buffer->lock, ticks,
+          [buffer, len] { return buffer->size - buffer->used >= len; });
+  size_t room = buffer->size - buffer->used;
+  size_t n = len < room ? len : room;
+  for (; sent < n; sent++)
+  {
+    buffer->data[(buffer->head + buffer->used + sent) % buffer->size] = src[sent];
+  }
+  buffer->used += sent;
+  if (sent)
+  {
+    pthread_cond_broadcast(&buffer->cond);
+  }
+  pthread_mutex_unlock(&buffer->lock);
+  return sent;
+}
+
+size_t xStreamBufferReceive(StreamBufferHandle_t buffer, void *data, size_t len, TickType_t ticks)
+{
+  uint8_t *dst = (uint8_t *)data;
+  pthread_mutex_lock(&buffer->lock);
+  waitFor(buffer->cond, buffer->lock, ticks, [buffer] { return buffer->used >= buffer->trigger; });
+  size_t n = len < buffer->used ? len : buffer->used;
+  for (size_t i = 0; i < n; i++)
+  {
+    dst[i] = buffer->data[(buffer->head + i) % buffer->size];
+  }
+  buffer->head = (buffer->head + n) % buffer->size;
+  buffer->used -= n;
+  if (n)
+  {
+    pthread_cond_broadcast(&buffer->cond);
+  }
+  pthread_mutex_unlock(&buffer->lock);
+  return n;
+}
+
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t buffer)
+{
+  pthread_mutex_lock(&buffer->lock);
+  size_t space = buffer->size - buffer->used;
+  pthread_mutex_unlock(&buffer->lock);
+  return space;
+}
+
+size_t xStreamBufferBytesAvailable(StreamBufferHandle_t buffer)
+{
+  pthread_mutex_lock(&buffer->lock);
+  size_t used = buffer->used;
+  pthread_mutex_unlock(&buffer->lock);
+  return used;
+}
+
+BaseType_t xStreamBufferReset(StreamBufferHandle_t buffer)
+{
+  pthread_mutex_lock(&buffer->lock);
+  buffer->head = 0;
+  buffer->used = 0;
+  pthread_cond_broadcast(&buffer->cond);
+  pthread_mutex_unlock(&buffer->lock);
+  return pdPASS;
+}
@@ -0,0 +1,256 @@
+// Host tool for the keyword spotter in wake_word.cpp.
+//
+//   pio run -e wake_eval
+//   .pio/build/wake_eval/program --enroll wake.bin kw1.wav kw2.wav kw3.wav
+//   .pio/build/wake_eval/program --templates wake.bin --corpus corpus.txt
+//
+// --enroll builds a template blob from up to WAKE_MAX_TEMPLATES recordings
+// of the keyword (16 kHz mono, ideally recorded on the device's own mic).
+// Copy it to data/wake.bin and upload the SPIFFS image to enable the wake
+// word on the device.
+//
+// --corpus runs every file listed in a text file, one "<keywords> <path>"
+// per line, where <keywords> is how many times the keyword is spoken (0 for
+// negative material such as speech, TV or room noise). Each file goes
+// through a fresh detector hop by hop, like the device. Output:
+//   - false-reject rate (missed keywords / keywords) and false accepts per
+//     hour of audio over a sweep of thresholds, so WAKE_THRESHOLD in
+//     main.cpp can be picked for the target trade-off
+//   - host CPU time per 10 ms hop (avg and max); profile the device with
+//     the hop cost the wake task prints on each detection
+//
+// Options:
+//   --max T       Highest threshold in the sweep (default 1.5)
+//   --steps N     Sweep points (default 15)
+#include "wake_word.h"
+#include "../wav_file.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct EvalFile
+{
+  int keywords;
+  std::vector<float> events; // Lowest score of each candidate detection
+  double seconds;
+};
+
+static WakeDetector detector;
+
+static bool loadMono16k(const char *path, std::vector<int16_t> &audio)
+{
+  int16_t *samples;
+  size_t count;
+  uint32_t rate;
+  if (!simLoadWav(path, samples, count, rate))
+  {
+    return false;
+  }
+  if (rate != WAKE_SAMPLE_RATE)
+  {
+    fprintf(stderr, "%s: %u Hz, the spotter needs %u Hz\n", path, rate, WAKE_SAMPLE_RATE);
+    free(samples);
+    return false;
+  }
+  audio.assign(samples, samples + count);
+  free(samples);
+  return true;
+}
+
+static int enroll(const char *outPath, int count, char **paths)
+{
+  WakeConfig config;
+  wakeDefaultConfig(config);
+  wakeInit(detector, config);
+
+  static float cepstra[WAKE_MAX_TEMPLATE_FRAMES][WAKE_CEPSTRA];
+  for (int i = 0; i < count; i++)
+  {
+    std::vector<int16_t> audio;
+    if (!loadMono16k(paths[i], audio))
+    {
+      return 2;
+    }
+    size_t frames = wakeExtractFeatures(audio.data(), audio.size(), cepstra, WAKE_MAX_TEMPLATE_FRAMES);
+    if (frames < 10 || !wakeAddTemplate(detector, cepstra, frames))
+    {
+      fprintf(stderr, "%s: cannot enroll (%zu frames, %d templates max)\n", paths[i], frames,
+              WAKE_MAX_TEMPLATES);
+      return 2;
+    }
+    printf("Template %d: %s, %zu frames (%zu ms)\n", detector.count, paths[i], frames, frames * 10);
+  }
+
+  std::vector<uint8_t> blob(64 * 1024);
+  size_t len = wakeWriteTemplates(detector, blob.data(), blob.size());
+  FILE *f = fopen(outPath, "wb");
+  if (!f || fwrite(blob.data(), 1, len, f) != len)
+  {
+    fprintf(stderr, "Cannot write %s\n", outPath);
+    if (f)
+      fclose(f);
+    return 2;
+  }
+  fclose(f);
+  printf("Wrote %zu bytes to %s\n", len, outPath);
+  return 0;
+}
+
+// Candidate detections: runs of hops scoring under the sweep ceiling,
+// merged while they are within the refractory period of each other
+static void evalFile(const std::vector<int16_t> &audio, const WakeConfig &config, const std::vector<uint8_t> &blob,
+                     float ceiling, EvalFile &file, double &hopUsSum, double &hopUsMax, uint64_t &hops)
+{
+  wakeInit(detector, config);
+  wakeLoadTemplates(detector, blob.data(), blob.size());
+  long lastBelow = -1000000;
+  for (size_t pos = 0; pos + WAKE_HOP_LEN <= audio.size(); pos += WAKE_HOP_LEN)
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    wakeProcess(detector, audio.data() + pos, WAKE_HOP_LEN);
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+    hopUsSum += us;
+    hopUsMax = us > hopUsMax ? us : hopUsMax;
+    hops++;
+
+    long hop = pos / WAKE_HOP_LEN;
+    float score = detector.lastScore;
+    if (hop < config.warmupHops || score >= ceiling)
+    {
+      continue;
+    }
+    if (hop - lastBelow > config.refractoryHops)
+    {
+      file.events.push_back(score);
+    }
+    else if (score < file.events.back())
+    {
+      file.events.back() = score;
+    }
+    lastBelow = hop;
+  }
+}
+
+static int evaluate(const char *templatePath, const char *corpusPath, float ceiling, int steps)
+{
+  std::vector<uint8_t> blob(64 * 1024);
+  FILE *f = fopen(templatePath, "rb");
+  size_t len = f ? fread(blob.data(), 1, blob.size(), f) : 0;
+  if (f)
+    fclose(f);
+  blob.resize(len);
+
+  WakeConfig config;
+  wakeDefaultConfig(config);
+  config.threshold = -1.0f; // Scores are thresholded here, not in the detector
+  wakeInit(detector, config);
+  int templates = wakeLoadTemplates(detector, blob.data(), len);
+  if (templates == 0)
+  {
+    fprintf(stderr, "No templates in %s\n", templatePath);
+    return 2;
+  }
+
+  FILE *corpus = fopen(corpusPath, "r");
+  if (!corpus)
+  {
+    fprintf(stderr, "Cannot open %s\n", corpusPath);
+    return 2;
+  }
+  std::vector<EvalFile> files;
+  double hopUsSum = 0, hopUsMax = 0;
+  uint64_t hops = 0;
+  char line[512];
+  char path[480];
+  while (fgets(line, sizeof(line), corpus))
+  {
+    EvalFile file;
+    if (line[0] == '#' || sscanf(line, "%d %479s", &file.keywords, path) != 2)
+    {
+      continue;
+    }
+    std::vector<int16_t> audio;
+    if (!loadMono16k(path, audio))
+    {
+      continue;
+    }
+    file.seconds = (double)audio.size() / WAKE_SAMPLE_RATE;
+    evalFile(audio, config, blob, ceiling, file, hopUsSum, hopUsMax, hops);
+    files.push_back(file);
+  }
+  fclose(corpus);
+
+  int keywords = 0;
+  double seconds = 0;
+  for (const EvalFile &file : files)
+  {
+    keywords += file.keywords;
+    seconds += file.seconds;
+  }
+  printf("%zu files, %d keywords, %.1f min of audio, %d templates\n", files.size(), keywords, seconds / 60,
+         templates);
+  printf("%10s %8s %8s %10s\n", "threshold", "FRR %", "FA", "FA/hour");
+  for (int s = 1; s <= steps; s++)
+  {
+    float threshold = ceiling * s / steps;
+    int hits = 0;
+    int falseAccepts = 0;
+    for (const EvalFile &file : files)
+    {
+      int detections = 0;
+      for (float score : file.events)
+      {
+        detections += score < threshold;
+      }
+      int matched = detections < file.keywords ? detections : file.keywords;
+      hits += matched;
+      falseAccepts += detections - matched;
+    }
+    printf("%10.3f %8.1f %8d %10.2f\n", threshold, keywords ? 100.0 * (keywords - hits) / keywords : 0.0,
+           falseAccepts, seconds > 0 ? falseAccepts * 3600.0 / seconds : 0.0);
+  }
+  printf("CPU per %d ms hop: avg %.1f us, max %.1f us (%.2f%% of real time on this host)\n",
+         WAKE_HOP_LEN * 1000 / WAKE_SAMPLE_RATE, hops ? hopUsSum / hops : 0.0, hopUsMax,
+         hops ? hopUsSum / hops / (WAKE_HOP_LEN * 1e6 / WAKE_SAMPLE_RATE) * 100 : 0.0);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc >= 4 && strcmp(argv[1], "--enroll") == 0)
+  {
+    return enroll(argv[2], argc - 3, argv + 3);
+  }
+
+  const char *templatePath = NULL;
+  const char *corpusPath = NULL;
+  float ceiling = 1.5f;
+  int steps = 15;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--templates") == 0)
+      templatePath = argv[i + 1];
+    else if (strcmp(argv[i], "--corpus") == 0)
+      corpusPath = argv[i + 1];
+    else if (strcmp(argv[i], "--max") == 0)
+      ceiling = atof(argv[i + 1]);
+    else if (strcmp(argv[i], "--steps") == 0)
+      steps = atoi(argv[i + 1]);
+    else
+    {
+      fprintf(stderr, "Bad option %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (!templatePath || !corpusPath || steps < 1)
+  {
+    fprintf(stderr, "Usage: %s --enroll OUT.bin WAV...\n"
+                    "       %s --templates FILE --corpus LIST [--max T] [--steps N]\n",
+            argv[0], argv[0]);
+    return 2;
+  }
+  return evaluate(templatePath, corpusPath, ceiling, steps);
+}
@@ -0,0 +1,103 @@
+// 16-bit PCM WAV file I/O for the host programs. Plain stdio, so tools
+// that don't run the simulated device can use it without the shim.
+#include "wav_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t readLe(const uint8_t *p, int bytes)
+{
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--)
+  {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+bool simLoadWav(const char *path, int16_t *&samples, size_t &count, uint32_t &sampleRate)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return false;
+  }
+  uint8_t riff[12];
+  if (fread(riff, 1, 12, f) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0)
+  {
+    fprintf(stderr, "%s is not a WAV file\n", path);
+    fclose(f);
+    return false;
+  }
+
+  uint16_t channels = 0;
+  uint16_t bits = 0;
+  uint8_t chunk[8];
+  while (fread(chunk, 1, 8, f) == 8)
+  {
+    uint32_t size = readLe(chunk + 4, 4);
+    if (memcmp(chunk, "fmt ", 4) == 0)
+    {
+      uint8_t fmt[16];
+      if (size < 16 || fread(fmt, 1, 16, f) != 16)
+      {
+        break;
+      }
+      channels = readLe(fmt + 2, 2);
+      sampleRate = readLe(fmt + 4, 4);
+      bits = readLe(fmt + 14, 2);
+      fseek(f, size - 16 + (size & 1), SEEK_CUR);
+    }
+    else if (memcmp(chunk, "data", 4) == 0)
+    {
+      if (bits != 16 || channels == 0)
+      {
+        fprintf(stderr, "%s: only 16-bit PCM is supported\n", path);
+        break;
+      }
+      size_t frames = size / 2 / channels;
+      int16_t *frame = (int16_t *)malloc(2 * channels);
+      samples = (int16_t *)malloc(frames * 2);
+      count = 0;
+      while (samples && count < frames && fread(frame, 2, channels, f) == channels)
+      {
+        samples[count++] = frame[0];
+      }
+      free(frame);
+      fclose(f);
+      return samples != NULL;
+    }
+    else
+    {
+      fseek(f, size + (size & 1), SEEK_CUR);
+    }
+  }
+  fclose(f);
+  return false;
+}
+
+bool simSaveWav(const char *path, const int16_t *samples, size_t count, uint32_t sampleRate)
+{
+  FILE *f = fopen(path, "wb");
+  if (!f)
+  {
+    return false;
+  }
+  uint32_t dataSize = count * 2;
+  uint8_t header[44] = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ',
+                        16, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                        2, 0, 16, 0, 'd', 'a', 't', 'a', 0, 0, 0, 0};
+  uint32_t fields[][2] = {{4, 36 + dataSize}, {24, sampleRate}, {28, sampleRate * 2}, {40, dataSize}};
+  for (auto &field : fields)
+  {
+    for (int i = 0; i < 4; i++)
+    {
+      header[field[0] + i] = (field[1] >> (8 * i)) & 0xFF;
+    }
+  }
+  bool ok = fwrite(header, 1, 44, f) == 44 && fwrite(samples, 2, count, f) == count;
+  fclose(f);
+  return ok;
+}
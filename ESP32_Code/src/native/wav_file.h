@@ -0,0 +1,9 @@
+// WAV file helpers shared by the host programs in src/native
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 16-bit PCM WAV files; multi-channel input keeps the first channel
+bool simLoadWav(const char *path, int16_t *&samples, size_t &count, uint32_t &sampleRate);
+bool simSaveWav(const char *path, const int16_t *samples, size_t count, uint32_t sampleRate);
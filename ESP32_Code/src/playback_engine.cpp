@@ -0,0 +1,284 @@
+#include "playback_engine.h"
+#include "audio_hal.h"
+#include "buffer_pool.h"
+#include "serial_log.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+
+// Silence written after the last sample so the 4 x 1024 sample TX DMA
+// ring is played out before the caller stops I2S.
+#define PLAYBACK_TAIL_SILENCE (4 * 1024 * 2)
+// Silence written per step while refilling after an underrun (8 ms)
+#define PLAYBACK_SILENCE_LEN (256)
+
+static const uint8_t playbackSilence[PLAYBACK_SILENCE_LEN] = {0};
+
+struct PlaybackSession
+{
+  PlaybackConfig config;
+  PlaybackStats *stats;
+  StreamBufferHandle_t buffer;
+  SemaphoreHandle_t done; // Given once by each task on exit
+  volatile bool sourceDone;
+  unsigned long startMs;
+};
+
+// Tasks and buffers made once by playbackBegin and reused by every run
+struct PlaybackWorkers
+{
+  uint8_t *readChunk;
+  uint8_t *writeChunk;
+  StreamBufferHandle_t buffer;
+  StaticStreamBuffer_t bufferState;
+  TaskHandle_t readerTask; // Notified to start a run
+  TaskHandle_t writerTask;
+  SemaphoreHandle_t done;
+  PlaybackSession *session;
+  PlaybackTap tap;
+  void *tapCtx;
+  bool running;
+};
+
+static PlaybackWorkers workers;
+
+static bool playbackCancelled(const PlaybackSession *session)
+{
+  return session->config.cancel && *session->config.cancel;
+}
+
+static size_t playbackOut(i2s_port_t port, const uint8_t *data, size_t len)
+{
+  size_t written = audioWrite(port, data, len);
+  if (workers.tap)
+  {
+    workers.tap(data, written, workers.tapCtx);
+  }
+  return written;
+}
+
+static void playbackRead(PlaybackSession *session)
+{
+  uint8_t *chunk = workers.readChunk;
+  unsigned long lastData = millis();
+
+  while (!playbackCancelled(session))
+  {
+    int len = session->config.source(chunk, PLAYBACK_CHUNK_LEN, session->config.sourceCtx);
+    if (len < 0)
+    {
+      break;
+    }
+    if (len == 0)
+    {
+      if (millis() - lastData > PLAYBACK_SOURCE_TIMEOUT)
+      {
+        session->stats->sourceTimedOut = true;
+        break;
+      }
+      vTaskDelay(pdMS_TO_TICKS(5));
+      continue;
+    }
+    lastData = millis();
+    session->stats->bytesReceived += len;
+
+    // Blocking here only back-pressures the socket, the writer keeps
+    // playing. Bounded waits so a cancel isn't stuck behind a full buffer.
+    size_t sent = 0;
+    while (sent < (size_t)len && !playbackCancelled(session))
+    {
+      sent += xStreamBufferSend(session->buffer, chunk + sent, len - sent, pdMS_TO_TICKS(10));
+    }
+
+    uint32_t depth = xStreamBufferBytesAvailable(session->buffer);
+    if (depth > session->stats->depthMax)
+    {
+      session->stats->depthMax = depth;
+    }
+  }
+
+  session->sourceDone = true;
+  xSemaphoreGive(session->done);
+}
+
+static void playbackWriteSilence(i2s_port_t port, size_t len)
+{
+  for (size_t i = 0; i < len; i += PLAYBACK_SILENCE_LEN)
+  {
+    playbackOut(port, playbackSilence, PLAYBACK_SILENCE_LEN);
+  }
+}
+
+static void playbackWrite(PlaybackSession *session)
+{
+  PlaybackStats *stats = session->stats;
+  uint8_t *chunk = workers.writeChunk;
+  size_t carry = 0; // Odd byte left over from the previous receive
+  bool buffering = true;
+  bool started = false;
+  // Half a chunk of audio: long enough to let the reader catch up
+  const TickType_t waitTicks = pdMS_TO_TICKS(16);
+
+  while (true)
+  {
+    if (playbackCancelled(session))
+    {
+      // Whatever is queued in DMA goes too; the tail isn't played
+      audioClear(session->config.port);
+      stats->cancelled = true;
+      stats->cancelledAtMs = millis();
+      xSemaphoreGive(session->done);
+      return;
+    }
+    size_t depth = xStreamBufferBytesAvailable(session->buffer);
+
+    if (buffering)
+    {
+      if (depth >= session->config.prebufferBytes || session->sourceDone)
+      {
+        buffering = false;
+      }
+      else if (started)
+      {
+        // Keep the DMA fed with silence while refilling after an underrun
+        playbackWriteSilence(session->config.port, PLAYBACK_SILENCE_LEN);
+        stats->silenceBytes += PLAYBACK_SILENCE_LEN;
+        continue;
+      }
+      else
+      {
+        vTaskDelay(pdMS_TO_TICKS(5));
+        continue;
+      }
+    }
+
+    size_t len = xStreamBufferReceive(session->buffer, chunk + carry, PLAYBACK_CHUNK_LEN - carry, waitTicks);
+    if (len == 0)
+    {
+      if (session->sourceDone && xStreamBufferBytesAvailable(session->buffer) == 0)
+      {
+        break;
+      }
+      stats->underruns++;
+      buffering = true;
+      continue;
+    }
+    len += carry;
+    carry = len & 1;
+    size_t whole = len - carry;
+
+    if (!started)
+    {
+      started = true;
+      stats->startDelayMs = millis() - session->startMs;
+      stats->depthMin = depth;
+    }
+    if (depth < stats->depthMin)
+    {
+      stats->depthMin = depth;
+    }
+
+    if (whole)
+    {
+      stats->bytesPlayed += playbackOut(session->config.port, chunk, whole);
+    }
+    if (carry)
+    {
+      chunk[0] = chunk[whole];
+    }
+  }
+
+  // Push the last samples out of DMA
+  playbackWriteSilence(session->config.port, PLAYBACK_TAIL_SILENCE);
+
+  xSemaphoreGive(session->done);
+}
+
+// The tasks sleep between runs; created once so a turn doesn't allocate
+static void playbackReaderTask(void *arg)
+{
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    playbackRead(workers.session);
+  }
+}
+
+static void playbackWriterTask(void *arg)
+{
+  while (true)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    playbackWrite(workers.session);
+  }
+}
+
+bool playbackBegin()
+{
+  if (workers.running)
+  {
+    return true;
+  }
+  // StreamBuffer storage needs one byte more than its capacity
+  uint8_t *storage = (uint8_t *)poolAlloc(PLAYBACK_BUFFER_SIZE + 1, "playback buffer");
+  workers.readChunk = (uint8_t *)poolAlloc(PLAYBACK_CHUNK_LEN, "playback read");
+  workers.writeChunk = (uint8_t *)poolAlloc(PLAYBACK_CHUNK_LEN + 1, "playback write");
+  workers.buffer = storage ? xStreamBufferCreateStatic(PLAYBACK_BUFFER_SIZE, 1, storage, &workers.bufferState) : NULL;
+  workers.done = xSemaphoreCreateCounting(2, 0);
+  if (!workers.readChunk || !workers.writeChunk || !workers.buffer || !workers.done)
+  {
+    return false;
+  }
+  workers.running = xTaskCreatePinnedToCore(playbackWriterTask, "playWriter", PLAYBACK_WRITER_STACK, NULL,
+                                            PLAYBACK_WRITER_PRIORITY, &workers.writerTask,
+                                            PLAYBACK_WRITER_CORE) == pdPASS &&
+                    xTaskCreatePinnedToCore(playbackReaderTask, "playReader", PLAYBACK_READER_STACK, NULL,
+                                            PLAYBACK_READER_PRIORITY, &workers.readerTask,
+                                            PLAYBACK_READER_CORE) == pdPASS;
+  return workers.running;
+}
+
+bool playbackRun(const PlaybackConfig &config, PlaybackStats &stats)
+{
+  memset(&stats, 0, sizeof(stats));
+  if (!workers.running)
+  {
+    return false;
+  }
+
+  PlaybackSession session;
+  session.config = config;
+  session.stats = &stats;
+  session.sourceDone = false;
+  session.startMs = millis();
+  session.buffer = workers.buffer;
+  session.done = workers.done;
+  if (session.config.prebufferBytes > PLAYBACK_BUFFER_SIZE / 2)
+  {
+    session.config.prebufferBytes = PLAYBACK_BUFFER_SIZE / 2;
+  }
+  xStreamBufferReset(session.buffer);
+
+  workers.session = &session;
+  xTaskNotifyGive(workers.writerTask);
+  xTaskNotifyGive(workers.readerTask);
+  xSemaphoreTake(session.done, portMAX_DELAY);
+  xSemaphoreTake(session.done, portMAX_DELAY);
+  return true;
+}
+
+void playbackSetTap(PlaybackTap tap, void *ctx)
+{
+  workers.tapCtx = ctx;
+  workers.tap = tap;
+}
+
+void playbackPrintStats(const PlaybackStats &stats)
+{
+  LOG_I("Playback: %u bytes received, %u played, start %u ms, %u underruns (%u silence bytes), depth %u..%u/%u%s\n",
+        stats.bytesReceived, stats.bytesPlayed, stats.startDelayMs, stats.underruns,
+        stats.silenceBytes, stats.depthMin, stats.depthMax, PLAYBACK_BUFFER_SIZE,
+        stats.sourceTimedOut ? ", source timed out" : stats.cancelled ? ", cancelled" : "");
+}
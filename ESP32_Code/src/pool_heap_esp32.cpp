@@ -0,0 +1,46 @@
+#include "buffer_pool.h"
+
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+
+// Internal RAM left in the largest block for the Wi-Fi and lwIP buffers
+// allocated after the pool
+#define POOL_INTERNAL_MARGIN (24 * 1024)
+
+void *poolReserve(size_t &size, bool &external)
+{
+  // PSRAM is slower, but only memcpy and the DSP touch these buffers; the
+  // I2S DMA descriptors stay in internal RAM inside the driver
+  external = psramFound();
+  if (external)
+  {
+    void *region = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (region)
+    {
+      return region;
+    }
+    external = false;
+  }
+
+  // Internal RAM is split into a few regions; take what one of them has
+  size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (largest <= POOL_INTERNAL_MARGIN)
+  {
+    return NULL;
+  }
+  if (size > largest - POOL_INTERNAL_MARGIN)
+  {
+    size = (largest - POOL_INTERNAL_MARGIN) & ~(size_t)(POOL_ALIGN - 1);
+  }
+  return heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+uint32_t poolHeapFree()
+{
+  return heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+uint32_t poolHeapLargestBlock()
+{
+  return heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
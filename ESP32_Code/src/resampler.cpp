@@ -0,0 +1,222 @@
+#include "resampler.h"
+
+#include <math.h>
+#include <string.h>
+
+// Samples of zero history in front of the stream, so the first output is
+// centred on the first input sample
+#define RESAMPLE_LEAD (RESAMPLE_TAPS / 2 - 1)
+
+static void resamplerBuildFilter(Resampler &rs)
+{
+  // Cutoff in cycles per input sample, 10% under the lower Nyquist
+  double ratio = rs.outRate < rs.in.sampleRate ? (double)rs.outRate / rs.in.sampleRate : 1.0;
+  double fc = 0.45 * ratio;
+
+  for (int p = 0; p < RESAMPLE_PHASES; p++)
+  {
+    double frac = (double)p / RESAMPLE_PHASES;
+    double taps[RESAMPLE_TAPS];
+    double sum = 0;
+    for (int k = 0; k < RESAMPLE_TAPS; k++)
+    {
+      // Distance from this tap to the output position
+      double d = k - RESAMPLE_LEAD - frac;
+      double x = 2 * M_PI * fc * d;
+      double sinc = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+      double w = 0.42 + 0.5 * cos(2 * M_PI * d / RESAMPLE_TAPS) + 0.08 * cos(4 * M_PI * d / RESAMPLE_TAPS);
+      taps[k] = fabs(d) < RESAMPLE_TAPS / 2.0 ? sinc * w : 0.0;
+      sum += taps[k];
+    }
+    // Unity gain at DC for every phase
+    for (int k = 0; k < RESAMPLE_TAPS; k++)
+    {
+      rs.coef[p][k] = (int16_t)lrint(taps[k] / sum * (1 << RESAMPLE_COEF_BITS));
+    }
+  }
+}
+
+bool resamplerInit(Resampler &rs, const WavFormat &in, uint32_t outRate)
+{
+  memset(&rs, 0, sizeof(rs));
+  if (in.frameBytes == 0 || in.frameBytes > RESAMPLE_MAX_FRAME || in.sampleRate == 0 || outRate == 0)
+  {
+    return false;
+  }
+  rs.in = in;
+  rs.outRate = outRate;
+  rs.bypass = in.sampleRate == outRate;
+  rs.step = (uint32_t)(((uint64_t)in.sampleRate << 16) / outRate);
+  rs.stepRem = (uint32_t)(((uint64_t)in.sampleRate << 16) % outRate);
+  if (!rs.bypass)
+  {
+    rs.histFill = RESAMPLE_LEAD;
+    resamplerBuildFilter(rs);
+  }
+  return true;
+}
+
+// One input frame to a mono 16-bit sample
+static int16_t resamplerFrame(const WavFormat &f, const uint8_t *frame)
+{
+  int32_t sum = 0;
+  for (int c = 0; c < f.channels; c++)
+  {
+    switch (f.bitsPerSample)
+    {
+    case 8:
+      sum += ((int32_t)frame[0] - 128) << 8;
+      break;
+    case 16:
+      sum += (int16_t)(frame[0] | frame[1] << 8);
+      break;
+    case 24:
+      sum += (int16_t)(frame[1] | frame[2] << 8);
+      break;
+    default:
+      sum += (int16_t)(frame[2] | frame[3] << 8);
+      break;
+    }
+    frame += f.bitsPerSample / 8;
+  }
+  return f.channels == 1 ? sum : sum / f.channels;
+}
+
+// Appends whole frames from in to the history. Returns bytes consumed.
+static size_t resamplerFill(Resampler &rs, const uint8_t *in, size_t len)
+{
+  size_t frameBytes = rs.in.frameBytes;
+  size_t used = 0;
+
+  if (rs.partialFill)
+  {
+    size_t take = frameBytes - rs.partialFill < len ? frameBytes - rs.partialFill : len;
+    memcpy(rs.partial + rs.partialFill, in, take);
+    rs.partialFill += take;
+    used += take;
+    if (rs.partialFill < frameBytes)
+    {
+      return used;
+    }
+    rs.hist[rs.histFill++] = resamplerFrame(rs.in, rs.partial);
+    rs.partialFill = 0;
+  }
+
+  size_t room = RESAMPLE_TAPS + RESAMPLE_HIST - rs.histFill;
+  size_t frames = (len - used) / frameBytes;
+  if (frames > room)
+  {
+    frames = room;
+  }
+  if (rs.in.channels == 1 && rs.in.bitsPerSample == 16)
+  {
+    memcpy(rs.hist + rs.histFill, in + used, frames * 2);
+  }
+  else if (rs.in.channels == 2 && rs.in.bitsPerSample == 16)
+  {
+    // Common TTS stereo output, skips the per-channel switch
+    const uint8_t *p = in + used;
+    for (size_t i = 0; i < frames; i++, p += 4)
+    {
+      int32_t left = (int16_t)(p[0] | p[1] << 8);
+      int32_t right = (int16_t)(p[2] | p[3] << 8);
+      rs.hist[rs.histFill + i] = (left + right) >> 1;
+    }
+  }
+  else
+  {
+    for (size_t i = 0; i < frames; i++)
+    {
+      rs.hist[rs.histFill + i] = resamplerFrame(rs.in, in + used + i * frameBytes);
+    }
+  }
+  rs.histFill += frames;
+  used += frames * frameBytes;
+
+  // A trailing partial frame waits for the rest of its bytes
+  if (frames < room && len - used < frameBytes)
+  {
+    memcpy(rs.partial, in + used, len - used);
+    rs.partialFill = len - used;
+    used = len;
+  }
+  return used;
+}
+
+// Emits what the history allows, then drops the samples no longer needed
+static size_t resamplerDrain(Resampler &rs, int16_t *out, size_t maxOut)
+{
+  size_t n = 0;
+
+  if (rs.bypass)
+  {
+    uint32_t read = rs.pos >> 16;
+    n = rs.histFill - read < maxOut ? rs.histFill - read : maxOut;
+    memcpy(out, rs.hist + read, n * 2);
+    rs.pos += n << 16;
+  }
+  else
+  {
+    while (n < maxOut && (rs.pos >> 16) + RESAMPLE_TAPS <= rs.histFill)
+    {
+      const int16_t *x = rs.hist + (rs.pos >> 16);
+      const int16_t *h = rs.coef[(rs.pos & 0xFFFF) * RESAMPLE_PHASES >> 16];
+      int32_t acc = 1 << (RESAMPLE_COEF_BITS - 1);
+      for (int k = 0; k < RESAMPLE_TAPS; k++)
+      {
+        acc += x[k] * h[k];
+      }
+      acc >>= RESAMPLE_COEF_BITS;
+      out[n++] = acc > 32767 ? 32767 : acc < -32768 ? -32768 : acc;
+      rs.pos += rs.step;
+      rs.err += rs.stepRem;
+      if (rs.err >= rs.outRate)
+      {
+        rs.err -= rs.outRate;
+        rs.pos++;
+      }
+    }
+  }
+
+  uint32_t drop = rs.pos >> 16;
+  if (drop > rs.histFill)
+  {
+    drop = rs.histFill;
+  }
+  memmove(rs.hist, rs.hist + drop, (rs.histFill - drop) * 2);
+  rs.histFill -= drop;
+  rs.pos -= drop << 16;
+  return n;
+}
+
+size_t resamplerRun(Resampler &rs, const uint8_t *in, size_t len, size_t &used, int16_t *out, size_t maxOut)
+{
+  size_t n = 0;
+  used = 0;
+
+  while (true)
+  {
+    n += resamplerDrain(rs, out + n, maxOut - n);
+    if (n == maxOut || used == len)
+    {
+      return n;
+    }
+    used += resamplerFill(rs, in + used, len - used);
+  }
+}
+
+size_t resamplerFlush(Resampler &rs, int16_t *out, size_t maxOut)
+{
+  if (!rs.bypass)
+  {
+    // Zeros after the last sample let the filter reach it
+    size_t pad = RESAMPLE_TAPS - RESAMPLE_LEAD;
+    if (pad > RESAMPLE_TAPS + RESAMPLE_HIST - rs.histFill)
+    {
+      pad = RESAMPLE_TAPS + RESAMPLE_HIST - rs.histFill;
+    }
+    memset(rs.hist + rs.histFill, 0, pad * 2);
+    rs.histFill += pad;
+  }
+  return resamplerDrain(rs, out, maxOut);
+}
@@ -0,0 +1,554 @@
+#include "response_cache.h"
+#include "serial_log.h"
+
+#define CACHE_INDEX_MAGIC (0x58494352) // "RCIX"
+#define CACHE_INDEX_VERSION (1)
+
+struct CacheEntry
+{
+  char key[RESPONSE_CACHE_KEY_LEN + 1];
+  bool pinned;
+  uint32_t size;
+  uint32_t lastUsed; // useClock at the last hit or store
+};
+
+struct CacheIndexHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t useClock;
+};
+
+struct ResponseCache
+{
+  fs::FS *fs;
+  uint32_t budget;
+  CacheEntry entries[RESPONSE_CACHE_MAX_ENTRIES];
+  int count;
+  uint32_t useClock;
+  bool indexDirty; // Hits not on flash yet, saved after playback
+  File store;
+  char storeKey[RESPONSE_CACHE_KEY_LEN + 1];
+  uint32_t storeBytes;
+  bool storing;
+  CacheStats stats;
+};
+
+// Cached and pinned responses both play from a file
+struct CacheTransport
+{
+  BackendTransport inner;
+  File play;
+  bool fromFlash;  // This response is a hit
+  bool complete;   // The download reached its end
+  char clip[RESPONSE_CACHE_KEY_LEN + 1];
+};
+
+static ResponseCache cache;
+static CacheTransport cacheTransport;
+static CacheTransport clipTransport;
+
+static bool isHashKey(const char *key)
+{
+  if (strlen(key) != RESPONSE_CACHE_HASH_LEN)
+  {
+    return false;
+  }
+  for (const char *c = key; *c; c++)
+  {
+    if (!isxdigit((unsigned char)*c))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool validKey(const char *key)
+{
+  size_t len = strlen(key);
+  if (len == 0 || len > RESPONSE_CACHE_KEY_LEN)
+  {
+    return false;
+  }
+  for (const char *c = key; *c; c++)
+  {
+    if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_')
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static String cachePath(const char *key)
+{
+  return String(RESPONSE_CACHE_DIR "/") + key + ".wav";
+}
+
+static int cacheFind(const char *key)
+{
+  for (int i = 0; i < cache.count; i++)
+  {
+    if (strcmp(cache.entries[i].key, key) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void cacheUpdateStats()
+{
+  cache.stats.bytesUsed = 0;
+  for (int i = 0; i < cache.count; i++)
+  {
+    cache.stats.bytesUsed += cache.entries[i].size;
+  }
+  cache.stats.entries = cache.count;
+}
+
+static void cacheSaveIndex()
+{
+  File index = cache.fs->open(RESPONSE_CACHE_INDEX, FILE_WRITE);
+  if (!index)
+  {
+    LOG_E("Cache: cannot write index\n");
+    return;
+  }
+  CacheIndexHeader header = {CACHE_INDEX_MAGIC, CACHE_INDEX_VERSION, (uint16_t)cache.count, cache.useClock};
+  index.write((const uint8_t *)&header, sizeof(header));
+  index.write((const uint8_t *)cache.entries, cache.count * sizeof(CacheEntry));
+  index.close();
+  cache.indexDirty = false;
+}
+
+// Hit order only steers eviction, so losing it to a reset costs nothing;
+// it is written once playback is over rather than in front of it
+static void cacheSaveIndexLazy()
+{
+  if (cache.indexDirty)
+  {
+    cacheSaveIndex();
+  }
+}
+
+static bool cacheLoadIndex()
+{
+  File index = cache.fs->open(RESPONSE_CACHE_INDEX, FILE_READ);
+  if (!index)
+  {
+    return false;
+  }
+  CacheIndexHeader header;
+  bool ok = index.read((uint8_t *)&header, sizeof(header)) == sizeof(header) && header.magic == CACHE_INDEX_MAGIC &&
+            header.version == CACHE_INDEX_VERSION && header.count <= RESPONSE_CACHE_MAX_ENTRIES;
+  if (ok)
+  {
+    size_t bytes = header.count * sizeof(CacheEntry);
+    ok = index.read((uint8_t *)cache.entries, bytes) == bytes;
+  }
+  index.close();
+  if (!ok)
+  {
+    return false;
+  }
+  cache.count = header.count;
+  cache.useClock = header.useClock;
+  return true;
+}
+
+static void cacheRemove(int i)
+{
+  cache.fs->remove(cachePath(cache.entries[i].key));
+  cache.entries[i] = cache.entries[--cache.count];
+}
+
+// Brings the index in line with the files: drops entries whose file is
+// gone, picks up files it doesn't list (clips from the SPIFFS image)
+static bool cacheReconcile()
+{
+  bool changed = false;
+  for (int i = cache.count - 1; i >= 0; i--)
+  {
+    if (!validKey(cache.entries[i].key) || !cache.fs->exists(cachePath(cache.entries[i].key)))
+    {
+      cache.entries[i] = cache.entries[--cache.count];
+      changed = true;
+    }
+  }
+
+  File dir = cache.fs->open(RESPONSE_CACHE_DIR);
+  if (!dir)
+  {
+    return changed;
+  }
+  for (File f = dir.openNextFile(); f; f = dir.openNextFile())
+  {
+    // Older cores report the full path, newer ones the base name
+    String name = f.name();
+    name = name.substring(name.lastIndexOf('/') + 1);
+    uint32_t size = f.size();
+    f.close();
+    if (!name.endsWith(".wav"))
+    {
+      continue;
+    }
+    String key = name.substring(0, name.length() - 4);
+    if (!validKey(key.c_str()) || cacheFind(key.c_str()) >= 0 || cache.count == RESPONSE_CACHE_MAX_ENTRIES)
+    {
+      continue;
+    }
+    CacheEntry &entry = cache.entries[cache.count++];
+    strlcpy(entry.key, key.c_str(), sizeof(entry.key));
+    entry.pinned = !isHashKey(entry.key);
+    entry.size = size;
+    entry.lastUsed = 0;
+    changed = true;
+  }
+  dir.close();
+  return changed;
+}
+
+// Evicts least recently used entries until size more bytes and one more
+// entry fit. False if pinned clips alone leave no room.
+static bool cacheMakeRoom(uint32_t size)
+{
+  cacheUpdateStats();
+  while (cache.stats.bytesUsed + size > cache.budget || cache.count == RESPONSE_CACHE_MAX_ENTRIES)
+  {
+    int oldest = -1;
+    for (int i = 0; i < cache.count; i++)
+    {
+      if (!cache.entries[i].pinned && (oldest < 0 || cache.entries[i].lastUsed < cache.entries[oldest].lastUsed))
+      {
+        oldest = i;
+      }
+    }
+    if (oldest < 0)
+    {
+      return false;
+    }
+    LOG_I("Cache: evicting %s (%u bytes)\n", cache.entries[oldest].key, cache.entries[oldest].size);
+    cacheRemove(oldest);
+    cache.stats.evictions++;
+    cacheUpdateStats();
+  }
+  return true;
+}
+
+bool cacheInit(fs::FS &fs, uint32_t budgetBytes)
+{
+  memset(cache.entries, 0, sizeof(cache.entries));
+  cache.fs = &fs;
+  cache.budget = budgetBytes;
+  cache.count = 0;
+  cache.useClock = 0;
+  cache.indexDirty = false;
+  cache.storing = false;
+  memset(&cache.stats, 0, sizeof(cache.stats));
+
+  fs.remove(RESPONSE_CACHE_TEMP);
+  bool loaded = cacheLoadIndex();
+  if (cacheReconcile() || !loaded)
+  {
+    cacheSaveIndex();
+  }
+  if (!cacheMakeRoom(0))
+  {
+    LOG_W("Cache: pinned clips exceed the budget\n");
+  }
+  cacheUpdateStats();
+  LOG_I("Cache: %u entries, %u/%u bytes\n", cache.stats.entries, cache.stats.bytesUsed, cache.budget);
+  return true;
+}
+
+bool cacheHas(const char *key)
+{
+  return cache.fs && cacheFind(key) >= 0;
+}
+
+bool cacheStoreBegin(const char *key)
+{
+  if (!cache.fs || cache.storing || !validKey(key))
+  {
+    return false;
+  }
+  cache.store = cache.fs->open(RESPONSE_CACHE_TEMP, FILE_WRITE);
+  if (!cache.store)
+  {
+    return false;
+  }
+  strlcpy(cache.storeKey, key, sizeof(cache.storeKey));
+  cache.storeBytes = 0;
+  cache.storing = true;
+  return true;
+}
+
+bool cacheStoreWrite(const uint8_t *data, size_t len)
+{
+  if (!cache.storing)
+  {
+    return false;
+  }
+  // Too long to be worth the flash, or the flash is full
+  if (cache.storeBytes + len > RESPONSE_CACHE_MAX_ITEM || cache.store.write(data, len) != len)
+  {
+    cacheStoreAbort();
+    return false;
+  }
+  cache.storeBytes += len;
+  return true;
+}
+
+void cacheStoreAbort()
+{
+  if (!cache.storing)
+  {
+    return;
+  }
+  cache.store.close();
+  cache.fs->remove(RESPONSE_CACHE_TEMP);
+  cache.storing = false;
+}
+
+bool cacheStoreCommit()
+{
+  if (!cache.storing)
+  {
+    return false;
+  }
+  cache.store.close();
+  cache.storing = false;
+
+  int existing = cacheFind(cache.storeKey);
+  if (existing >= 0)
+  {
+    cacheRemove(existing);
+  }
+  String path = cachePath(cache.storeKey);
+  if (cache.storeBytes == 0 || !cacheMakeRoom(cache.storeBytes) || !cache.fs->rename(RESPONSE_CACHE_TEMP, path.c_str()))
+  {
+    cache.fs->remove(RESPONSE_CACHE_TEMP);
+    cacheSaveIndex();
+    return false;
+  }
+
+  CacheEntry &entry = cache.entries[cache.count++];
+  strlcpy(entry.key, cache.storeKey, sizeof(entry.key));
+  entry.pinned = !isHashKey(entry.key);
+  entry.size = cache.storeBytes;
+  entry.lastUsed = ++cache.useClock;
+  cache.stats.stores++;
+  cacheUpdateStats();
+  cacheSaveIndex();
+  LOG_I("Cache: stored %s (%u bytes, %u/%u used)\n", entry.key, entry.size, cache.stats.bytesUsed,
+        cache.budget);
+  return true;
+}
+
+// Opens the entry's file for playback and marks it used. The index is
+// only updated in RAM; cacheSaveIndexLazy writes it after playback.
+static bool cacheOpen(const char *key, File &file)
+{
+  int i = cacheFind(key);
+  if (i < 0)
+  {
+    return false;
+  }
+  file = cache.fs->open(cachePath(key), FILE_READ);
+  cache.indexDirty = true;
+  if (!file)
+  {
+    cache.entries[i] = cache.entries[--cache.count];
+    return false;
+  }
+  cache.entries[i].lastUsed = ++cache.useClock;
+  return true;
+}
+
+static int cacheFileRead(File &file, uint8_t *buf, size_t len)
+{
+  int n = file.read(buf, len);
+  return n > 0 ? n : -1;
+}
+
+static bool cacheUploadBegin(AudioEncoding encoding, uint32_t sampleRate, void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  return t->inner.uploadBegin(encoding, sampleRate, t->inner.ctx);
+}
+
+static bool cacheUploadWrite(const uint8_t *data, size_t len, void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  return t->inner.uploadWrite(data, len, t->inner.ctx);
+}
+
+static void cacheUploadAbort(void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  t->inner.uploadAbort(t->inner.ctx);
+}
+
+static int cacheUploadFinish(char *reply, size_t replyLen, void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  return t->inner.uploadFinish(reply, replyLen, t->inner.ctx);
+}
+
+static int cachePollReady(uint32_t waitMs, void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  return t->inner.pollReady(waitMs, t->inner.ctx);
+}
+
+static bool cacheResponseKey(char *key, size_t len, void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  return t->inner.responseKey(key, len, t->inner.ctx);
+}
+
+static int cacheResponseOpen(void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  char key[RESPONSE_CACHE_KEY_LEN + 1];
+  t->fromFlash = false;
+  t->complete = false;
+
+  if (!cache.fs || !t->inner.responseKey(key, sizeof(key), t->inner.ctx) || !isHashKey(key))
+  {
+    return t->inner.responseOpen(t->inner.ctx);
+  }
+
+  cache.stats.lookups++;
+  if (cacheOpen(key, t->play))
+  {
+    t->fromFlash = true;
+    cache.stats.hits++;
+    cache.stats.bytesSaved += t->play.size();
+    LOG_I("Cache hit %s, %u bytes from flash\n", key, (uint32_t)t->play.size());
+    return 200;
+  }
+
+  int code = t->inner.responseOpen(t->inner.ctx);
+  if (code == 200)
+  {
+    cacheStoreBegin(key);
+  }
+  return code;
+}
+
+static int cacheResponseRead(uint8_t *buf, size_t len, void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  if (t->fromFlash)
+  {
+    return cacheFileRead(t->play, buf, len);
+  }
+  int n = t->inner.responseRead(buf, len, t->inner.ctx);
+  if (n > 0)
+  {
+    cacheStoreWrite(buf, n);
+  }
+  else if (n < 0)
+  {
+    t->complete = true;
+  }
+  return n;
+}
+
+static void cacheResponseClose(void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  if (t->fromFlash)
+  {
+    t->play.close();
+    t->fromFlash = false;
+    cacheSaveIndexLazy();
+    return;
+  }
+  t->inner.responseClose(t->inner.ctx);
+  // Only a body read to its end is kept
+  if (t->complete)
+  {
+    cacheStoreCommit();
+  }
+  else
+  {
+    cacheStoreAbort();
+  }
+  // A stale entry dropped by the lookup
+  cacheSaveIndexLazy();
+}
+
+void cacheTransportInit(BackendTransport &transport, const BackendTransport &inner)
+{
+  cacheTransport.inner = inner;
+  cacheTransport.fromFlash = false;
+
+  transport.uploadBegin = cacheUploadBegin;
+  transport.uploadWrite = cacheUploadWrite;
+  transport.uploadAbort = cacheUploadAbort;
+  transport.uploadFinish = cacheUploadFinish;
+  transport.pollReady = cachePollReady;
+  transport.responseKey = cacheResponseKey;
+  transport.responseOpen = cacheResponseOpen;
+  transport.responseRead = cacheResponseRead;
+  transport.responseClose = cacheResponseClose;
+  transport.ctx = &cacheTransport;
+}
+
+static int clipResponseOpen(void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  if (!cacheOpen(t->clip, t->play))
+  {
+    return 404;
+  }
+  cache.stats.clipPlays++;
+  return 200;
+}
+
+static int clipResponseRead(uint8_t *buf, size_t len, void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  return cacheFileRead(t->play, buf, len);
+}
+
+static void clipResponseClose(void *ctx)
+{
+  CacheTransport *t = (CacheTransport *)ctx;
+  t->play.close();
+  cacheSaveIndexLazy();
+}
+
+bool cacheClipTransport(BackendTransport &transport, const char *key)
+{
+  if (!cacheHas(key))
+  {
+    return false;
+  }
+  strlcpy(clipTransport.clip, key, sizeof(clipTransport.clip));
+
+  memset(&transport, 0, sizeof(transport));
+  transport.responseOpen = clipResponseOpen;
+  transport.responseRead = clipResponseRead;
+  transport.responseClose = clipResponseClose;
+  transport.ctx = &clipTransport;
+  return true;
+}
+
+CacheStats cacheGetStats()
+{
+  return cache.stats;
+}
+
+void cachePrintStats()
+{
+  const CacheStats &s = cache.stats;
+  LOG_I("Cache: %u/%u hits (%u%%), %u bytes saved, %u stored, %u evicted, %u clips played, %u entries %u/%u bytes\n",
+        s.hits, s.lookups, s.lookups ? s.hits * 100 / s.lookups : 0, s.bytesSaved, s.stores, s.evictions,
+        s.clipPlays, s.entries, s.bytesUsed, cache.budget);
+}
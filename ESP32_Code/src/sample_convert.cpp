@@ -0,0 +1,49 @@
+#include "sample_convert.h"
+
+void converterInit(SampleConverter &conv, int32_t gainQ8, bool agc)
+{
+  if (gainQ8 < 1)
+    gainQ8 = 1;
+  if (gainQ8 > CONVERT_GAIN_MAX)
+    gainQ8 = CONVERT_GAIN_MAX;
+
+  conv.gainQ8 = gainQ8;
+  conv.agc = agc;
+  conv.agcTarget = 16384; // -6 dBFS
+  conv.agcMaxGainQ8 = CONVERT_GAIN_MAX; // ~+24 dB
+  conv.agcMinGainQ8 = CONVERT_GAIN_UNITY;
+  conv.agcGate = 64;
+  conv.clipped = 0;
+}
+
+void converterAgc(SampleConverter &conv, int32_t peak)
+{
+  const int32_t gain = conv.gainQ8;
+  // Block peak at unity gain, in 16-bit units
+  int32_t unityPeak = peak >> 4;
+  if (unityPeak >= conv.agcGate)
+  {
+    int32_t outPeak = (peak * gain) >> 12;
+    int32_t next = gain;
+    if (outPeak > conv.agcTarget)
+    {
+      // Fast attack: jump straight to the gain that would hit the target
+      next = (int32_t)((int64_t)conv.agcTarget * 4096 / peak);
+    }
+    else
+    {
+      // Slow release: +1/32 (~0.27 dB) per block
+      next = gain + (gain >> 5) + 1;
+    }
+    if (next > conv.agcMaxGainQ8)
+      next = conv.agcMaxGainQ8;
+    if (next < conv.agcMinGainQ8)
+      next = conv.agcMinGainQ8;
+    conv.gainQ8 = next;
+  }
+}
+
+size_t converterRun(SampleConverter &conv, int16_t *dst, const int32_t *src, size_t count)
+{
+  return converterRunSlots<32>(conv, dst, src, count);
+}
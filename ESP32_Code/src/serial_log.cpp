@@ -0,0 +1,280 @@
+#include "serial_log.h"
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "task_layout.h"
+
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+
+#define LOG_ALIGN (4)
+#define LOG_DRAIN_STACK (3072)
+#define LOG_SHORT_LINE (96) // Formatted on the caller's stack; longer ones straight into the ring
+
+enum LogKind : uint8_t
+{
+  LOG_KIND_FREE = 0, // Reserved, not written yet (or never reserved)
+  LOG_KIND_TEXT,
+  LOG_KIND_BINARY,
+  LOG_KIND_PAD,      // Rest of the ring up to the wrap is unused
+};
+
+// Every record starts on a LOG_ALIGN boundary with this header. kind is
+// stored last; until then the drain stops at the record.
+struct LogHeader
+{
+  uint16_t length; // Payload bytes, a text record's NUL included
+  uint8_t kind;
+  uint8_t count;   // Binary records: arguments
+};
+
+// head and tail count bytes since boot; the offset in the ring is the low
+// bits. Space between them is reserved or waiting to be written out, the
+// rest is zero, so a header the drain reaches before its producer has
+// stored it reads as LOG_KIND_FREE.
+struct LogRing
+{
+  uint8_t bytes[LOG_RING_SIZE] __attribute__((aligned(LOG_ALIGN)));
+  uint32_t head;
+  uint32_t tail;
+  uint32_t reported; // Drops already announced
+  LogStats stats;
+  SemaphoreHandle_t drainLock;
+};
+
+static LogRing ring;
+
+static inline uint32_t logRecordSize(uint32_t length)
+{
+  return (sizeof(LogHeader) + length + LOG_ALIGN - 1) & ~(uint32_t)(LOG_ALIGN - 1);
+}
+
+static void logCount(uint32_t &counter)
+{
+  __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+}
+
+// Claims size contiguous bytes, padding to the end of the ring first if
+// the record would straddle the wrap. NULL when the ring is full.
+static LogHeader *logReserve(uint32_t size)
+{
+  uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+  uint32_t pad;
+  for (;;)
+  {
+    uint32_t offset = head & (LOG_RING_SIZE - 1);
+    pad = LOG_RING_SIZE - offset < size ? LOG_RING_SIZE - offset : 0;
+    uint32_t tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+    if (head + pad + size - tail > LOG_RING_SIZE)
+    {
+      logCount(ring.stats.dropped);
+      return NULL;
+    }
+    if (__atomic_compare_exchange_n(&ring.head, &head, head + pad + size, true, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED))
+    {
+      break;
+    }
+  }
+  if (pad)
+  {
+    LogHeader *filler = (LogHeader *)&ring.bytes[head & (LOG_RING_SIZE - 1)];
+    __atomic_store_n(&filler->kind, (uint8_t)LOG_KIND_PAD, __ATOMIC_RELEASE);
+  }
+  return (LogHeader *)&ring.bytes[(head + pad) & (LOG_RING_SIZE - 1)];
+}
+
+static void logCommit(LogHeader *record, uint32_t length, LogKind kind, uint8_t count)
+{
+  record->length = (uint16_t)length;
+  record->count = count;
+  __atomic_store_n(&record->kind, (uint8_t)kind, __ATOMIC_RELEASE);
+  logCount(ring.stats.written);
+}
+
+static void logCountLevel(uint8_t level)
+{
+  if (level == LOG_LEVEL_ERROR)
+  {
+    logCount(ring.stats.errors);
+  }
+  else if (level == LOG_LEVEL_WARN)
+  {
+    logCount(ring.stats.warnings);
+  }
+}
+
+void logWrite(uint8_t level, const char *format, ...)
+{
+  logCountLevel(level);
+  char line[LOG_SHORT_LINE];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (n < 0)
+  {
+    return;
+  }
+  uint32_t length = (uint32_t)n;
+  if (length >= LOG_LINE_MAX)
+  {
+    length = LOG_LINE_MAX - 1;
+    logCount(ring.stats.cut);
+  }
+  // Stored with its NUL, which vsnprintf needs room for
+  LogHeader *record = logReserve(logRecordSize(length + 1));
+  if (!record)
+  {
+    return;
+  }
+  char *text = (char *)(record + 1);
+  if (length < sizeof(line))
+  {
+    memcpy(text, line, length + 1);
+  }
+  else
+  {
+    va_start(args, format);
+    vsnprintf(text, length + 1, format, args);
+    va_end(args);
+    if (length + 1 == LOG_LINE_MAX)
+    {
+      text[length - 1] = '\n';
+    }
+  }
+  logCommit(record, length + 1, LOG_KIND_TEXT, 0);
+}
+
+void logWriteWords(uint8_t level, const char *format, const uint32_t *args, uint8_t count)
+{
+  logCountLevel(level);
+  if (count > LOG_BINARY_ARGS)
+  {
+    count = LOG_BINARY_ARGS;
+  }
+  uint32_t length = sizeof(format) + count * sizeof(uint32_t);
+  LogHeader *record = logReserve(logRecordSize(length));
+  if (!record)
+  {
+    return;
+  }
+  uint8_t *payload = (uint8_t *)(record + 1);
+  memcpy(payload, &format, sizeof(format));
+  memcpy(payload + sizeof(format), args, count * sizeof(uint32_t));
+  logCommit(record, length, LOG_KIND_BINARY, count);
+}
+
+static void logOut(const char *text, size_t len)
+{
+  Serial.write((const uint8_t *)text, len);
+}
+
+static void logOutBinary(const uint8_t *payload, uint8_t count)
+{
+  const char *format;
+  uint32_t a[LOG_BINARY_ARGS] = {0};
+  memcpy(&format, payload, sizeof(format));
+  memcpy(a, payload + sizeof(format), count * sizeof(uint32_t));
+  char line[LOG_SHORT_LINE * 2];
+  int n = snprintf(line, sizeof(line), format, a[0], a[1], a[2], a[3], a[4], a[5]);
+  if (n > 0)
+  {
+    logOut(line, (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1);
+  }
+}
+
+// Writes out committed records in order, stopping at the first one still
+// being written. One consumer at a time (drainLock).
+static void logDrainRing()
+{
+  uint32_t tail = ring.tail;
+  uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+  if (head - tail > ring.stats.fillPeak)
+  {
+    ring.stats.fillPeak = head - tail;
+  }
+  while (tail != head)
+  {
+    uint32_t offset = tail & (LOG_RING_SIZE - 1);
+    LogHeader *record = (LogHeader *)&ring.bytes[offset];
+    uint8_t kind = __atomic_load_n(&record->kind, __ATOMIC_ACQUIRE);
+    if (kind == LOG_KIND_FREE)
+    {
+      break;
+    }
+    uint32_t size;
+    if (kind == LOG_KIND_PAD)
+    {
+      size = LOG_RING_SIZE - offset;
+    }
+    else
+    {
+      size = logRecordSize(record->length);
+      if (kind == LOG_KIND_TEXT)
+      {
+        logOut((const char *)(record + 1), record->length - 1);
+      }
+      else
+      {
+        logOutBinary((const uint8_t *)(record + 1), record->count);
+      }
+    }
+    memset(record, 0, size);
+    tail += size;
+    __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+  }
+
+  uint32_t dropped = __atomic_load_n(&ring.stats.dropped, __ATOMIC_RELAXED);
+  if (dropped != ring.reported)
+  {
+    char line[48];
+    int n = snprintf(line, sizeof(line), "Log: %u messages dropped\n", dropped - ring.reported);
+    logOut(line, (size_t)n);
+    ring.reported = dropped;
+  }
+}
+
+static void logDrainTask(void *)
+{
+  for (;;)
+  {
+    xSemaphoreTake(ring.drainLock, portMAX_DELAY);
+    logDrainRing();
+    xSemaphoreGive(ring.drainLock);
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
+  }
+}
+
+bool logBegin()
+{
+  if (ring.drainLock)
+  {
+    return true;
+  }
+  ring.drainLock = xSemaphoreCreateMutex();
+  if (!ring.drainLock)
+  {
+    return false;
+  }
+  return xTaskCreatePinnedToCore(logDrainTask, "logDrain", LOG_DRAIN_STACK, NULL, TASK_PRIORITY_LOG, NULL,
+                                 TASK_CORE_NET) == pdPASS;
+}
+
+void logFlush()
+{
+  if (!ring.drainLock)
+  {
+    logDrainRing();
+    return;
+  }
+  xSemaphoreTake(ring.drainLock, portMAX_DELAY);
+  logDrainRing();
+  xSemaphoreGive(ring.drainLock);
+}
+
+LogStats logGetStats()
+{
+  return ring.stats;
+}
@@ -0,0 +1,93 @@
+#include "storage_bench.h"
+#include "serial_log.h"
+
+struct BenchResult
+{
+  uint32_t bytes;
+  uint32_t elapsedUs;
+  uint32_t writeUsMax;
+  uint32_t writeUsTotal;
+  uint32_t writes;
+  uint32_t late; // Appends slower than the audio they carry
+  bool ok;
+};
+
+static void benchPrint(const char *name, const BenchResult &r, uint32_t blockUs)
+{
+  if (!r.ok)
+  {
+    LOG_E("  %-10s failed after %u bytes\n", name, r.bytes);
+    return;
+  }
+  LOG_I("  %-10s %7u KB/s  write avg %6u us  max %7u us  over %u us: %u/%u\n", name,
+        r.elapsedUs ? (uint32_t)((uint64_t)r.bytes * 1000000 / 1024 / r.elapsedUs) : 0,
+        r.writes ? r.writeUsTotal / r.writes : 0, r.writeUsMax, blockUs, r.late, r.writes);
+}
+
+static void benchRecord(BenchResult &r, uint32_t us, uint32_t blockUs)
+{
+  r.writes++;
+  r.writeUsTotal += us;
+  r.bytes += STORAGE_BENCH_BLOCK;
+  if (us > r.writeUsMax)
+  {
+    r.writeUsMax = us;
+  }
+  if (us > blockUs)
+  {
+    r.late++;
+  }
+}
+
+void storageBenchRun(fs::FS &fs, AudioLog &log, uint32_t totalBytes, uint32_t sampleRate)
+{
+  static uint8_t block[STORAGE_BENCH_BLOCK];
+  for (size_t i = 0; i < sizeof(block); i++)
+  {
+    block[i] = (uint8_t)(i * 7);
+  }
+  uint32_t blockUs = (uint32_t)((uint64_t)STORAGE_BENCH_BLOCK / 2 * 1000000 / sampleRate);
+  LOG_I("Storage benchmark: %u bytes in %u-byte appends\n", totalBytes, STORAGE_BENCH_BLOCK);
+
+  // SPIFFS, the way recordings used to be written
+  BenchResult spiffs = {};
+  spiffs.ok = true;
+  fs.remove(STORAGE_BENCH_FILE);
+  uint32_t start = micros();
+  File file = fs.open(STORAGE_BENCH_FILE, FILE_WRITE);
+  spiffs.ok = file;
+  while (spiffs.ok && spiffs.bytes < totalBytes)
+  {
+    uint32_t t = micros();
+    spiffs.ok = file.write(block, sizeof(block)) == sizeof(block);
+    benchRecord(spiffs, micros() - t, blockUs);
+  }
+  if (file)
+  {
+    file.close();
+  }
+  spiffs.elapsedUs = micros() - start;
+  fs.remove(STORAGE_BENCH_FILE);
+
+  // Audio log with the space erased up front, as between turns
+  BenchResult flash = {};
+  uint32_t eraseStart = micros();
+  uint32_t prepared = audioLogPrepare(log, totalBytes + AUDIO_LOG_HEADER_SIZE);
+  uint32_t eraseUs = micros() - eraseStart;
+  flash.ok = audioLogBegin(log);
+  start = micros();
+  while (flash.ok && flash.bytes < totalBytes)
+  {
+    uint32_t t = micros();
+    flash.ok = audioLogAppend(log, block, sizeof(block));
+    benchRecord(flash, micros() - t, blockUs);
+  }
+  flash.elapsedUs = micros() - start;
+  AudioLogRecord record;
+  flash.ok = audioLogFinish(log, record) && audioLogMarkDone(log, record) && flash.ok;
+
+  benchPrint("spiffs", spiffs, blockUs);
+  benchPrint("audio log", flash, blockUs);
+  LOG_I("  audio log pre-erase: %u bytes in %u ms, %u late erases\n", prepared, eraseUs / 1000,
+        log.stats.lateErases);
+}
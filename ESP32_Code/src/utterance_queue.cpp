@@ -0,0 +1,259 @@
+#include "utterance_queue.h"
+#include "serial_log.h"
+
+#define QUEUE_READ_CHUNK (1024)
+
+struct UtteranceQueue
+{
+  AudioLog *log;
+  uint32_t rng;                 // xorshift state for the jitter
+  uint32_t failuresInRow;
+  unsigned long nextAttemptMs;
+  bool batchActive;
+  unsigned long batchStartMs;
+  QueueStats stats;
+};
+
+static UtteranceQueue queue;
+
+static uint32_t queueRandom()
+{
+  uint32_t x = queue.rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  queue.rng = x;
+  return x;
+}
+
+static void queueRefresh()
+{
+  AudioLogRecord records[UTTERANCE_QUEUE_DEPTH + 1];
+  queue.stats.depth = queue.log ? audioLogPending(*queue.log, records, UTTERANCE_QUEUE_DEPTH + 1) : 0;
+  if (queue.stats.depth == 0 && queue.batchActive)
+  {
+    queue.batchActive = false;
+    queue.stats.drainMsLast = millis() - queue.batchStartMs;
+    if (queue.stats.drainMsLast > queue.stats.drainMsMax)
+    {
+      queue.stats.drainMsMax = queue.stats.drainMsLast;
+    }
+  }
+}
+
+static bool queueDropOldest()
+{
+  AudioLogRecord oldest;
+  if (audioLogPending(*queue.log, &oldest, 1) == 0 || !audioLogMarkDone(*queue.log, oldest))
+  {
+    return false;
+  }
+  LOG_W("Queue: dropped utterance #%u (%u bytes)\n", oldest.seq, oldest.length);
+  queue.stats.dropped++;
+  queueRefresh();
+  return true;
+}
+
+// Doubles the wait per failure in a row, up to the maximum; the actual
+// wait is drawn from its upper half so devices don't retry in step
+static void queueBackoff()
+{
+  uint32_t backoff = UTTERANCE_QUEUE_BACKOFF_MIN_MS;
+  for (uint32_t i = 1; i < queue.failuresInRow && backoff < UTTERANCE_QUEUE_BACKOFF_MAX_MS; i++)
+  {
+    backoff *= 2;
+  }
+  if (backoff > UTTERANCE_QUEUE_BACKOFF_MAX_MS)
+  {
+    backoff = UTTERANCE_QUEUE_BACKOFF_MAX_MS;
+  }
+  queue.stats.backoffMs = backoff / 2 + queueRandom() % (backoff / 2 + 1);
+  queue.nextAttemptMs = millis() + queue.stats.backoffMs;
+}
+
+static bool queueFailed(const char *what)
+{
+  queue.failuresInRow++;
+  queue.stats.failures++;
+  queueBackoff();
+  LOG_W("Queue: %s, retrying in %u ms (%u queued)\n", what, queue.stats.backoffMs, queue.stats.depth);
+  return false;
+}
+
+// Worst-case record for one capture in the upload encoding
+static uint32_t queueMaxRecord(const TurnConfig &config)
+{
+  switch (config.encoding)
+  {
+  case AUDIO_ENCODING_IMA_ADPCM:
+    return config.captureLimit / 4 + 1;
+  case AUDIO_ENCODING_MULAW:
+    return config.captureLimit / 2;
+  default:
+    return config.captureLimit;
+  }
+}
+
+void queueInit(AudioLog &log, uint32_t seed)
+{
+  memset(&queue, 0, sizeof(queue));
+  queue.log = &log;
+  queue.rng = seed ? seed : 1;
+  queue.nextAttemptMs = millis();
+  queueRefresh();
+  if (queue.stats.depth)
+  {
+    LOG_I("Queue: %u utterances left from before the reboot\n", queue.stats.depth);
+  }
+}
+
+bool queueBegin(const TurnConfig &config)
+{
+  if (!queue.log)
+  {
+    return false;
+  }
+  queueRefresh();
+  uint32_t need = queueMaxRecord(config);
+  while (queue.stats.depth > 0 &&
+         (queue.stats.depth >= UTTERANCE_QUEUE_DEPTH || audioLogRoom(*queue.log) < need))
+  {
+    if (!queueDropOldest())
+    {
+      break;
+    }
+  }
+  return audioLogBegin(*queue.log);
+}
+
+bool queueCommit(AudioLogRecord &record, bool keep)
+{
+  if (!queue.log || !audioLogFinish(*queue.log, record))
+  {
+    return false;
+  }
+  if (!keep || record.length == 0)
+  {
+    audioLogMarkDone(*queue.log, record);
+    return false;
+  }
+  queue.stats.enqueued++;
+  queueRefresh();
+  LOG_I("Queue: utterance #%u queued (%u bytes, %u waiting)\n", record.seq, record.length,
+        queue.stats.depth);
+  return true;
+}
+
+void queueRemove(const AudioLogRecord &record)
+{
+  if (queue.log && audioLogMarkDone(*queue.log, record))
+  {
+    queueRefresh();
+  }
+}
+
+uint32_t queueDepth()
+{
+  return queue.stats.depth;
+}
+
+bool queueDrainDue()
+{
+  return queue.stats.depth > 0 && (long)(millis() - queue.nextAttemptMs) >= 0;
+}
+
+uint32_t queueRetryInMs()
+{
+  long left = (long)(queue.nextAttemptMs - millis());
+  return left > 0 ? left : 0;
+}
+
+void queueKick()
+{
+  queue.failuresInRow = 0;
+  queue.stats.backoffMs = 0;
+  queue.nextAttemptMs = millis();
+}
+
+bool queueDrainOne(const TurnConfig &config, const BackendTransport &transport, TurnResult &result)
+{
+  AudioLogRecord record;
+  if (!queue.log || audioLogPending(*queue.log, &record, 1) == 0)
+  {
+    return false;
+  }
+  if (!queue.batchActive)
+  {
+    queue.batchActive = true;
+    queue.batchStartMs = millis();
+  }
+
+  AudioLogReader reader;
+  if (!audioLogOpen(*queue.log, record, reader))
+  {
+    // Listed as pending but unreadable: don't let it block the rest
+    audioLogMarkDone(*queue.log, record);
+    queue.stats.dropped++;
+    queueRefresh();
+    return false;
+  }
+
+  if (!transport.uploadBegin(config.encoding, config.sampleRate, transport.ctx))
+  {
+    return queueFailed("backend unreachable");
+  }
+  bool ok = true;
+  if (config.encoding == AUDIO_ENCODING_PCM)
+  {
+    // Canonical header with the record's real length, like uploadFile() sends
+    WavHeader header = wavHeaderMake(config.sampleRate, 16, 1, record.length);
+    ok = transport.uploadWrite(header.bytes, sizeof(header.bytes), transport.ctx);
+  }
+  uint8_t buf[QUEUE_READ_CHUNK];
+  size_t n;
+  while (ok && (n = audioLogRead(reader, buf, sizeof(buf))) > 0)
+  {
+    ok = transport.uploadWrite(buf, n, transport.ctx);
+  }
+  if (!ok || reader.pos != record.length)
+  {
+    transport.uploadAbort(transport.ctx);
+    return queueFailed("upload interrupted");
+  }
+  char reply[128];
+  int code = transport.uploadFinish(reply, sizeof(reply), transport.ctx);
+  if (code != 200)
+  {
+    return queueFailed("upload rejected");
+  }
+  LOG_I("Queue: utterance #%u uploaded: %s\n", record.seq, reply);
+
+  // Marked done only once the answer has played; a retry uploads it again
+  if (!turnWaitResponse(config, transport))
+  {
+    return queueFailed("no response");
+  }
+  if (!turnPlayResponse(config, transport, result))
+  {
+    return queueFailed("response download failed");
+  }
+  audioLogMarkDone(*queue.log, record);
+  queue.failuresInRow = 0;
+  queue.stats.backoffMs = 0;
+  queue.stats.drained++;
+  queueRefresh();
+  return true;
+}
+
+QueueStats queueGetStats()
+{
+  return queue.stats;
+}
+
+void queuePrintStats()
+{
+  const QueueStats &s = queue.stats;
+  LOG_I("Queue: %u waiting, %u queued, %u drained, %u dropped, %u failed attempts, drain %u ms (max %u), "
+        "backoff %u ms\n",
+        s.depth, s.enqueued, s.drained, s.dropped, s.failures, s.drainMsLast, s.drainMsMax, s.backoffMs);
+}
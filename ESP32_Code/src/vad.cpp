@@ -0,0 +1,137 @@
+#include "vad.h"
+
+#include <string.h>
+
+// Noise floor tracks quiet frames with a 1/16 EMA, never below this
+#define VAD_NOISE_FLOOR_MIN (16)
+// Frames used to seed the noise floor before detection starts
+#define VAD_CALIBRATION_FRAMES (5)
+
+void vadDefaultConfig(VadConfig &config, uint32_t sampleRate)
+{
+  config.sampleRate = sampleRate;
+  config.frameMs = 20;
+  config.onsetFrames = 3;
+  config.trailingSilenceMs = 800;
+  config.noSpeechTimeoutMs = 4000;
+  config.energyRatio = 4;
+  config.zcrPercent = 25;
+  config.minEnergy = 2000;
+}
+
+void vadInit(Vad &vad, const VadConfig &config)
+{
+  memset(&vad, 0, sizeof(vad));
+  vad.config = config;
+  vad.state = VAD_WAITING;
+  vad.frameLen = config.sampleRate * config.frameMs / 1000;
+  if (vad.frameLen == 0)
+  {
+    vad.frameLen = 1;
+  }
+  vad.lastSign = 1;
+}
+
+static bool vadIsSpeech(const Vad &vad, uint32_t energy, uint32_t crossings)
+{
+  if (energy < vad.config.minEnergy)
+  {
+    return false;
+  }
+  uint64_t floor = vad.noiseFloor;
+  if ((uint64_t)energy > floor * vad.config.energyRatio)
+  {
+    return true;
+  }
+  // Fricatives are quiet but noisy: accept them at half the ratio
+  bool highZcr = crossings * 100 >= vad.frameLen * vad.config.zcrPercent;
+  return highZcr && (uint64_t)energy * 2 > floor * vad.config.energyRatio;
+}
+
+static void vadEndFrame(Vad &vad)
+{
+  int32_t mean = (int32_t)(vad.sum / (int64_t)vad.frameLen);
+  uint64_t meanSq = (uint64_t)((int64_t)mean * mean);
+  uint64_t avgSq = vad.sumSq / vad.frameLen;
+  uint32_t energy = avgSq > meanSq ? (uint32_t)(avgSq - meanSq) : 0;
+
+  uint32_t frame = vad.frames++;
+  if (frame < VAD_CALIBRATION_FRAMES)
+  {
+    // Assume the first ~100 ms are background; take the quietest frame
+    if (frame == 0 || energy < vad.noiseFloor)
+    {
+      vad.noiseFloor = energy;
+    }
+    if (vad.noiseFloor < VAD_NOISE_FLOOR_MIN)
+    {
+      vad.noiseFloor = VAD_NOISE_FLOOR_MIN;
+    }
+  }
+  else if (vad.state == VAD_WAITING || vad.state == VAD_SPEECH)
+  {
+    bool speech = vadIsSpeech(vad, energy, vad.crossings);
+    uint32_t frameMs = vad.config.frameMs;
+
+    if (!speech)
+    {
+      // Adapt only on non-speech so the floor does not climb into the voice
+      int64_t delta = (int64_t)energy - (int64_t)vad.noiseFloor;
+      int64_t next = (int64_t)vad.noiseFloor + delta / 16;
+      vad.noiseFloor = next < VAD_NOISE_FLOOR_MIN ? VAD_NOISE_FLOOR_MIN : (uint32_t)next;
+    }
+
+    if (vad.state == VAD_WAITING)
+    {
+      vad.speechRun = speech ? vad.speechRun + 1 : 0;
+      if (vad.speechRun >= vad.config.onsetFrames)
+      {
+        vad.state = VAD_SPEECH;
+        vad.speechStartFrame = vad.frames - vad.speechRun;
+        vad.silenceRun = 0;
+      }
+      else if (vad.config.noSpeechTimeoutMs && vad.frames * frameMs >= vad.config.noSpeechTimeoutMs)
+      {
+        vad.state = VAD_NO_SPEECH;
+      }
+    }
+    else
+    {
+      vad.silenceRun = speech ? 0 : vad.silenceRun + 1;
+      if (vad.silenceRun * frameMs >= vad.config.trailingSilenceMs)
+      {
+        vad.state = VAD_ENDED;
+        vad.speechEndFrame = vad.frames - vad.silenceRun;
+      }
+    }
+  }
+
+  vad.dc = mean;
+  vad.sum = 0;
+  vad.sumSq = 0;
+  vad.crossings = 0;
+  vad.frameFill = 0;
+}
+
+VadState vadProcess(Vad &vad, const int16_t *samples, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    int32_t x = samples[i];
+    vad.sum += x;
+    vad.sumSq += (uint64_t)((int64_t)x * x);
+
+    int32_t sign = (x - vad.dc) >= 0 ? 1 : -1;
+    if (sign != vad.lastSign)
+    {
+      vad.crossings++;
+      vad.lastSign = sign;
+    }
+
+    if (++vad.frameFill == vad.frameLen)
+    {
+      vadEndFrame(vad);
+    }
+  }
+  return vad.state;
+}
@@ -0,0 +1,385 @@
+#include "voice_turn.h"
+#include "audio_hal.h"
+#include "resampler.h"
+#include "vad.h"
+#include "wav_stream.h"
+#include "serial_log.h"
+
+#define RESPONSE_READ_LEN (1024) // Body bytes fetched per refill
+
+// Endpointing state wrapped around the real sink. Static so the lead-in
+// block stays off the caller's stack.
+struct EndpointSink
+{
+  Vad vad;
+  CaptureSink sink;
+  void *sinkCtx;
+  uint8_t lead[CAPTURE_BLOCK_LEN]; // Block before onset, keeps the first syllable
+  size_t leadLen;
+  bool started;
+  bool ended;
+  bool failed;
+  uint32_t bytesOut;
+};
+static EndpointSink endpoint;
+
+// Encoder stage between endpointing and the real sink
+struct EncodeSink
+{
+  AudioEncoding encoding;
+  AdpcmState adpcm;
+  CaptureSink sink;
+  void *sinkCtx;
+  uint8_t out[CAPTURE_BLOCK_LEN / 2]; // Worst case: mu-law of one PCM block
+  uint32_t bytesOut;
+};
+static EncodeSink encoder;
+
+// Response body as a playback source: the WAV header is parsed off the
+// stream and the payload converted to what the speaker is running at.
+// Static, the filter bank and buffers are too big for the reader's stack.
+struct ResponseSource
+{
+  const BackendTransport *transport;
+  i2s_port_t port;
+  uint32_t speakerRate;
+  TurnPlayRate notifyRate;
+  WavParser parser;
+  Resampler resampler;
+  bool formatReady;
+  uint32_t playRate;           // Rate the speaker ends up at
+  uint8_t in[RESPONSE_READ_LEN]; // Payload not yet converted
+  size_t inPos;
+  size_t inLen;
+  bool ended;
+  bool flushed;
+};
+static ResponseSource response;
+
+static bool encodeSink(const uint8_t *data, size_t len, void *ctx)
+{
+  EncodeSink *enc = (EncodeSink *)ctx;
+  const int16_t *pcm = (const int16_t *)data;
+  size_t samples = len / 2;
+  size_t outLen;
+
+  if (enc->encoding == AUDIO_ENCODING_IMA_ADPCM)
+  {
+    outLen = adpcmEncode(enc->adpcm, enc->out, pcm, samples);
+  }
+  else
+  {
+    outLen = mulawEncodeBlock(enc->out, pcm, samples);
+  }
+  enc->bytesOut += outLen;
+  return outLen == 0 || enc->sink(enc->out, outLen, enc->sinkCtx);
+}
+
+static bool endpointSink(const uint8_t *data, size_t len, void *ctx)
+{
+  EndpointSink *ep = (EndpointSink *)ctx;
+  VadState state = vadProcess(ep->vad, (const int16_t *)data, len / 2);
+
+  if (state == VAD_NO_SPEECH)
+  {
+    return false;
+  }
+
+  if (!ep->started)
+  {
+    if (state == VAD_WAITING)
+    {
+      // Hold on to the latest block so the onset isn't clipped
+      memcpy(ep->lead, data, len);
+      ep->leadLen = len;
+      return true;
+    }
+    ep->started = true;
+    if (ep->leadLen)
+    {
+      if (!ep->sink(ep->lead, ep->leadLen, ep->sinkCtx))
+      {
+        ep->failed = true;
+        return false;
+      }
+      ep->bytesOut += ep->leadLen;
+    }
+  }
+
+  if (!ep->sink(data, len, ep->sinkCtx))
+  {
+    ep->failed = true;
+    return false;
+  }
+  ep->bytesOut += len;
+
+  if (state == VAD_ENDED)
+  {
+    ep->ended = true;
+    return false;
+  }
+  return true;
+}
+
+// Picks how to play the response once its format is known: the speaker
+// clock follows the stream when I2S can run at that rate, otherwise the
+// resampler brings it to the speaker rate
+static bool responseSetFormat(ResponseSource *src, const WavFormat &format)
+{
+  src->playRate = src->speakerRate;
+  if (format.sampleRate != src->speakerRate && audioSetRate(src->port, format.sampleRate))
+  {
+    src->playRate = format.sampleRate;
+  }
+  if (!resamplerInit(src->resampler, format, src->playRate))
+  {
+    LOG_E("Unsupported response format: %u Hz, %u ch, %u-bit\n", format.sampleRate,
+          format.channels, format.bitsPerSample);
+    return false;
+  }
+  LOG_I("Response: %u Hz, %u ch, %u-bit, playing at %u Hz%s\n", format.sampleRate, format.channels,
+        format.bitsPerSample, src->playRate, src->resampler.bypass ? "" : " (resampled)");
+  if (src->notifyRate)
+  {
+    src->notifyRate(src->playRate);
+  }
+  return true;
+}
+
+static int responseSource(uint8_t *buf, size_t len, void *ctx)
+{
+  ResponseSource *src = (ResponseSource *)ctx;
+  int16_t *out = (int16_t *)buf;
+  size_t maxOut = len / 2;
+
+  while (true)
+  {
+    if (src->inPos < src->inLen)
+    {
+      size_t used;
+      size_t n = resamplerRun(src->resampler, src->in + src->inPos, src->inLen - src->inPos, used, out, maxOut);
+      src->inPos += used;
+      if (n > 0)
+      {
+        return n * 2;
+      }
+    }
+    if (src->ended)
+    {
+      size_t n = 0;
+      if (!src->flushed && src->formatReady)
+      {
+        n = resamplerFlush(src->resampler, out, maxOut);
+      }
+      src->flushed = true;
+      return n > 0 ? (int)(n * 2) : -1;
+    }
+
+    int n = src->transport->responseRead(src->in, sizeof(src->in), src->transport->ctx);
+    if (n < 0)
+    {
+      src->ended = true;
+      continue;
+    }
+    if (n == 0)
+    {
+      return 0;
+    }
+    src->inLen = wavParserRun(src->parser, src->in, n);
+    src->inPos = 0;
+    if (src->parser.state == WAV_PARSE_ERROR)
+    {
+      LOG_E("Malformed response WAV\n");
+      return -1;
+    }
+
+    WavFormat format;
+    if (!src->formatReady && wavParserFormat(src->parser, format))
+    {
+      if (!responseSetFormat(src, format))
+      {
+        return -1;
+      }
+      src->formatReady = true;
+    }
+  }
+}
+
+bool turnCapture(const TurnConfig &config, unsigned long startMs, CaptureSink sink, void *sinkCtx,
+                 TurnResult &result)
+{
+  CaptureConfig capture = {startMs, config.captureLimit, config.process, sink, sinkCtx};
+  bool ok;
+
+  encoder.bytesOut = 0;
+  if (config.encoding != AUDIO_ENCODING_PCM)
+  {
+    encoder.encoding = config.encoding;
+    adpcmInit(encoder.adpcm);
+    encoder.sink = sink;
+    encoder.sinkCtx = sinkCtx;
+    capture.sink = encodeSink;
+    capture.sinkCtx = &encoder;
+  }
+
+  result.captureStartMs = millis();
+
+  if (config.useVad)
+  {
+    VadConfig vadConfig;
+    vadDefaultConfig(vadConfig, config.sampleRate);
+    vadConfig.trailingSilenceMs = config.trailingSilenceMs;
+    vadConfig.noSpeechTimeoutMs = config.noSpeechTimeoutMs;
+    vadInit(endpoint.vad, vadConfig);
+    endpoint.sink = capture.sink;
+    endpoint.sinkCtx = capture.sinkCtx;
+    endpoint.leadLen = 0;
+    endpoint.started = false;
+    endpoint.ended = false;
+    endpoint.failed = false;
+    endpoint.bytesOut = 0;
+
+    capture.sink = endpointSink;
+    capture.sinkCtx = &endpoint;
+    ok = captureRun(capture, result.capture) && !endpoint.failed;
+    result.pcmBytes = endpoint.bytesOut;
+    result.hadSpeech = endpoint.started;
+
+    if (endpoint.ended)
+    {
+      LOG_I("Endpoint after %u ms of speech\n",
+            (endpoint.vad.speechEndFrame - endpoint.vad.speechStartFrame) * vadConfig.frameMs);
+    }
+    else if (endpoint.started)
+    {
+      LOG_W("Hit the capture limit before trailing silence\n");
+    }
+  }
+  else
+  {
+    ok = captureRun(capture, result.capture) && !result.capture.stoppedEarly;
+    result.pcmBytes = result.capture.bytesDelivered;
+    result.hadSpeech = true;
+  }
+
+  if (ok && config.encoding == AUDIO_ENCODING_IMA_ADPCM)
+  {
+    size_t tail = adpcmFlush(encoder.adpcm, encoder.out);
+    if (tail)
+    {
+      ok = encoder.sink(encoder.out, tail, encoder.sinkCtx);
+      encoder.bytesOut += tail;
+    }
+  }
+  if (config.encoding != AUDIO_ENCODING_PCM)
+  {
+    result.encodedBytes = encoder.bytesOut;
+    LOG_I("Encoded %u PCM bytes to %u %s bytes\n", result.pcmBytes, encoder.bytesOut,
+          audioEncodingName(config.encoding));
+  }
+  else
+  {
+    result.encodedBytes = result.pcmBytes;
+  }
+
+  capturePrintStats(result.capture);
+  return ok;
+}
+
+bool turnUploadSink(const uint8_t *data, size_t len, void *ctx)
+{
+  const BackendTransport *transport = (const BackendTransport *)ctx;
+  return transport->uploadWrite(data, len, transport->ctx);
+}
+
+bool turnWaitResponse(const TurnConfig &config, const BackendTransport &transport)
+{
+  bool responseReady = false;
+  unsigned long waitStart = millis();
+
+  LOG_I("Waiting for server processing...\n");
+
+  while (!responseReady && millis() - waitStart < config.responseWaitMs)
+  {
+    unsigned long remaining = config.responseWaitMs - (millis() - waitStart);
+    unsigned long wait = remaining < config.longPollMs ? remaining : config.longPollMs;
+    unsigned long requestStart = millis();
+
+    responseReady = transport.pollReady(wait, transport.ctx) == 1;
+
+    // An old backend ignores ?wait and answers at once; don't hammer it
+    if (!responseReady && millis() - requestStart < config.pollRetryMs)
+    {
+      delay(config.pollRetryMs);
+    }
+  }
+
+  if (!responseReady)
+  {
+    LOG_E("Server response timeout\n");
+    return false;
+  }
+  LOG_I("Response ready after %lu ms\n", millis() - waitStart);
+  return true;
+}
+
+bool turnPlayResponse(const TurnConfig &config, const BackendTransport &transport, TurnResult &result)
+{
+  LOG_I("Playing response...\n");
+  unsigned long requestStart = millis();
+  memset(&result.playback, 0, sizeof(result.playback));
+  result.firstAudioMs = 0;
+  if (config.cancel && *config.cancel)
+  {
+    // Interrupted before the answer started, nothing to fetch
+    result.playback.cancelled = true;
+    result.playback.cancelledAtMs = millis();
+    LOG_W("Playback cancelled before the response was fetched\n");
+    return true;
+  }
+
+  int code = transport.responseOpen(transport.ctx);
+  if (code != 200)
+  {
+    if (code < 0)
+    {
+      LOG_E("Cannot reach server for playback\n");
+    }
+    transport.responseClose(transport.ctx);
+    return false;
+  }
+
+  audioClear(config.speakerPort);
+
+  // Headerless bodies are taken as PCM at the speaker rate
+  memset(&response, 0, sizeof(response));
+  response.transport = &transport;
+  response.port = config.speakerPort;
+  response.speakerRate = config.speakerRate;
+  response.notifyRate = config.playRate;
+  WavFormat fallback = {1, config.speakerRate, 16, 2};
+  wavParserInit(response.parser, fallback);
+
+  PlaybackConfig playback = {config.speakerPort, config.prebufferBytes, responseSource, &response, config.cancel};
+  uint32_t requestMs = millis() - requestStart;
+  if (!playbackRun(playback, result.playback))
+  {
+    LOG_E("Failed to start playback tasks\n");
+  }
+  if (result.playback.bytesPlayed > 0)
+  {
+    result.firstAudioMs = requestMs + result.playback.startDelayMs;
+  }
+
+  audioClear(config.speakerPort);
+  if (response.playRate != config.speakerRate)
+  {
+    audioSetRate(config.speakerPort, config.speakerRate);
+  }
+  // Closes the socket too if the body was cut short
+  transport.responseClose(transport.ctx);
+
+  playbackPrintStats(result.playback);
+  LOG_I("Audio playback completed (bytes: %u)\n", result.playback.bytesPlayed);
+  return true;
+}
@@ -0,0 +1,516 @@
+#include "wake_word.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WAKE_BINS (WAKE_FFT_LEN / 2 + 1)
+#define WAKE_MEL_LOW_HZ (100.0f)
+#define WAKE_MEL_HIGH_HZ (7600.0f)
+#define WAKE_NO_PATH (1e30f)
+#define WAKE_TRIM_DB (30.0f)
+#define WAKE_FLOOR_DB (10.0f)
+#define WAKE_BLOB_MAGIC "WAKE"
+#define WAKE_BLOB_VERSION (1)
+#define WAKE_BLOB_HEADER (8)
+#define WAKE_BLOB_TEMPLATE_HEADER (6)
+
+// Shared, read-only once built
+static bool tablesReady = false;
+static float hamming[WAKE_FRAME_LEN];
+static float twiddleCos[WAKE_FFT_LEN / 2];
+static float twiddleSin[WAKE_FFT_LEN / 2];
+static int8_t melSegment[WAKE_BINS]; // Mel segment a bin falls in, -1 outside the filterbank
+static float melRise[WAKE_BINS];     // Weight for band melSegment, band melSegment - 1 gets 1 - w
+static float dct[WAKE_CEPSTRA][WAKE_MEL_BANDS];
+
+static float hzToMel(float hz)
+{
+  return 1127.0f * logf(1.0f + hz / 700.0f);
+}
+
+static float melToHz(float mel)
+{
+  return 700.0f * (expf(mel / 1127.0f) - 1.0f);
+}
+
+static void wakeBuildTables()
+{
+  if (tablesReady)
+  {
+    return;
+  }
+  for (int i = 0; i < WAKE_FRAME_LEN; i++)
+  {
+    hamming[i] = 0.54f - 0.46f * cosf(2.0f * (float)M_PI * i / (WAKE_FRAME_LEN - 1));
+  }
+  for (int i = 0; i < WAKE_FFT_LEN / 2; i++)
+  {
+    twiddleCos[i] = cosf(2.0f * (float)M_PI * i / WAKE_FFT_LEN);
+    twiddleSin[i] = -sinf(2.0f * (float)M_PI * i / WAKE_FFT_LEN);
+  }
+
+  // Band b rises from edge b to b + 1 and falls from b + 1 to b + 2
+  float edges[WAKE_MEL_BANDS + 2];
+  float melLow = hzToMel(WAKE_MEL_LOW_HZ);
+  float melHigh = hzToMel(WAKE_MEL_HIGH_HZ);
+  for (int i = 0; i < WAKE_MEL_BANDS + 2; i++)
+  {
+    edges[i] = melToHz(melLow + (melHigh - melLow) * i / (WAKE_MEL_BANDS + 1));
+  }
+  for (int k = 0; k < WAKE_BINS; k++)
+  {
+    float hz = (float)k * WAKE_SAMPLE_RATE / WAKE_FFT_LEN;
+    melSegment[k] = -1;
+    melRise[k] = 0.0f;
+    for (int m = 0; m < WAKE_MEL_BANDS + 1; m++)
+    {
+      if (hz >= edges[m] && hz < edges[m + 1])
+      {
+        melSegment[k] = m;
+        melRise[k] = (hz - edges[m]) / (edges[m + 1] - edges[m]);
+        break;
+      }
+    }
+  }
+
+  for (int c = 0; c < WAKE_CEPSTRA; c++)
+  {
+    for (int b = 0; b < WAKE_MEL_BANDS; b++)
+    {
+      // c + 1: c0 (overall level) is not used
+      dct[c][b] = sqrtf(2.0f / WAKE_MEL_BANDS) * cosf((float)M_PI * (c + 1) * (b + 0.5f) / WAKE_MEL_BANDS);
+    }
+  }
+  tablesReady = true;
+}
+
+// In-place radix-2 FFT over WAKE_FFT_LEN points
+static void wakeFft(float *re, float *im)
+{
+  for (int i = 1, j = 0; i < WAKE_FFT_LEN; i++)
+  {
+    int bit = WAKE_FFT_LEN >> 1;
+    for (; j & bit; bit >>= 1)
+    {
+      j ^= bit;
+    }
+    j |= bit;
+    if (i < j)
+    {
+      float t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+  for (int len = 2; len <= WAKE_FFT_LEN; len <<= 1)
+  {
+    int step = WAKE_FFT_LEN / len;
+    for (int i = 0; i < WAKE_FFT_LEN; i += len)
+    {
+      for (int k = 0; k < len / 2; k++)
+      {
+        float wr = twiddleCos[k * step];
+        float wi = twiddleSin[k * step];
+        int a = i + k;
+        int b = a + len / 2;
+        float xr = re[b] * wr - im[b] * wi;
+        float xi = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - xr;
+        im[b] = im[a] - xi;
+        re[a] += xr;
+        im[a] += xi;
+      }
+    }
+  }
+}
+
+// Cepstra of one WAKE_FRAME_LEN frame. Returns the frame's log energy.
+static float wakeFeature(const int16_t *frame, float *re, float *im, float *cep)
+{
+  for (int i = 0; i < WAKE_FRAME_LEN; i++)
+  {
+    re[i] = hamming[i] * frame[i] * (1.0f / 32768.0f);
+    im[i] = 0.0f;
+  }
+  for (int i = WAKE_FRAME_LEN; i < WAKE_FFT_LEN; i++)
+  {
+    re[i] = 0.0f;
+    im[i] = 0.0f;
+  }
+  wakeFft(re, im);
+
+  float mel[WAKE_MEL_BANDS] = {0};
+  float total = 0.0f;
+  for (int k = 0; k < WAKE_BINS; k++)
+  {
+    float power = re[k] * re[k] + im[k] * im[k];
+    total += power;
+    int m = melSegment[k];
+    if (m < 0)
+    {
+      continue;
+    }
+    if (m < WAKE_MEL_BANDS)
+    {
+      mel[m] += power * melRise[k];
+    }
+    if (m > 0)
+    {
+      mel[m - 1] += power * (1.0f - melRise[k]);
+    }
+  }
+  for (int b = 0; b < WAKE_MEL_BANDS; b++)
+  {
+    mel[b] = logf(mel[b] + 1e-8f);
+  }
+  for (int c = 0; c < WAKE_CEPSTRA; c++)
+  {
+    float sum = 0.0f;
+    for (int b = 0; b < WAKE_MEL_BANDS; b++)
+    {
+      sum += dct[c][b] * mel[b];
+    }
+    cep[c] = sum;
+  }
+  return logf(total + 1e-10f);
+}
+
+static void wakeResetPaths(WakeDetector &det)
+{
+  for (int t = 0; t < WAKE_MAX_TEMPLATES; t++)
+  {
+    for (int j = 0; j < WAKE_MAX_TEMPLATE_FRAMES; j++)
+    {
+      det.cost[t][j] = WAKE_NO_PATH;
+      det.steps[t][j] = 0;
+      det.start[t][j] = 0;
+    }
+  }
+}
+
+// Advances template t's DTW column by one input frame and returns the
+// normalized cost of the best path ending on its last frame.
+static float wakeMatch(WakeDetector &det, int t, const float *cep)
+{
+  const WakeTemplate &tmpl = det.templates[t];
+  float *cost = det.cost[t];
+  uint16_t *steps = det.steps[t];
+  uint32_t *start = det.start[t];
+  // Previous column's j - 1 entry, before it is overwritten
+  float diagCost = WAKE_NO_PATH;
+  uint16_t diagSteps = 0;
+  uint32_t diagStart = 0;
+
+  for (int j = 0; j < tmpl.frames; j++)
+  {
+    float d = 0.0f;
+    for (int c = 0; c < WAKE_CEPSTRA; c++)
+    {
+      d += fabsf(cep[c] - tmpl.data[j][c] * tmpl.scale);
+    }
+
+    float prevCost = cost[j];
+    uint16_t prevSteps = steps[j];
+    uint32_t prevStart = start[j];
+
+    float best;
+    uint16_t bestSteps;
+    uint32_t bestStart;
+    if (j == 0)
+    {
+      // Open start: a match may begin at any input frame
+      best = 0.0f;
+      bestSteps = 0;
+      bestStart = det.hops;
+    }
+    else
+    {
+      // Diagonal, input repeat (same j), template skip (j - 1 this frame)
+      best = diagCost;
+      bestSteps = diagSteps;
+      bestStart = diagStart;
+      if (prevCost < best)
+      {
+        best = prevCost;
+        bestSteps = prevSteps;
+        bestStart = prevStart;
+      }
+      if (cost[j - 1] < best)
+      {
+        best = cost[j - 1];
+        bestSteps = steps[j - 1];
+        bestStart = start[j - 1];
+      }
+    }
+
+    diagCost = prevCost;
+    diagSteps = prevSteps;
+    diagStart = prevStart;
+    if (best >= WAKE_NO_PATH)
+    {
+      cost[j] = WAKE_NO_PATH;
+      continue;
+    }
+    cost[j] = best + d;
+    steps[j] = bestSteps + 1;
+    start[j] = bestStart;
+  }
+
+  int last = tmpl.frames - 1;
+  if (cost[last] >= WAKE_NO_PATH)
+  {
+    return WAKE_NO_PATH;
+  }
+  // Reject spans far shorter or longer than the keyword
+  uint32_t span = det.hops - start[last] + 1;
+  if (span * 2 < tmpl.frames || span > (uint32_t)tmpl.frames * 2)
+  {
+    return WAKE_NO_PATH;
+  }
+  return cost[last] / (steps[last] * WAKE_CEPSTRA);
+}
+
+void wakeDefaultConfig(WakeConfig &config)
+{
+  config.threshold = 0.7f;
+  config.refractoryHops = 100;
+  config.warmupHops = 50;
+}
+
+void wakeInit(WakeDetector &det, const WakeConfig &config)
+{
+  wakeBuildTables();
+  memset(&det, 0, sizeof(det));
+  det.config = config;
+  det.quietUntil = config.warmupHops;
+  det.lastScore = WAKE_NO_PATH;
+  det.triggerScore = WAKE_NO_PATH;
+  wakeResetPaths(det);
+}
+
+int wakeLoadTemplates(WakeDetector &det, const uint8_t *blob, size_t len)
+{
+  if (len < WAKE_BLOB_HEADER || memcmp(blob, WAKE_BLOB_MAGIC, 4) != 0 || blob[4] != WAKE_BLOB_VERSION ||
+      blob[6] != WAKE_CEPSTRA)
+  {
+    return 0;
+  }
+  int count = blob[5];
+  size_t pos = WAKE_BLOB_HEADER;
+  int loaded = 0;
+  for (int i = 0; i < count && det.count < WAKE_MAX_TEMPLATES; i++)
+  {
+    if (pos + WAKE_BLOB_TEMPLATE_HEADER > len)
+    {
+      break;
+    }
+    WakeTemplate &tmpl = det.templates[det.count];
+    uint16_t frames;
+    memcpy(&frames, blob + pos, 2);
+    memcpy(&tmpl.scale, blob + pos + 2, 4);
+    pos += WAKE_BLOB_TEMPLATE_HEADER;
+    size_t bytes = (size_t)frames * WAKE_CEPSTRA;
+    if (frames == 0 || frames > WAKE_MAX_TEMPLATE_FRAMES || pos + bytes > len)
+    {
+      break;
+    }
+    memcpy(tmpl.data, blob + pos, bytes);
+    tmpl.frames = frames;
+    pos += bytes;
+    det.count++;
+    loaded++;
+  }
+  return loaded;
+}
+
+size_t wakeWriteTemplates(const WakeDetector &det, uint8_t *out, size_t len)
+{
+  size_t need = WAKE_BLOB_HEADER;
+  for (int i = 0; i < det.count; i++)
+  {
+    need += WAKE_BLOB_TEMPLATE_HEADER + (size_t)det.templates[i].frames * WAKE_CEPSTRA;
+  }
+  if (need > len)
+  {
+    return 0;
+  }
+  memcpy(out, WAKE_BLOB_MAGIC, 4);
+  out[4] = WAKE_BLOB_VERSION;
+  out[5] = (uint8_t)det.count;
+  out[6] = WAKE_CEPSTRA;
+  out[7] = 0;
+  size_t pos = WAKE_BLOB_HEADER;
+  for (int i = 0; i < det.count; i++)
+  {
+    const WakeTemplate &tmpl = det.templates[i];
+    memcpy(out + pos, &tmpl.frames, 2);
+    memcpy(out + pos + 2, &tmpl.scale, 4);
+    pos += WAKE_BLOB_TEMPLATE_HEADER;
+    memcpy(out + pos, tmpl.data, (size_t)tmpl.frames * WAKE_CEPSTRA);
+    pos += (size_t)tmpl.frames * WAKE_CEPSTRA;
+  }
+  return pos;
+}
+
+bool wakeAddTemplate(WakeDetector &det, const float (*cepstra)[WAKE_CEPSTRA], uint16_t frames)
+{
+  if (det.count >= WAKE_MAX_TEMPLATES || frames == 0)
+  {
+    return false;
+  }
+  if (frames > WAKE_MAX_TEMPLATE_FRAMES)
+  {
+    frames = WAKE_MAX_TEMPLATE_FRAMES;
+  }
+  float peak = 0.0f;
+  for (int j = 0; j < frames; j++)
+  {
+    for (int c = 0; c < WAKE_CEPSTRA; c++)
+    {
+      if (fabsf(cepstra[j][c]) > peak)
+      {
+        peak = fabsf(cepstra[j][c]);
+      }
+    }
+  }
+  WakeTemplate &tmpl = det.templates[det.count];
+  tmpl.frames = frames;
+  tmpl.scale = peak > 0.0f ? peak / 127.0f : 1.0f;
+  for (int j = 0; j < frames; j++)
+  {
+    for (int c = 0; c < WAKE_CEPSTRA; c++)
+    {
+      tmpl.data[j][c] = (int8_t)lrintf(cepstra[j][c] / tmpl.scale);
+    }
+  }
+  det.count++;
+  return true;
+}
+
+bool wakeProcess(WakeDetector &det, const int16_t *samples, size_t count)
+{
+  bool detected = false;
+
+  while (count)
+  {
+    size_t take = WAKE_FRAME_LEN - det.fill;
+    if (take > count)
+    {
+      take = count;
+    }
+    memcpy(det.window + det.fill, samples, take * sizeof(int16_t));
+    det.fill += take;
+    samples += take;
+    count -= take;
+    if (det.fill < WAKE_FRAME_LEN)
+    {
+      break;
+    }
+
+    float cep[WAKE_CEPSTRA];
+    wakeFeature(det.window, det.re, det.im, cep);
+    memmove(det.window, det.window + WAKE_HOP_LEN, (WAKE_FRAME_LEN - WAKE_HOP_LEN) * sizeof(int16_t));
+    det.fill = WAKE_FRAME_LEN - WAKE_HOP_LEN;
+
+    float score = WAKE_NO_PATH;
+    for (int t = 0; t < det.count; t++)
+    {
+      float s = wakeMatch(det, t, cep);
+      if (s < score)
+      {
+        score = s;
+      }
+    }
+    det.lastScore = score;
+    if (det.hops >= det.quietUntil && score < det.config.threshold)
+    {
+      detected = true;
+      det.triggerScore = score;
+      det.quietUntil = det.hops + det.config.refractoryHops;
+      wakeResetPaths(det);
+    }
+    det.hops++;
+  }
+  return detected;
+}
+
+void wakeReset(WakeDetector &det)
+{
+  det.fill = 0;
+  det.quietUntil = det.hops + det.config.warmupHops;
+  det.lastScore = WAKE_NO_PATH;
+  wakeResetPaths(det);
+}
+
+static int compareFloat(const void *a, const void *b)
+{
+  float x = *(const float *)a;
+  float y = *(const float *)b;
+  return x < y ? -1 : x > y;
+}
+
+size_t wakeExtractFeatures(const int16_t *samples, size_t count, float (*out)[WAKE_CEPSTRA], size_t maxFrames)
+{
+  wakeBuildTables();
+  if (count < WAKE_FRAME_LEN)
+  {
+    return 0;
+  }
+  size_t frames = (count - WAKE_FRAME_LEN) / WAKE_HOP_LEN + 1;
+  float *re = (float *)malloc(WAKE_FFT_LEN * sizeof(float));
+  float *im = (float *)malloc(WAKE_FFT_LEN * sizeof(float));
+  float *energy = (float *)malloc(frames * sizeof(float));
+  float(*cep)[WAKE_CEPSTRA] = (float(*)[WAKE_CEPSTRA])malloc(frames * sizeof(*cep));
+  size_t written = 0;
+
+  if (re && im && energy && cep)
+  {
+    float peak = -1e30f;
+    for (size_t i = 0; i < frames; i++)
+    {
+      energy[i] = wakeFeature(samples + i * WAKE_HOP_LEN, re, im, cep[i]);
+      peak = energy[i] > peak ? energy[i] : peak;
+    }
+    // Natural-log power. Keep frames within WAKE_TRIM_DB of the peak and
+    // WAKE_FLOOR_DB above the room noise, taken as the 10th percentile
+    // frame (the minimum is often digital silence between syllables).
+    float *sorted = (float *)malloc(frames * sizeof(float));
+    float noise = peak;
+    if (sorted)
+    {
+      memcpy(sorted, energy, frames * sizeof(float));
+      qsort(sorted, frames, sizeof(float), compareFloat);
+      noise = sorted[frames / 10];
+      free(sorted);
+    }
+    float floor = peak - WAKE_TRIM_DB / 10.0f * logf(10.0f);
+    if (noise + WAKE_FLOOR_DB / 10.0f * logf(10.0f) > floor)
+    {
+      floor = noise + WAKE_FLOOR_DB / 10.0f * logf(10.0f);
+    }
+    size_t first = 0;
+    size_t last = frames - 1;
+    while (first < last && energy[first] < floor)
+    {
+      first++;
+    }
+    while (last > first && energy[last] < floor)
+    {
+      last--;
+    }
+    for (size_t i = first; i <= last && written < maxFrames; i++)
+    {
+      memcpy(out[written++], cep[i], sizeof(cep[i]));
+    }
+  }
+
+  free(re);
+  free(im);
+  free(energy);
+  free(cep);
+  return written;
+}
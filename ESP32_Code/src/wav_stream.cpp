@@ -0,0 +1,202 @@
+#include "wav_stream.h"
+
+#include <string.h>
+
+static uint32_t readLe(const uint8_t *p, int bytes)
+{
+  uint32_t value = 0;
+  for (int i = bytes - 1; i >= 0; i--)
+  {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+// Copies up to want - headerFill bytes into the header buffer. Returns the
+// bytes taken from src.
+static size_t wavCollect(WavParser &parser, const uint8_t *src, size_t len, uint32_t want)
+{
+  size_t take = want - parser.headerFill;
+  if (take > len)
+  {
+    take = len;
+  }
+  memcpy(parser.header + parser.headerFill, src, take);
+  parser.headerFill += take;
+  return take;
+}
+
+static bool wavParseFmt(WavParser &parser, uint32_t size)
+{
+  const uint8_t *fmt = parser.header;
+  if (size < 16)
+  {
+    return false;
+  }
+  uint16_t tag = readLe(fmt, 2);
+  if (tag == WAV_FORMAT_EXTENSIBLE && size >= 26)
+  {
+    // SubFormat GUID starts at byte 24; its first two bytes are the format tag
+    tag = readLe(fmt + 24, 2);
+  }
+  WavFormat &f = parser.format;
+  f.channels = readLe(fmt + 2, 2);
+  f.sampleRate = readLe(fmt + 4, 4);
+  f.bitsPerSample = readLe(fmt + 14, 2);
+  f.frameBytes = f.channels * f.bitsPerSample / 8;
+  bool supported = tag == WAV_FORMAT_PCM && f.channels > 0 && f.sampleRate > 0 &&
+                   (f.bitsPerSample == 8 || f.bitsPerSample == 16 || f.bitsPerSample == 24 ||
+                    f.bitsPerSample == 32);
+  parser.haveFormat = supported;
+  return supported;
+}
+
+void wavParserInit(WavParser &parser, const WavFormat &fallback)
+{
+  memset(&parser, 0, sizeof(parser));
+  parser.state = WAV_PARSE_RIFF;
+  parser.format = fallback;
+  parser.format.frameBytes = fallback.channels * fallback.bitsPerSample / 8;
+}
+
+size_t wavParserRun(WavParser &parser, uint8_t *buf, size_t len)
+{
+  size_t in = 0;
+  size_t out = 0;
+
+  while (in < len)
+  {
+    switch (parser.state)
+    {
+    case WAV_PARSE_RIFF:
+      in += wavCollect(parser, buf + in, len - in, 12);
+      if (parser.headerFill < 4 && memcmp(parser.header, "RIFF", parser.headerFill) == 0)
+      {
+        break;
+      }
+      if (memcmp(parser.header, "RIFF", 4) != 0)
+      {
+        // Raw PCM in the fallback format: what was collected is audio
+        parser.haveFormat = true;
+        parser.unbounded = true;
+        parser.state = WAV_PARSE_DATA;
+        size_t held = parser.headerFill;
+        parser.headerFill = 0;
+        if (held <= in)
+        {
+          memmove(buf + held, buf + in, len - in);
+          memcpy(buf, parser.header, held);
+          len = len - in + held;
+          in = 0;
+        }
+        else
+        {
+          // Held over from earlier calls and no room to put back: drop
+          // them and enough input to stay frame aligned
+          size_t frame = parser.format.frameBytes ? parser.format.frameBytes : 1;
+          size_t realign = (frame - held % frame) % frame;
+          in += realign < len - in ? realign : len - in;
+        }
+        break;
+      }
+      if (parser.headerFill == 12)
+      {
+        parser.headerBytes += 12;
+        parser.headerFill = 0;
+        parser.state = memcmp(parser.header + 8, "WAVE", 4) == 0 ? WAV_PARSE_CHUNK : WAV_PARSE_ERROR;
+      }
+      break;
+
+    case WAV_PARSE_CHUNK:
+      in += wavCollect(parser, buf + in, len - in, 8);
+      if (parser.headerFill < 8)
+      {
+        break;
+      }
+      parser.headerBytes += 8;
+      parser.headerFill = 0;
+      parser.chunkLeft = readLe(parser.header + 4, 4);
+      if (memcmp(parser.header, "data", 4) == 0)
+      {
+        parser.unbounded = parser.chunkLeft == 0 || parser.chunkLeft == 0xFFFFFFFF;
+        parser.dataPad = parser.chunkLeft & 1;
+        // Audio before a format can't be played
+        parser.state = parser.haveFormat ? WAV_PARSE_DATA : WAV_PARSE_ERROR;
+        break;
+      }
+      parser.fmtWant = parser.chunkLeft < WAV_FMT_MAX ? parser.chunkLeft : WAV_FMT_MAX;
+      parser.chunkLeft += parser.chunkLeft & 1;
+      parser.state = memcmp(parser.header, "fmt ", 4) == 0 ? WAV_PARSE_FMT : WAV_PARSE_SKIP;
+      break;
+
+    case WAV_PARSE_FMT:
+    {
+      size_t took = wavCollect(parser, buf + in, len - in, parser.fmtWant);
+      in += took;
+      parser.chunkLeft -= took;
+      parser.headerBytes += took;
+      if (parser.headerFill < parser.fmtWant)
+      {
+        break;
+      }
+      if (!wavParseFmt(parser, parser.headerFill))
+      {
+        parser.state = WAV_PARSE_ERROR;
+        break;
+      }
+      parser.headerFill = 0;
+      // Anything past WAV_FMT_MAX (and the pad byte) is skipped
+      parser.state = parser.chunkLeft ? WAV_PARSE_SKIP : WAV_PARSE_CHUNK;
+      break;
+    }
+
+    case WAV_PARSE_SKIP:
+    {
+      size_t skip = len - in < parser.chunkLeft ? len - in : parser.chunkLeft;
+      in += skip;
+      parser.chunkLeft -= skip;
+      parser.headerBytes += skip;
+      if (parser.chunkLeft == 0)
+      {
+        parser.state = WAV_PARSE_CHUNK;
+      }
+      break;
+    }
+
+    case WAV_PARSE_DATA:
+    {
+      size_t take = len - in;
+      if (!parser.unbounded && take > parser.chunkLeft)
+      {
+        take = parser.chunkLeft;
+      }
+      memmove(buf + out, buf + in, take);
+      out += take;
+      in += take;
+      if (!parser.unbounded)
+      {
+        parser.chunkLeft -= take;
+        if (parser.chunkLeft == 0)
+        {
+          // Trailing chunks (LIST after data) are skipped, after the pad
+          // byte of an odd-sized data chunk
+          parser.chunkLeft = parser.dataPad ? 1 : 0;
+          parser.state = parser.chunkLeft ? WAV_PARSE_SKIP : WAV_PARSE_CHUNK;
+        }
+      }
+      break;
+    }
+
+    case WAV_PARSE_ERROR:
+      in = len;
+      break;
+    }
+  }
+  return out;
+}
+
+bool wavParserFormat(const WavParser &parser, WavFormat &format)
+{
+  format = parser.format;
+  return parser.haveFormat;
+}
@@ -0,0 +1,257 @@
+#include "wifi_link.h"
+#include "serial_log.h"
+
+#include <WiFi.h>
+#include <Preferences.h>
+
+#define WIFI_LINK_KEY_CREDENTIALS "cred"
+#define WIFI_LINK_KEY_AP "ap"
+
+struct WifiCredentials
+{
+  char ssid[33];
+  char password[65];
+};
+
+// Last AP the credentials connected to
+struct WifiLinkAp
+{
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t valid;
+  uint32_t ip; // Lease for WIFI_LINK_STATIC_IP
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+enum WifiLinkState
+{
+  WIFI_LINK_DOWN,
+  WIFI_LINK_FAST, // Connecting with the stored AP
+  WIFI_LINK_SCAN, // Connecting after a full scan
+  WIFI_LINK_UP
+};
+
+struct WifiLink
+{
+  WifiCredentials credentials;
+  WifiLinkAp ap;
+  WifiLinkState state;
+  unsigned long attemptStart;
+  unsigned long downSince; // Begin or drop, for the connect time
+  WifiLinkStats stats;
+};
+
+static WifiLink link;
+
+static bool linkLoad(Preferences &prefs, const char *key, void *value, size_t len)
+{
+  return prefs.getBytesLength(key) == len && prefs.getBytes(key, value, len) == len;
+}
+
+static void linkSave(const char *key, const void *value, size_t len)
+{
+  Preferences prefs;
+  if (!prefs.begin(WIFI_LINK_NAMESPACE, false))
+  {
+    LOG_E("Wi-Fi: cannot open NVS\n");
+    return;
+  }
+  prefs.putBytes(key, value, len);
+  prefs.end();
+}
+
+static void linkStart(bool fast)
+{
+  if (link.state == WIFI_LINK_FAST || link.state == WIFI_LINK_SCAN)
+  {
+    WiFi.disconnect();
+  }
+  if (WIFI_LINK_STATIC_IP && fast && link.ap.ip)
+  {
+    WiFi.config(IPAddress(link.ap.ip), IPAddress(link.ap.gateway), IPAddress(link.ap.subnet), IPAddress(link.ap.dns));
+  }
+  else
+  {
+    // Back to DHCP
+    WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+  }
+  WiFi.begin(link.credentials.ssid, link.credentials.password, fast ? link.ap.channel : 0,
+             fast ? link.ap.bssid : NULL);
+  link.state = fast ? WIFI_LINK_FAST : WIFI_LINK_SCAN;
+  link.attemptStart = millis();
+}
+
+// Stores the AP (and lease) just connected to if it changed
+static void linkRemember()
+{
+  WifiLinkAp ap = {};
+  memcpy(ap.bssid, WiFi.BSSID(), sizeof(ap.bssid));
+  ap.channel = WiFi.channel();
+  ap.valid = 1;
+  if (WIFI_LINK_STATIC_IP)
+  {
+    ap.ip = WiFi.localIP();
+    ap.gateway = WiFi.gatewayIP();
+    ap.subnet = WiFi.subnetMask();
+    ap.dns = WiFi.dnsIP();
+  }
+  if (memcmp(&ap, &link.ap, sizeof(ap)) != 0)
+  {
+    link.ap = ap;
+    linkSave(WIFI_LINK_KEY_AP, &link.ap, sizeof(link.ap));
+    LOG_I("Wi-Fi: stored AP %s on channel %u\n", WiFi.BSSIDstr().c_str(), ap.channel);
+  }
+}
+
+void wifiLinkInit(const char *defaultSsid, const char *defaultPassword)
+{
+  memset(&link, 0, sizeof(link));
+  Preferences prefs;
+  bool stored = false;
+  if (prefs.begin(WIFI_LINK_NAMESPACE, true))
+  {
+    stored = linkLoad(prefs, WIFI_LINK_KEY_CREDENTIALS, &link.credentials, sizeof(link.credentials));
+    if (!stored || !linkLoad(prefs, WIFI_LINK_KEY_AP, &link.ap, sizeof(link.ap)))
+    {
+      memset(&link.ap, 0, sizeof(link.ap));
+    }
+    prefs.end();
+  }
+  if (!stored)
+  {
+    strlcpy(link.credentials.ssid, defaultSsid, sizeof(link.credentials.ssid));
+    strlcpy(link.credentials.password, defaultPassword, sizeof(link.credentials.password));
+  }
+  LOG_I("Wi-Fi: %s credentials for %s, %s\n", stored ? "stored" : "default", link.credentials.ssid,
+        link.ap.valid ? "fast connect" : "no AP stored");
+
+  // The link stores what it needs; the SDK writing its config to flash on
+  // every begin only costs time, and its reconnect always scans
+  WiFi.persistent(false);
+  WiFi.setAutoReconnect(false);
+  WiFi.mode(WIFI_STA);
+}
+
+bool wifiLinkVerified()
+{
+  return link.ap.valid;
+}
+
+const char *wifiLinkSsid()
+{
+  return link.credentials.ssid;
+}
+
+void wifiLinkSetCredentials(const char *ssid, const char *password)
+{
+  memset(&link.credentials, 0, sizeof(link.credentials));
+  strlcpy(link.credentials.ssid, ssid, sizeof(link.credentials.ssid));
+  strlcpy(link.credentials.password, password, sizeof(link.credentials.password));
+  memset(&link.ap, 0, sizeof(link.ap));
+
+  Preferences prefs;
+  if (prefs.begin(WIFI_LINK_NAMESPACE, false))
+  {
+    prefs.putBytes(WIFI_LINK_KEY_CREDENTIALS, &link.credentials, sizeof(link.credentials));
+    prefs.remove(WIFI_LINK_KEY_AP);
+    prefs.end();
+  }
+}
+
+void wifiLinkBegin()
+{
+  WiFi.mode(WIFI_STA);
+  link.state = WIFI_LINK_DOWN;
+  link.downSince = millis();
+  linkStart(link.ap.valid);
+}
+
+bool wifiLinkPoll()
+{
+  wl_status_t status = WiFi.status();
+  unsigned long now = millis();
+
+  if (status == WL_CONNECTED)
+  {
+    if (link.state != WIFI_LINK_UP)
+    {
+      uint32_t ms = now - link.downSince;
+      link.stats.connectMsLast = ms;
+      link.stats.connectMsMax = ms > link.stats.connectMsMax ? ms : link.stats.connectMsMax;
+      if (link.state == WIFI_LINK_FAST)
+      {
+        link.stats.fastConnects++;
+      }
+      else
+      {
+        link.stats.scanConnects++;
+      }
+      if (link.stats.bootConnectMs == 0)
+      {
+        link.stats.bootConnectMs = now;
+      }
+      LOG_I("Wi-Fi: connected in %u ms (%s), IP %s\n", ms, link.state == WIFI_LINK_FAST ? "fast" : "scan",
+            WiFi.localIP().toString().c_str());
+      link.state = WIFI_LINK_UP;
+      linkRemember();
+    }
+    return true;
+  }
+
+  switch (link.state)
+  {
+  case WIFI_LINK_UP:
+    // Straight back to the AP we just lost
+    link.stats.drops++;
+    link.downSince = now;
+    linkStart(link.ap.valid);
+    break;
+  case WIFI_LINK_FAST:
+    // A refused or missing AP fails early; don't wait out the timeout
+    if (status == WL_NO_SSID_AVAIL || status == WL_CONNECT_FAILED || now - link.attemptStart > WIFI_LINK_FAST_TIMEOUT)
+    {
+      link.stats.fastFailures++;
+      linkStart(false);
+    }
+    break;
+  case WIFI_LINK_SCAN:
+    if (now - link.attemptStart > WIFI_LINK_SCAN_TIMEOUT)
+    {
+      linkStart(link.ap.valid);
+    }
+    break;
+  default:
+    break;
+  }
+  return false;
+}
+
+bool wifiLinkWait(uint32_t timeoutMs)
+{
+  unsigned long start = millis();
+  while (!wifiLinkPoll())
+  {
+    if (millis() - start > timeoutMs)
+    {
+      return false;
+    }
+    delay(10);
+  }
+  return true;
+}
+
+WifiLinkStats wifiLinkGetStats()
+{
+  return link.stats;
+}
+
+void wifiLinkPrintStats()
+{
+  const WifiLinkStats &s = link.stats;
+  LOG_I("Wi-Fi: first connect %u ms after boot, last %u ms (max %u), %u fast, %u scan, %u fast failures, "
+        "%u drops\n",
+        s.bootConnectMs, s.connectMsLast, s.connectMsMax, s.fastConnects, s.scanConnects, s.fastFailures,
+        s.drops);
+}